@@ -14,6 +14,8 @@ if [ ! -d $SRC_DIR/$PACKAGE_NAME ]; then
 fi
 
 cp -r $DIR/patches/$PACKAGE_NAME/* $SRC_DIR/$PACKAGE_NAME
+# read-only kernel data page layout is shared with the kernel
+cp $DIR/../src/kernel/include/kernel_data.h $SRC_DIR/$PACKAGE_NAME/newlib/libc/sys/moo/include/
 pushd $SRC_DIR/$PACKAGE_NAME/newlib/libc/sys/moo
 autoreconf2.64
 cd ..
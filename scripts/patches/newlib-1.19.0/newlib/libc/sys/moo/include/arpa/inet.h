@@ -0,0 +1,11 @@
+#ifndef _ARPA_INET_H
+#define _ARPA_INET_H
+
+#include <netinet/in.h>
+
+int inet_aton(const char *str, struct in_addr *addr);
+in_addr_t inet_addr(const char *str);
+// result is in static buffer, it's overwritten by the next call
+char *inet_ntoa(struct in_addr addr);
+
+#endif
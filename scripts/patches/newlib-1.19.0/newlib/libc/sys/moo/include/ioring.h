@@ -0,0 +1,77 @@
+#ifndef _MOO_IORING_H
+#define _MOO_IORING_H
+
+#include <stdint.h>
+
+/*
+ * Submission/completion ring: many VFS operations per kernel entry, executed by a kernel worker of the process.
+ * Layout must match src/kernel/include/ioring.h. One ring per process, helpers aren't thread safe.
+ */
+#define IORING_MAX_ENTRIES 256
+#define IORING_SQES_OFFSET 0x1000
+#define IORING_CQES_OFFSET 0x3000
+
+#define IORING_OP_NOP 0
+#define IORING_OP_READ 1
+#define IORING_OP_WRITE 2
+#define IORING_OP_OPEN 3
+#define IORING_OP_CLOSE 4
+#define IORING_OP_STAT 5
+#define IORING_OP_READDIR 6
+
+// read/write at the file position (and advance it) instead of explicit offset
+#define IORING_OFFSET_CURRENT 0xFFFFFFFF
+
+struct stat;
+
+struct ioring_sqe
+{
+    uint8_t opcode;
+    uint8_t reserved[3];
+    int32_t fd;
+    uint32_t addr;
+    uint32_t len;
+    uint32_t offset;
+    uint32_t addr2;
+    uint32_t user_data;
+    uint32_t pad;
+};
+
+struct ioring_cqe
+{
+    uint32_t user_data;
+    int32_t res; // negative errno on error
+};
+
+struct ioring
+{
+    volatile uint32_t sq_head;
+    volatile uint32_t sq_tail;
+    uint32_t sq_entries;
+    volatile uint32_t cq_head;
+    volatile uint32_t cq_tail;
+    uint32_t cq_entries;
+};
+
+// raw syscalls
+void *ring_setup(uint32_t entries);
+int ring_enter(uint32_t min_complete);
+
+int ioring_init(uint32_t entries);
+struct ioring_sqe *ioring_get_sqe(void);
+int ioring_submit(void);
+int ioring_submit_and_wait(uint32_t wait_nr);
+struct ioring_cqe *ioring_peek_cqe(void);
+struct ioring_cqe *ioring_wait_cqe(void);
+void ioring_cqe_seen(void);
+
+void ioring_prep_nop(struct ioring_sqe *sqe);
+void ioring_prep_read(struct ioring_sqe *sqe, int fd, void *buf, uint32_t len, uint32_t offset);
+void ioring_prep_write(struct ioring_sqe *sqe, int fd, const void *buf, uint32_t len, uint32_t offset);
+void ioring_prep_open(struct ioring_sqe *sqe, const char *path, int flags);
+void ioring_prep_close(struct ioring_sqe *sqe, int fd);
+void ioring_prep_stat(struct ioring_sqe *sqe, const char *path, struct stat *st);
+// uses kernel struct dirent, not DIR
+void ioring_prep_readdir(struct ioring_sqe *sqe, int fd, void *dirent);
+
+#endif
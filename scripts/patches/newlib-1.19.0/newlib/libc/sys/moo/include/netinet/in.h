@@ -0,0 +1,44 @@
+#ifndef _NETINET_IN_H
+#define _NETINET_IN_H
+
+#include <sys/socket.h>
+#include <stdint.h>
+
+typedef uint16_t in_port_t;
+typedef uint32_t in_addr_t;
+
+struct in_addr
+{
+    in_addr_t s_addr; // network byte order
+};
+
+struct sockaddr_in
+{
+    sa_family_t sin_family;
+    in_port_t sin_port; // network byte order
+    struct in_addr sin_addr;
+    unsigned char sin_zero[8];
+};
+
+#define IPPROTO_TCP 6
+#define IPPROTO_UDP 17
+
+#define INADDR_ANY ((in_addr_t)0x00000000)
+#define INADDR_LOOPBACK ((in_addr_t)0x7F000001)
+#define INADDR_BROADCAST ((in_addr_t)0xFFFFFFFF)
+
+// x86 is little endian
+static inline uint16_t htons(uint16_t value)
+{
+    return (value << 8) | (value >> 8);
+}
+
+static inline uint32_t htonl(uint32_t value)
+{
+    return __builtin_bswap32(value);
+}
+
+#define ntohs(x) htons(x)
+#define ntohl(x) htonl(x)
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef _POLL_H
+#define _POLL_H
+
+/*
+ * Readiness of file descriptors, values and struct pollfd must match src/kernel/include/poll.h.
+ */
+
+#define POLLIN 0x1
+#define POLLPRI 0x2
+#define POLLOUT 0x4
+#define POLLERR 0x8
+#define POLLHUP 0x10
+#define POLLNVAL 0x20
+#define POLLRDNORM POLLIN
+#define POLLWRNORM POLLOUT
+
+typedef unsigned int nfds_t;
+
+struct pollfd
+{
+    int fd;
+    short events;
+    short revents;
+};
+
+// timeout in ms, negative waits forever
+int poll(struct pollfd *fds, nfds_t nfds, int timeout);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef _MOO_PTHREAD_H
+#define _MOO_PTHREAD_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/*
+ * Minimal pthread subset on top of thread_create/thread_exit/thread_join and futex syscalls.
+ * Mutexes and condition variables are plain futex words, so static initializers are just zero.
+ */
+
+// newlib declares these types only for _POSIX_THREADS targets
+#ifndef _POSIX_THREADS
+typedef uint32_t pthread_t;
+typedef uint32_t pthread_mutex_t;
+typedef uint32_t pthread_cond_t;
+
+typedef struct {
+    int is_initialized;
+} pthread_attr_t;
+
+typedef struct {
+    int is_initialized;
+} pthread_mutexattr_t;
+
+typedef struct {
+    int is_initialized;
+} pthread_condattr_t;
+#endif
+
+#define PTHREAD_MUTEX_INITIALIZER 0
+#define PTHREAD_COND_INITIALIZER 0
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*start_routine)(void*), void *arg);
+void pthread_exit(void *retval) __attribute__((noreturn));
+int pthread_join(pthread_t thread, void **retval);
+pthread_t pthread_self(void);
+int pthread_equal(pthread_t t1, pthread_t t2);
+
+int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr);
+int pthread_mutex_destroy(pthread_mutex_t *mutex);
+int pthread_mutex_lock(pthread_mutex_t *mutex);
+int pthread_mutex_trylock(pthread_mutex_t *mutex);
+int pthread_mutex_unlock(pthread_mutex_t *mutex);
+
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr);
+int pthread_cond_destroy(pthread_cond_t *cond);
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+int pthread_cond_signal(pthread_cond_t *cond);
+int pthread_cond_broadcast(pthread_cond_t *cond);
+
+#endif
@@ -0,0 +1,44 @@
+#include <arpa/inet.h>
+#include <stdio.h>
+
+// dotted decimal only, returns 0 for malformed address
+int inet_aton(const char *str, struct in_addr *addr)
+{
+    uint32_t result = 0;
+    for (int i = 0; i < 4; i++) {
+        if (*str < '0' || *str > '9') {
+            return 0;
+        }
+        uint32_t part = 0;
+        while (*str >= '0' && *str <= '9') {
+            part = part * 10 + (*str++ - '0');
+            if (part > 255) {
+                return 0;
+            }
+        }
+        if (*str != (i == 3 ? '\0' : '.')) {
+            return 0;
+        }
+        str++;
+        result |= part << (i * 8);
+    }
+    addr->s_addr = result;
+    return 1;
+}
+
+in_addr_t inet_addr(const char *str)
+{
+    struct in_addr addr;
+    if (!inet_aton(str, &addr)) {
+        return INADDR_BROADCAST;
+    }
+    return addr.s_addr;
+}
+
+char *inet_ntoa(struct in_addr addr)
+{
+    static char buf[16];
+    uint8_t *bytes = (uint8_t*)&addr.s_addr;
+    sprintf(buf, "%u.%u.%u.%u", bytes[0], bytes[1], bytes[2], bytes[3]);
+    return buf;
+}
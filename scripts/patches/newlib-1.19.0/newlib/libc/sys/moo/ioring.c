@@ -0,0 +1,117 @@
+#include <ioring.h>
+#include <sys/errno.h>
+#include <string.h>
+
+static struct ioring *ring = NULL;
+// entries handed out by ioring_get_sqe() but not published to the kernel yet
+static uint32_t sq_tail = 0;
+
+int ioring_init(uint32_t entries)
+{
+    if (ring != NULL) {
+        return 0;
+    }
+    ring = ring_setup(entries);
+    if (ring == NULL) {
+        return -1;
+    }
+    sq_tail = ring->sq_tail;
+    return 0;
+}
+
+struct ioring_sqe *ioring_get_sqe(void)
+{
+    if (sq_tail - ring->sq_head >= ring->sq_entries) {
+        return NULL;
+    }
+    struct ioring_sqe *sqe = (struct ioring_sqe*)((uint8_t*)ring + IORING_SQES_OFFSET);
+    sqe += sq_tail & (ring->sq_entries - 1);
+    sq_tail++;
+    memset(sqe, 0, sizeof(struct ioring_sqe));
+    return sqe;
+}
+
+int ioring_submit_and_wait(uint32_t wait_nr)
+{
+    __sync_synchronize();
+    ring->sq_tail = sq_tail;
+    return ring_enter(wait_nr);
+}
+
+int ioring_submit(void)
+{
+    return ioring_submit_and_wait(0);
+}
+
+struct ioring_cqe *ioring_peek_cqe(void)
+{
+    if (ring->cq_head == ring->cq_tail) {
+        return NULL;
+    }
+    __sync_synchronize();
+    struct ioring_cqe *cqe = (struct ioring_cqe*)((uint8_t*)ring + IORING_CQES_OFFSET);
+    return cqe + (ring->cq_head & (ring->cq_entries - 1));
+}
+
+struct ioring_cqe *ioring_wait_cqe(void)
+{
+    struct ioring_cqe *cqe = ioring_peek_cqe();
+    if (cqe == NULL) {
+        if (ring_enter(1) == -1) {
+            return NULL;
+        }
+        cqe = ioring_peek_cqe();
+    }
+    return cqe;
+}
+
+void ioring_cqe_seen(void)
+{
+    __sync_synchronize();
+    ring->cq_head++;
+}
+
+static void prep_rw(struct ioring_sqe *sqe, uint8_t opcode, int fd, uint32_t addr, uint32_t len, uint32_t offset)
+{
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = addr;
+    sqe->len = len;
+    sqe->offset = offset;
+}
+
+void ioring_prep_nop(struct ioring_sqe *sqe)
+{
+    sqe->opcode = IORING_OP_NOP;
+}
+
+void ioring_prep_read(struct ioring_sqe *sqe, int fd, void *buf, uint32_t len, uint32_t offset)
+{
+    prep_rw(sqe, IORING_OP_READ, fd, (uint32_t)buf, len, offset);
+}
+
+void ioring_prep_write(struct ioring_sqe *sqe, int fd, const void *buf, uint32_t len, uint32_t offset)
+{
+    prep_rw(sqe, IORING_OP_WRITE, fd, (uint32_t)buf, len, offset);
+}
+
+void ioring_prep_open(struct ioring_sqe *sqe, const char *path, int flags)
+{
+    prep_rw(sqe, IORING_OP_OPEN, -1, (uint32_t)path, flags, 0);
+}
+
+void ioring_prep_close(struct ioring_sqe *sqe, int fd)
+{
+    prep_rw(sqe, IORING_OP_CLOSE, fd, 0, 0, 0);
+}
+
+void ioring_prep_stat(struct ioring_sqe *sqe, const char *path, struct stat *st)
+{
+    prep_rw(sqe, IORING_OP_STAT, -1, (uint32_t)path, 0, 0);
+    sqe->addr2 = (uint32_t)st;
+}
+
+void ioring_prep_readdir(struct ioring_sqe *sqe, int fd, void *dirent)
+{
+    prep_rw(sqe, IORING_OP_READDIR, fd, (uint32_t)dirent, 0, 0);
+}
@@ -0,0 +1,112 @@
+#include <sys/lock.h>
+#include <sys/errno.h>
+#include <stdint.h>
+
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+
+extern int futex(volatile int *uaddr, int op, int val, uint32_t timeout_ms);
+
+// kernel keeps thread id at %gs:4
+static int current_tid()
+{
+    int tid;
+    __asm__ __volatile__("movl %%gs:4, %0" : "=r" (tid));
+    return tid;
+}
+
+/*
+ * "Futexes are tricky" (Drepper), uncontended lock/unlock never enter the kernel
+ */
+void __moo_lock_acquire(volatile int *lock)
+{
+    int c = __sync_val_compare_and_swap(lock, 0, 1);
+    if (c == 0) {
+        return;
+    }
+
+    if (c != 2) {
+        c = __sync_lock_test_and_set(lock, 2);
+    }
+    while (c != 0) {
+        futex(lock, FUTEX_WAIT, 2, 0);
+        c = __sync_lock_test_and_set(lock, 2);
+    }
+}
+
+int __moo_lock_try_acquire(volatile int *lock)
+{
+    return __sync_val_compare_and_swap(lock, 0, 1) == 0 ? 0 : EBUSY;
+}
+
+void __moo_lock_release(volatile int *lock)
+{
+    if (__sync_fetch_and_sub(lock, 1) != 1) {
+        *lock = 0;
+        futex(lock, FUTEX_WAKE, 1, 0);
+    }
+}
+
+/*
+ * Condition variable is a sequence word: waiter sleeps while it's unchanged, signal increments it. The mutex is
+ * retaken in contended state, because other waiters can be sleeping on it after wake up. Returns 0 or ETIMEDOUT,
+ * timeout 0 waits forever.
+ */
+int __moo_cond_wait(volatile int *seq, volatile int *lock, unsigned int timeout_ms)
+{
+    int value = *seq;
+    __moo_lock_release(lock);
+    int timed_out = futex(seq, FUTEX_WAIT, value, timeout_ms) == -1 && errno == ETIMEDOUT;
+    while (__sync_lock_test_and_set(lock, 2) != 0) {
+        futex(lock, FUTEX_WAIT, 2, 0);
+    }
+    return timed_out ? ETIMEDOUT : 0;
+}
+
+void __moo_cond_wake(volatile int *seq, int count)
+{
+    __sync_fetch_and_add(seq, 1);
+    futex(seq, FUTEX_WAKE, count, 0);
+}
+
+void __moo_lock_init_recursive(_LOCK_RECURSIVE_T *lock)
+{
+    lock->state = 0;
+    lock->owner = -1;
+    lock->depth = 0;
+}
+
+void __moo_lock_acquire_recursive(_LOCK_RECURSIVE_T *lock)
+{
+    int tid = current_tid();
+    if (lock->owner == tid) {
+        lock->depth++;
+        return;
+    }
+    __moo_lock_acquire(&lock->state);
+    lock->owner = tid;
+    lock->depth = 1;
+}
+
+int __moo_lock_try_acquire_recursive(_LOCK_RECURSIVE_T *lock)
+{
+    int tid = current_tid();
+    if (lock->owner == tid) {
+        lock->depth++;
+        return 0;
+    }
+    if (__moo_lock_try_acquire(&lock->state) != 0) {
+        return EBUSY;
+    }
+    lock->owner = tid;
+    lock->depth = 1;
+    return 0;
+}
+
+void __moo_lock_release_recursive(_LOCK_RECURSIVE_T *lock)
+{
+    if (--lock->depth == 0) {
+        lock->owner = -1;
+        __moo_lock_release(&lock->state);
+    }
+}
@@ -0,0 +1,125 @@
+#include <pthread.h>
+#include <sys/lock.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <sys/errno.h>
+
+// defined in syscalls.c
+extern int syscall_thread_create(void *entry, void *arg);
+extern int syscall_thread_exit(void *retval);
+extern int syscall_thread_join(int tid, void **retval);
+
+struct thread_start {
+    void *(*start_routine)(void*);
+    void *arg;
+};
+
+static void thread_entry(struct thread_start *start)
+{
+    void *(*start_routine)(void*) = start->start_routine;
+    void *arg = start->arg;
+    free(start);
+
+    pthread_exit(start_routine(arg));
+}
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*start_routine)(void*), void *arg)
+{
+    struct thread_start *start = malloc(sizeof(struct thread_start));
+    if (start == NULL) {
+        return ENOMEM;
+    }
+    start->start_routine = start_routine;
+    start->arg = arg;
+
+    int tid = syscall_thread_create(thread_entry, start);
+    if (tid < 0) {
+        free(start);
+        return -tid;
+    }
+
+    *thread = tid;
+    return 0;
+}
+
+void pthread_exit(void *retval)
+{
+    syscall_thread_exit(retval);
+    while(1){}
+}
+
+int pthread_join(pthread_t thread, void **retval)
+{
+    int i = syscall_thread_join(thread, retval);
+    return i < 0 ? -i : 0;
+}
+
+// see struct user_tls in kernel
+pthread_t pthread_self(void)
+{
+    pthread_t tid;
+    __asm__ __volatile__("movl %%gs:4, %0" : "=r" (tid));
+    return tid;
+}
+
+int pthread_equal(pthread_t t1, pthread_t t2)
+{
+    return t1 == t2;
+}
+
+int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr)
+{
+    *mutex = 0;
+    return 0;
+}
+
+int pthread_mutex_destroy(pthread_mutex_t *mutex)
+{
+    return *mutex != 0 ? EBUSY : 0;
+}
+
+int pthread_mutex_lock(pthread_mutex_t *mutex)
+{
+    __moo_lock_acquire((volatile int*)mutex);
+    return 0;
+}
+
+int pthread_mutex_trylock(pthread_mutex_t *mutex)
+{
+    return __moo_lock_try_acquire((volatile int*)mutex);
+}
+
+int pthread_mutex_unlock(pthread_mutex_t *mutex)
+{
+    __moo_lock_release((volatile int*)mutex);
+    return 0;
+}
+
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr)
+{
+    *cond = 0;
+    return 0;
+}
+
+int pthread_cond_destroy(pthread_cond_t *cond)
+{
+    return 0;
+}
+
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+    __moo_cond_wait((volatile int*)cond, (volatile int*)mutex, 0);
+    return 0;
+}
+
+int pthread_cond_signal(pthread_cond_t *cond)
+{
+    __moo_cond_wake((volatile int*)cond, 1);
+    return 0;
+}
+
+int pthread_cond_broadcast(pthread_cond_t *cond)
+{
+    __moo_cond_wake((volatile int*)cond, INT_MAX);
+    return 0;
+}
@@ -0,0 +1,41 @@
+#ifndef __SYS_LOCK_H__
+#define __SYS_LOCK_H__
+
+/*
+ * Replaces newlib's no-op locks, so malloc, stdio and env are safe with threads (see pthread.h).
+ * Locks are futex words: 0 - unlocked, 1 - locked, 2 - locked and somebody may sleep in kernel.
+ */
+
+typedef volatile int _LOCK_T;
+
+typedef struct {
+    volatile int state;
+    int owner;
+    int depth;
+} _LOCK_RECURSIVE_T;
+
+#define __LOCK_INIT(class, lock) class _LOCK_T lock = 0;
+#define __LOCK_INIT_RECURSIVE(class, lock) class _LOCK_RECURSIVE_T lock = {0, -1, 0};
+
+#define __lock_init(lock) ((lock) = 0)
+#define __lock_init_recursive(lock) __moo_lock_init_recursive(&(lock))
+#define __lock_close(lock) ((void)0)
+#define __lock_close_recursive(lock) ((void)0)
+#define __lock_acquire(lock) __moo_lock_acquire(&(lock))
+#define __lock_acquire_recursive(lock) __moo_lock_acquire_recursive(&(lock))
+#define __lock_try_acquire(lock) __moo_lock_try_acquire(&(lock))
+#define __lock_try_acquire_recursive(lock) __moo_lock_try_acquire_recursive(&(lock))
+#define __lock_release(lock) __moo_lock_release(&(lock))
+#define __lock_release_recursive(lock) __moo_lock_release_recursive(&(lock))
+
+void __moo_lock_acquire(volatile int *lock);
+int __moo_lock_try_acquire(volatile int *lock);
+void __moo_lock_release(volatile int *lock);
+int __moo_cond_wait(volatile int *seq, volatile int *lock, unsigned int timeout_ms);
+void __moo_cond_wake(volatile int *seq, int count);
+void __moo_lock_init_recursive(_LOCK_RECURSIVE_T *lock);
+void __moo_lock_acquire_recursive(_LOCK_RECURSIVE_T *lock);
+int __moo_lock_try_acquire_recursive(_LOCK_RECURSIVE_T *lock);
+void __moo_lock_release_recursive(_LOCK_RECURSIVE_T *lock);
+
+#endif
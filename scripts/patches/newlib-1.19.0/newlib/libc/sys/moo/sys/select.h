@@ -0,0 +1,13 @@
+#ifndef _SYS_SELECT_H
+#define _SYS_SELECT_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+/*
+ * select() is built on poll() in libc, fd_set comes from sys/types.h.
+ */
+
+int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timeval *timeout);
+
+#endif
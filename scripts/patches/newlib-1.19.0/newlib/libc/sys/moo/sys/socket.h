@@ -0,0 +1,65 @@
+#ifndef _SYS_SOCKET_H
+#define _SYS_SOCKET_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * BSD sockets, a socket is a file descriptor, so read(), write() and close() work on it as well.
+ * Only AF_INET is supported, structures must match src/kernel/include/socket.h.
+ */
+
+#define AF_INET 2
+#define PF_INET AF_INET
+#define SOCK_STREAM 1
+#define SOCK_DGRAM 2
+
+#define MSG_TRUNC 0x20 // msg_flags: datagram didn't fit into the buffers
+#define MSG_DONTWAIT 0x40 // O_NONBLOCK for one call
+#define MSG_WAITFORONE 0x10000 // recvmmsg: don't wait after the first datagram
+
+typedef uint32_t socklen_t;
+typedef uint16_t sa_family_t;
+
+struct sockaddr
+{
+    sa_family_t sa_family;
+    char sa_data[14];
+};
+
+struct iovec
+{
+    void *iov_base;
+    size_t iov_len;
+};
+
+struct msghdr
+{
+    void *msg_name;
+    socklen_t msg_namelen;
+    struct iovec *msg_iov;
+    size_t msg_iovlen;
+    void *msg_control; // ancillary data isn't supported
+    size_t msg_controllen;
+    int msg_flags;
+};
+
+struct mmsghdr
+{
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+};
+
+int socket(int domain, int type, int protocol);
+int bind(int fd, const struct sockaddr *addr, socklen_t addrlen);
+int listen(int fd, int backlog);
+int accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+int connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
+ssize_t send(int fd, const void *buf, size_t len, int flags);
+ssize_t recv(int fd, void *buf, size_t len, int flags);
+ssize_t sendto(int fd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen);
+ssize_t recvfrom(int fd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen);
+int recvmmsg(int fd, struct mmsghdr *msgvec, unsigned int vlen, int flags, struct timespec *timeout);
+
+#endif
@@ -7,7 +7,14 @@
 #include <sys/time.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
 #include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <kernel_data.h>
 
 #define F_DUPFD_CLOEXEC 14
 
@@ -57,6 +64,82 @@ typedef struct DIR {
 		return __res; \
 	}
 
+#define DEFN_SYSCALL4(fn, num, P1, P2, P3, P4) \
+	int syscall_##fn(P1 p1, P2 p2, P3 p3, P4 p4) { \
+		int __res; __asm__ __volatile__("push %%ebx; movl %2,%%ebx; int $0x80; pop %%ebx" \
+				: "=a" (__res) \
+				: "0" (num), "r" ((int)(p1)), "c"((int)(p2)), "d"((int)(p3)), "S"((int)(p4)) \
+				: "memory"); \
+		return __res; \
+	}
+
+/*
+ * sysenter versions, kernel returns to label 1 and restores esp from ebp (see sysenter_entry in kernel/irq.S).
+ * sysexit clobbers ecx and edx.
+ */
+#define FAST_SYSCALL_ENTER "push %%ebp; push $1f; mov %%esp, %%ebp; sysenter; 1: pop %%ebp"
+
+#define DEFN_FAST_SYSCALL0(fn, num) \
+	int syscall_##fn() { \
+		int __res, __c, __d; __asm__ __volatile__(FAST_SYSCALL_ENTER \
+				: "=a" (__res), "=c" (__c), "=d" (__d) \
+				: "0" (num) \
+				: "memory", "cc"); \
+		return __res; \
+	}
+
+#define DEFN_FAST_SYSCALL1(fn, num, P1) \
+	int syscall_##fn(P1 p1) { \
+		int __res, __c, __d; __asm__ __volatile__("push %%ebx; movl %4,%%ebx; " FAST_SYSCALL_ENTER "; pop %%ebx" \
+				: "=a" (__res), "=c" (__c), "=d" (__d) \
+				: "0" (num), "r" ((int)(p1)) \
+				: "memory", "cc"); \
+		return __res; \
+	}
+
+#define DEFN_FAST_SYSCALL2(fn, num, P1, P2) \
+	int syscall_##fn(P1 p1, P2 p2) { \
+		int __res, __c, __d; __asm__ __volatile__("push %%ebx; movl %4,%%ebx; " FAST_SYSCALL_ENTER "; pop %%ebx" \
+				: "=a" (__res), "=c" (__c), "=d" (__d) \
+				: "0" (num), "r" ((int)(p1)), "1" ((int)(p2)) \
+				: "memory", "cc"); \
+		return __res; \
+	}
+
+#define DEFN_FAST_SYSCALL3(fn, num, P1, P2, P3) \
+	int syscall_##fn(P1 p1, P2 p2, P3 p3) { \
+		int __res, __c, __d; __asm__ __volatile__("push %%ebx; movl %4,%%ebx; " FAST_SYSCALL_ENTER "; pop %%ebx" \
+				: "=a" (__res), "=c" (__c), "=d" (__d) \
+				: "0" (num), "r" ((int)(p1)), "1" ((int)(p2)), "2" ((int)(p3)) \
+				: "memory", "cc"); \
+		return __res; \
+	}
+
+#define DEFN_FAST_SYSCALL4(fn, num, P1, P2, P3, P4) \
+	int syscall_##fn(P1 p1, P2 p2, P3 p3, P4 p4) { \
+		int __res, __c, __d; __asm__ __volatile__("push %%ebx; movl %4,%%ebx; " FAST_SYSCALL_ENTER "; pop %%ebx" \
+				: "=a" (__res), "=c" (__c), "=d" (__d) \
+				: "0" (num), "r" ((int)(p1)), "1" ((int)(p2)), "2" ((int)(p3)), "S" ((int)(p4)) \
+				: "memory", "cc"); \
+		return __res; \
+	}
+
+#define DEFN_FAST_SYSCALL5(fn, num, P1, P2, P3, P4, P5) \
+	int syscall_##fn(P1 p1, P2 p2, P3 p3, P4 p4, P5 p5) { \
+		int __res, __c, __d; __asm__ __volatile__("push %%ebx; movl %4,%%ebx; " FAST_SYSCALL_ENTER "; pop %%ebx" \
+				: "=a" (__res), "=c" (__c), "=d" (__d) \
+				: "0" (num), "r" ((int)(p1)), "1" ((int)(p2)), "2" ((int)(p3)), "S" ((int)(p4)), "D" ((int)(p5)) \
+				: "memory", "cc"); \
+		return __res; \
+	}
+
+
+/*
+ * Read-only pages mapped by kernel into every process. kernel_data.h is copied from kernel/include by
+ * build-newlib.sh, so addresses and layout always match the kernel.
+ */
+#define KERNEL_DATA get_kernel_data()
+#define PROCESS_DATA get_process_data()
 
 #define SYSCALL_EXIT 1
 #define SYSCALL_FORK 2
@@ -92,13 +175,33 @@ typedef struct DIR {
 #define SYSCALL_SHM_UNMAP 33
 #define SYSCALL_SHM_GET_ADDR 34
 #define SYSCALL_SHM_ALLOC 35
+#define SYSCALL_FUTEX 36
+#define SYSCALL_THREAD_CREATE 38
+#define SYSCALL_THREAD_EXIT 39
+#define SYSCALL_THREAD_JOIN 40
+#define SYSCALL_RING_SETUP 41
+#define SYSCALL_RING_ENTER 42
+#define SYSCALL_SOCKET 43
+#define SYSCALL_BIND 44
+#define SYSCALL_LISTEN 45
+#define SYSCALL_ACCEPT 46
+#define SYSCALL_CONNECT 47
+#define SYSCALL_SEND 48
+#define SYSCALL_RECV 49
+#define SYSCALL_SENDTO 50
+#define SYSCALL_RECVFROM 51
+#define SYSCALL_POLL 52
+#define SYSCALL_EPOLL_CREATE 53
+#define SYSCALL_EPOLL_CTL 54
+#define SYSCALL_EPOLL_WAIT 55
+#define SYSCALL_RECVMMSG 56
 
 DEFN_SYSCALL0(fork, SYSCALL_FORK);
-DEFN_SYSCALL3(write, SYSCALL_WRITE, int, char *, int);
-DEFN_SYSCALL3(read, SYSCALL_READ, int, char *, int);
+DEFN_FAST_SYSCALL3(write, SYSCALL_WRITE, int, char *, int);
+DEFN_FAST_SYSCALL3(read, SYSCALL_READ, int, char *, int);
 DEFN_SYSCALL3(execve, SYSCALL_EXECVE, char *, char **, char **);
 DEFN_SYSCALL3(open, SYSCALL_OPEN, char *, int, int);
-DEFN_SYSCALL3(lseek, SYSCALL_LSEEK, int, int, int);
+DEFN_FAST_SYSCALL3(lseek, SYSCALL_LSEEK, int, int, int);
 DEFN_SYSCALL0(exit, SYSCALL_EXIT);
 DEFN_SYSCALL1(brk, SYSCALL_BRK, int);
 DEFN_SYSCALL1(chdir, SYSCALL_CHDIR, char*);
@@ -120,8 +223,8 @@ DEFN_SYSCALL2(stat, SYSCALL_STAT, char *, struct stat *);
 DEFN_SYSCALL2(kill, 37, int, int);
 DEFN_SYSCALL2(link, 9, char*, char*);
 DEFN_SYSCALL2(setpgrp, SYSCALL_SETPGRP, pid_t, pid_t);
-DEFN_SYSCALL1(close, SYSCALL_CLOSE, int);
-DEFN_SYSCALL0(getpid, SYSCALL_GETPID);
+DEFN_FAST_SYSCALL1(close, SYSCALL_CLOSE, int);
+DEFN_FAST_SYSCALL0(getpid, SYSCALL_GETPID);
 DEFN_SYSCALL2(mkdir, SYSCALL_MKDIR, char *, mode_t);
 DEFN_SYSCALL3(sigprocmask, 0x7e, int, sigset_t*, sigset_t*);
 DEFN_SYSCALL3(waitpid, SYSCALL_WAITPID, int, int*, int);
@@ -135,6 +238,26 @@ DEFN_SYSCALL1(shm_map, SYSCALL_SHM_MAP, const char*);
 DEFN_SYSCALL1(shm_unmap, SYSCALL_SHM_UNMAP, const char*);
 DEFN_SYSCALL2(shm_get_addr, SYSCALL_SHM_GET_ADDR, const char*, uintptr_t*);
 DEFN_SYSCALL2(shm_alloc, SYSCALL_SHM_ALLOC, const char*, uint32_t);
+DEFN_FAST_SYSCALL4(futex, SYSCALL_FUTEX, volatile int*, int, int, uint32_t);
+DEFN_SYSCALL2(thread_create, SYSCALL_THREAD_CREATE, void*, void*);
+DEFN_SYSCALL1(thread_exit, SYSCALL_THREAD_EXIT, void*);
+DEFN_SYSCALL2(thread_join, SYSCALL_THREAD_JOIN, int, void**);
+DEFN_SYSCALL1(ring_setup, SYSCALL_RING_SETUP, uint32_t);
+DEFN_FAST_SYSCALL1(ring_enter, SYSCALL_RING_ENTER, uint32_t);
+DEFN_SYSCALL3(socket, SYSCALL_SOCKET, int, int, int);
+DEFN_SYSCALL3(bind, SYSCALL_BIND, int, const struct sockaddr*, socklen_t);
+DEFN_SYSCALL2(listen, SYSCALL_LISTEN, int, int);
+DEFN_SYSCALL3(accept, SYSCALL_ACCEPT, int, struct sockaddr*, socklen_t*);
+DEFN_SYSCALL3(connect, SYSCALL_CONNECT, int, const struct sockaddr*, socklen_t);
+DEFN_FAST_SYSCALL4(send, SYSCALL_SEND, int, const void*, size_t, int);
+DEFN_FAST_SYSCALL4(recv, SYSCALL_RECV, int, void*, size_t, int);
+DEFN_FAST_SYSCALL5(sendto, SYSCALL_SENDTO, int, const void*, size_t, int, const struct sockaddr_in*);
+DEFN_FAST_SYSCALL5(recvfrom, SYSCALL_RECVFROM, int, void*, size_t, int, struct sockaddr_in*);
+DEFN_FAST_SYSCALL3(poll, SYSCALL_POLL, struct pollfd*, nfds_t, int);
+DEFN_SYSCALL1(epoll_create, SYSCALL_EPOLL_CREATE, int);
+DEFN_FAST_SYSCALL4(epoll_ctl, SYSCALL_EPOLL_CTL, int, int, int, struct epoll_event*);
+DEFN_FAST_SYSCALL4(epoll_wait, SYSCALL_EPOLL_WAIT, int, struct epoll_event*, int, int);
+DEFN_FAST_SYSCALL5(recvmmsg, SYSCALL_RECVMMSG, int, struct mmsghdr*, unsigned int, int, struct timespec*);
 
 __attribute__((noreturn)) void __stack_chk_fail(void)
 {
@@ -169,7 +292,7 @@ int sigprocmask(int how, const sigset_t *set, sigset_t *oldset)
 
 int getppid(void)
 {
-    return syscall_getppid();
+    return PROCESS_DATA->ppid;
 }
 
 int geteuid(void)
@@ -267,7 +390,7 @@ char *getcwd(char *buf, size_t size)
 int fcntl(int fd, int cmd, ...)
 {
     int arg = 0;
-    if (cmd == F_DUPFD || cmd == F_DUPFD_CLOEXEC || cmd == F_SETFD) {
+    if (cmd == F_DUPFD || cmd == F_DUPFD_CLOEXEC || cmd == F_SETFD || cmd == F_SETFL) {
         va_list args;
         va_start(args, cmd);
         arg = va_arg(args, int);
@@ -275,7 +398,7 @@ int fcntl(int fd, int cmd, ...)
     }
     int i = syscall_fcntl(fd, cmd, arg);
     if (i < 0) {
-        errno = i;
+        errno = -i;
         return -1;
     }
     return i;
@@ -451,9 +574,287 @@ uintptr_t shm_get_addr(const char *name)
     return out;
 }
 
+int futex(volatile int *uaddr, int op, int val, uint32_t timeout_ms)
+{
+    int i = syscall_futex(uaddr, op, val, timeout_ms);
+    if (i < 0) {
+        errno = -i;
+        return -1;
+    }
+    return i;
+}
+
+// returns address of the process submission/completion ring
+void *ring_setup(uint32_t entries)
+{
+    int i = syscall_ring_setup(entries);
+    if (i < 0 && i > -4096) {
+        errno = -i;
+        return NULL;
+    }
+    return (void*)i;
+}
+
+int ring_enter(uint32_t min_complete)
+{
+    int i = syscall_ring_enter(min_complete);
+    if (i < 0) {
+        errno = -i;
+        return -1;
+    }
+    return i;
+}
+
+int socket(int domain, int type, int protocol)
+{
+    int i = syscall_socket(domain, type, protocol);
+    if (i < 0) {
+        errno = -i;
+        return -1;
+    }
+    return i;
+}
+
+int bind(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+    int i = syscall_bind(fd, addr, addrlen);
+    if (i < 0) {
+        errno = -i;
+        return -1;
+    }
+    return i;
+}
+
+int listen(int fd, int backlog)
+{
+    int i = syscall_listen(fd, backlog);
+    if (i < 0) {
+        errno = -i;
+        return -1;
+    }
+    return i;
+}
+
+int accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+    int i = syscall_accept(fd, addr, addrlen);
+    if (i < 0) {
+        errno = -i;
+        return -1;
+    }
+    return i;
+}
+
+int connect(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+    int i = syscall_connect(fd, addr, addrlen);
+    if (i < 0) {
+        errno = -i;
+        return -1;
+    }
+    return i;
+}
+
+ssize_t send(int fd, const void *buf, size_t len, int flags)
+{
+    int i = syscall_send(fd, buf, len, flags);
+    if (i < 0) {
+        errno = -i;
+        return -1;
+    }
+    return i;
+}
+
+ssize_t recv(int fd, void *buf, size_t len, int flags)
+{
+    int i = syscall_recv(fd, buf, len, flags);
+    if (i < 0) {
+        errno = -i;
+        return -1;
+    }
+    return i;
+}
+
+// kernel takes only sockaddr_in, so addrlen is checked here
+ssize_t sendto(int fd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+    if (dest_addr != NULL && addrlen < sizeof(struct sockaddr_in)) {
+        errno = EINVAL;
+        return -1;
+    }
+    int i = syscall_sendto(fd, buf, len, flags, (const struct sockaddr_in*)dest_addr);
+    if (i < 0) {
+        errno = -i;
+        return -1;
+    }
+    return i;
+}
+
+// address is truncated to addrlen, addrlen is set to the full size as in POSIX
+ssize_t recvfrom(int fd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen)
+{
+    struct sockaddr_in from;
+    int i = syscall_recvfrom(fd, buf, len, flags, src_addr != NULL ? &from : NULL);
+    if (i < 0) {
+        errno = -i;
+        return -1;
+    }
+    if (src_addr != NULL) {
+        memcpy(src_addr, &from, *addrlen < sizeof(from) ? *addrlen : sizeof(from));
+        *addrlen = sizeof(from);
+    }
+    return i;
+}
+
+// msg_name of each message must have room for struct sockaddr_in, otherwise the address isn't stored
+int recvmmsg(int fd, struct mmsghdr *msgvec, unsigned int vlen, int flags, struct timespec *timeout)
+{
+    int i = syscall_recvmmsg(fd, msgvec, vlen, flags, timeout);
+    if (i < 0) {
+        errno = -i;
+        return -1;
+    }
+    return i;
+}
+
+int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    int i = syscall_poll(fds, nfds, timeout);
+    if (i < 0) {
+        errno = -i;
+        return -1;
+    }
+    return i;
+}
+
+// kernel has only poll(), sets are converted to pollfd array and back
+int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timeval *timeout)
+{
+    if (nfds < 0 || nfds > FD_SETSIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct pollfd fds[FD_SETSIZE];
+    nfds_t count = 0;
+    for (int fd = 0; fd < nfds; fd++) {
+        short events = 0;
+        if (readfds != NULL && FD_ISSET(fd, readfds)) {
+            events |= POLLIN;
+        }
+        if (writefds != NULL && FD_ISSET(fd, writefds)) {
+            events |= POLLOUT;
+        }
+        if (exceptfds != NULL && FD_ISSET(fd, exceptfds)) {
+            events |= POLLPRI;
+        }
+        if (events != 0) {
+            fds[count].fd = fd;
+            fds[count].events = events;
+            count++;
+        }
+    }
+
+    int ms = timeout == NULL ? -1 : timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+    int i = syscall_poll(fds, count, ms);
+    if (i < 0) {
+        errno = -i;
+        return -1;
+    }
+
+    int ready = 0;
+    for (nfds_t n = 0; n < count; n++) {
+        if (fds[n].revents & POLLNVAL) {
+            errno = EBADF;
+            return -1;
+        }
+    }
+    for (int fd = 0; fd < nfds; fd++) {
+        if (readfds != NULL) FD_CLR(fd, readfds);
+        if (writefds != NULL) FD_CLR(fd, writefds);
+        if (exceptfds != NULL) FD_CLR(fd, exceptfds);
+    }
+    for (nfds_t n = 0; n < count; n++) {
+        // hang up and errors make descriptor readable and writable, so the next call reports them
+        if ((fds[n].events & POLLIN) && (fds[n].revents & (POLLIN | POLLHUP | POLLERR))) {
+            FD_SET(fds[n].fd, readfds);
+            ready++;
+        }
+        if ((fds[n].events & POLLOUT) && (fds[n].revents & (POLLOUT | POLLHUP | POLLERR))) {
+            FD_SET(fds[n].fd, writefds);
+            ready++;
+        }
+        if ((fds[n].events & POLLPRI) && (fds[n].revents & POLLPRI)) {
+            FD_SET(fds[n].fd, exceptfds);
+            ready++;
+        }
+    }
+    return ready;
+}
+
+int epoll_create(int size)
+{
+    if (size <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return epoll_create1(0);
+}
+
+int epoll_create1(int flags)
+{
+    int i = syscall_epoll_create(flags);
+    if (i < 0) {
+        errno = -i;
+        return -1;
+    }
+    return i;
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+    int i = syscall_epoll_ctl(epfd, op, fd, event);
+    if (i < 0) {
+        errno = -i;
+        return -1;
+    }
+    return i;
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+    int i = syscall_epoll_wait(epfd, events, maxevents, timeout);
+    if (i < 0) {
+        errno = -i;
+        return -1;
+    }
+    return i;
+}
+
 int getpid()
 {
-    return syscall_getpid();
+    return PROCESS_DATA->pid;
+}
+
+// time since boot, TSC is used to get better precision than PIT tick
+static uint64_t uptime_us()
+{
+    uint32_t seq, ticks;
+    uint64_t tick_tsc;
+    do {
+        seq = KERNEL_DATA->seq;
+        ticks = KERNEL_DATA->ticks;
+        tick_tsc = KERNEL_DATA->tick_tsc;
+    } while ((seq & 1) || seq != KERNEL_DATA->seq);
+
+    uint64_t us = (uint64_t)ticks * 1000000 / KERNEL_DATA->tick_frequency;
+    if (KERNEL_DATA->tsc_khz != 0) {
+        uint64_t tsc = rdtsc();
+        uint64_t max_us = 1000000 / KERNEL_DATA->tick_frequency;
+        uint64_t delta_us = (tsc - tick_tsc) * 1000 / KERNEL_DATA->tsc_khz;
+        us += delta_us < max_us ? delta_us : max_us;
+    }
+    return us;
 }
 
 int isatty(int file)
@@ -508,7 +909,7 @@ int read(int file, char *ptr, int len)
 {
     int i = syscall_read(file, ptr, len);
     if (i < 0) {
-        errno = i;
+        errno = -i;
         return -1;
     }
     return i;
@@ -543,10 +944,17 @@ caddr_t sbrk(int incr)
     return old_brk;
 }
 
+// there is no CPU time accounting per process, uptime is reported as user time (in ms, CLOCKS_PER_SEC)
 clock_t times(struct tms *buf)
 {
-    syscall_debug("times isn't implemented\n", 25);
-    return -1;
+    clock_t uptime = uptime_us() / 1000;
+    if (buf != NULL) {
+        buf->tms_utime = uptime;
+        buf->tms_stime = 0;
+        buf->tms_cutime = 0;
+        buf->tms_cstime = 0;
+    }
+    return uptime;
 }
 
 int unlink(char *name)
@@ -565,14 +973,19 @@ int write(int file, char *ptr, int len)
 {
     int i = syscall_write(file, ptr, len);
     if (i < 0) {
-        errno = i;
+        errno = -i;
         return -1;
     }
     return i;
 }
 
+// boot_time stays 0 until kernel gets RTC support, so it's time since boot for now
 int gettimeofday(struct timeval *ptimeval, void *ptimezone)
 {
-    syscall_debug("gettimeofday isn't implemented\n", 32);
-    return -1;
+    if (ptimeval != NULL) {
+        uint64_t us = uptime_us();
+        ptimeval->tv_sec = KERNEL_DATA->boot_time + us / 1000000;
+        ptimeval->tv_usec = us % 1000000;
+    }
+    return 0;
 }
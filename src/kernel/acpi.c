@@ -0,0 +1,137 @@
+#include "acpi.h"
+#include "mm.h"
+#include "log.h"
+#include "string.h"
+#include "system.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+#define BIOS_AREA 0xE0000
+#define BIOS_AREA_SIZE 0x20000
+#define EBDA_POINTER 0x40E
+
+struct rsdp
+{
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+} __attribute__((packed));
+
+#define ACPI_MAX_TABLES 32
+
+static struct acpi_sdt_header *rsdt = NULL;
+static bool rsdt_searched = false;
+// mappings of RSDT entries, hardware space is never freed, so every table is mapped only once
+static struct acpi_sdt_header *tables[ACPI_MAX_TABLES];
+
+/*
+ * Maps physical memory into hardware space, returns virtual address of physical. Hardware space is never freed,
+ * so it's meant for boot time tables and device registers.
+ */
+void *map_physical_region(uint32_t physical, uint32_t size, uint8_t flags)
+{
+    uint32_t base = physical & ~0xFFF;
+    uint32_t pages = PAGE_ALIGN(physical - base + size) / 0x1000;
+    uint32_t virtual = alloc_hardware_space_chunk(pages);
+    for (uint32_t i = 0; i < pages; i++) {
+        map_virtual_to_physical(virtual + i * 0x1000, base + i * 0x1000, flags);
+    }
+    return (void*)(virtual + physical - base);
+}
+
+static bool checksum_ok(void *data, uint32_t length)
+{
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < length; i++) {
+        sum += ((uint8_t*)data)[i];
+    }
+    return sum == 0;
+}
+
+static struct rsdp *scan_rsdp(uint8_t *area, uint32_t size)
+{
+    for (uint32_t offset = 0; offset + sizeof(struct rsdp) <= size; offset += 16) {
+        struct rsdp *rsdp = (struct rsdp*)(area + offset);
+        if (strncmp(rsdp->signature, "RSD PTR ", 8) == 0 && checksum_ok(rsdp, sizeof(struct rsdp))) {
+            return rsdp;
+        }
+    }
+    return NULL;
+}
+
+// RSDP is in the first KB of EBDA or in the BIOS area, 16 bytes aligned
+static struct rsdp *find_rsdp()
+{
+    uint16_t ebda_segment = *(uint16_t*)map_physical_region(EBDA_POINTER, 2, 0);
+    if (ebda_segment != 0) {
+        struct rsdp *rsdp = scan_rsdp(map_physical_region(ebda_segment << 4, 0x400, 0), 0x400);
+        if (rsdp != NULL) {
+            return rsdp;
+        }
+    }
+    return scan_rsdp(map_physical_region(BIOS_AREA, BIOS_AREA_SIZE, 0), BIOS_AREA_SIZE);
+}
+
+/*
+ * Maps the whole table, the first mapping covers the rest of the header's page so most tables don't need another
+ * one. Checksum is checked by the caller.
+ */
+static struct acpi_sdt_header *map_table(uint32_t physical)
+{
+    uint32_t mapped = 0x1000 - (physical & 0xFFF);
+    if (mapped < sizeof(struct acpi_sdt_header)) {
+        mapped += 0x1000;
+    }
+    struct acpi_sdt_header *header = map_physical_region(physical, mapped, 0);
+    if (header->length > mapped) {
+        header = map_physical_region(physical, header->length, 0);
+    }
+    return header;
+}
+
+static bool table_valid(struct acpi_sdt_header *header)
+{
+    if (!checksum_ok(header, header->length)) {
+        log(KERN_ERR, "[ACPI] bad checksum of table %c%c%c%c\n",
+            header->signature[0], header->signature[1], header->signature[2], header->signature[3]);
+        return false;
+    }
+    return true;
+}
+
+// 32-bit kernel, so XSDT isn't used even for ACPI 2.0+
+struct acpi_sdt_header *acpi_find_table(const char *signature)
+{
+    if (!rsdt_searched) {
+        rsdt_searched = true;
+        struct rsdp *rsdp = find_rsdp();
+        if (rsdp == NULL) {
+            log(KERN_INFO, "[ACPI] RSDP not found\n");
+            return NULL;
+        }
+        rsdt = map_table(rsdp->rsdt_address);
+        if (!table_valid(rsdt)) {
+            rsdt = NULL;
+        }
+    }
+    if (rsdt == NULL) {
+        return NULL;
+    }
+
+    uint32_t count = (rsdt->length - sizeof(struct acpi_sdt_header)) / 4;
+    if (count > ACPI_MAX_TABLES) {
+        count = ACPI_MAX_TABLES;
+    }
+    uint32_t *entries = (uint32_t*)(rsdt + 1);
+    for (uint32_t i = 0; i < count; i++) {
+        if (tables[i] == NULL) {
+            tables[i] = map_table(entries[i]);
+        }
+        if (strncmp(tables[i]->signature, signature, 4) == 0) {
+            return table_valid(tables[i]) ? tables[i] : NULL;
+        }
+    }
+    return NULL;
+}
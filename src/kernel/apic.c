@@ -0,0 +1,216 @@
+#include "apic.h"
+#include "acpi.h"
+#include "msr.h"
+#include "mm.h"
+#include "mmio.h"
+#include "irq.h"
+#include "port.h"
+#include "log.h"
+#include "errno.h"
+#include <stddef.h>
+
+#define MAX_IOAPICS 4
+
+struct ioapic
+{
+    uint32_t mmio;
+    uint32_t gsi_base;
+    uint32_t gsi_count;
+};
+
+// connection of ISA IRQ to IOAPIC input, identity unless MADT has an override
+struct isa_route
+{
+    uint32_t gsi;
+    uint16_t flags;
+    bool overridden;
+};
+
+static bool enabled = false;
+static uint32_t lapic = 0;
+static struct ioapic ioapics[MAX_IOAPICS];
+static uint32_t ioapic_count = 0;
+static struct isa_route isa_routes[ISA_IRQ_COUNT];
+static uint32_t used_vectors = 0; // bit per dynamic vector
+
+static uint32_t ioapic_read(struct ioapic *io, uint32_t reg)
+{
+    mmio_write32(io->mmio, IOAPIC_REG_SELECT, reg);
+    return mmio_read32(io->mmio, IOAPIC_REG_WINDOW);
+}
+
+static void ioapic_write(struct ioapic *io, uint32_t reg, uint32_t value)
+{
+    mmio_write32(io->mmio, IOAPIC_REG_SELECT, reg);
+    mmio_write32(io->mmio, IOAPIC_REG_WINDOW, value);
+}
+
+static struct ioapic *ioapic_for_gsi(uint32_t gsi)
+{
+    for (uint32_t i = 0; i < ioapic_count; i++) {
+        if (gsi >= ioapics[i].gsi_base && gsi < ioapics[i].gsi_base + ioapics[i].gsi_count) {
+            return &ioapics[i];
+        }
+    }
+    return NULL;
+}
+
+static int ioapic_route_gsi(uint32_t gsi, uint8_t vector, uint32_t flags)
+{
+    struct ioapic *io = ioapic_for_gsi(gsi);
+    if (io == NULL) {
+        return -ENODEV;
+    }
+
+    uint32_t n = gsi - io->gsi_base;
+    uint32_t flags_irq = irq_save();
+    ioapic_write(io, IOAPIC_REDIRECTION(n) + 1, (uint32_t)apic_id() << 24);
+    // fixed delivery, physical destination
+    ioapic_write(io, IOAPIC_REDIRECTION(n), vector | flags);
+    irq_restore(flags_irq);
+    return 0;
+}
+
+static void parse_madt(struct acpi_madt *madt)
+{
+    for (uint32_t irq = 0; irq < ISA_IRQ_COUNT; irq++) {
+        isa_routes[irq].gsi = irq;
+    }
+
+    uint8_t *entry = madt->entries;
+    uint8_t *end = (uint8_t*)madt + madt->header.length;
+    while (entry < end) {
+        struct madt_entry_header *header = (struct madt_entry_header*)entry;
+        if (header->length == 0) {
+            break;
+        }
+
+        if (header->type == MADT_TYPE_IOAPIC && ioapic_count < MAX_IOAPICS) {
+            struct madt_ioapic *info = (struct madt_ioapic*)entry;
+            struct ioapic *io = &ioapics[ioapic_count++];
+            io->mmio = (uint32_t)map_physical_region(info->address, 0x20, PAGE_NO_CACHE);
+            io->gsi_base = info->gsi_base;
+            io->gsi_count = ((ioapic_read(io, IOAPIC_VERSION) >> 16) & 0xFF) + 1;
+        } else if (header->type == MADT_TYPE_ISO) {
+            struct madt_iso *iso = (struct madt_iso*)entry;
+            if (iso->bus == 0 && iso->source < ISA_IRQ_COUNT) {
+                isa_routes[iso->source].gsi = iso->gsi;
+                isa_routes[iso->source].flags = iso->flags;
+                isa_routes[iso->source].overridden = true;
+            }
+        }
+        entry += header->length;
+    }
+}
+
+/*
+ * Switches from 8259 to LAPIC + IOAPIC if CPU has APIC and ACPI describes IOAPIC. ISA IRQs keep their vectors,
+ * so drivers don't notice the change. Must be called before drivers request PCI interrupts.
+ */
+void init_apic()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if ((edx & (1 << 9)) == 0) {
+        log(KERN_INFO, "[APIC] not supported by CPU, using 8259 PIC\n");
+        return;
+    }
+
+    struct acpi_madt *madt = (struct acpi_madt*)acpi_find_table("APIC");
+    if (madt == NULL) {
+        log(KERN_INFO, "[APIC] no MADT, using 8259 PIC\n");
+        return;
+    }
+    parse_madt(madt);
+    if (ioapic_count == 0) {
+        log(KERN_INFO, "[APIC] no IOAPIC, using 8259 PIC\n");
+        return;
+    }
+
+    uint32_t flags = irq_save();
+    lapic = (uint32_t)map_physical_region(madt->lapic_address, 0x1000, PAGE_NO_CACHE);
+    wrmsr(MSR_APIC_BASE, rdmsr(MSR_APIC_BASE) | APIC_BASE_ENABLE);
+    mmio_write32(lapic, LAPIC_REG_TPR, 0);
+    mmio_write32(lapic, LAPIC_REG_SVR, LAPIC_SVR_ENABLE | SPURIOUS_VECTOR);
+
+    // mask everything on 8259, it stays remapped, so spurious IRQs don't look like CPU exceptions
+    outb(0x21, 0xFF);
+    outb(0xA1, 0xFF);
+
+    for (uint32_t i = 0; i < ioapic_count; i++) {
+        for (uint32_t n = 0; n < ioapics[i].gsi_count; n++) {
+            ioapic_write(&ioapics[i], IOAPIC_REDIRECTION(n), IOAPIC_MASKED);
+        }
+    }
+    // IRQ 2 is 8259 cascade, it's never raised
+    for (uint8_t irq = 0; irq < ISA_IRQ_COUNT; irq++) {
+        if (irq != 2) {
+            apic_route_isa_irq(irq, IRQ_VECTOR_BASE + irq, false);
+        }
+    }
+
+    enabled = true;
+    irq_restore(flags);
+    log(KERN_INFO, "[APIC] enabled, LAPIC id %i, %i IOAPIC(s)\n", apic_id(), ioapic_count);
+}
+
+bool apic_enabled()
+{
+    return enabled;
+}
+
+void apic_eoi()
+{
+    mmio_write32(lapic, LAPIC_REG_EOI, 0);
+}
+
+uint8_t apic_id()
+{
+    return mmio_read32(lapic, LAPIC_REG_ID) >> 24;
+}
+
+// returns free vector in DYNAMIC_VECTOR_FIRST..DYNAMIC_VECTOR_LAST
+int apic_alloc_vector()
+{
+    for (uint32_t i = 0; i <= DYNAMIC_VECTOR_LAST - DYNAMIC_VECTOR_FIRST; i++) {
+        if (!(__sync_fetch_and_or(&used_vectors, 1 << i) & (1 << i))) {
+            return DYNAMIC_VECTOR_FIRST + i;
+        }
+    }
+    return -ENOSPC;
+}
+
+void apic_free_vector(uint8_t vector)
+{
+    if (vector >= DYNAMIC_VECTOR_FIRST && vector <= DYNAMIC_VECTOR_LAST) {
+        __sync_fetch_and_and(&used_vectors, ~(1 << (vector - DYNAMIC_VECTOR_FIRST)));
+    }
+}
+
+/*
+ * Routes ISA IRQ (or PCI INTx which firmware connected to it) through the MADT override. Without override
+ * ISA IRQs are edge triggered active high and PCI interrupts are level triggered active low.
+ */
+int apic_route_isa_irq(uint8_t irq, uint8_t vector, bool pci)
+{
+    if (irq >= ISA_IRQ_COUNT) {
+        return -EINVAL;
+    }
+
+    struct isa_route *route = &isa_routes[irq];
+    uint32_t flags = 0;
+    if (route->overridden) {
+        // polarity 3 - active low, trigger mode 3 - level, 0 means bus default
+        uint8_t polarity = route->flags & 3;
+        uint8_t trigger = (route->flags >> 2) & 3;
+        if (polarity == 3 || (polarity == 0 && pci)) {
+            flags |= IOAPIC_ACTIVE_LOW;
+        }
+        if (trigger == 3 || (trigger == 0 && pci)) {
+            flags |= IOAPIC_LEVEL;
+        }
+    } else if (pci) {
+        flags = IOAPIC_ACTIVE_LOW | IOAPIC_LEVEL;
+    }
+    return ioapic_route_gsi(route->gsi, vector, flags);
+}
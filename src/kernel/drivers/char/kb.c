@@ -4,6 +4,10 @@
 #include "vfs.h"
 #include "buffer.h"
 #include "irq.h"
+#include "softirq.h"
+#include "wait_queue.h"
+#include "poll.h"
+#include "errno.h"
 
 #define ESC    27
 #define BACKSPACE '\b'
@@ -89,31 +93,57 @@ TAB, 'Q', 'W',   'E', 'R', 'T', 'Y', 'U', 'I', 'O', 'P',   '{', '}', ENTER, 0,
 KF1,   KF2, KF3, KF4, KF5, KF6, KF7, KF8, KF9, KF10, 0, 0,
 KHOME, KUP, KPGUP, '-', KLEFT, '5',   KRIGHT, '+', KEND, KDOWN, KPGDN, KINS, KDEL, 0, 0, 0, KF11, KF12 };
 
+// power of 2
+#define SCANCODES_SIZE 64
+
 struct special_keys modifiers;
 buffer_t *buffer;
+static wait_queue_t readers;
+
+// written by IRQ handler only, read by tasklet only
+static uint8_t scancodes[SCANCODES_SIZE];
+static volatile uint32_t scancodes_head = 0;
+static volatile uint32_t scancodes_tail = 0;
+
+static void keyboard_tasklet(uint32_t data);
+static struct tasklet kb_tasklet = TASKLET_INIT(keyboard_tasklet, 0);
 
 static void keyboard_handler(struct regs *r)
 {
-	uint8_t scancode = inb(0x60);
-    // Key released? Check bit 7 (0x80) of scan code for this
-    if (scancode & 0x80) {
-        scancode &= 0x7F; // Key was released, compare only low seven bits
-        if (scancode == KRLEFT_SHIFT || scancode == KRRIGHT_SHIFT) {
-            modifiers.shift = 0;
-        }
-    } else if (scancode == KRLEFT_SHIFT || scancode == KRRIGHT_SHIFT) {
-        modifiers.shift = 1;
-    } else {
-        assert(0 && "direct mutex flag usage");
-        uint8_t b = buffer->mutex.flag;
-        buffer->mutex.flag = 0;
-        if (modifiers.shift == 1) {
+    uint8_t scancode = inb(0x60);
+    if (scancodes_head - scancodes_tail < SCANCODES_SIZE) {
+        scancodes[scancodes_head % SCANCODES_SIZE] = scancode;
+        scancodes_head++;
+    }
+    tasklet_schedule(&kb_tasklet);
+}
+
+static void keyboard_tasklet(uint32_t data)
+{
+    // reader was interrupted inside buffer, try again on next interrupt exit
+    if (MUTEX_IS_SET(buffer->mutex)) {
+        tasklet_schedule(&kb_tasklet);
+        return;
+    }
+
+    while (scancodes_tail != scancodes_head) {
+        uint8_t scancode = scancodes[scancodes_tail % SCANCODES_SIZE];
+        scancodes_tail++;
+        // Key released? Check bit 7 (0x80) of scan code for this
+        if (scancode & 0x80) {
+            scancode &= 0x7F; // Key was released, compare only low seven bits
+            if (scancode == KRLEFT_SHIFT || scancode == KRRIGHT_SHIFT) {
+                modifiers.shift = 0;
+            }
+        } else if (scancode == KRLEFT_SHIFT || scancode == KRRIGHT_SHIFT) {
+            modifiers.shift = 1;
+        } else if (modifiers.shift == 1) {
             buffer->add(buffer, (char*)&ascii_shift[scancode], 1);
         } else {
             buffer->add(buffer, (char*)&ascii_non_shift[scancode], 1);
         }
-        buffer->mutex.flag = b;
     }
+    wake_up(&readers, WAIT_ANY_KEY, 0);
 }
 
 static int kb_read(vfs_file_t *file, void *buf, uint32_t size, uint32_t *offset)
@@ -124,16 +154,32 @@ static int kb_read(vfs_file_t *file, void *buf, uint32_t size, uint32_t *offset)
 
     uint32_t done = buffer->get(buffer, buf, size);
     while(done == 0) {
+        if (FILE_NONBLOCK(file)) {
+            return -EAGAIN;
+        }
+        cli();
+        if (buffer->head == buffer->tail && !buffer->is_full) {
+            wait_event(&readers, WAIT_ANY_KEY, 0);
+        } else {
+            sti();
+        }
         done = buffer->get(buffer, buf, size);
     }
     return done;
 }
 
+static uint32_t kb_poll(vfs_file_t *file, poll_table_t *table)
+{
+    poll_wait(table, &readers);
+    return buffer->head == buffer->tail && !buffer->is_full ? 0 : POLLIN;
+}
+
 static vfs_file_operations_t kb_file_ops = {
     .open = 0,
     .close = 0,
     .write = 0,
-    .read = &kb_read
+    .read = &kb_read,
+    .poll = &kb_poll
 };
 
 void init_keyboard()
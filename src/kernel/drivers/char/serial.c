@@ -4,14 +4,37 @@
 #include "log.h"
 #include "buffer.h"
 #include "irq.h"
+#include "softirq.h"
+#include "wait_queue.h"
+#include "poll.h"
+#include "errno.h"
 
 #define SERIAL_PORT_1 0x3F8
 #define SERIAL_PORT_2 0x2F8
 #define SERIAL_PORT_3 0x3E8
 #define SERIAL_PORT_4 0x2E8
 
+// power of 2
+#define RX_SIZE 16
+
 buffer_t *buffers[4];
 uint32_t ports[4] = {SERIAL_PORT_1, SERIAL_PORT_2, SERIAL_PORT_3, SERIAL_PORT_4};
+static wait_queue_t readers[4];
+
+// received chars, written by IRQ handlers only, read by tasklets only
+static struct {
+    char data[RX_SIZE];
+    volatile uint32_t head;
+    volatile uint32_t tail;
+} rx[4];
+
+static void serial_tasklet(uint32_t index);
+static struct tasklet rx_tasklets[4] = {
+    TASKLET_INIT(serial_tasklet, 0),
+    TASKLET_INIT(serial_tasklet, 1),
+    TASKLET_INIT(serial_tasklet, 2),
+    TASKLET_INIT(serial_tasklet, 3)
+};
 
 static void setup_serial(uint32_t port)
 {
@@ -32,6 +55,10 @@ static int serial_write(vfs_file_t *file, void *buf, uint32_t size, uint32_t *of
 
     while(done < size)
     {
+        // transmitter holding register is busy
+        if ((inb(ports[index] + 5) & 0x20) == 0 && FILE_NONBLOCK(file)) {
+            return done > 0 ? (int)done : -EAGAIN;
+        }
         while ((inb(ports[index] + 5) & 0x20) == 0);
         outb(ports[index], *(char*)buf);
         done++;
@@ -53,11 +80,29 @@ static int serial_read(vfs_file_t *file, void *buf, uint32_t size, uint32_t *off
     uint32_t done = buffers[index]->get(buffers[index], buf, size);
     while(done == 0)
     {
+        if (FILE_NONBLOCK(file)) {
+            return -EAGAIN;
+        }
+        cli();
+        if (buffers[index]->head == buffers[index]->tail && !buffers[index]->is_full) {
+            wait_event(&readers[index], WAIT_ANY_KEY, 0);
+        } else {
+            sti();
+        }
         done = buffers[index]->get(buffers[index], buf, size);
     }
     return done;
 }
 
+// writes go straight to the port, so the port is always writable
+static uint32_t serial_poll(vfs_file_t *file, poll_table_t *table)
+{
+    uint32_t index = (uint32_t)file->node->obj;
+    poll_wait(table, &readers[index]);
+    uint8_t empty = buffers[index]->head == buffers[index]->tail && !buffers[index]->is_full;
+    return (empty ? 0 : POLLIN) | POLLOUT;
+}
+
 static int serial_open(vfs_file_t *file, uint32_t flags)
 {
     uint32_t index = (uint32_t)file->node->obj;
@@ -71,11 +116,26 @@ static void read_serial_intr(uint32_t index)
     // because system has no ideas how much data will come and system can go to infinity loop
     while ((inb(ports[index] + 5) & 0x01) == 0);
     char c = inb(ports[index]);
-    assert(0 && "direct mutex flag usage");
-    uint8_t b = buffers[index]->mutex.flag;
-    buffers[index]->mutex.flag = 0;
-    buffers[index]->add(buffers[index], (void*)&c, 1);
-    buffers[index]->mutex.flag = b;
+    if (rx[index].head - rx[index].tail < RX_SIZE) {
+        rx[index].data[rx[index].head % RX_SIZE] = c;
+        rx[index].head++;
+    }
+    tasklet_schedule(&rx_tasklets[index]);
+}
+
+static void serial_tasklet(uint32_t index)
+{
+    // reader was interrupted inside buffer, try again on next interrupt exit
+    if (MUTEX_IS_SET(buffers[index]->mutex)) {
+        tasklet_schedule(&rx_tasklets[index]);
+        return;
+    }
+
+    while (rx[index].tail != rx[index].head) {
+        buffers[index]->add(buffers[index], (void*)&rx[index].data[rx[index].tail % RX_SIZE], 1);
+        rx[index].tail++;
+    }
+    wake_up(&readers[index], WAIT_ANY_KEY, 0);
 }
 
 static void serial_1_3_handler(struct regs *r)
@@ -104,7 +164,8 @@ static vfs_file_operations_t serial_file_ops = {
     .open = &serial_open,
     .close = 0,
     .write = &serial_write,
-    .read = &serial_read
+    .read = &serial_read,
+    .poll = &serial_poll
 };
 
 void init_serial()
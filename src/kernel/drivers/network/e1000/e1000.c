@@ -7,16 +7,56 @@
 #include "mm.h"
 #include "timer.h"
 #include "network.h"
+#include "ip.h"
+#include "tcp.h"
+#include "udp.h"
 #include "string.h"
 #include "system.h"
 #include "log.h"
+#include "irq.h"
+#include "wait_queue.h"
+#include "e1000.h"
+#include "pcap.h"
 
 // must be multiple of 8
 // 256 because it will take exactly one page (descriptor size is 16 bytes)
 #define RX_DESCRIPTORS_COUNT 256
 #define TX_DESCRIPTORS_COUNT 256
 
-#define DESCRIPTOR_BUFFER_SIZE 2048
+
+// packets processed by RX worker before it yields CPU, ring is polled with RX interrupts masked meanwhile
+#define RX_BUDGET 64
+// interrupt throttling, ITR is in 256ns units: ~20000 interrupts per second at most
+#define E1000_ITR_VALUE 195
+
+#define E1000_MAX_DEVICES 4
+// 82574 has two RX and two TX queues, frames are spread over RX ones by RSS hash of the flow
+#define E1000_MAX_QUEUES 2
+// MSI-X: vectors 0..E1000_MAX_QUEUES-1 are RX queues, the following ones TX queues
+#define E1000_MSIX_VECTORS (2 * E1000_MAX_QUEUES)
+
+// completed TX descriptors are reclaimed lazily, when less than this number is free
+#define TX_RECLAIM_THRESHOLD (TX_DESCRIPTORS_COUNT / 4)
+// TDT is written at least once per this number of descriptors even inside of TX batch
+#define TX_DOORBELL_BATCH 16
+
+#define E1000_TXD_CMD_EOP  (1<<0)
+#define E1000_TXD_CMD_IFCS (1<<1)
+#define E1000_TXD_CMD_TSE  (1<<2)
+#define E1000_TXD_CMD_RS   (1<<3)
+#define E1000_TXD_CMD_DEXT (1<<5) // extended (context or data) descriptor
+#define E1000_TXD_DTYP_CONTEXT 0
+#define E1000_TXD_DTYP_DATA 1
+// context descriptor command shares RS, TSE and DEXT bits with data descriptor one
+#define E1000_TXD_TUCMD_TCP (1<<0)
+#define E1000_TXD_TUCMD_IP  (1<<1)
+#define E1000_TXD_POPTS_IXSM (1<<0) // insert IP checksum
+#define E1000_TXD_POPTS_TXSM (1<<1) // insert TCP/UDP checksum
+
+#define E1000_RXD_STAT_EOP   (1<<1) // last descriptor of the frame
+#define E1000_RXD_STAT_IXSM  (1<<2) // checksum wasn't checked
+#define E1000_RXD_STAT_TCPCS (1<<5) // TCP/UDP checksum checked
+#define E1000_RXD_STAT_IPCS  (1<<6) // IP checksum checked
 
 #define E1000_REG_RDH   0x2810
 #define E1000_REG_RDT   0x2818
@@ -27,7 +67,11 @@
 #define E1000_REG_TDH   0x3810
 #define E1000_REG_TDT   0x3818
 #define E1000_REG_CTRL  0x0000
+#define E1000_REG_ICR   0x00c0
+#define E1000_REG_ITR   0x00c4
+#define E1000_REG_IMS   0x00d0
 #define E1000_REG_IMC   0x00d8
+#define E1000_REG_RDTR  0x2820
 #define E1000_REG_MTA   0x5200
 #define E1000_REG_RAL   0x5400
 #define E1000_REG_RAH   0x5404
@@ -37,6 +81,30 @@
 #define E1000_REG_RDBAH 0x2804
 #define E1000_REG_RDLEN 0x2808
 #define E1000_REG_EERD  0x14
+#define E1000_REG_RXCSUM 0x5000
+#define E1000_REG_RFCTL 0x5008
+#define E1000_REG_MRQC  0x5818
+#define E1000_REG_RETA  0x5C00
+#define E1000_REG_RSSRK 0x5C80
+#define E1000_REG_IVAR  0x00e4
+#define E1000_REG_EIAC  0x00dc
+#define E1000_REG_EITR  0x00e8
+#define E1000_REG_TARC  0x3840
+// registers of queue n are 0x100 apart
+#define E1000_QUEUE_REG(reg, n) ((reg) + (n) * 0x100)
+
+#define E1000_RXCSUM_IPOFL (1<<8)
+#define E1000_RXCSUM_TUOFL (1<<9)
+#define E1000_RXCSUM_PCSD  (1<<13) // descriptor reports RSS hash instead of packet checksum
+#define E1000_RFCTL_EXSTEN (1<<15) // extended RX descriptors
+#define E1000_MRQC_RSS     (1<<0)
+#define E1000_MRQC_TCP_IPV4 (1<<16)
+#define E1000_MRQC_IPV4    (1<<17)
+#define E1000_RETA_QUEUE1  0x80 // bit of redirection table entry which selects queue 1
+#define E1000_TARC_ENABLE  (1<<10) // transmit queue enable
+#define E1000_IVAR_VALID   (1<<3) // IVAR has 4 bits per cause: vector and valid bit
+#define E1000_IVAR_TX_SHIFT 8 // RX queue causes are in the first byte, TX ones in the second
+#define E1000_CTRL_EXT_PBA_CLR (1U<<31) // required with MSI-X
 
 #define E1000_RCTL_EN   (1<<1)
 #define E1000_RCTL_SBP  (1<<2)
@@ -50,6 +118,16 @@
 #define E1000_CTRL_SLU  (1<<6)
 #define E1000_CTRL_EXT_LINK_MODE_MASK (uint32_t)(3ULL<<22)
 
+#define E1000_ICR_TXDW   (1<<0) // transmit descriptor written back
+#define E1000_ICR_LSC    (1<<2) // link status change
+#define E1000_ICR_RXDMT0 (1<<4) // receive descriptor minimum threshold
+#define E1000_ICR_RXO    (1<<6) // receiver overrun
+#define E1000_ICR_RXT0   (1<<7) // receiver timer
+#define E1000_ICR_RX (E1000_ICR_RXDMT0 | E1000_ICR_RXO | E1000_ICR_RXT0)
+// MSI-X causes of 82574
+#define E1000_ICR_RXQ(n) (1 << (20 + (n)))
+#define E1000_ICR_TXQ(n) (1 << (22 + (n)))
+
 #define E1000_TCTL_EN   (1<<1)
 #define E1000_TCTL_PSP  (1<<3) // pad short packets
 #define E1000_TCTL_MULR (1<<28) // (Multiple Request Support) WTF? 2 days of debugging, WTF?
@@ -63,6 +141,16 @@ typedef struct e1000_rx_descriptor {
     uint16_t special;
 } __attribute__((packed)) e1000_rx_descriptor_t;
 
+// write-back of extended RX descriptor (needed for RSS), hardware reads it as address and reserved quadword
+typedef struct e1000_rx_ext_descriptor
+{
+    uint32_t mrq; // RSS type and queue
+    uint32_t rss_hash;
+    uint32_t status_error; // bits 0-19 status as in legacy descriptor, 24-31 errors as in legacy descriptor
+    uint16_t length;
+    uint16_t vlan;
+} __attribute__((packed)) e1000_rx_ext_descriptor_t;
+
 typedef struct e1000_tx_descriptor
 {
     uint64_t address;
@@ -74,94 +162,294 @@ typedef struct e1000_tx_descriptor
     uint16_t special;
 } __attribute__((packed)) e1000_tx_descriptor_t;
 
+// sets up checksum and segmentation offsets for following data descriptors, hardware keeps the last one
+typedef struct e1000_tx_context_descriptor
+{
+    uint8_t ipcss; // IP checksum start
+    uint8_t ipcso; // IP checksum offset
+    uint16_t ipcse; // IP checksum end
+    uint8_t tucss; // TCP/UDP checksum start
+    uint8_t tucso;
+    uint16_t tucse; // 0 - end of packet
+    uint32_t paylen_dtyp_tucmd; // bits 0-19 TSO payload length, 20-23 descriptor type, 24-31 command
+    uint8_t status;
+    uint8_t hdrlen; // headers replicated in every TSO segment
+    uint16_t mss;
+} __attribute__((packed)) e1000_tx_context_descriptor_t;
+
+typedef struct e1000_tx_data_descriptor
+{
+    uint64_t address;
+    uint32_t length_dtyp_dcmd; // bits 0-19 length, 20-23 descriptor type, 24-31 command
+    uint8_t status;
+    uint8_t popts;
+    uint16_t special;
+} __attribute__((packed)) e1000_tx_data_descriptor_t;
+
+struct e1000_device;
+
+// RX queue with its own worker, buffers and interrupt cause
+typedef struct e1000_rx_ring
+{
+    struct e1000_device *dev;
+    uint32_t index;
+    e1000_rx_descriptor_t *base;
+    uint32_t tail;
+    net_buffer_t *buffers[RX_DESCRIPTORS_COUNT]; // hardware DMAs into them
+    net_buffer_t *chain; // jumbo frame being assembled from descriptors until EOP
+    net_buffer_t *chain_tail;
+    bool drop; // rest of current frame is discarded
+    int vector; // negative if device has no interrupt, RX worker polls then
+    uint32_t cause; // interrupt cause masked while the worker polls
+    wait_queue_t queue;
+} e1000_rx_ring_t;
+
+typedef struct e1000_tx_ring
+{
+    uint32_t index;
+    e1000_tx_descriptor_t *base;
+    uint32_t tail;
+    uint32_t clean; // oldest descriptor which isn't reclaimed
+    uint32_t free;
+    uint32_t unflushed; // descriptors written after last TDT update
+    uint32_t context; // checksum context loaded into hardware, 0 - none or TSO context
+    net_buffer_t *buffers[TX_DESCRIPTORS_COUNT]; // held until descriptor is reclaimed
+    mutex_t mutex;
+    int vector;
+    uint32_t cause; // unmasked only while sender waits for free descriptor
+    wait_queue_t queue;
+} e1000_tx_ring_t;
+
 typedef struct e1000_device
 {
     uint32_t mmio;
-    e1000_rx_descriptor_t *rx_base;
-    e1000_tx_descriptor_t *tx_base;
-    uint32_t rx_tail;
-    uint32_t tx_tail;
-    void *rx_data_buffer;
-    void *tx_data_buffer;
-    mutex_t mutex;
     pci_device_t *pci_dev;
+    uint32_t queue_count;
+    bool extended_rx; // RX descriptors are written back in extended format
+    bool msix; // every ring has its own vector, otherwise all rings share one
+    e1000_rx_ring_t rx[E1000_MAX_QUEUES];
+    e1000_tx_ring_t tx[E1000_MAX_QUEUES];
 } e1000_device_t;
 
-void rx_thread(e1000_device_t *dev)
-{
-    network_device_t *net_dev = (network_device_t*)dev->pci_dev->logical_driver;
+static e1000_device_t *devices[E1000_MAX_DEVICES];
 
-    while(true)
+// status byte of the descriptor at the tail, 0 if hardware hasn't written it back yet
+static uint8_t rx_status(e1000_rx_ring_t *ring, uint8_t *errors, uint16_t *length)
+{
+    if (ring->dev->extended_rx)
     {
-        if (!(dev->rx_base[dev->rx_tail].status & 1))
-        {
-            force_task_switch();
+        e1000_rx_ext_descriptor_t *desc = (e1000_rx_ext_descriptor_t*)&ring->base[ring->tail];
+        *errors = desc->status_error >> 24;
+        *length = desc->length;
+        return desc->status_error & 0xFF;
+    }
+    *errors = ring->base[ring->tail].errors;
+    *length = ring->base[ring->tail].length;
+    return ring->base[ring->tail].status;
+}
+
+static bool rx_ready(e1000_rx_ring_t *ring)
+{
+    uint8_t errors;
+    uint16_t length;
+    return rx_status(ring, &errors, &length) & 1;
+}
+
+// top half: RX interrupts stay masked until RX worker drains the ring (NAPI)
+static void e1000_irq_handler(struct regs *r)
+{
+    for (uint32_t i = 0; i < E1000_MAX_DEVICES; i++) {
+        e1000_device_t *dev = devices[i];
+        if (dev == NULL) {
             continue;
         }
 
-        // we got packet
-        uint8_t drop = 0;
-        if ((dev->rx_base[dev->rx_tail].status & (1 << 1)) == 0)
-        {
-            //debug("[e1000] no End Of Packet flag. Status: %x, packet ignored.\n", dev->rx_base[dev->rx_tail].status);
-            drop = 1;
+        if (dev->msix) {
+            // vector tells the ring, causes are cleared by hardware (EIAC)
+            for (uint32_t q = 0; q < dev->queue_count; q++) {
+                if (dev->rx[q].vector == (int)r->int_num) {
+                    mmio_write32(dev->mmio, E1000_REG_IMC, dev->rx[q].cause);
+                    wake_up(&dev->rx[q].queue, WAIT_ANY_KEY, 0);
+                }
+                if (dev->tx[q].vector == (int)r->int_num) {
+                    mmio_write32(dev->mmio, E1000_REG_IMC, dev->tx[q].cause);
+                    wake_up(&dev->tx[q].queue, WAIT_ANY_KEY, 0);
+                }
+            }
+            continue;
         }
-        else if (dev->rx_base[dev->rx_tail].length < 60)
+        if (dev->rx[0].vector != (int)r->int_num) {
+            continue;
+        }
+
+        // reading clears causes, 0 - line is shared and the interrupt isn't ours; cause doesn't tell the queue
+        uint32_t icr = mmio_read32(dev->mmio, E1000_REG_ICR);
+        if (icr & E1000_ICR_RX) {
+            mmio_write32(dev->mmio, E1000_REG_IMC, E1000_ICR_RX);
+            for (uint32_t q = 0; q < dev->queue_count; q++) {
+                wake_up(&dev->rx[q].queue, WAIT_ANY_KEY, 0);
+            }
+        }
+        if (icr & E1000_ICR_TXDW) {
+            mmio_write32(dev->mmio, E1000_REG_IMC, E1000_ICR_TXDW);
+            for (uint32_t q = 0; q < dev->queue_count; q++) {
+                wake_up(&dev->tx[q].queue, WAIT_ANY_KEY, 0);
+            }
+        }
+    }
+}
+
+/*
+ * Frame longer than descriptor buffer (jumbo frame) is spread over several descriptors, their buffers are chained
+ * with next_frag and the chain goes up the stack on EOP descriptor, which also carries errors and checksum status.
+ */
+static uint32_t rx_poll(e1000_rx_ring_t *ring, uint32_t budget)
+{
+    e1000_device_t *dev = ring->dev;
+    network_device_t *net_dev = (network_device_t*)dev->pci_dev->logical_driver;
+    uint32_t done = 0;
+
+    for (; done < budget && rx_ready(ring); done++)
+    {
+        e1000_rx_descriptor_t *desc = &ring->base[ring->tail];
+        uint8_t errors;
+        uint16_t length;
+        uint8_t status = rx_status(ring, &errors, &length);
+
+        // buffer goes up the stack as is and the descriptor gets a fresh one; if pool is empty the whole frame is
+        // dropped and the buffer is recycled
+        net_buffer_t *fresh = ring->drop ? NULL : alloc_net_buffer();
+        if (fresh != NULL)
         {
-            //debug("[e1000] packet length is %i, packet ignored.\n", dev->rx_base[dev->rx_tail].length);
-            drop = 1;
+            net_buffer_t *buffer = ring->buffers[ring->tail];
+            buffer->len = length;
+            if (ring->chain == NULL)
+            {
+                ring->chain = buffer;
+            }
+            else
+            {
+                ring->chain_tail->next_frag = buffer;
+            }
+            ring->chain_tail = buffer;
+
+            ring->buffers[ring->tail] = fresh;
+            fresh->data = fresh->head;
         }
-        else if (dev->rx_base[dev->rx_tail].errors)
+        else if (ring->chain != NULL)
         {
-            //debug("[e1000] packet error code is %i, packet ignored.\n", dev->rx_base[dev->rx_tail].errors);
-            drop = 1;
+            release_net_buffer(ring->chain);
+            ring->chain = NULL;
         }
+        ring->drop = !(status & E1000_RXD_STAT_EOP) && fresh == NULL;
 
-        if (drop == 0)
+        if ((status & E1000_RXD_STAT_EOP) && ring->chain != NULL)
         {
-            net_dev->receive_packet(net_dev, dev->rx_data_buffer + dev->rx_tail * DESCRIPTOR_BUFFER_SIZE);
+            net_buffer_t *frame = ring->chain;
+            ring->chain = NULL;
+            if (net_buffer_total_len(frame) < 60 || errors)
+            {
+                //debug("[e1000] packet length is %i, error code is %i, packet ignored.\n", net_buffer_total_len(frame), errors);
+                release_net_buffer(frame);
+            }
+            else
+            {
+                // frames with bad checksums have error bits set and are dropped above
+                frame->offload = 0;
+                if (!(status & E1000_RXD_STAT_IXSM))
+                {
+                    frame->offload |= (status & E1000_RXD_STAT_IPCS) ? NET_OFFLOAD_RX_IP_OK : 0;
+                    frame->offload |= (status & E1000_RXD_STAT_TCPCS) ? NET_OFFLOAD_RX_L4_OK : 0;
+                }
+                net_dev->receive_packet(net_dev, frame);
+            }
         }
 
-        dev->rx_base[dev->rx_tail].status = 0;
-        dev->rx_tail = (dev->rx_tail + 1) % RX_DESCRIPTORS_COUNT;
-        mmio_write32(dev->mmio, E1000_REG_RDT, dev->rx_tail);
+        // extended write-back overwrites the address, so the descriptor is always rebuilt
+        memset(desc, 0, sizeof(e1000_rx_descriptor_t));
+        desc->address = ring->buffers[ring->tail]->physical;
+        ring->tail = (ring->tail + 1) % RX_DESCRIPTORS_COUNT;
+        mmio_write32(dev->mmio, E1000_QUEUE_REG(E1000_REG_RDT, ring->index), ring->tail);
     }
+    return done;
 }
 
-void e1000_setup_tx(e1000_device_t *dev)
+/*
+ * Sleeps until RX interrupt, then drains the ring in RX_BUDGET batches with interrupts masked. Under load it keeps
+ * polling (yielding between batches), when ring is empty RX interrupts are enabled again. Every RX queue has its
+ * own worker.
+ */
+void rx_thread(e1000_rx_ring_t *ring)
+{
+    e1000_device_t *dev = ring->dev;
+    network_device_t *net_dev = (network_device_t*)dev->pci_dev->logical_driver;
+
+    while(true)
+    {
+        // replies generated by the batch share TDT writes
+        net_tx_batch_begin(net_dev);
+        uint32_t done = rx_poll(ring, RX_BUDGET);
+        net_tx_batch_end(net_dev);
+        if (done == RX_BUDGET) {
+            force_task_switch();
+            continue;
+        }
+
+        cli();
+        if (ring->vector < 0) {
+            // no interrupt, poll every tick
+            wait_event(&ring->queue, WAIT_ANY_KEY, 1);
+            continue;
+        }
+        mmio_write32(dev->mmio, E1000_REG_IMS, ring->cause);
+        // packet could come before interrupts were unmasked
+        if (rx_ready(ring)) {
+            mmio_write32(dev->mmio, E1000_REG_IMC, ring->cause);
+            sti();
+            continue;
+        }
+        wait_event(&ring->queue, WAIT_ANY_KEY, 0);
+    }
+}
+
+// descriptor rings must be aligned on 16 byte boundary and physically continuous, returns virtual address
+static void *alloc_descriptor_ring(uint32_t size)
 {
-    uint32_t desc_pages = PAGE_ALIGN(sizeof(e1000_tx_descriptor_t) * TX_DESCRIPTORS_COUNT) / 0x1000;
-    // tx_buffer must be aligned on 16 byte boundary, also we need continuous chunk of memory
+    uint32_t desc_pages = PAGE_ALIGN(size) / 0x1000;
     // alloc_physical_range returns address aligned on page boundary
     uint32_t physical_addr = alloc_physical_range(desc_pages);
     uint32_t virtual_addr = alloc_hardware_space_chunk(desc_pages);
-    map_virtual_to_physical_range(virtual_addr, physical_addr, desc_pages, PAGE_NO_CACHE);
-
-    dev->tx_base = (void*)virtual_addr;
-    memset(dev->tx_base, 0, sizeof(e1000_tx_descriptor_t) * TX_DESCRIPTORS_COUNT);
-
-    uint16_t pages_count = PAGE_ALIGN(DESCRIPTOR_BUFFER_SIZE * RX_DESCRIPTORS_COUNT) / 0x1000;
-    dev->tx_data_buffer = (void*)alloc_hardware_space_chunk(pages_count);
-    uint32_t phys_addr = alloc_physical_range(pages_count);
-    map_virtual_to_physical_range((uint32_t)dev->tx_data_buffer, phys_addr, pages_count, PAGE_NO_CACHE);
-    memset(dev->tx_data_buffer, 0, DESCRIPTOR_BUFFER_SIZE * RX_DESCRIPTORS_COUNT);
+    map_virtual_to_physical_range(virtual_addr, physical_addr, PAGE_NO_CACHE, desc_pages);
+    memset((void*)virtual_addr, 0, size);
+    return (void*)virtual_addr;
+}
 
-    for (uint16_t i = 0; i < TX_DESCRIPTORS_COUNT; i++)
+void e1000_setup_tx(e1000_device_t *dev)
+{
+    for (uint32_t q = 0; q < dev->queue_count; q++)
     {
-        e1000_tx_descriptor_t *current = &(dev->tx_base[i]);
-        current->address = get_physical_address((uint32_t)dev->tx_data_buffer + DESCRIPTOR_BUFFER_SIZE * i);
+        e1000_tx_ring_t *ring = &dev->tx[q];
+        ring->index = q;
+        ring->base = alloc_descriptor_ring(sizeof(e1000_tx_descriptor_t) * TX_DESCRIPTORS_COUNT);
+        // descriptors get addresses of net buffers in send_packet()
+
+        // must be (uint32_t)ring->base >> 32, but we don't use 64bit mode
+        mmio_write32(dev->mmio, E1000_QUEUE_REG(E1000_REG_TDBAH, q), 0);
+        // must contains "& 0xFFFFFFFF" but we don't use 64bit mode
+        mmio_write32(dev->mmio, E1000_QUEUE_REG(E1000_REG_TDBAL, q), get_physical_address((uint32_t)ring->base));
+        mmio_write32(dev->mmio, E1000_QUEUE_REG(E1000_REG_TDLEN, q), (uint32_t)(TX_DESCRIPTORS_COUNT * sizeof(e1000_tx_descriptor_t)));
+        mmio_write32(dev->mmio, E1000_QUEUE_REG(E1000_REG_TDH, q), 0);
+        mmio_write32(dev->mmio, E1000_QUEUE_REG(E1000_REG_TDT, q), 0);
+        ring->tail = 0;
+        ring->clean = 0;
+        ring->free = TX_DESCRIPTORS_COUNT;
+        if (dev->queue_count > 1)
+        {
+            mmio_write32(dev->mmio, E1000_QUEUE_REG(E1000_REG_TARC, q),
+                         mmio_read32(dev->mmio, E1000_QUEUE_REG(E1000_REG_TARC, q)) | E1000_TARC_ENABLE);
+        }
     }
 
-    // must be (uint32_t)dev->tx_base >> 32, but we don't use 64bit mode
-    mmio_write32(dev->mmio, E1000_REG_TDBAH, 0);
-    // must contains "& 0xFFFFFFFF" but we don't use 64bit mode
-    mmio_write32(dev->mmio, E1000_REG_TDBAL, get_physical_address((uint32_t)dev->tx_base));
-
-    mmio_write32(dev->mmio, E1000_REG_TDLEN, (uint32_t)(TX_DESCRIPTORS_COUNT * sizeof(e1000_tx_descriptor_t)));
-    mmio_write32(dev->mmio, E1000_REG_TDH, 0);
-    mmio_write32(dev->mmio, E1000_REG_TDT, 0);
-    dev->tx_tail = 0;
-
     mmio_write32(dev->mmio, E1000_REG_TCTL, E1000_TCTL_PSP | E1000_TCTL_MULR);
 }
 
@@ -189,87 +477,350 @@ uint16_t e1000_eeprom_read_8254x(uint32_t base, uint8_t eeprom_addr)
     return data >> 16;
 }
 
-void e1000_setup_rx(e1000_device_t *dev)
+/*
+ * RSS hashes IPv4 addresses (and TCP ports) of the frame, the redirection table sends even entries to queue 0 and
+ * odd ones to queue 1. Hash is reported in place of packet checksum and needs extended descriptors.
+ */
+static void e1000_setup_rss(e1000_device_t *dev)
 {
-     uint32_t desc_pages = PAGE_ALIGN(sizeof(e1000_rx_descriptor_t) * RX_DESCRIPTORS_COUNT) / 0x1000;
-    // rx_buffer must be aligned on 16 byte boundary, also we need continuous chunk of memory
-    // alloc_physical_range returns address aligned on page boundary
-    uint32_t physical_addr = alloc_physical_range(desc_pages);
-    uint32_t virtual_addr = alloc_hardware_space_chunk(desc_pages);
-    map_virtual_to_physical_range(virtual_addr, physical_addr, desc_pages, PAGE_NO_CACHE);
+    // default key from Microsoft RSS specification
+    static const uint32_t key[10] = {
+        0xda565a6d, 0xc20e5b25, 0x3d256741, 0xb08fa343, 0xcb2bcad0,
+        0xb4307bae, 0xa32dcb77, 0x0cf23080, 0x3bb7426a, 0xfa01acbe
+    };
+    for (uint32_t i = 0; i < 10; i++)
+    {
+        mmio_write32(dev->mmio, E1000_REG_RSSRK + i * 4, key[i]);
+    }
+    // 128 one byte entries
+    for (uint32_t i = 0; i < 32; i++)
+    {
+        mmio_write32(dev->mmio, E1000_REG_RETA + i * 4, (uint32_t)E1000_RETA_QUEUE1 << 8 | (uint32_t)E1000_RETA_QUEUE1 << 24);
+    }
+    mmio_write32(dev->mmio, E1000_REG_RFCTL, mmio_read32(dev->mmio, E1000_REG_RFCTL) | E1000_RFCTL_EXSTEN);
+    mmio_write32(dev->mmio, E1000_REG_RXCSUM, mmio_read32(dev->mmio, E1000_REG_RXCSUM) | E1000_RXCSUM_PCSD);
+    mmio_write32(dev->mmio, E1000_REG_MRQC, E1000_MRQC_RSS | E1000_MRQC_TCP_IPV4 | E1000_MRQC_IPV4);
+    dev->extended_rx = true;
+}
 
-    dev->rx_base = (void*)virtual_addr;
-    memset(dev->rx_base, 0, sizeof(e1000_rx_descriptor_t) * RX_DESCRIPTORS_COUNT);
+void e1000_setup_rx(e1000_device_t *dev)
+{
+    for (uint32_t q = 0; q < dev->queue_count; q++)
+    {
+        e1000_rx_ring_t *ring = &dev->rx[q];
+        ring->dev = dev;
+        ring->index = q;
+        ring->base = alloc_descriptor_ring(sizeof(e1000_rx_descriptor_t) * RX_DESCRIPTORS_COUNT);
+
+        // ring always holds RX_DESCRIPTORS_COUNT buffers, so the pool grows by them and the stack keeps its share
+        net_buffer_reserve(RX_DESCRIPTORS_COUNT);
+        // frames are received directly into net buffers, BSIZE_2048 matches NET_BUFFER_SIZE, so no headroom is left
+        for (uint16_t i = 0; i < RX_DESCRIPTORS_COUNT; i++)
+        {
+            // traffic of devices which are already up could take the reserve meanwhile
+            while ((ring->buffers[i] = alloc_net_buffer()) == NULL)
+            {
+                net_buffer_reserve(RX_DESCRIPTORS_COUNT - i);
+            }
+            ring->buffers[i]->data = ring->buffers[i]->head;
+            ring->base[i].address = ring->buffers[i]->physical;
+        }
 
-    uint16_t pages_count = PAGE_ALIGN(DESCRIPTOR_BUFFER_SIZE * RX_DESCRIPTORS_COUNT) / 0x1000;
-    dev->rx_data_buffer = (void*)alloc_hardware_space_chunk(pages_count);
-    uint32_t phys_addr = alloc_physical_range(pages_count);
-    map_virtual_to_physical_range((uint32_t)dev->rx_data_buffer, phys_addr, pages_count, PAGE_NO_CACHE);
-    memset(dev->rx_data_buffer, 0, DESCRIPTOR_BUFFER_SIZE * RX_DESCRIPTORS_COUNT);
+        // must be (uint32_t)ring->base >> 32, but we don't use 64bit mode
+        mmio_write32(dev->mmio, E1000_QUEUE_REG(E1000_REG_RDBAH, q), 0);
+        // must contains "& 0xFFFFFFFF" but we don't use 64bit mode
+        mmio_write32(dev->mmio, E1000_QUEUE_REG(E1000_REG_RDBAL, q), get_physical_address((uint32_t)ring->base));
+        mmio_write32(dev->mmio, E1000_QUEUE_REG(E1000_REG_RDLEN, q), RX_DESCRIPTORS_COUNT * sizeof(e1000_rx_descriptor_t));
+        mmio_write32(dev->mmio, E1000_QUEUE_REG(E1000_REG_RDH, q), 0);
+        mmio_write32(dev->mmio, E1000_QUEUE_REG(E1000_REG_RDT, q), RX_DESCRIPTORS_COUNT - 1);
+    }
 
-    for (uint16_t i = 0; i < RX_DESCRIPTORS_COUNT; i++)
+    mmio_write32(dev->mmio, E1000_REG_RXCSUM, E1000_RXCSUM_IPOFL | E1000_RXCSUM_TUOFL);
+    if (dev->queue_count > 1)
     {
-        e1000_rx_descriptor_t *current = &(dev->rx_base[i]);
-        current->address = get_physical_address((uint32_t)dev->rx_data_buffer + DESCRIPTOR_BUFFER_SIZE * i);
+        e1000_setup_rss(dev);
     }
-
-    // must be (uint32_t)dev->rx_base >> 32, but we don't use 64bit mode
-    mmio_write32(dev->mmio, E1000_REG_RDBAH, 0);
-    // must contains "& 0xFFFFFFFF" but we don't use 64bit mode
-    mmio_write32(dev->mmio, E1000_REG_RDBAL, get_physical_address((uint32_t)dev->rx_base));
-    mmio_write32(dev->mmio, E1000_REG_RDLEN, RX_DESCRIPTORS_COUNT * sizeof(e1000_rx_descriptor_t));
-    mmio_write32(dev->mmio, E1000_REG_RDH, 0);
-    mmio_write32(dev->mmio, E1000_REG_RDT, RX_DESCRIPTORS_COUNT - 1);
     mmio_write32(dev->mmio, E1000_REG_RCTL, mmio_read32(dev->mmio, E1000_REG_RCTL) | E1000_RCTL_SBP | E1000_RCTL_UPE
                  | E1000_RCTL_MPE | E1000_RCTL_BAM
                  | E1000_RCTL_BSIZE_2048 | E1000_RCTL_SECRC);
 }
 
-void send_packet(network_device_t *net_dev, void *packet, size_t size)
+// caller holds ring->mutex
+static void tx_reclaim(e1000_tx_ring_t *ring)
 {
-    e1000_device_t *dev = (e1000_device_t*)net_dev->pci_dev->hardware_driver;
+    while (ring->free < TX_DESCRIPTORS_COUNT && (ring->base[ring->clean].status & 1))
+    {
+        ring->base[ring->clean].status = 0;
+        release_net_buffer(ring->buffers[ring->clean]);
+        ring->buffers[ring->clean] = NULL;
+        ring->clean = (ring->clean + 1) % TX_DESCRIPTORS_COUNT;
+        ring->free++;
+    }
+}
 
-    if (packet == 0)
+// caller holds ring->mutex
+static void tx_doorbell(e1000_device_t *dev, e1000_tx_ring_t *ring)
+{
+    if (ring->unflushed > 0)
+    {
+        mmio_write32(dev->mmio, E1000_QUEUE_REG(E1000_REG_TDT, ring->index), ring->tail);
+        ring->unflushed = 0;
+    }
+}
+
+// caller holds ring->mutex
+static void tx_put_context(e1000_tx_ring_t *ring, net_buffer_t *buffer, uint32_t total)
+{
+    bool tso = buffer->offload & NET_OFFLOAD_TSO;
+    bool tcp = buffer->l4_protocol == PROTOCOL_TCP;
+    uint32_t key = (1 << 31) | (tcp ? E1000_TXD_TUCMD_TCP : 0);
+    if (!tso && ring->context == key)
     {
-        //debug("[e1000] can't send packet because of zero pointer\n");
         return;
     }
 
-    if (size == 0)
+    uint32_t ip_start = sizeof(eth_header_t);
+    uint32_t l4_start = ip_start + sizeof(ip4_header_t);
+    e1000_tx_context_descriptor_t *context = (e1000_tx_context_descriptor_t*)&ring->base[ring->tail];
+    context->ipcss = ip_start;
+    context->ipcso = ip_start + offsetof(ip4_header_t, header_checksum);
+    context->ipcse = l4_start - 1;
+    context->tucss = l4_start;
+    context->tucso = l4_start + (tcp ? offsetof(tcp_header_t, checksum) : offsetof(udp_header_t, checksum));
+    context->tucse = 0;
+    context->status = 0;
+
+    uint8_t command = E1000_TXD_CMD_DEXT | E1000_TXD_CMD_RS | E1000_TXD_TUCMD_IP | (tcp ? E1000_TXD_TUCMD_TCP : 0);
+    uint32_t payload = 0;
+    if (tso)
     {
-        //debug("[e1000] can't send empty packet\n");
+        tcp_header_t *header = (tcp_header_t*)(buffer->data + l4_start);
+        context->hdrlen = l4_start + header->data_offset * 4;
+        context->mss = buffer->mss;
+        command |= E1000_TXD_CMD_TSE;
+        payload = total - context->hdrlen;
+    }
+    else
+    {
+        context->hdrlen = 0;
+        context->mss = 0;
+    }
+    context->paylen_dtyp_tucmd = payload | (E1000_TXD_DTYP_CONTEXT << 20) | ((uint32_t)command << 24);
+
+    // TSO context carries payload length, so it's never reused
+    ring->context = tso ? 0 : key;
+    ring->buffers[ring->tail] = NULL;
+    ring->tail = (ring->tail + 1) % TX_DESCRIPTORS_COUNT;
+    ring->free--;
+    ring->unflushed++;
+}
+
+// frames of one flow always go to the same queue, so they aren't reordered
+static e1000_tx_ring_t *tx_select_ring(e1000_device_t *dev, net_buffer_t *buffer)
+{
+    ip_packet_t *packet = (ip_packet_t*)buffer->data;
+    if (dev->queue_count == 1 || buffer->len < sizeof(ip_packet_t) + 4 || packet->eth.type != bswap16(PROTOCOL_IP))
+    {
+        return &dev->tx[0];
+    }
+    uint32_t hash = packet->ip.source_ip.addr ^ packet->ip.destination_ip.addr;
+    if (packet->ip.protocol == PROTOCOL_TCP || packet->ip.protocol == PROTOCOL_UDP)
+    {
+        // ports are the first 4 bytes of both headers
+        hash ^= *(uint32_t*)(buffer->data + sizeof(eth_header_t) + packet->ip.header_size * 4);
+    }
+    hash ^= hash >> 16;
+    hash ^= hash >> 8;
+    return &dev->tx[hash % dev->queue_count];
+}
+
+/*
+ * Asynchronous: frame is queued and function returns without waiting for the wire, it blocks only when TX ring is
+ * full. Inside of net_tx_batch_begin()/net_tx_batch_end() TDT update is deferred. Hardware reads the frame from the
+ * net buffers (one descriptor per fragment), the reference is dropped when the last descriptor is reclaimed.
+ * Frames with offload flags use a context descriptor and extended data descriptors.
+ */
+void send_packet(network_device_t *net_dev, net_buffer_t *buffer)
+{
+    e1000_device_t *dev = (e1000_device_t*)net_dev->pci_dev->hardware_driver;
+
+    if (buffer == 0)
+    {
+        //debug("[e1000] can't send packet because of zero pointer\n");
         return;
     }
 
-    if (size > MAX_ETHERNET_PACKET_SIZE)
+    uint32_t total = net_buffer_total_len(buffer);
+    bool tso = buffer->offload & NET_OFFLOAD_TSO;
+    if (total > (tso ? NET_TSO_MAX_SIZE : net_dev->mtu) + sizeof(eth_header_t))
     {
-        //debug("[e1000] trying to send eth packet with size > %i\n", MAX_ETHERNET_PAYLOAD_SIZE);
+        //debug("[e1000] trying to send eth packet with size > %i\n", net_dev->mtu);
+        release_net_buffer(buffer);
         return;
     }
 
-    if (size < MIN_ETHERNET_PACKET_SIZE)
+    if (buffer->len < MIN_ETHERNET_PACKET_SIZE)
     {
         //debug("[e1000] trying to send eth packet with size < %i\n", MIN_ETHERNET_PACKET_SIZE);
+        release_net_buffer(buffer);
         return;
     }
 
-    mutex_lock(&dev->mutex);
-    memcpy(dev->tx_data_buffer + DESCRIPTOR_BUFFER_SIZE * dev->tx_tail, packet, size);
-    dev->tx_base[dev->tx_tail].length = size;
-    dev->tx_base[dev->tx_tail].command = (1 << 3) | 3;
-    dev->tx_base[dev->tx_tail].status = 0;
+    // TSO super-frame is captured as is, checksums left to hardware aren't filled yet
+    pcap_tap(buffer);
+
+    bool offload = buffer->offload & (NET_OFFLOAD_TX_IP_CSUM | NET_OFFLOAD_TX_L4_CSUM | NET_OFFLOAD_TSO);
+    uint32_t needed = offload ? 1 : 0;
+    for (net_buffer_t *frag = buffer; frag != NULL; frag = frag->next_frag)
+    {
+        needed++;
+    }
+
+    e1000_tx_ring_t *ring = tx_select_ring(dev, buffer);
+    mutex_lock(&ring->mutex);
+    if (ring->free < TX_RECLAIM_THRESHOLD)
+    {
+        tx_reclaim(ring);
+    }
+    while (ring->free < needed)
+    {
+        // ring can be full of descriptors which hardware doesn't know about yet
+        tx_doorbell(dev, ring);
+        mutex_release(&ring->mutex);
+
+        cli();
+        if (!(ring->base[ring->clean].status & 1))
+        {
+            if (ring->vector >= 0)
+            {
+                mmio_write32(dev->mmio, E1000_REG_IMS, ring->cause);
+            }
+            // without interrupt the ring is rechecked every tick
+            wait_event(&ring->queue, WAIT_ANY_KEY, ring->vector < 0 ? 1 : 0);
+        }
+        else
+        {
+            sti();
+        }
+
+        mutex_lock(&ring->mutex);
+        tx_reclaim(ring);
+    }
+
+    uint8_t popts = 0;
+    if (offload)
+    {
+        tx_put_context(ring, buffer, total);
+        popts |= (buffer->offload & (NET_OFFLOAD_TX_IP_CSUM | NET_OFFLOAD_TSO)) ? E1000_TXD_POPTS_IXSM : 0;
+        popts |= (buffer->offload & (NET_OFFLOAD_TX_L4_CSUM | NET_OFFLOAD_TSO)) ? E1000_TXD_POPTS_TXSM : 0;
+    }
+
+    // RS on every descriptor, so reclaim can walk the ring without knowing packet boundaries
+    for (net_buffer_t *frag = buffer; frag != NULL; frag = frag->next_frag)
+    {
+        uint8_t command = E1000_TXD_CMD_RS | E1000_TXD_CMD_IFCS | (frag->next_frag == NULL ? E1000_TXD_CMD_EOP : 0);
+        if (offload)
+        {
+            e1000_tx_data_descriptor_t *data = (e1000_tx_data_descriptor_t*)&ring->base[ring->tail];
+            command |= E1000_TXD_CMD_DEXT | (tso ? E1000_TXD_CMD_TSE : 0);
+            data->address = NET_BUFFER_DMA(frag);
+            data->length_dtyp_dcmd = frag->len | (E1000_TXD_DTYP_DATA << 20) | ((uint32_t)command << 24);
+            data->status = 0;
+            data->popts = popts;
+            data->special = 0;
+        }
+        else
+        {
+            ring->base[ring->tail].address = NET_BUFFER_DMA(frag);
+            ring->base[ring->tail].length = frag->len;
+            ring->base[ring->tail].checksum_offset = 0;
+            ring->base[ring->tail].command = command;
+            ring->base[ring->tail].status = 0;
+        }
+        // chain is released with the first buffer when the last descriptor is done
+        ring->buffers[ring->tail] = frag->next_frag == NULL ? buffer : NULL;
+        ring->tail = (ring->tail + 1) % TX_DESCRIPTORS_COUNT;
+        ring->free--;
+        ring->unflushed++;
+    }
+
+    if (net_dev->tx_batch == 0 || ring->unflushed >= TX_DOORBELL_BATCH)
+    {
+        tx_doorbell(dev, ring);
+    }
+    mutex_release(&ring->mutex);
+}
 
-    uint32_t old_tail = dev->tx_tail;
-    dev->tx_tail = (dev->tx_tail + 1) % TX_DESCRIPTORS_COUNT;
-    mmio_write32(dev->mmio, E1000_REG_TDT, dev->tx_tail);
-    mutex_release(&dev->mutex);
+// 2048 byte descriptor buffers stay, long packet reception makes hardware chain them for jumbo frames
+static bool e1000_set_mtu(network_device_t *net_dev, uint32_t mtu)
+{
+    e1000_device_t *dev = (e1000_device_t*)net_dev->pci_dev->hardware_driver;
+    uint32_t rctl = mmio_read32(dev->mmio, E1000_REG_RCTL);
+    rctl = mtu > MAX_ETHERNET_PAYLOAD_SIZE ? rctl | E1000_RCTL_LPE : rctl & ~E1000_RCTL_LPE;
+    mmio_write32(dev->mmio, E1000_REG_RCTL, rctl);
+    return true;
+}
 
-    while(!(dev->tx_base[old_tail].status & 1))
+static void e1000_flush(network_device_t *net_dev)
+{
+    e1000_device_t *dev = (e1000_device_t*)net_dev->pci_dev->hardware_driver;
+    for (uint32_t q = 0; q < dev->queue_count; q++)
     {
-        asm("nop");
+        mutex_lock(&dev->tx[q].mutex);
+        tx_doorbell(dev, &dev->tx[q]);
+        mutex_release(&dev->tx[q].mutex);
     }
 }
 
+/*
+ * 82574 gets a vector per ring through MSI-X, IVAR maps queue causes to them and EIAC clears the causes on delivery.
+ * Otherwise all rings share one MSI or INTx vector and the handler reads ICR. Returns false without interrupt.
+ */
+static bool e1000_setup_interrupts(e1000_device_t *dev)
+{
+    int vectors[E1000_MSIX_VECTORS];
+    uint32_t count = 2 * dev->queue_count;
+    if (dev->queue_count > 1 && pci_request_msix(dev->pci_dev, e1000_irq_handler, vectors, count) == 0)
+    {
+        dev->msix = true;
+        uint32_t ivar = 0;
+        uint32_t causes = 0;
+        for (uint32_t q = 0; q < dev->queue_count; q++)
+        {
+            dev->rx[q].vector = vectors[q];
+            dev->rx[q].cause = E1000_ICR_RXQ(q);
+            dev->tx[q].vector = vectors[dev->queue_count + q];
+            dev->tx[q].cause = E1000_ICR_TXQ(q);
+            ivar |= (q | E1000_IVAR_VALID) << (q * 4);
+            ivar |= ((dev->queue_count + q) | E1000_IVAR_VALID) << (E1000_IVAR_TX_SHIFT + q * 4);
+            causes |= dev->rx[q].cause | dev->tx[q].cause;
+        }
+        mmio_write32(dev->mmio, E1000_REG_CTRL_EXT, mmio_read32(dev->mmio, E1000_REG_CTRL_EXT) | E1000_CTRL_EXT_PBA_CLR);
+        mmio_write32(dev->mmio, E1000_REG_IVAR, ivar);
+        mmio_write32(dev->mmio, E1000_REG_EIAC, causes);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            mmio_write32(dev->mmio, E1000_REG_EITR + i * 4, E1000_ITR_VALUE);
+        }
+        return true;
+    }
+
+    int vector = pci_request_irq(dev->pci_dev, e1000_irq_handler);
+    for (uint32_t q = 0; q < dev->queue_count; q++)
+    {
+        dev->rx[q].vector = vector;
+        dev->rx[q].cause = E1000_ICR_RX;
+        dev->tx[q].vector = vector;
+        dev->tx[q].cause = E1000_ICR_TXDW;
+    }
+    if (vector < 0)
+    {
+        return false;
+    }
+    mmio_write32(dev->mmio, E1000_REG_ITR, E1000_ITR_VALUE);
+    return true;
+}
+
 void e1000_init(pci_device_t *pci_dev)
 {
     e1000_device_t *dev = kmalloc(sizeof(e1000_device_t));
@@ -281,6 +832,9 @@ void e1000_init(pci_device_t *pci_dev)
     network_device_t *net_dev = (network_device_t*)pci_dev->logical_driver;
     net_dev->send_packet = &send_packet;
     net_dev->enable = &e1000_enable;
+    net_dev->flush = &e1000_flush;
+    net_dev->set_mtu = &e1000_set_mtu;
+    net_dev->features = NET_FEATURE_IP_CSUM | NET_FEATURE_TCP_CSUM | NET_FEATURE_UDP_CSUM | NET_FEATURE_TSO;
 
     uint32_t mmio_region_pages = PAGE_ALIGN(pci_dev->base_address_length[0]) / 0x1000;
     dev->mmio = alloc_hardware_space_chunk(mmio_region_pages);
@@ -290,13 +844,17 @@ void e1000_init(pci_device_t *pci_dev)
         map_virtual_to_physical(dev->mmio + i * 0x1000, pci_dev->base_address[0] + i * 0x1000, PAGE_NO_CACHE);
     }
 
+    // DMA for descriptor rings, firmware doesn't always enable it; status bits are write-1-to-clear
+    uint32_t command = pci_config_read(pci_dev->bus, pci_dev->slot, pci_dev->func, PCI_REG_COMMAND);
+    pci_config_write(pci_dev->bus, pci_dev->slot, pci_dev->func, PCI_REG_COMMAND, (command & 0xFFFF) | PCI_COMMAND_BUS_MASTER);
+
     mmio_write32(dev->mmio, E1000_REG_IMC, 0xffffffff);
     mmio_write32(dev->mmio, E1000_REG_CTRL, mmio_read32(dev->mmio, E1000_REG_CTRL) | E1000_CTRL_RST);
     sleep(100);
     mmio_write32(dev->mmio, E1000_REG_CTRL, mmio_read32(dev->mmio, E1000_REG_CTRL) | E1000_CTRL_SLU);
     //mmio_write32(dev->mmio, E1000_REG_CTRL_EXT, mmio_read32(dev->mmio, E1000_REG_CTRL_EXT) & ~E1000_CTRL_EXT_LINK_MODE_MASK);
 
-    if (pci_dev->device_id == 0x100e)
+    if (pci_dev->device_id == E1000_DEVICE_82540EM)
     {
         uint16_t mac_part = e1000_eeprom_read_8254x(dev->mmio, 0);
         net_dev->mac.b[0] = mac_part & 0xff;
@@ -310,7 +868,7 @@ void e1000_init(pci_device_t *pci_dev)
         net_dev->mac.b[4] = mac_part & 0xff;
         net_dev->mac.b[5] = (mac_part >> 8) & 0xff;
     }
-    else if (pci_dev->device_id == 0x10f5)
+    else if (pci_dev->device_id == E1000_DEVICE_82567LM || pci_dev->device_id == E1000_DEVICE_82574)
     {
         uint32_t mac_part = mmio_read32(dev->mmio, E1000_REG_RAL);
         net_dev->mac.b[0] = mac_part & 0xff;
@@ -335,9 +893,30 @@ void e1000_init(pci_device_t *pci_dev)
         mmio_write32(dev->mmio, E1000_REG_MTA + i * 4, 0);
     }
 
+    dev->queue_count = pci_dev->device_id == E1000_DEVICE_82574 ? E1000_MAX_QUEUES : 1;
     e1000_setup_rx(dev);
     e1000_setup_tx(dev);
-    start_thread(rx_thread, (uint32_t)dev);
+
+    for (uint32_t i = 0; i < E1000_MAX_DEVICES; i++) {
+        if (devices[i] == NULL) {
+            devices[i] = dev;
+            break;
+        }
+    }
+    if (!e1000_setup_interrupts(dev)) {
+        log(KERN_WARNING, "[e1000] no interrupt, falling back to polling\n");
+    } else {
+        // no extra receive delay, ITR already batches interrupts
+        mmio_write32(dev->mmio, E1000_REG_RDTR, 0);
+        mmio_read32(dev->mmio, E1000_REG_ICR);
+        for (uint32_t q = 0; q < dev->queue_count; q++) {
+            mmio_write32(dev->mmio, E1000_REG_IMS, dev->rx[q].cause);
+        }
+    }
+
+    for (uint32_t q = 0; q < dev->queue_count; q++) {
+        start_thread(rx_thread, (uint32_t)&dev->rx[q]);
+    }
     e1000_enable(net_dev);
     //debug("[e1000] initialized\n");
 }
@@ -0,0 +1,141 @@
+#include <stdint.h>
+#include "loopback.h"
+#include "network.h"
+#include "net_buffer.h"
+#include "task.h"
+#include "irq.h"
+#include "string.h"
+#include "log.h"
+#include "wait_queue.h"
+
+typedef struct loopback_device
+{
+    net_buffer_t *head; // frames linked by buffer->next, guarded by irq_save()
+    net_buffer_t *tail;
+    uint32_t count;
+    wait_queue_t queue;
+} loopback_device_t;
+
+static loopback_device_t loopback = {0};
+
+/*
+ * Receiving side owns the buffer and moves data/len while headers are parsed, so a buffer still referenced by the
+ * sender (TCP retransmission queue) is copied with its fragments, otherwise it's passed as is.
+ */
+static net_buffer_t *take_frame(net_buffer_t *buffer)
+{
+    if (buffer->ref_count == 1)
+    {
+        return buffer;
+    }
+
+    net_buffer_t *copy = copy_net_buffer(buffer);
+    release_net_buffer(buffer);
+    return copy;
+}
+
+// queues the frame for loopback_thread(), stack isn't reentered from the sender's context
+static void loopback_send_packet(network_device_t *net_dev, net_buffer_t *buffer)
+{
+    buffer = take_frame(buffer);
+    if (buffer == NULL)
+    {
+        return;
+    }
+    // data never leaves memory, checksums which were left to "hardware" aren't needed
+    buffer->offload = NET_OFFLOAD_RX_IP_OK | NET_OFFLOAD_RX_L4_OK;
+    buffer->next = NULL;
+
+    uint32_t flags = irq_save();
+    if (loopback.count == LOOPBACK_QUEUE_SIZE)
+    {
+        irq_restore(flags);
+        release_net_buffer(buffer);
+        return;
+    }
+    if (loopback.tail != NULL)
+    {
+        loopback.tail->next = buffer;
+    }
+    else
+    {
+        loopback.head = buffer;
+    }
+    loopback.tail = buffer;
+    loopback.count++;
+    irq_restore(flags);
+
+    __sync_add_and_fetch(&net_dev->stats.packets_sent, 1);
+    wake_up(&loopback.queue, WAIT_ANY_KEY, 0);
+}
+
+static net_buffer_t *pop_frame()
+{
+    uint32_t flags = irq_save();
+    net_buffer_t *buffer = loopback.head;
+    if (buffer != NULL)
+    {
+        loopback.head = buffer->next;
+        if (loopback.head == NULL)
+        {
+            loopback.tail = NULL;
+        }
+        loopback.count--;
+        buffer->next = NULL;
+    }
+    irq_restore(flags);
+    return buffer;
+}
+
+// RX side of the device, replies of a batch are queued behind it
+static void loopback_thread(network_device_t *net_dev)
+{
+    while (true)
+    {
+        uint32_t done = 0;
+        net_buffer_t *buffer;
+        while (done < LOOPBACK_BUDGET && (buffer = pop_frame()) != NULL)
+        {
+            net_dev->receive_packet(net_dev, buffer);
+            done++;
+        }
+        if (done == LOOPBACK_BUDGET)
+        {
+            force_task_switch();
+            continue;
+        }
+
+        cli();
+        if (loopback.head == NULL)
+        {
+            wait_event(&loopback.queue, WAIT_ANY_KEY, 0);
+        }
+        else
+        {
+            sti();
+        }
+    }
+}
+
+static void loopback_enable(network_device_t *net_dev)
+{
+}
+
+// registers lo with 127.0.0.1/8, protocols must be initialized before frames are sent
+network_device_t *init_loopback()
+{
+    network_device_t *net_dev = create_network_device(NULL);
+    ip4_addr_t addr = BUILD_IP4_ADDR(127, 0, 0, 1);
+    ip4_addr_t mask = BUILD_IP4_ADDR(255, 0, 0, 0);
+    net_dev->ip4_addr = addr;
+    net_dev->subnet_mask = mask;
+    net_dev->send_packet = &loopback_send_packet;
+    net_dev->enable = &loopback_enable;
+    net_dev->features = NET_FEATURE_IP_CSUM | NET_FEATURE_TCP_CSUM | NET_FEATURE_UDP_CSUM;
+    net_dev->flags = NET_DEV_LOOPBACK;
+    net_dev->mtu = NET_MAX_MTU; // frames are chained buffers, there is no wire limit
+    register_network_device(net_dev);
+    start_thread(loopback_thread, (uint32_t)net_dev);
+    log(KERN_INFO, "[network] loopback device is up\n");
+    return net_dev;
+}
@@ -4,6 +4,8 @@
 #include "task.h"
 #include "errno.h"
 #include "log.h"
+#include "irq.h"
+#include "poll.h"
 #include <stddef.h>
 
 static int write(vfs_file_t *file, void *buf, uint32_t size, uint32_t *offset)
@@ -24,9 +26,17 @@ static int write(vfs_file_t *file, void *buf, uint32_t size, uint32_t *offset)
 
 static int read(vfs_file_t *file, void *buf, uint32_t size, uint32_t *offset)
 {
-    struct event_data *packet = NULL;
-    // always perform blocking read. TODO: Must be fixed in future versions.
+    struct event_data *packet = get_event();
     while(packet == NULL) {
+        if (FILE_NONBLOCK(file)) {
+            return -EAGAIN;
+        }
+        cli();
+        if (current_process->events == NULL) {
+            wait_event(&current_process->events_queue, WAIT_ANY_KEY, 0);
+        } else {
+            sti();
+        }
         packet = get_event();
     }
 
@@ -41,11 +51,19 @@ static int read(vfs_file_t *file, void *buf, uint32_t size, uint32_t *offset)
     return done;
 }
 
+// events are queued for the process which reads the file
+static uint32_t poll(vfs_file_t *file, poll_table_t *table)
+{
+    poll_wait(table, &current_process->events_queue);
+    return (current_process->events != NULL ? POLLIN : 0) | POLLOUT;
+}
+
 static vfs_file_operations_t file_ops = {
     .open = 0,
     .close = 0,
     .write = &write,
-    .read = &read
+    .read = &read,
+    .poll = &poll
 };
 
 void init_events()
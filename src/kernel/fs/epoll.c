@@ -0,0 +1,364 @@
+#include "poll.h"
+#include "task.h"
+#include "pit.h"
+#include "irq.h"
+#include "mutex.h"
+#include "errno.h"
+#include "string.h"
+#include "liballoc.h"
+#include "system.h"
+
+#define EPOLL_QUEUES_PER_FILE 2
+
+struct epoll;
+
+/*
+ * Watched file. Its callback entries stay in the file's wait queues, so every wake up of the file puts the item into
+ * ready list of epoll, epoll_wait() doesn't have to scan all files.
+ */
+struct epoll_item {
+    list_node_t list; // items of epoll
+    struct epoll_item *ready_next;
+    struct epoll_item *file_next; // items watching the same file
+    struct epoll *ep;
+    vfs_file_t *file;
+    uint32_t events;
+    uint64_t data;
+    volatile uint8_t ready;
+    uint32_t queue_count;
+    struct wait_entry waits[EPOLL_QUEUES_PER_FILE];
+};
+
+// ready list is changed by callbacks with interrupts disabled, so it's protected by irq_save() and not by mutex
+struct epoll {
+    struct epoll_item *items;
+    struct epoll_item *ready_head;
+    struct epoll_item *ready_tail;
+    volatile uint32_t ready_count;
+    wait_queue_t wait;
+};
+
+struct epoll_poll_table {
+    poll_table_t table;
+    struct epoll_item *item;
+};
+
+// item lists of all epolls and files
+static mutex_t epoll_mutex = {0};
+
+static uint32_t epoll_poll(vfs_file_t *file, poll_table_t *table);
+static int epoll_close(vfs_file_t *file);
+
+static vfs_file_operations_t epoll_file_ops = {
+    .open = 0,
+    .read = 0,
+    .readdir = 0,
+    .write = 0,
+    .close = &epoll_close,
+    .poll = &epoll_poll
+};
+
+// interrupts must be disabled
+static void mark_ready(struct epoll_item *item)
+{
+    if (item->ready) {
+        return;
+    }
+    struct epoll *ep = item->ep;
+    item->ready = 1;
+    item->ready_next = NULL;
+    if (ep->ready_tail != NULL) {
+        ep->ready_tail->ready_next = item;
+    } else {
+        ep->ready_head = item;
+    }
+    ep->ready_tail = item;
+    ep->ready_count++;
+}
+
+// interrupts must be disabled
+static struct epoll_item *pop_ready(struct epoll *ep)
+{
+    struct epoll_item *item = ep->ready_head;
+    if (item == NULL) {
+        return NULL;
+    }
+    ep->ready_head = item->ready_next;
+    if (ep->ready_head == NULL) {
+        ep->ready_tail = NULL;
+    }
+    item->ready = 0;
+    ep->ready_count--;
+    return item;
+}
+
+static void item_callback(struct wait_entry *entry)
+{
+    struct epoll_item *item = entry->private;
+    mark_ready(item);
+    wake_up(&item->ep->wait, WAIT_ANY_KEY, 0);
+}
+
+static void queue_callback(poll_table_t *table, wait_queue_t *wq)
+{
+    struct epoll_item *item = ((struct epoll_poll_table*)table)->item;
+    if (item->queue_count < EPOLL_QUEUES_PER_FILE) {
+        wait_queue_add_callback(wq, &item->waits[item->queue_count++], &item_callback, item);
+    }
+}
+
+static uint32_t item_events(struct epoll_item *item, poll_table_t *table)
+{
+    return vfs_poll(item->file, table) & ((item->events & ~EPOLLET) | POLLERR | POLLHUP);
+}
+
+// epoll_mutex must be held
+static void remove_item(struct epoll_item *item)
+{
+    struct epoll *ep = item->ep;
+    for (uint32_t i = 0; i < item->queue_count; i++) {
+        wait_queue_remove(&item->waits[i]);
+    }
+
+    uint32_t flags = irq_save();
+    struct epoll_item **iterator = &ep->ready_head;
+    while (*iterator != NULL) {
+        if (*iterator == item) {
+            *iterator = item->ready_next;
+            ep->ready_count--;
+            break;
+        }
+        iterator = &(*iterator)->ready_next;
+    }
+    ep->ready_tail = NULL;
+    for (struct epoll_item *ready = ep->ready_head; ready != NULL; ready = ready->ready_next) {
+        ep->ready_tail = ready;
+    }
+    irq_restore(flags);
+
+    delete_from_list((void*)&ep->items, item);
+    iterator = &item->file->epoll_items;
+    while (*iterator != NULL) {
+        if (*iterator == item) {
+            *iterator = item->file_next;
+            break;
+        }
+        iterator = &(*iterator)->file_next;
+    }
+    kfree(item);
+}
+
+static struct epoll_item *find_item(struct epoll *ep, vfs_file_t *file)
+{
+    FOR_EACH(item, ep->items, struct epoll_item) {
+        if (item->file == file) {
+            return item;
+        }
+    }
+    return NULL;
+}
+
+static int add_item(struct epoll *ep, vfs_file_t *file, struct epoll_event *event)
+{
+    if (find_item(ep, file) != NULL) {
+        return -EEXIST;
+    }
+
+    struct epoll_item *item = kmalloc(sizeof(struct epoll_item));
+    memset(item, 0, sizeof(struct epoll_item));
+    item->ep = ep;
+    item->file = file;
+    item->events = event->events;
+    item->data = event->data;
+    add_to_list(ep->items, item);
+    item->file_next = file->epoll_items;
+    file->epoll_items = item;
+
+    // callbacks are registered before the check, so readiness which comes after it isn't lost
+    struct epoll_poll_table table = {.table = {.queue = &queue_callback}, .item = item};
+    if (item_events(item, &table.table) != 0) {
+        uint32_t flags = irq_save();
+        mark_ready(item);
+        irq_restore(flags);
+        wake_up(&ep->wait, WAIT_ANY_KEY, 0);
+    }
+    return 0;
+}
+
+static int modify_item(struct epoll_item *item, struct epoll_event *event)
+{
+    item->events = event->events;
+    item->data = event->data;
+    if (item_events(item, NULL) != 0) {
+        uint32_t flags = irq_save();
+        mark_ready(item);
+        irq_restore(flags);
+        wake_up(&item->ep->wait, WAIT_ANY_KEY, 0);
+    }
+    return 0;
+}
+
+static int get_epoll(int epfd, struct epoll **out)
+{
+    vfs_file_t *file = get_file(epfd);
+    if (file == NULL) {
+        return -EBADF;
+    }
+    if (file->ops != &epoll_file_ops) {
+        return -EINVAL;
+    }
+    *out = file->node->obj;
+    return 0;
+}
+
+// no flags are supported
+int sys_epoll_create(int flags)
+{
+    if (flags != 0) {
+        return -EINVAL;
+    }
+
+    struct epoll *ep = kmalloc(sizeof(struct epoll));
+    memset(ep, 0, sizeof(struct epoll));
+    int fd = open_anonymous_file("epoll", 0, &epoll_file_ops, ep);
+    if (fd < 0) {
+        kfree(ep);
+    }
+    return fd;
+}
+
+int sys_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+    struct epoll *ep;
+    int err = get_epoll(epfd, &ep);
+    if (err) {
+        return err;
+    }
+    vfs_file_t *file = get_file(fd);
+    if (file == NULL) {
+        return -EBADF;
+    }
+    // nested epolls aren't supported, their callbacks would wake each other with interrupts disabled
+    if (file->ops == &epoll_file_ops) {
+        return -EINVAL;
+    }
+    if (file->ops == NULL || file->ops->poll == NULL) {
+        return -EPERM;
+    }
+    if (op != EPOLL_CTL_DEL && event == NULL) {
+        return -EFAULT;
+    }
+
+    mutex_lock(&epoll_mutex);
+    struct epoll_item *item = find_item(ep, file);
+    switch (op) {
+        case EPOLL_CTL_ADD:
+            err = add_item(ep, file, event);
+            break;
+        case EPOLL_CTL_DEL:
+            if (item == NULL) {
+                err = -ENOENT;
+            } else {
+                remove_item(item);
+            }
+            break;
+        case EPOLL_CTL_MOD:
+            err = item == NULL ? -ENOENT : modify_item(item, event);
+            break;
+        default:
+            err = -EINVAL;
+            break;
+    }
+    mutex_release(&epoll_mutex);
+    return err;
+}
+
+/*
+ * Reports up to maxevents ready files, timeout is in ms (negative - forever). Only items from ready list are polled.
+ * Level triggered item goes back to the list while the file is ready, edge triggered one waits for the next wake up.
+ */
+int sys_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+    struct epoll *ep;
+    int err = get_epoll(epfd, &ep);
+    if (err) {
+        return err;
+    }
+    if (maxevents <= 0) {
+        return -EINVAL;
+    }
+
+    uint32_t finish = timeout > 0 ? get_pit_ticks() + ms_to_ticks(timeout) : 0;
+    while (1) {
+        int count = 0;
+        mutex_lock(&epoll_mutex);
+        // items which are put back during the pass aren't polled again
+        uint32_t pending = ep->ready_count;
+        while (count < maxevents && pending-- > 0) {
+            uint32_t flags = irq_save();
+            struct epoll_item *item = pop_ready(ep);
+            irq_restore(flags);
+            if (item == NULL) {
+                break;
+            }
+
+            uint32_t revents = item_events(item, NULL);
+            if (revents == 0) {
+                continue;
+            }
+            events[count].events = revents;
+            events[count].data = item->data;
+            count++;
+            if (!(item->events & EPOLLET)) {
+                flags = irq_save();
+                mark_ready(item);
+                irq_restore(flags);
+            }
+        }
+        mutex_release(&epoll_mutex);
+
+        uint32_t now = get_pit_ticks();
+        if (count > 0 || timeout == 0 || (timeout > 0 && now >= finish)) {
+            return count;
+        }
+        cli();
+        if (ep->ready_count == 0) {
+            wait_event(&ep->wait, WAIT_ANY_KEY, timeout < 0 ? 0 : finish - now);
+        } else {
+            sti();
+        }
+    }
+}
+
+// file is closed by sys_close(), it's removed from all epolls which watch it
+void epoll_file_closed(vfs_file_t *file)
+{
+    mutex_lock(&epoll_mutex);
+    while (file->epoll_items != NULL) {
+        remove_item(file->epoll_items);
+    }
+    mutex_release(&epoll_mutex);
+}
+
+static uint32_t epoll_poll(vfs_file_t *file, poll_table_t *table)
+{
+    struct epoll *ep = file->node->obj;
+    poll_wait(table, &ep->wait);
+    return ep->ready_count > 0 ? POLLIN : 0;
+}
+
+static int epoll_close(vfs_file_t *file)
+{
+    vfs_node_t *node = file->node;
+    if (ref_dec(&node->ref_count) == 0) {
+        struct epoll *ep = node->obj;
+        mutex_lock(&epoll_mutex);
+        while (ep->items != NULL) {
+            remove_item(ep->items);
+        }
+        mutex_release(&epoll_mutex);
+        kfree(ep);
+        kfree(node);
+    }
+    return 0;
+}
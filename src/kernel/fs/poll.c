@@ -0,0 +1,96 @@
+#include "poll.h"
+#include "task.h"
+#include "pit.h"
+#include "irq.h"
+#include "errno.h"
+#include "string.h"
+#include "liballoc.h"
+
+// every file is polled on one or two queues (readers and writers)
+#define POLL_QUEUES_PER_FILE 2
+
+struct poll_wait_table {
+    poll_table_t table;
+    struct wait_entry *entries;
+    uint32_t count;
+    uint32_t size;
+};
+
+// files without poll operation never block
+uint32_t vfs_poll(vfs_file_t *file, poll_table_t *table)
+{
+    if (file->ops == NULL || file->ops->poll == NULL) {
+        return POLLIN | POLLOUT;
+    }
+    return file->ops->poll(file, table);
+}
+
+static void queue_entry(poll_table_t *table, wait_queue_t *wq)
+{
+    struct poll_wait_table *wait = (struct poll_wait_table*)table;
+    if (wait->count < wait->size) {
+        wait_queue_add(wq, &wait->entries[wait->count++], WAIT_ANY_KEY);
+    }
+}
+
+static uint32_t poll_files(struct pollfd *fds, uint32_t nfds, poll_table_t *table)
+{
+    uint32_t ready = 0;
+    for (uint32_t i = 0; i < nfds; i++) {
+        fds[i].revents = 0;
+        if (fds[i].fd < 0) {
+            continue;
+        }
+        vfs_file_t *file = get_file(fds[i].fd);
+        if (file == NULL) {
+            fds[i].revents = POLLNVAL;
+        } else {
+            // errors and hang up are reported even if they weren't requested
+            fds[i].revents = vfs_poll(file, table) & (fds[i].events | POLLERR | POLLHUP);
+        }
+        if (fds[i].revents != 0) {
+            ready++;
+        }
+    }
+    return ready;
+}
+
+/*
+ * Waits until one of the files is ready, timeout is in ms (negative - forever, 0 - just check). Every pass puts
+ * the thread into queues of all files and sleeps until any of them is woken, then files are checked again.
+ */
+int sys_poll(struct pollfd *fds, uint32_t nfds, int timeout)
+{
+    if (nfds > MAX_OPENED_FILES) {
+        return -EINVAL;
+    }
+
+    struct poll_wait_table wait;
+    wait.table.queue = &queue_entry;
+    wait.size = nfds * POLL_QUEUES_PER_FILE;
+    wait.entries = wait.size > 0 ? kmalloc(sizeof(struct wait_entry) * wait.size) : NULL;
+    uint32_t finish = timeout > 0 ? get_pit_ticks() + ms_to_ticks(timeout) : 0;
+
+    uint32_t ready;
+    while (1) {
+        wait.count = 0;
+        ready = poll_files(fds, nfds, timeout == 0 ? NULL : &wait.table);
+
+        uint32_t now = get_pit_ticks();
+        int err = 0;
+        if (ready == 0 && timeout != 0 && (timeout < 0 || now < finish)) {
+            err = wait_entries(wait.entries, wait.count, timeout < 0 ? 0 : finish - now);
+        }
+        for (uint32_t i = 0; i < wait.count; i++) {
+            wait_queue_remove(&wait.entries[i]);
+        }
+        if (ready > 0 || timeout == 0 || err == -ETIMEDOUT || (timeout > 0 && now >= finish)) {
+            break;
+        }
+    }
+
+    if (wait.entries != NULL) {
+        kfree(wait.entries);
+    }
+    return ready;
+}
@@ -7,9 +7,17 @@
 #include "log.h"
 #include "system.h"
 #include "task.h"
+#include "irq.h"
+#include "poll.h"
 
 extern struct process *current_process;
 
+// without buffer mutex, so it can be checked with interrupts disabled before sleep
+static bool buffer_is_empty(buffer_t *buffer)
+{
+    return buffer->head == buffer->tail && !buffer->is_full;
+}
+
 static int slave_write(vfs_file_t *file, void *buf, uint32_t size, uint32_t *offset)
 {
     pty_t *pty = file->node->obj;
@@ -31,7 +39,12 @@ static int slave_write(vfs_file_t *file, void *buf, uint32_t size, uint32_t *off
     }*/
 
     uint32_t min = MIN(size, pty->out->get_free_space(pty->out));
+    if (min == 0 && size > 0 && FILE_NONBLOCK(file))
+    {
+        return -EAGAIN;
+    }
     pty->out->add(pty->out, buf, min);
+    wake_up(&pty->out_wait, WAIT_ANY_KEY, 0);
     return min;
 }
 
@@ -75,6 +88,7 @@ static int master_write(vfs_file_t *file, void *buf, uint32_t size, uint32_t *of
                     {
                         //debug("[pty] flush to slave failed, buffer is full\n");
                     }
+                    wake_up(&pty->in_wait, WAIT_ANY_KEY, 0);
 
                     pty->input_buffer_pos = 0;
                 }
@@ -94,11 +108,23 @@ static int master_read(vfs_file_t *file, void *buf, uint32_t size, uint32_t *off
 {
     //debug("read from pty master\n");
     pty_t *pty = file->node->obj;
-    uint32_t count = pty->in->get(pty->out, buf, size);
+    uint32_t count = pty->out->get(pty->out, buf, size);
     while(count == 0)
     {
-        force_task_switch();
-        count = pty->in->get(pty->out, buf, size);
+        if (FILE_NONBLOCK(file))
+        {
+            return -EAGAIN;
+        }
+        cli();
+        if (buffer_is_empty(pty->out))
+        {
+            wait_event(&pty->out_wait, WAIT_ANY_KEY, 0);
+        }
+        else
+        {
+            sti();
+        }
+        count = pty->out->get(pty->out, buf, size);
     }
     return count;
 }
@@ -116,7 +142,19 @@ static int slave_read(vfs_file_t *file, void *buf, uint32_t size, uint32_t *offs
     uint32_t count = pty->in->get_until(pty->in, buf, size, '\n');
     while(count == 0)
     {
-        force_task_switch();
+        if (FILE_NONBLOCK(file))
+        {
+            return -EAGAIN;
+        }
+        cli();
+        if (buffer_is_empty(pty->in))
+        {
+            wait_event(&pty->in_wait, WAIT_ANY_KEY, 0);
+        }
+        else
+        {
+            sti();
+        }
         count = pty->in->get_until(pty->in, buf, size, '\n');
     }
 
@@ -144,18 +182,35 @@ static int slave_close(vfs_file_t *file)
     return 0;
 }
 
+// slave gets whole lines from master, so any data in the buffer can be read
+static uint32_t slave_poll(vfs_file_t *file, poll_table_t *table)
+{
+    pty_t *pty = file->node->obj;
+    poll_wait(table, &pty->in_wait);
+    return (pty->in->get_used(pty->in) > 0 ? POLLIN : 0) | POLLOUT;
+}
+
+static uint32_t master_poll(vfs_file_t *file, poll_table_t *table)
+{
+    pty_t *pty = file->node->obj;
+    poll_wait(table, &pty->out_wait);
+    return (pty->out->get_used(pty->out) > 0 ? POLLIN : 0) | POLLOUT;
+}
+
 vfs_file_operations_t pty_slave_file_ops = {
     .open = &slave_open,
     .close = &slave_close,
     .write = &slave_write,
-    .read = &slave_read
+    .read = &slave_read,
+    .poll = &slave_poll
 };
 
 vfs_file_operations_t pty_master_file_ops = {
     .open = 0,
     .close = 0,
     .write = &master_write,
-    .read = &master_read
+    .read = &master_read,
+    .poll = &master_poll
 };
 
 file_descriptor_t create_pty(char *slave_name)
@@ -215,6 +270,7 @@ file_descriptor_t create_pty(char *slave_name)
     file->ops = pty->master->file_ops;
     file->node = pty->master;
     file->pid = current_process->id;
+    file->status_flags = O_RDWR;
 
     for(uint32_t i = 0; i < MAX_OPENED_FILES; i++)
     {
@@ -7,6 +7,8 @@
 #include "mutex.h"
 #include "libc.h"
 #include "errno.h"
+#include "system.h"
+#include "poll.h"
 #include <stdbool.h>
 
 #define MAX_FS_TYPES_COUNT 10
@@ -308,6 +310,34 @@ int sys_write(file_descriptor_t fd, void *buf, uint32_t size)
     return err;
 }
 
+// like sys_read() but at the given offset, file position isn't changed
+int sys_pread(file_descriptor_t fd, void *buf, uint32_t size, uint32_t offset)
+{
+    if (fd >= MAX_OPENED_FILES || fd < 0 || current_process->files[fd] == NULL) {
+        return -EBADF;
+    }
+
+    vfs_file_t *file = current_process->files[fd];
+    if (file->ops == NULL || file->ops->read == NULL) {
+        return -EPERM;
+    }
+    return file->ops->read(file, buf, size, &offset);
+}
+
+// like sys_write() but at the given offset, file position isn't changed
+int sys_pwrite(file_descriptor_t fd, void *buf, uint32_t size, uint32_t offset)
+{
+    if (fd >= MAX_OPENED_FILES || fd < 0 || current_process->files[fd] == NULL) {
+        return -EBADF;
+    }
+
+    vfs_file_t *file = current_process->files[fd];
+    if (file->ops == NULL || file->ops->write == NULL) {
+        return -EPERM;
+    }
+    return file->ops->write(file, buf, size, &offset);
+}
+
 file_descriptor_t sys_open(char *path, int flags)
 {
     mutex_lock(&vfs_mutex);
@@ -340,6 +370,7 @@ file_descriptor_t sys_open(char *path, int flags)
             file->ops = node->file_ops;
             file->node = node;
             file->pid = current_process->id;
+            file->status_flags = flags & (O_ACCMODE | O_SETFL_MASK);
             if (file->ops && file->ops->open) {
                 err = file->ops->open(file, 0);
                 if (err) {
@@ -372,6 +403,9 @@ int sys_close(file_descriptor_t fd)
     }
     log(KERN_DEBUG, "close %s\n", current_process->files[fd]->node->name);
     vfs_file_t *file = current_process->files[fd];
+    if (file->epoll_items != NULL) {
+        epoll_file_closed(file);
+    }
     if (file->ops != NULL && file->ops->close != NULL) {
         int err = file->ops->close(file);
         if (err) {
@@ -399,8 +433,7 @@ int fcntl(int fd, int cmd, int arg)
             debug("fcntl F_DUPFD %i -> %i\n", fd, arg);
             for(uint32_t i = arg; i < MAX_OPENED_FILES; i++) {
                 if (current_process->files[i] == NULL) {
-                    current_process->files[i] = kmalloc(sizeof(vfs_file_t));
-                    *current_process->files[i] = *current_process->files[fd];
+                    current_process->files[i] = dup_file(current_process->files[fd]);
                     return i;
                 }
             }
@@ -410,8 +443,7 @@ int fcntl(int fd, int cmd, int arg)
             debug("fcntl F_DUPFD_CLOEXEC %i -> %i\n", fd, arg);
             for(uint32_t i = arg; i < MAX_OPENED_FILES; i++) {
                 if (current_process->files[i] == NULL) {
-                    current_process->files[i] = kmalloc(sizeof(vfs_file_t));
-                    *current_process->files[i] = *current_process->files[fd];
+                    current_process->files[i] = dup_file(current_process->files[fd]);
                     current_process->files[i]->flags |= FD_CLOEXEC;
                     return i;
                 }
@@ -425,6 +457,15 @@ int fcntl(int fd, int cmd, int arg)
         debug("fcntl F_SETFD %i -> %i\n", fd, arg);
             return current_process->files[fd]->flags = arg;
         break;
+        case F_GETFL:
+            return current_process->files[fd]->status_flags;
+        break;
+        case F_SETFL:
+            debug("fcntl F_SETFL %i -> %x\n", fd, arg);
+            current_process->files[fd]->status_flags &= ~O_SETFL_MASK;
+            current_process->files[fd]->status_flags |= arg & O_SETFL_MASK;
+            return 0;
+        break;
         default:
             log(KERN_DEBUG, "unknown fcntl cmd %i with arg %i", cmd, arg);
             return -EINVAL;
@@ -565,12 +606,57 @@ int dup2(file_descriptor_t old, file_descriptor_t new)
             log(KERN_ERR, "dup2 can't close fd %i\n", new);
         }
     }
-    current_process->files[new] = kmalloc(sizeof(vfs_file_t));
-    *current_process->files[new] = *current_process->files[old];
+    current_process->files[new] = dup_file(current_process->files[old]);
 
     return 0;
 }
 
+/*
+ * Copy of opened file for dup2(), fcntl() and fork(). ops->close() is called for every copy, so nodes shared by
+ * several files (sockets) count their users in ref_count.
+ */
+vfs_file_t *dup_file(vfs_file_t *file)
+{
+    vfs_file_t *copy = kmalloc(sizeof(vfs_file_t));
+    *copy = *file;
+    copy->epoll_items = NULL;
+    ref_inc(&file->node->ref_count);
+    return copy;
+}
+
+/*
+ * Installs file of a node which isn't in the tree (socket, epoll), returns descriptor. Node is freed by ops->close()
+ * of the last file, its ref_count is 1 for the first one.
+ */
+int open_anonymous_file(char *name, mode_t mode, vfs_file_operations_t *ops, void *obj)
+{
+    vfs_node_t *node = kmalloc(sizeof(vfs_node_t));
+    memset(node, 0, sizeof(vfs_node_t));
+    strcpy(node->name, name);
+    node->mode = mode;
+    node->file_ops = ops;
+    node->obj = obj;
+    node->ref_count = 1;
+
+    vfs_file_t *file = kmalloc(sizeof(vfs_file_t));
+    memset(file, 0, sizeof(vfs_file_t));
+    file->ops = ops;
+    file->node = node;
+    file->pid = current_process->id;
+    file->status_flags = O_RDWR;
+
+    for (uint32_t i = 0; i < MAX_OPENED_FILES; i++) {
+        if (current_process->files[i] == NULL) {
+            current_process->files[i] = file;
+            return i;
+        }
+    }
+
+    kfree(file);
+    kfree(node);
+    return -EMFILE;
+}
+
 struct vfs_file *get_file(file_descriptor_t fd)
 {
     if (fd >= MAX_OPENED_FILES || fd < 0 || current_process->files[fd] == NULL) {
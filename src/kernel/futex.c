@@ -0,0 +1,68 @@
+#include "futex.h"
+#include "wait_queue.h"
+#include "task.h"
+#include "mm.h"
+#include "pit.h"
+#include "irq.h"
+#include "errno.h"
+#include <stddef.h>
+
+#define FUTEX_HASH_BITS 6
+#define FUTEX_HASH_SIZE (1 << FUTEX_HASH_BITS)
+
+static wait_queue_t futex_queues[FUTEX_HASH_SIZE];
+
+/*
+ * Futex is identified by physical address, so the same word in a shared memory segment is the same futex
+ * for all processes which mapped it.
+ */
+static uint32_t futex_key(uint32_t *uaddr)
+{
+    if ((uintptr_t)uaddr >= KERNEL_SPACE_ADDR || ((uintptr_t)uaddr & 3) != 0) {
+        return 0;
+    }
+    return get_physical_address((uint32_t)uaddr);
+}
+
+static wait_queue_t *futex_queue(uint32_t key)
+{
+    return &futex_queues[((key >> 2) * 0x9E3779B1) >> (32 - FUTEX_HASH_BITS)];
+}
+
+/*
+ * FUTEX_WAIT: sleeps while *uaddr == val, timeout in ms is passed in esi (0 - wait forever).
+ * FUTEX_WAKE: wakes up to val waiters, returns number of woken threads.
+ */
+int futex(uint32_t *uaddr, int op, uint32_t val)
+{
+    uint32_t key = futex_key(uaddr);
+    if (key == 0) {
+        return -EFAULT;
+    }
+    wait_queue_t *wq = futex_queue(key);
+
+    if (op == FUTEX_WAKE) {
+        // count 0 means all waiters for wake_up()
+        if (val == 0) {
+            return 0;
+        }
+        return wake_up(wq, key, val > 0x7FFFFFFF ? 0x7FFFFFFF : (int)val);
+    }
+
+    if (op != FUTEX_WAIT) {
+        return -ENOSYS;
+    }
+
+    uint32_t timeout = current_thread->user_regs != NULL ? current_thread->user_regs->esi : 0;
+    if (timeout != 0) {
+        timeout = ms_to_ticks(timeout);
+    }
+
+    // no wake up can happen between the check and sleep, FUTEX_WAKE also runs with interrupts disabled
+    cli();
+    if (*(volatile uint32_t*)uaddr != val) {
+        sti();
+        return -EAGAIN;
+    }
+    return wait_event(wq, key, timeout);
+}
@@ -6,7 +6,8 @@
 extern void flush_tss();
 extern void flush_gdt(uintptr_t gdt);
 
-#define GDT_SIZE 6
+#define GDT_SIZE 7
+#define GDT_TLS_ENTRY 6
 
 struct gdt_entry gdt_entries[GDT_SIZE];
 struct gdt_register gdt_reg;
@@ -17,6 +18,14 @@ void set_kernel_stack(uint32_t stack)
    tss_entry.esp0 = stack;
 }
 
+// new base is used after next %gs reload, it happens on every return to userspace
+void set_tls_base(uint32_t base)
+{
+    gdt_entries[GDT_TLS_ENTRY].base_low = (base & 0xFFFF);
+    gdt_entries[GDT_TLS_ENTRY].base_middle = (base >> 16) & 0xFF;
+    gdt_entries[GDT_TLS_ENTRY].base_high = (base >> 24) & 0xFF;
+}
+
 static void write_tss(int num, uint16_t ss0, uint32_t esp0)
 {
    uint32_t base = (uint32_t)(uintptr_t)&tss_entry;
@@ -55,6 +64,8 @@ void init_gdt()
     // data segment, usermode
     gdt_set_gate(gdt_entries, 4, 0, 0xFFFFFFFF, 0xF2, 0xCF);
     write_tss(5, 0x10, 0x0);
+    // thread local storage segment (%gs in userspace), one page, base is changed by scheduler
+    gdt_set_gate(gdt_entries, GDT_TLS_ENTRY, 0, 0xFFF, 0xF2, 0x40);
     gdt_reg.limit = (sizeof(struct gdt_entry) * GDT_SIZE) - 1;
     gdt_reg.base = (uint32_t)&gdt_entries;
 
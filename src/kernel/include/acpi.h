@@ -0,0 +1,70 @@
+#ifndef H_ACPI
+#define H_ACPI
+
+#include <stdint.h>
+
+struct acpi_sdt_header
+{
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+// "APIC" table
+struct acpi_madt
+{
+    struct acpi_sdt_header header;
+    uint32_t lapic_address;
+    uint32_t flags;
+    uint8_t entries[];
+} __attribute__((packed));
+
+#define MADT_FLAG_PCAT_COMPAT 1
+
+#define MADT_TYPE_LAPIC 0
+#define MADT_TYPE_IOAPIC 1
+#define MADT_TYPE_ISO 2
+
+struct madt_entry_header
+{
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed));
+
+struct madt_lapic
+{
+    struct madt_entry_header header;
+    uint8_t processor_id;
+    uint8_t apic_id;
+    uint32_t flags;
+} __attribute__((packed));
+
+struct madt_ioapic
+{
+    struct madt_entry_header header;
+    uint8_t ioapic_id;
+    uint8_t reserved;
+    uint32_t address;
+    uint32_t gsi_base;
+} __attribute__((packed));
+
+// interrupt source override: ISA IRQ source is connected to gsi
+struct madt_iso
+{
+    struct madt_entry_header header;
+    uint8_t bus;
+    uint8_t source;
+    uint32_t gsi;
+    uint16_t flags; // MPS INTI flags: bits 0-1 polarity, bits 2-3 trigger mode
+} __attribute__((packed));
+
+void *map_physical_region(uint32_t physical, uint32_t size, uint8_t flags);
+struct acpi_sdt_header *acpi_find_table(const char *signature);
+
+#endif
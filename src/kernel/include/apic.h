@@ -0,0 +1,43 @@
+#ifndef H_APIC
+#define H_APIC
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MSR_APIC_BASE 0x1B
+#define APIC_BASE_ENABLE (1 << 11)
+
+#define LAPIC_REG_ID 0x20
+#define LAPIC_REG_TPR 0x80
+#define LAPIC_REG_EOI 0xB0
+#define LAPIC_REG_SVR 0xF0
+#define LAPIC_SVR_ENABLE (1 << 8)
+
+#define IOAPIC_REG_SELECT 0x00
+#define IOAPIC_REG_WINDOW 0x10
+#define IOAPIC_VERSION 0x01
+#define IOAPIC_REDIRECTION(n) (0x10 + (n) * 2)
+
+#define IOAPIC_ACTIVE_LOW (1 << 13)
+#define IOAPIC_LEVEL (1 << 15)
+#define IOAPIC_MASKED (1 << 16)
+
+#define MSI_ADDRESS_BASE 0xFEE00000
+
+// ISA IRQ n is delivered to vector IRQ_VECTOR_BASE + n with both 8259 and IOAPIC
+#define IRQ_VECTOR_BASE 32
+#define ISA_IRQ_COUNT 16
+// vectors for MSI and PCI interrupts which can't be shared with ISA IRQs
+#define DYNAMIC_VECTOR_FIRST 48
+#define DYNAMIC_VECTOR_LAST 63
+#define SPURIOUS_VECTOR 255
+
+void init_apic();
+bool apic_enabled();
+void apic_eoi();
+uint8_t apic_id();
+int apic_alloc_vector();
+void apic_free_vector(uint8_t vector);
+int apic_route_isa_irq(uint8_t irq, uint8_t vector, bool pci);
+
+#endif
@@ -4,17 +4,45 @@
 #include <stdint.h>
 #include "network.h"
 #include "list.h"
+#include "net_buffer.h"
 
 #define ARP_REQUEST 1
 #define ARP_REPLY 2
 
 #define ARP_HARDWARE_TYPE_ETHERNET 1
 
+// buckets of ARP table, power of 2
+#define ARP_HASH_SIZE 64
+// times in ms
+#define ARP_REACHABLE_TIME 30000 // entry is used without revalidation
+#define ARP_GC_TIME 600000 // unconfirmed stale entry is removed
+#define ARP_REQUEST_INTERVAL 1000 // between requests for one address
+#define ARP_TIMER_INTERVAL 500
+#define ARP_TIMER_REQUESTS 8 // retransmissions per timer pass
+#define ARP_MAX_REQUESTS 3 // unanswered requests before incomplete entry is dropped with its packets
+#define ARP_MAX_PENDING 16 // packets waiting for resolution of one address
+#define ARP_MAX_REQUEST_RATE 50 // requests per second for all addresses
+
+enum
+{
+    ARP_ENTRY_INCOMPLETE = 1, // request is sent, packets are queued
+    ARP_ENTRY_REACHABLE,
+    ARP_ENTRY_STALE // MAC is used, but next use sends a request to confirm it
+};
+
 typedef struct arp_entry
 {
-    list_node_t list;
+    struct arp_entry *next; // hash chain
     ip4_addr_t ip_addr;
     eth_addr_t mac;
+    uint8_t state;
+    uint8_t requests; // sent since the last confirmation
+    uint32_t confirmed; // ticks of the last reply
+    uint32_t requested; // ticks of the last request
+    network_device_t *net_dev; // link of the address, sends pending packets
+    net_buffer_t *pending; // linked by next, the oldest first
+    net_buffer_t *pending_tail;
+    uint32_t pending_count;
 } arp_entry_t;
 
 typedef struct arp_header
@@ -36,9 +64,12 @@ typedef struct arp_packet
     arp_header_t arp;
 } __attribute__((packed)) arp_packet_t;
 
-uint8_t get_mac_from_cache(const ip4_addr_t *ip, eth_addr_t *out);
-void add_mac_to_arp_cache(ip4_addr_t *ip, eth_addr_t *mac);
+uint8_t get_mac_from_cache(network_device_t *net_dev, const ip4_addr_t *ip, eth_addr_t *out);
+void add_mac_to_arp_cache(network_device_t *net_dev, ip4_addr_t *ip, eth_addr_t *mac);
 uint8_t get_mac_by_ip(network_device_t *net_dev, ip4_addr_t *ip, eth_addr_t *out);
+uint8_t arp_resolve(network_device_t *net_dev, ip4_addr_t *ip, net_buffer_t *buffer, eth_addr_t *out);
+void flush_arp_cache();
 void process_arp_request(network_device_t *net_dev, void *packet);
+void init_arp_protocol();
 
 #endif
@@ -23,6 +23,10 @@ typedef struct buffer
     uint32_t (*get)(struct buffer*, void*, uint32_t);
     uint32_t (*get_until)(struct buffer*, void*, uint32_t, uint8_t);
     uint32_t (*get_free_space)(struct buffer*);
+    uint32_t (*get_used)(struct buffer*);
+    uint32_t (*peek)(struct buffer*, void*, uint32_t, uint32_t);
+    uint32_t (*drop)(struct buffer*, uint32_t);
+    uint8_t (*resize)(struct buffer*, uint32_t);
     void (*clear)(struct buffer*);
     void (*free)(struct buffer*);
 } buffer_t;
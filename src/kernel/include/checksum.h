@@ -0,0 +1,20 @@
+#ifndef H_CHECKSUM
+#define H_CHECKSUM
+
+#include <stdint.h>
+
+/*
+ * Internet checksum (RFC 1071). Partial sums are 32 bit one's complement sums of the data as it's laid out in
+ * memory, so folded results can be stored into headers without byte swapping. Partial sums of separate blocks are
+ * combined with checksum_block_add().
+ */
+
+uint32_t checksum_partial(const void *data, uint32_t size, uint32_t sum);
+uint32_t checksum_add(uint32_t a, uint32_t b);
+uint32_t checksum_block_add(uint32_t sum, uint32_t block, uint32_t offset);
+uint16_t checksum_fold(uint32_t sum);
+uint16_t checksum(const void *data, uint32_t size);
+uint16_t checksum_update16(uint16_t check, uint16_t old_value, uint16_t new_value);
+uint16_t checksum_update32(uint16_t check, uint32_t old_value, uint32_t new_value);
+
+#endif
@@ -3,6 +3,10 @@
 
 #include "pci.h"
 
+#define E1000_DEVICE_82540EM 0x100e
+#define E1000_DEVICE_82567LM 0x10f5
+#define E1000_DEVICE_82574 0x10d3 // two queues with RSS and MSI-X
+
 void e1000_init(pci_device_t *pci_dev);
 
 #endif
@@ -35,5 +35,21 @@
 #define	EPIPE		32	/* Broken pipe */
 #define	EDOM		33	/* Math argument out of domain of func */
 #define	ERANGE		34	/* Math result not representable */
+// newlib numbering
+#define	ENOSYS		88	/* Function not implemented */
+#define	EOPNOTSUPP	95	/* Operation not supported on socket */
+#define	ENOBUFS		105	/* No buffer space available */
+#define	EAFNOSUPPORT	106	/* Address family not supported by protocol */
+#define	ENOTSOCK	108	/* Socket operation on non-socket */
+#define	EADDRINUSE	112	/* Address already in use */
+#define	ENETUNREACH	114	/* Network is unreachable */
+#define	ENETDOWN	115	/* Network is down */
+#define	ETIMEDOUT	116	/* Connection timed out */
+#define	EDESTADDRREQ	121	/* Destination address required */
+#define	EMSGSIZE	122	/* Message too long */
+#define	EPROTONOSUPPORT	123	/* Protocol not supported */
+#define	EADDRNOTAVAIL	125	/* Cannot assign requested address */
+#define	EISCONN		127	/* Transport endpoint is already connected */
+#define	ENOTCONN	128	/* Transport endpoint is not connected */
 
 #endif
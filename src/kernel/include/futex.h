@@ -0,0 +1,11 @@
+#ifndef H_FUTEX
+#define H_FUTEX
+
+#include <stdint.h>
+
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+
+int futex(uint32_t *uaddr, int op, uint32_t val);
+
+#endif
@@ -3,5 +3,6 @@
 
 void init_gdt();
 void set_kernel_stack(uint32_t stack);
+void set_tls_base(uint32_t base);
 
 #endif
@@ -0,0 +1,74 @@
+#ifndef H_IORING
+#define H_IORING
+
+#include <stdint.h>
+
+/*
+ * Submission/completion ring shared between a process and its kernel I/O worker.
+ * Userspace fills sqes and advances sq_tail, the worker consumes them and posts cqes (cq_tail), userspace
+ * reaps cqes and advances cq_head. ring_enter() kicks the worker and optionally waits for completions.
+ * Header is shared with userspace, so keep it free of kernel includes.
+ * Must be equal to USERSPACE_IORING, checked in ioring.c
+ */
+#define IORING_ADDR 0xB996E000
+#define IORING_SIZE 0x4000
+#define IORING_MAX_ENTRIES 256
+#define IORING_SQES_OFFSET 0x1000
+#define IORING_CQES_OFFSET 0x3000
+
+#define IORING_OP_NOP 0
+#define IORING_OP_READ 1
+#define IORING_OP_WRITE 2
+#define IORING_OP_OPEN 3
+#define IORING_OP_CLOSE 4
+#define IORING_OP_STAT 5
+#define IORING_OP_READDIR 6
+
+// read/write at the file position (and advance it) instead of explicit offset
+#define IORING_OFFSET_CURRENT 0xFFFFFFFF
+
+struct ioring_sqe
+{
+    uint8_t opcode;
+    uint8_t reserved[3];
+    int32_t fd;
+    uint32_t addr; // buffer, path for OPEN/STAT
+    uint32_t len; // size, flags for OPEN
+    uint32_t offset;
+    uint32_t addr2; // struct stat * for STAT
+    uint32_t user_data;
+    uint32_t pad;
+};
+
+struct ioring_cqe
+{
+    uint32_t user_data;
+    int32_t res; // result of operation, negative errno on error
+};
+
+struct ioring
+{
+    // sq_tail is written by userspace, sq_head by kernel
+    volatile uint32_t sq_head;
+    volatile uint32_t sq_tail;
+    uint32_t sq_entries;
+    // cq_tail is written by kernel, cq_head by userspace
+    volatile uint32_t cq_head;
+    volatile uint32_t cq_tail;
+    uint32_t cq_entries;
+};
+
+static inline struct ioring_sqe *ioring_sqes(struct ioring *ring)
+{
+    return (struct ioring_sqe*)((uint8_t*)ring + IORING_SQES_OFFSET);
+}
+
+static inline struct ioring_cqe *ioring_cqes(struct ioring *ring)
+{
+    return (struct ioring_cqe*)((uint8_t*)ring + IORING_CQES_OFFSET);
+}
+
+int ring_setup(uint32_t entries);
+int ring_enter(uint32_t min_complete);
+
+#endif
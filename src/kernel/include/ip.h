@@ -2,6 +2,7 @@
 #define H_IP
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "network.h"
 
 #define IP_VERSION 4
@@ -23,12 +24,25 @@ typedef struct ip4_header
     ip4_addr_t destination_ip;
 } __attribute__((packed)) ip4_header_t;
 
+// prepended to TCP and UDP segments for checksum calculation
+typedef struct ip4_pseudo_header
+{
+    ip4_addr_t source;
+    ip4_addr_t destination;
+    uint8_t reserved;
+    uint8_t protocol;
+    uint16_t length;
+} __attribute__((packed)) ip4_pseudo_header_t;
+
 typedef struct ip_packet
 {
     eth_header_t eth;
     ip4_header_t ip;
 } __attribute__((packed)) ip_packet_t;
 
-void send_ip4_packet(network_device_t *net_dev, ip4_addr_t* destination, uint8_t protocol, void *packet, size_t size);
+uint16_t ip4_pseudo_checksum(ip4_addr_t *source, ip4_addr_t *destination, uint8_t protocol, uint16_t length);
+bool ip4_header_valid(net_buffer_t *buffer);
+bool ip4_payload_valid(net_buffer_t *buffer);
+void send_ip4_packet(network_device_t *net_dev, ip4_addr_t* destination, uint8_t protocol, net_buffer_t *buffer);
 
 #endif
@@ -45,7 +45,23 @@ struct regs {
 #define cli() __asm__ __volatile__("cli")
 #define sti() __asm__ __volatile__("sti")
 
+// disables interrupts and returns previous EFLAGS, so nested critical sections don't enable IRQs too early
+static inline uint32_t irq_save()
+{
+    uint32_t flags;
+    __asm__ __volatile__("pushf; pop %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags)
+{
+    if (flags & 0x200) {
+        sti();
+    }
+}
+
 void set_irq_handler(uint8_t number, void *handler);
+void *get_irq_handler(uint8_t number);
 void init_irq();
 
 #endif
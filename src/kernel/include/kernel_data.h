@@ -0,0 +1,59 @@
+#ifndef H_KERNEL_DATA
+#define H_KERNEL_DATA
+
+#include <stdint.h>
+
+/*
+ * Read-only pages mapped into every process at KERNEL_DATA_ADDR, userspace reads them without syscalls.
+ * Header is shared with userspace (mdm, newlib), so keep it free of kernel includes.
+ * Must be equal to USERSPACE_KDATA, checked in kernel_data.c
+ */
+#define KERNEL_DATA_ADDR 0xB9973000
+#define PROCESS_DATA_ADDR (KERNEL_DATA_ADDR + 0x1000)
+
+struct kernel_data
+{
+    // odd while PIT handler updates ticks & tick_tsc, readers retry
+    volatile uint32_t seq;
+    volatile uint32_t ticks;
+    volatile uint64_t tick_tsc;
+    uint32_t tick_frequency;
+    uint32_t tsc_khz; // 0 if TSC isn't calibrated
+    // reserved for wall clock, 0 until RTC is supported
+    volatile uint32_t boot_time;
+};
+
+struct process_data
+{
+    int pid;
+    int ppid;
+    volatile int gid;
+};
+
+static inline uint64_t rdtsc()
+{
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a" (low), "=d" (high));
+    return ((uint64_t)high << 32) | low;
+}
+
+static inline const struct kernel_data *get_kernel_data()
+{
+    return (const struct kernel_data*)KERNEL_DATA_ADDR;
+}
+
+static inline const struct process_data *get_process_data()
+{
+    return (const struct process_data*)PROCESS_DATA_ADDR;
+}
+
+struct process;
+struct page_directory;
+
+void init_kernel_data();
+void kernel_data_tick(uint32_t ticks);
+void alloc_process_data(struct process *p);
+void free_process_data(struct process *p);
+void map_kernel_data(struct process *p);
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef H_LOOPBACK
+#define H_LOOPBACK
+
+#include "network.h"
+
+/*
+ * Software network device for 127.0.0.0/8. Frames sent to it are received back by the stack from its own thread,
+ * so the protocols can be exercised (and benchmarked) without a NIC or remote peers.
+ */
+
+#define LOOPBACK_QUEUE_SIZE 256 // frames waiting for delivery, more are dropped
+#define LOOPBACK_BUDGET 32 // frames delivered between yields
+
+network_device_t *init_loopback();
+
+#endif
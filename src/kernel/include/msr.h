@@ -0,0 +1,27 @@
+#ifndef H_MSR
+#define H_MSR
+
+#include <stdint.h>
+
+#define MSR_SYSENTER_CS 0x174
+#define MSR_SYSENTER_ESP 0x175
+#define MSR_SYSENTER_EIP 0x176
+
+inline __attribute__((always_inline)) void wrmsr(uint32_t msr, uint64_t value)
+{
+    __asm__ __volatile__("wrmsr" :: "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+inline __attribute__((always_inline)) uint64_t rdmsr(uint32_t msr)
+{
+    uint32_t low, high;
+    __asm__ __volatile__("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+inline __attribute__((always_inline)) void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
+{
+    __asm__ __volatile__("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef H_NET_BUFFER
+#define H_NET_BUFFER
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Packet buffers shared by drivers and protocols. Storage is DMA capable, so a received frame is handed from the
+ * RX ring to the socket without copies and an outgoing frame is transmitted from the buffer it was built in.
+ * Headers are prepended in the headroom with net_buffer_push() while the packet goes down the stack.
+ */
+
+#define NET_BUFFER_SIZE 2048
+#define NET_BUFFER_HEADROOM 128 // Ethernet, IP and TCP headers with options
+#define NET_BUFFER_POOL_SIZE 1024 // shared by the stack, RX rings reserve their buffers on top of it
+// receive accounting of sockets: pool buffers one socket may keep queued, fragments included
+#define NET_SOCKET_RX_BUFFERS 64
+// below this many free buffers a socket which already holds some can't queue more, see net_buffer_charge()
+#define NET_BUFFER_LOW_WATERMARK (NET_BUFFER_POOL_SIZE / 8)
+
+// offload flags, TX ones are requests for the driver, RX ones are set by the driver
+#define NET_OFFLOAD_TX_IP_CSUM (1 << 0) // IP header checksum is left to hardware
+#define NET_OFFLOAD_TX_L4_CSUM (1 << 1) // TCP/UDP checksum field holds pseudo header sum, hardware completes it
+#define NET_OFFLOAD_TSO        (1 << 2) // TCP super-segment, hardware splits it into mss sized segments
+#define NET_OFFLOAD_RX_IP_OK   (1 << 3) // hardware verified IP header checksum
+#define NET_OFFLOAD_RX_L4_OK   (1 << 4) // hardware verified TCP/UDP checksum
+
+typedef struct net_buffer
+{
+    struct net_buffer *next; // free list
+    volatile uint32_t ref_count;
+    uint8_t *head; // start of storage
+    uint8_t *data; // start of packet
+    uint32_t len;
+    uint32_t physical; // physical address of head
+    struct net_buffer *next_frag; // packet continues in this buffer, chain is released with the first one
+    uint8_t offload;
+    uint8_t l4_protocol;
+    uint16_t mss;
+} net_buffer_t;
+
+void init_net_buffers();
+void net_buffer_reserve(uint32_t count);
+net_buffer_t *alloc_net_buffer();
+void hold_net_buffer(net_buffer_t *buffer);
+void release_net_buffer(net_buffer_t *buffer);
+void *net_buffer_push(net_buffer_t *buffer, uint32_t size);
+void *net_buffer_pull(net_buffer_t *buffer, uint32_t size);
+void *net_buffer_put(net_buffer_t *buffer, uint32_t size);
+uint32_t net_buffer_headroom(net_buffer_t *buffer);
+uint32_t net_buffer_tailroom(net_buffer_t *buffer);
+uint32_t net_buffer_free_count();
+uint32_t net_buffer_total_len(net_buffer_t *buffer);
+uint32_t net_buffer_checksum(net_buffer_t *buffer, uint32_t offset, uint32_t size, uint32_t sum);
+uint32_t net_buffer_copy(net_buffer_t *buffer, uint32_t offset, void *out, uint32_t size);
+bool net_buffer_append(net_buffer_t *buffer, const void *data, uint32_t size);
+net_buffer_t *copy_net_buffer(net_buffer_t *buffer);
+uint32_t net_buffer_count(net_buffer_t *buffer);
+bool net_buffer_charge(volatile uint32_t *held, net_buffer_t *buffer);
+void net_buffer_uncharge(volatile uint32_t *held, net_buffer_t *buffer);
+
+// physical address of data, for descriptors
+#define NET_BUFFER_DMA(b) ((b)->physical + (uint32_t)((b)->data - (b)->head))
+
+#endif
@@ -3,20 +3,39 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 #include "pci.h"
 #include "mutex.h"
 #include "list.h"
+#include "net_buffer.h"
 
 #define MAX_ETHERNET_PAYLOAD_SIZE 1500
 #define MIN_ETHERNET_PACKET_SIZE 14
 #define MAX_ETHERNET_PACKET_SIZE 1514
 
+// MTU is per device, frames above the standard payload (jumbo frames) span several net buffers
+#define NET_DEFAULT_MTU MAX_ETHERNET_PAYLOAD_SIZE
+#define NET_MIN_MTU 68
+#define NET_MAX_MTU 9000
+
 #define PROTOCOL_TCP 6
 #define PROTOCOL_UDP 17
 
 #define ETH_ADDR_LENGTH 6
 #define IP4_ADDR_LENGTH 4
 
+// network_device features, offloads the stack may request in net_buffer offload flags
+#define NET_FEATURE_IP_CSUM (1 << 0)
+#define NET_FEATURE_TCP_CSUM (1 << 1)
+#define NET_FEATURE_UDP_CSUM (1 << 2)
+#define NET_FEATURE_TSO (1 << 3)
+
+// largest TCP super-segment handed to a device with NET_FEATURE_TSO, IP total length is 16 bits
+#define NET_TSO_MAX_SIZE 0xFFFF
+
+// network_device flags
+#define NET_DEV_LOOPBACK (1 << 0) // software device, frames come back to the stack, no ARP
+
 #define PROTOCOL_IP 0x0800
 #define PROTOCOL_ARP 0x0806
 
@@ -72,15 +91,26 @@ struct network_device
     ip4_addr_t subnet_mask;
     ip4_addr_t router;
     eth_addr_t mac;
-    void (*send_packet)(network_device_t*, void*, size_t);
+    void (*send_packet)(network_device_t*, net_buffer_t*); // takes the buffer reference
     void (*enable)(network_device_t*);
-    void (*receive_packet)(network_device_t*, eth_packet_t*);
+    void (*receive_packet)(network_device_t*, net_buffer_t*); // takes the buffer reference
+    void (*flush)(network_device_t*); // optional, kicks frames queued during TX batch
+    bool (*set_mtu)(network_device_t*, uint32_t); // optional, configures hardware for frames of new MTU
+    volatile uint32_t tx_batch; // nesting depth of net_tx_batch_begin()
+    uint32_t features;
+    uint32_t flags;
+    uint32_t mtu; // largest IP packet, without ethernet header
     network_stats_t stats;
     mutex_t mutex;
 };
 
 network_device_t* create_network_device(pci_device_t *pci_dev);
 void register_network_device(network_device_t *net_dev);
+void set_network_address(network_device_t *net_dev, ip4_addr_t *addr, ip4_addr_t *mask, ip4_addr_t *router);
+network_device_t *get_network_device_by_ip(ip4_addr_t *addr);
+int set_network_mtu(network_device_t *net_dev, uint32_t mtu);
+void net_tx_batch_begin(network_device_t *net_dev);
+void net_tx_batch_end(network_device_t *net_dev);
 void ip4_to_str(ip4_addr_t *addr, char *buff);
 
 #endif
@@ -0,0 +1,121 @@
+#ifndef H_PCAP
+#define H_PCAP
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "net_buffer.h"
+
+/*
+ * Packet capture: /dev/pcap reads as a pcap file (Ethernet link type) with frames of all network devices. Frames
+ * are tapped in receive_packet() and in drivers' send_packet() (loopback frames are seen once, on receive) and are
+ * written by producers into a lock-free ring of fixed slots, the reader never blocks the stack: a full ring drops
+ * the frame. While /dev/pcap isn't open a tap is a single flag check.
+ *
+ * Writing to /dev/pcap installs a classic BPF program (as printed by tcpdump -dd), an empty write removes it.
+ * Program returns the number of bytes to capture, 0 drops the frame.
+ */
+
+#define PCAP_SNAPLEN 256
+#define PCAP_RING_SLOTS 1024 // power of 2
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_VERSION_MAJOR 2
+#define PCAP_VERSION_MINOR 4
+#define PCAP_LINKTYPE_ETHERNET 1
+
+#define BPF_MAX_INSNS 64
+#define BPF_MEMWORDS 16
+
+// instruction classes and fields, values of classic BPF
+#define BPF_CLASS(code) ((code) & 0x07)
+#define BPF_LD   0x00
+#define BPF_LDX  0x01
+#define BPF_ST   0x02
+#define BPF_STX  0x03
+#define BPF_ALU  0x04
+#define BPF_JMP  0x05
+#define BPF_RET  0x06
+#define BPF_MISC 0x07
+
+#define BPF_SIZE(code) ((code) & 0x18)
+#define BPF_W 0x00
+#define BPF_H 0x08
+#define BPF_B 0x10
+
+#define BPF_MODE(code) ((code) & 0xe0)
+#define BPF_IMM 0x00
+#define BPF_ABS 0x20
+#define BPF_IND 0x40
+#define BPF_MEM 0x60
+#define BPF_LEN 0x80
+#define BPF_MSH 0xa0
+
+#define BPF_OP(code) ((code) & 0xf0)
+#define BPF_ADD 0x00
+#define BPF_SUB 0x10
+#define BPF_MUL 0x20
+#define BPF_DIV 0x30
+#define BPF_OR  0x40
+#define BPF_AND 0x50
+#define BPF_LSH 0x60
+#define BPF_RSH 0x70
+#define BPF_NEG 0x80
+#define BPF_JA   0x00
+#define BPF_JEQ  0x10
+#define BPF_JGT  0x20
+#define BPF_JGE  0x30
+#define BPF_JSET 0x40
+
+#define BPF_SRC(code) ((code) & 0x08)
+#define BPF_K 0x00
+#define BPF_X 0x08
+
+#define BPF_RVAL(code) ((code) & 0x18)
+#define BPF_A 0x10
+
+#define BPF_MISCOP(code) ((code) & 0xf8)
+#define BPF_TAX 0x00
+#define BPF_TXA 0x80
+
+typedef struct bpf_insn
+{
+    uint16_t code;
+    uint8_t jt;
+    uint8_t jf;
+    uint32_t k;
+} __attribute__((packed)) bpf_insn_t;
+
+typedef struct pcap_file_header
+{
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+} __attribute__((packed)) pcap_file_header_t;
+
+typedef struct pcap_record
+{
+    uint32_t ts_sec; // time since boot
+    uint32_t ts_usec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+} __attribute__((packed)) pcap_record_t;
+
+extern volatile uint32_t pcap_active;
+
+void init_pcap();
+void pcap_capture(net_buffer_t *buffer);
+bool bpf_validate(bpf_insn_t *program, uint32_t count);
+uint32_t bpf_run(bpf_insn_t *program, net_buffer_t *buffer);
+
+// frame is only read, caller keeps its reference
+static inline void pcap_tap(net_buffer_t *buffer)
+{
+    if (pcap_active) {
+        pcap_capture(buffer);
+    }
+}
+
+#endif
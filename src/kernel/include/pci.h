@@ -14,6 +14,30 @@
 
 #define PCI_SUB_CLASS_IDE 0x01
 
+#define PCI_REG_COMMAND 0x04
+#define PCI_REG_CAPABILITIES 0x34
+#define PCI_REG_INTERRUPT 0x3C
+
+#define PCI_COMMAND_BUS_MASTER (1 << 2)
+#define PCI_COMMAND_INTX_DISABLE (1 << 10)
+#define PCI_STATUS_CAPABILITIES (1 << 4)
+
+#define PCI_CAP_MSI 0x05
+#define PCI_CAP_MSIX 0x11
+
+#define PCI_MSI_ENABLE (1 << 0)
+#define PCI_MSI_64BIT (1 << 7)
+
+#define PCI_MSIX_ENABLE (1 << 15)
+#define PCI_MSIX_TABLE_SIZE_MASK 0x7FF // table size - 1
+#define PCI_MSIX_BIR_MASK 0x7 // BAR which holds the table, rest of the register is offset in it
+#define PCI_MSIX_ENTRY_SIZE 16
+#define PCI_MSIX_ENTRY_MASKED (1 << 0)
+#define PCI_MSIX_MAX_VECTORS 8
+
+#define PCI_NO_IRQ 0xFF
+#define PCI_INTX_SHARED_HANDLERS 4 // drivers sharing one legacy line
+
 typedef struct pci_device
 {
     list_node_t list;
@@ -22,6 +46,11 @@ typedef struct pci_device
     uint8_t class;
     uint8_t subclass;
     uint8_t interface;
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t func;
+    uint8_t irq_line; // legacy INTx line assigned by firmware, PCI_NO_IRQ if none
+    uint8_t irq_pin;
     uint32_t base_address[6];
     uint32_t base_address_length[6];
     void* hardware_driver;
@@ -41,5 +70,11 @@ typedef struct driver_map_node
 void detect_pci_devices();
 void init_pci_devices();
 pci_device_t* get_pci_device_by_class(uint8_t class, pci_device_t* curr);
+uint32_t pci_config_read(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
+void pci_config_write(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t value);
+uint8_t pci_find_capability(pci_device_t *dev, uint8_t id);
+int pci_enable_msi(pci_device_t *dev, uint8_t vector);
+int pci_request_irq(pci_device_t *dev, void *handler);
+int pci_request_msix(pci_device_t *dev, void *handler, int *vectors, uint32_t count);
 
 #endif
@@ -17,4 +17,10 @@
 void init_pit();
 uint32_t get_pit_ticks();
 
+// rounded up, so a short timeout still sleeps at least one tick
+static inline uint32_t ms_to_ticks(uint32_t ms)
+{
+    return ms / 1000 * TICK_FREQUENCY + (ms % 1000) * TICK_FREQUENCY / 1000 + 1;
+}
+
 #endif
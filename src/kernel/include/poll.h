@@ -0,0 +1,67 @@
+#ifndef H_POLL
+#define H_POLL
+
+#include <stdint.h>
+#include <stddef.h>
+#include "vfs.h"
+#include "wait_queue.h"
+
+/*
+ * Readiness of file descriptors: poll(), select() (newlib builds it on poll()) and epoll. Files report readiness
+ * with ops->poll(), which registers the queues the file wakes on a change with poll_wait() and returns POLL* mask.
+ * Values and layouts must match newlib's poll.h and sys/epoll.h.
+ */
+
+#define POLLIN 0x1
+#define POLLPRI 0x2
+#define POLLOUT 0x4
+#define POLLERR 0x8
+#define POLLHUP 0x10
+#define POLLNVAL 0x20
+
+#define EPOLLIN POLLIN
+#define EPOLLPRI POLLPRI
+#define EPOLLOUT POLLOUT
+#define EPOLLERR POLLERR
+#define EPOLLHUP POLLHUP
+#define EPOLLET (1u << 31) // edge triggered, event is reported once per wake up of the file
+
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+struct pollfd
+{
+    int fd;
+    short events;
+    short revents;
+};
+
+struct epoll_event
+{
+    uint32_t events;
+    uint64_t data;
+} __attribute__((packed));
+
+// NULL table means that caller only checks readiness and won't sleep
+typedef struct poll_table
+{
+    void (*queue)(struct poll_table *table, wait_queue_t *wq);
+} poll_table_t;
+
+// must be called before file checks its state, so a change between the check and sleep isn't lost
+static inline void poll_wait(poll_table_t *table, wait_queue_t *wq)
+{
+    if (table != NULL) {
+        table->queue(table, wq);
+    }
+}
+
+uint32_t vfs_poll(vfs_file_t *file, poll_table_t *table);
+int sys_poll(struct pollfd *fds, uint32_t nfds, int timeout);
+int sys_epoll_create(int flags);
+int sys_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int sys_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+void epoll_file_closed(vfs_file_t *file);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef H_ROUTE
+#define H_ROUTE
+
+#include <stdint.h>
+#include "network.h"
+
+/*
+ * IPv4 routing table, it chooses the egress device and the next hop. Lookup is the longest prefix match: routes
+ * are kept sorted by prefix length, so the first match wins, equal prefixes go in the order they were added.
+ * Connected and default routes of a device are installed when it's registered or its address changes.
+ */
+
+typedef struct route
+{
+    struct route *next;
+    ip4_addr_t destination; // masked
+    ip4_addr_t mask;
+    ip4_addr_t gateway; // 0 - destination is on the link
+    network_device_t *net_dev;
+    uint8_t prefix_length;
+} route_t;
+
+void add_route(ip4_addr_t *destination, ip4_addr_t *mask, ip4_addr_t *gateway, network_device_t *net_dev);
+void remove_device_routes(network_device_t *net_dev);
+network_device_t *route_lookup(ip4_addr_t *destination, ip4_addr_t *next_hop);
+ip4_addr_t route_next_hop(network_device_t *net_dev, ip4_addr_t *destination);
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef H_SOCKET
+#define H_SOCKET
+
+#include <stdint.h>
+#include "network.h"
+#include "tcp.h"
+#include "udp.h"
+#include "mutex.h"
+#include "vfs.h"
+
+/*
+ * BSD sockets for userspace. Socket is an anonymous VFS node, so it's used through a file descriptor and
+ * read()/write()/close() work on it. Layout of the structures must match newlib's sys/socket.h and netinet/in.h.
+ */
+
+#define AF_INET 2
+#define SOCK_STREAM 1
+#define SOCK_DGRAM 2
+#define INADDR_ANY 0
+#define MSG_TRUNC 0x20 // msg_flags: datagram didn't fit into the buffers
+#define MSG_DONTWAIT 0x40 // O_NONBLOCK for one call
+#define MSG_WAITFORONE 0x10000 // recvmmsg: don't wait after the first datagram
+
+#define RECVMMSG_BATCH 16 // datagrams taken from the socket at once
+
+// ports for sockets which are used without bind(), IANA dynamic range (port 0xFFFF doesn't fit protocol tables)
+#define SOCKET_EPHEMERAL_PORT_FIRST 49152
+#define SOCKET_EPHEMERAL_PORT_LAST 0xFFFE
+
+typedef uint32_t socklen_t;
+
+struct sockaddr_in
+{
+    uint16_t sin_family;
+    uint16_t sin_port; // network byte order
+    ip4_addr_t sin_addr;
+    uint8_t sin_zero[8];
+} __attribute__((packed));
+
+struct iovec
+{
+    void *iov_base;
+    uint32_t iov_len;
+};
+
+struct msghdr
+{
+    void *msg_name; // struct sockaddr_in
+    socklen_t msg_namelen;
+    struct iovec *msg_iov;
+    uint32_t msg_iovlen;
+    void *msg_control; // ancillary data isn't supported
+    uint32_t msg_controllen;
+    int msg_flags;
+};
+
+struct mmsghdr
+{
+    struct msghdr msg_hdr;
+    uint32_t msg_len; // received bytes
+};
+
+typedef struct socket
+{
+    uint8_t type;
+    network_device_t *net_dev; // set by bind() to an address, 0 - device is chosen by routing
+    uint16_t port; // local port, 0 - not bound
+    tcp_socket_binder_t *binder; // owned by socket, connections made by accept() have none
+    tcp_socket_t *tcp;
+    udp_socket_t *udp;
+    uint8_t listening;
+    uint8_t connected;
+    ip4_addr_t remote_host; // peer of connected socket
+    uint16_t remote_port;
+    mutex_t mutex; // bind, listen and connect
+} socket_t;
+
+int sys_socket(int domain, int type, int protocol);
+int sys_bind(int fd, struct sockaddr_in *addr, socklen_t addrlen);
+int sys_listen(int fd, int backlog);
+int sys_accept(int fd, struct sockaddr_in *addr, socklen_t *addrlen);
+int sys_connect(int fd, struct sockaddr_in *addr, socklen_t addrlen);
+int sys_sendto(int fd, void *buf, uint32_t size, int flags, struct sockaddr_in *addr);
+int sys_recvfrom(int fd, void *buf, uint32_t size, int flags, struct sockaddr_in *addr);
+int sys_recvmmsg(int fd, struct mmsghdr *msgvec, uint32_t vlen, int flags, struct timespec *timeout);
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef H_SOFTIRQ
+#define H_SOFTIRQ
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Bottom halves. Hardware IRQ handlers (top halves) run with interrupts disabled, they only acknowledge the device
+ * and raise a softirq or schedule a tasklet. Pending softirqs run with interrupts enabled on exit from the outermost
+ * hardware interrupt. Bottom halves run on the stack of the interrupted thread, so they must not sleep or wait for
+ * a mutex (check MUTEX_IS_SET and reschedule instead).
+ */
+
+enum {
+    SOFTIRQ_NET_RX,
+    SOFTIRQ_NET_TX,
+    SOFTIRQ_BLOCK,
+    SOFTIRQ_TASKLET,
+    SOFTIRQ_COUNT
+};
+
+struct tasklet {
+    struct tasklet *next;
+    void (*func)(uint32_t);
+    uint32_t data;
+    volatile uint8_t scheduled;
+};
+
+#define TASKLET_INIT(f, d) {NULL, (f), (d), 0}
+
+// nesting count of bottom halves and preempt_disable() sections, interrupts don't switch task while it isn't 0
+extern volatile uint32_t preempt_count;
+
+static inline void preempt_disable()
+{
+    __sync_add_and_fetch(&preempt_count, 1);
+}
+
+static inline void preempt_enable()
+{
+    __sync_sub_and_fetch(&preempt_count, 1);
+}
+
+static inline bool preemptible()
+{
+    return preempt_count == 0;
+}
+
+void open_softirq(uint32_t nr, void (*handler)());
+void raise_softirq(uint32_t nr);
+void do_softirq();
+void tasklet_init(struct tasklet *t, void (*func)(uint32_t), uint32_t data);
+void tasklet_schedule(struct tasklet *t);
+void init_softirq();
+
+#endif
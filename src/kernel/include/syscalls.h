@@ -35,4 +35,25 @@
 #define SYSCALL_SHM_UNMAP 33
 #define SYSCALL_SHM_GET_ADDR 34
 #define SYSCALL_SHM_ALLOC 35
+#define SYSCALL_FUTEX 36
+// 37 is taken by kill() in newlib port
+#define SYSCALL_THREAD_CREATE 38
+#define SYSCALL_THREAD_EXIT 39
+#define SYSCALL_THREAD_JOIN 40
+#define SYSCALL_RING_SETUP 41
+#define SYSCALL_RING_ENTER 42
+#define SYSCALL_SOCKET 43
+#define SYSCALL_BIND 44
+#define SYSCALL_LISTEN 45
+#define SYSCALL_ACCEPT 46
+#define SYSCALL_CONNECT 47
+#define SYSCALL_SEND 48
+#define SYSCALL_RECV 49
+#define SYSCALL_SENDTO 50
+#define SYSCALL_RECVFROM 51
+#define SYSCALL_POLL 52
+#define SYSCALL_EPOLL_CREATE 53
+#define SYSCALL_EPOLL_CTL 54
+#define SYSCALL_EPOLL_WAIT 55
+#define SYSCALL_RECVMMSG 56
 #endif
@@ -9,6 +9,8 @@
 #include "vfs.h"
 #include "signal.h"
 #include "event.h"
+#include "wait_queue.h"
+#include "kernel_data.h"
 
 #define THREAD_RUNNING 1
 #define THREAD_STOPED 2
@@ -23,6 +25,25 @@
 
 #define WNOHANG 1
 
+#define USER_THREAD_FREE 0
+#define USER_THREAD_RUNNING 1
+#define USER_THREAD_EXITED 2
+
+struct user_thread_slot
+{
+    int tid;
+    uint8_t state;
+    uint8_t joined; // a thread waits for it in thread_join(), others get -EINVAL
+    uint32_t retval;
+};
+
+// beginning of TLS page, userspace reads it through %gs
+struct user_tls
+{
+    uint32_t self;
+    uint32_t tid;
+};
+
 struct thread
 {
     list_node_t list;
@@ -33,6 +54,10 @@ struct thread
     uint8_t state;
     int volatile ref_count;
     struct regs *user_regs;
+    struct wait_entry *waits;
+    volatile uint32_t wakeup_ticks; // sleeping thread is woken by scheduler after this tick (0 - never)
+    uint32_t tls; // 0 for kernel threads
+    uint8_t user_slot;
 };
 
 struct process
@@ -56,6 +81,17 @@ struct process
     char cur_dir[MAX_PATH_LENGTH];
     int volatile ref_count;
     mutex_t mutex;
+    struct user_thread_slot thread_slots[USERSPACE_THREADS_COUNT];
+    wait_queue_t join_queue;
+    struct process_data *data; // mapped read-only at PROCESS_DATA_ADDR
+    void *data_chunk;
+    struct ioring *ioring; // mapped at USERSPACE_IORING, NULL until ring_setup()
+    // kernel copies of ring sizes, the ones in the ring are writable by userspace and never trusted
+    uint32_t ioring_sq_mask;
+    uint32_t ioring_cq_mask;
+    wait_queue_t ioring_sq_queue;
+    wait_queue_t ioring_cq_queue;
+    wait_queue_t events_queue; // readers of /dev/event
 };
 
 extern struct process *current_process;
@@ -63,7 +99,7 @@ extern struct thread *current_thread;
 
 void init_multitasking();
 void switch_task();
-void start_thread(void *entry_point, uint32_t arg);
+struct thread *start_thread(void *entry_point, uint32_t arg);
 void force_task_switch();
 struct process *create_process(void *entry_point, uint32_t arg);
 void schedule_process(struct process *p);
@@ -74,6 +110,11 @@ int get_p_pid();
 int get_gid();
 int fork();
 void stop_process();
+void stop_other_threads();
+void setup_main_thread_tls();
+int thread_create(uint32_t entry_point, uint32_t arg);
+void thread_exit(uint32_t retval);
+int thread_join(int tid, uint32_t *retval);
 int set_proc_group(int pid, int group_id);
 int wait_pid(int pid, int *status, int options);
 int execve(char *path, char **argv, char **envp);
@@ -7,14 +7,47 @@
 #include "ip.h"
 #include "buffer.h"
 #include "list.h"
+#include "wait_queue.h"
 
 #define TCP_FLAG_FIN (1 << 0)
 #define TCP_FLAG_SYN (1 << 1)
 #define TCP_FLAG_RST (1 << 2)
 #define TCP_FLAG_ACK (1 << 4)
 
-#define TCP_MAX_PAYLOAD_SIZE MAX_ETHERNET_PACKET_SIZE - sizeof(tcp_packet_t)
+#define TCP_MAX_PAYLOAD_SIZE (MAX_ETHERNET_PACKET_SIZE - sizeof(tcp_packet_t))
+#define TCP_MAX_OPTIONS_SIZE 40
+#define TCP_TSO_MAX_PAYLOAD_SIZE (NET_TSO_MAX_SIZE - sizeof(ip4_header_t) - sizeof(tcp_header_t) - TCP_MAX_OPTIONS_SIZE)
 #define TCP_SOCKET_TIME_WAIT 15000
+// buckets of connection hash table, power of 2
+#define TCP_HASH_SIZE 1024
+
+// work for TCP worker, set on socket by RX path, user calls and timers
+#define TCP_PENDING_INPUT (1 << 0)
+#define TCP_PENDING_OUTPUT (1 << 1)
+#define TCP_PENDING_TIMER (1 << 2)
+#define TCP_PENDING_ACK (1 << 3) // window update after reader freed receive buffer
+
+#define TCP_OPTION_END 0
+#define TCP_OPTION_NOP 1
+#define TCP_OPTION_MSS 2
+#define TCP_OPTION_WINDOW_SCALE 3
+#define TCP_OPTION_SACK_PERMITTED 4
+#define TCP_OPTION_SACK 5
+#define TCP_OPTION_TIMESTAMP 8
+// NOP, NOP, kind, length, value, echo
+#define TCP_TIMESTAMP_OPTION_SIZE 12
+#define TCP_MAX_SACK_BLOCKS 4
+#define TCP_MAX_WINDOW_SCALE 14
+// our receive window is advertised with this shift, enough for TCP_SOCKET_MAX_BUFFER_SIZE
+#define TCP_WINDOW_SCALE 6
+// limit of listen() backlog
+#define TCP_MAX_BACKLOG 128
+
+// comparison of sequence numbers modulo 2^32
+#define SEQ_LT(a, b) ((int32_t)((a) - (b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t)((a) - (b)) <= 0)
+#define SEQ_GT(a, b) ((int32_t)((a) - (b)) > 0)
+#define SEQ_GEQ(a, b) ((int32_t)((a) - (b)) >= 0)
 
 enum
 {
@@ -25,7 +58,8 @@ enum
     TCP_CONNECTION_CLOSE_WAIT,
     TCP_CONNECTION_FIN_1,
     TCP_CONNECTION_FIN_2,
-    TCP_CONNECTION_TIME_WAIT
+    TCP_CONNECTION_TIME_WAIT,
+    TCP_CONNECTION_SYN_RECEIVED
 };
 
 enum
@@ -35,7 +69,9 @@ enum
     TCP_SOCKET_TIMEOUT,
     TCP_SOCKET_BUFFER_IS_FULL,
     TCP_SOCKET_TRANSMIT_NOT_FINISHED,
-    TCP_SOCKET_WRONG_STATE
+    TCP_SOCKET_WRONG_STATE,
+    TCP_SOCKET_NO_BUFFER,
+    TCP_SOCKET_NO_ROUTE
 };
 
 typedef struct tcp_header
@@ -53,15 +89,6 @@ typedef struct tcp_header
     uint16_t urgent_pointer;
 } __attribute__((packed)) tcp_header_t;
 
-typedef struct tcp_pseudo_header
-{
-    ip4_addr_t source;
-    ip4_addr_t destination;
-    uint8_t reserved;
-    uint8_t protocol;
-    uint16_t tcp_length;
-} __attribute__((packed)) tcp_pseudo_header_t;
-
 typedef struct tcp_packet
 {
     eth_header_t eth;
@@ -69,45 +96,112 @@ typedef struct tcp_packet
     tcp_header_t tcp;
 } __attribute__((packed)) tcp_packet_t;
 
+typedef struct tcp_options
+{
+    uint16_t mss;
+    uint8_t window_scale;
+    uint8_t has_window_scale;
+    uint8_t sack_permitted;
+    uint8_t has_timestamp;
+    uint32_t ts_value;
+    uint32_t ts_echo;
+    uint8_t sack_count;
+    uint32_t sack_left[TCP_MAX_SACK_BLOCKS];
+    uint32_t sack_right[TCP_MAX_SACK_BLOCKS];
+} tcp_options_t;
+
 typedef struct tcp_socket tcp_socket_t;
 
 typedef struct tcp_socket_binder
 {
-    mutex_t mutex;
     uint16_t port;
-    tcp_socket_t *connected;
-    tcp_socket_t *accept_wait;
-    tcp_socket_t *handshake;
-    tcp_socket_t *time_wait;
+    network_device_t *net_dev; // listener accepts only from this device, 0 - from all
+    tcp_socket_t *accept_wait; // established connections which aren't accepted yet
+    wait_queue_t accept_queue;
+    uint32_t backlog; // limit of syn_count and accept_count
+    uint32_t syn_count; // half-open connections (SYN_RECEIVED)
+    uint32_t accept_count; // connections in accept_wait
     uint8_t is_listening;
 } tcp_socket_binder_t;
 
 struct tcp_socket
 {
-    list_node_t list;
+    list_node_t list; // accept_wait of binder
+    tcp_socket_t *hash_next;
+    tcp_socket_t *pending_next;
+    tcp_socket_t *timer_next;
+    tcp_socket_binder_t *binder;
     uint8_t state;
     uint16_t port;
     network_device_t *net_dev;
+    ip4_addr_t local_host;
     ip4_addr_t remote_host;
     uint16_t remote_port;
-    uint32_t seq_number;
+    uint32_t seq_number; // next sequence number to send, goes back to snd_una on retransmission timeout
     uint32_t ack_number;
-    uint32_t remote_ack_number;
+    uint32_t snd_una; // oldest unacknowledged sequence number, first byte of transmit_buffer
+    uint32_t snd_max; // highest sequence number sent
     uint32_t remote_window_size;
     buffer_t *transmit_buffer;
     buffer_t *receive_buffer;
-    ring_t *ring;
-    uint32_t ttl;
+    ring_t *ring; // received segments, processed by TCP worker
+    volatile uint32_t rx_buffers; // pool buffers queued in ring
+    uint32_t ttl; // deadline of TIME_WAIT or retransmission timer
+    // congestion control (NewReno) and RTT estimation (RFC 6298), sizes in bytes, times in ms
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t recover; // snd_max when fast recovery started
+    uint32_t srtt; // smoothed RTT << 3
+    uint32_t rttvar; // RTT variation << 2
+    uint32_t rto;
+    uint32_t rtt_seq; // ack number which acknowledges the timed segment
+    uint32_t rtt_start;
+    uint8_t rtt_timing;
+    uint8_t rtt_measured;
+    uint8_t dup_acks;
+    uint8_t in_recovery;
+    uint8_t retransmits;
+    uint8_t fin_sent;
+    uint8_t probe; // send one byte into zero window
+    // negotiated in SYN
+    uint16_t mss; // payload of a segment, options excluded
+    uint8_t snd_window_scale;
+    uint8_t rcv_window_scale;
+    uint8_t sack_ok;
+    uint8_t ts_ok;
+    uint32_t ts_recent; // timestamp to echo
+    // received segments beyond ack_number, sorted by sequence number
+    net_buffer_t *ooo_queue;
+    uint32_t ooo_count;
+    volatile uint32_t ooo_buffers; // pool buffers held by ooo_queue
+    uint32_t ooo_last_seq; // reported in the first SACK block
+    // SACK scoreboard of sent data
+    uint8_t sack_count;
+    uint32_t sack_left[TCP_MAX_SACK_BLOCKS];
+    uint32_t sack_right[TCP_MAX_SACK_BLOCKS];
+    uint32_t rexmit_next; // next hole is searched from here in fast recovery
+    uint8_t pending; // TCP_PENDING_* flags
+    uint8_t queued; // is in worker queue
+    uint8_t timer_armed;
+    uint8_t hashed;
+    uint8_t in_accept_queue;
+    uint8_t half_open; // counted in syn_count of binder
+    uint8_t owned; // returned by accept or connect and not closed yet, so it isn't freed by TCP worker
+    wait_queue_t wait; // readers and connect() wait for data or state change
 };
 
 void init_tcp_protocol();
 uint8_t tcp_bind(network_device_t* net_dev, uint16_t port, tcp_socket_binder_t **out);
 uint8_t tcp_connect(network_device_t *net_dev, ip4_addr_t *ip, uint16_t port, tcp_socket_binder_t *binder, tcp_socket_t **out);
-void process_tcp_packet(network_device_t *net_dev, void* packet);
+void process_tcp_packet(network_device_t *net_dev, net_buffer_t *buffer);
 uint32_t read_from_tcp_socket(tcp_socket_t *socket, void *buffer, uint32_t size, uint32_t timeout);
 uint8_t close_tcp_connection(tcp_socket_t *socket);
 uint8_t write_to_tcp_socket(tcp_socket_t *socket, void *buffer, uint32_t size);
-uint8_t tcp_listen(tcp_socket_binder_t *binder);
+uint32_t write_all_to_tcp_socket(tcp_socket_t *socket, void *buffer, uint32_t size);
+uint8_t tcp_listen(tcp_socket_binder_t *binder, int backlog);
+void release_tcp_binder(tcp_socket_binder_t *binder);
 uint8_t accept_tcp_connection(tcp_socket_binder_t *binder, tcp_socket_t **out, uint32_t timeout);
+uint32_t tcp_poll_events(tcp_socket_t *socket);
+uint32_t tcp_binder_poll_events(tcp_socket_binder_t *binder);
 
 #endif
@@ -3,6 +3,7 @@
 
 #include "vfs.h"
 #include "buffer.h"
+#include "wait_queue.h"
 
 #define MAX_PTY_STR_LENGTH 4096
 #define MAX_PTY_COUNT 100
@@ -19,6 +20,8 @@ typedef struct pty
     uint32_t input_buffer_pos;
     buffer_t *in;
     buffer_t *out;
+    wait_queue_t in_wait; // slave readers
+    wait_queue_t out_wait; // master readers
     uint32_t flags;
     int ct_group_id;
 } pty_t;
@@ -5,13 +5,22 @@
 #include "network.h"
 #include "ip.h"
 #include "ring.h"
+#include "wait_queue.h"
 
 #define UDP_SOCKET_SUCCESS 0
 #define UDP_SOCKET_PORT_BUSY 1
 #define UDP_SOCKET_TIMEOUT 2
 #define UDP_SOCKET_TOO_BIG_PACKET 3
+#define UDP_SOCKET_NO_BUFFER 4
+#define UDP_SOCKET_NO_ROUTE 5
 
 #define UDP_SOCKET_RING_SIZE 128
+// buckets of socket hash table, power of 2
+#define UDP_HASH_SIZE 256
+// port 0 given to create_udp_socket() takes a free one from this range
+#define UDP_EPHEMERAL_PORT_FIRST 49152
+#define UDP_EPHEMERAL_PORT_LAST 0xFFFE
+#define UDP_WAIT_FOREVER 0xFFFFFFFF
 
 typedef struct udp_header
 {
@@ -30,18 +39,23 @@ typedef struct udp_packet
 
 typedef struct udp_socket
 {
+    struct udp_socket *hash_next;
     ring_t *receive_ring;
+    volatile uint32_t rx_buffers; // pool buffers queued in receive_ring
     uint16_t port;
     network_device_t *net_dev;
     udp_packet_t* (*receive)(struct udp_socket*, uint32_t);
     void (*free)(struct udp_socket*);
+    wait_queue_t wait; // woken when a packet is queued
 } udp_socket_t;
 
 uint8_t send_udp_packet(udp_socket_t *socket, ip4_addr_t* ip, uint16_t port, void *payload, size_t size);
 uint8_t create_udp_socket(network_device_t *net_dev, uint16_t port, udp_socket_t **out);
 void init_udp_protocol();
 void release_udp_socket(udp_socket_t *socket);
-void process_udp_packet(network_device_t *net_dev, void *packet);
-uint8_t receive_udp_packet(udp_socket_t *socket, uint32_t timeout, void **buffer);
+void process_udp_packet(network_device_t *net_dev, net_buffer_t *buffer);
+uint8_t receive_udp_packet(udp_socket_t *socket, uint32_t timeout, net_buffer_t **buffer);
+uint32_t receive_udp_packets(udp_socket_t *socket, net_buffer_t **buffers, uint32_t count, uint32_t timeout);
+uint32_t udp_poll_events(udp_socket_t *socket);
 
 #endif
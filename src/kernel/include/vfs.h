@@ -21,6 +21,8 @@ typedef int32_t file_descriptor_t;
 typedef struct vfs_file vfs_file_t;
 typedef struct vfs_file_operations vfs_file_operations_t;
 typedef struct vfs_node_operations vfs_node_operations_t;
+struct poll_table;
+struct epoll_item;
 
 
 typedef uint16_t gid_t;
@@ -47,8 +49,18 @@ struct timespec {
 #define		_IFSOCK	0140000	/* socket */
 #define		_IFIFO	0010000	/* fifo */
 
+#define O_RDONLY 0x0000
+#define O_WRONLY 0x0001
+#define O_RDWR 0x0002
+#define O_ACCMODE 0x0003
 #define	O_CREAT 0x0200
 #define O_APPEND 0x0008
+#define O_NONBLOCK 0x4000
+/*
+ * File status flags which can be changed by F_SETFL. Unlike POSIX they belong to the descriptor: dup_file() copies
+ * vfs_file_t (the offset too), so F_SETFL on one descriptor doesn't change its duplicates or the ones inherited by fork.
+ */
+#define O_SETFL_MASK (O_APPEND | O_NONBLOCK)
 
 #define S_IFMT 0170000	/* type of file */
 #define S_IFDIR 0040000	/* directory */
@@ -128,6 +140,7 @@ struct vfs_file_operations
     int (*readdir)(vfs_file_t*, struct dirent*, uint32_t*);
     int (*write)(vfs_file_t*, void*, uint32_t, uint32_t*);
     int (*close)(vfs_file_t*);
+    uint32_t (*poll)(vfs_file_t*, struct poll_table*); // POLL* readiness mask, see poll.h
 };
 
 struct vfs_node
@@ -161,11 +174,13 @@ struct vfs_file
     vfs_node_t *node;
     vfs_file_operations_t *ops;
     uint32_t pid;
-    int flags;
+    int flags; // descriptor flags (FD_CLOEXEC)
+    uint32_t status_flags; // O_* flags given to open() or F_SETFL, not shared with duplicates (see O_SETFL_MASK)
     uint32_t pos;
     mutex_t mutex;
     int opened;
     int volatile ref_count;
+    struct epoll_item *epoll_items; // epoll instances watching this file
 };
 
 int register_fs(struct vfs_fs_type *fs);
@@ -175,6 +190,8 @@ int mkdir(char *path);
 file_descriptor_t sys_open(char *path, int flags);
 int sys_read(file_descriptor_t fd, void *buf, uint32_t size);
 int sys_write(file_descriptor_t fd, void *buf, uint32_t size);
+int sys_pread(file_descriptor_t fd, void *buf, uint32_t size, uint32_t offset);
+int sys_pwrite(file_descriptor_t fd, void *buf, uint32_t size, uint32_t offset);
 int sys_close(file_descriptor_t fd);
 int create_vfs_node(char *path, mode_t mode, vfs_file_operations_t *file_ops, void *obj, vfs_node_t **out);
 int stat_fs(char *path, struct stat *buf);
@@ -185,4 +202,9 @@ int symlink(char *path, char *target_path);
 int lseek(file_descriptor_t fd, int offset, int whence);
 int dup2(file_descriptor_t old, file_descriptor_t new);
 struct vfs_file *get_file(file_descriptor_t fd);
+vfs_file_t *dup_file(vfs_file_t *file);
+int open_anonymous_file(char *name, mode_t mode, vfs_file_operations_t *ops, void *obj);
+
+// read or write which can't be done immediately returns -EAGAIN instead of sleeping
+#define FILE_NONBLOCK(file) ((file)->status_flags & O_NONBLOCK)
 #endif
@@ -0,0 +1,38 @@
+#ifndef H_WAIT_QUEUE
+#define H_WAIT_QUEUE
+
+#include <stdint.h>
+#include "list.h"
+
+#define WAIT_ANY_KEY 0
+
+struct thread;
+
+typedef struct wait_queue {
+    struct wait_entry *entries;
+} wait_queue_t;
+
+/*
+ * Usually lives on the stack of a sleeping thread. Thread keeps a chain of its entries (next), so killer() can
+ * remove them from queues before stack is freed. Callback entries (epoll) have no thread and stay in queue.
+ */
+struct wait_entry {
+    list_node_t list;
+    struct thread *thread;
+    wait_queue_t *queue;
+    uint32_t key;
+    volatile uint8_t woken;
+    struct wait_entry *next;
+    void (*callback)(struct wait_entry*);
+    void *private;
+};
+
+void wait_queue_add(wait_queue_t *wq, struct wait_entry *entry, uint32_t key);
+void wait_queue_add_callback(wait_queue_t *wq, struct wait_entry *entry, void (*callback)(struct wait_entry*), void *private);
+void wait_queue_remove(struct wait_entry *entry);
+int wake_up(wait_queue_t *wq, uint32_t key, int count);
+void wait_queue_cancel(struct thread *thread);
+int wait_event(wait_queue_t *wq, uint32_t key, uint32_t timeout);
+int wait_entries(struct wait_entry *entries, uint32_t count, uint32_t timeout);
+
+#endif
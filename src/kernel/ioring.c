@@ -0,0 +1,136 @@
+#include "ioring.h"
+#include "task.h"
+#include "mm.h"
+#include "vfs.h"
+#include "irq.h"
+#include "errno.h"
+#include "string.h"
+#include "system.h"
+#include <stddef.h>
+
+_Static_assert(IORING_ADDR == USERSPACE_IORING, "ioring.h address doesn't match system.h");
+_Static_assert(IORING_SQES_OFFSET + IORING_MAX_ENTRIES * sizeof(struct ioring_sqe) <= IORING_CQES_OFFSET,
+        "submission queue doesn't fit");
+_Static_assert(IORING_CQES_OFFSET + 2 * IORING_MAX_ENTRIES * sizeof(struct ioring_cqe) <= IORING_SIZE,
+        "completion queue doesn't fit");
+
+static int ioring_execute(struct ioring_sqe *sqe)
+{
+    switch (sqe->opcode) {
+        case IORING_OP_NOP:
+            return 0;
+        case IORING_OP_READ:
+            if (sqe->offset == IORING_OFFSET_CURRENT) {
+                return sys_read(sqe->fd, (void*)sqe->addr, sqe->len);
+            }
+            return sys_pread(sqe->fd, (void*)sqe->addr, sqe->len, sqe->offset);
+        case IORING_OP_WRITE:
+            if (sqe->offset == IORING_OFFSET_CURRENT) {
+                return sys_write(sqe->fd, (void*)sqe->addr, sqe->len);
+            }
+            return sys_pwrite(sqe->fd, (void*)sqe->addr, sqe->len, sqe->offset);
+        case IORING_OP_OPEN:
+            return sys_open((char*)sqe->addr, sqe->len);
+        case IORING_OP_CLOSE:
+            return sys_close(sqe->fd);
+        case IORING_OP_STAT:
+            return stat_fs((char*)sqe->addr, (struct stat*)sqe->addr2);
+        case IORING_OP_READDIR:
+            return sys_readdir(sqe->fd, (struct dirent*)sqe->addr);
+        default:
+            return -EINVAL;
+    }
+}
+
+/*
+ * Kernel thread of the process, so VFS calls see its file table and userspace buffers are addressable.
+ * It's killed together with the process (or by execve), blocking operations don't block user threads.
+ */
+static void ioring_worker()
+{
+    struct process *p = current_process;
+    struct ioring *ring = p->ioring;
+    struct ioring_sqe *sqes = ioring_sqes(ring);
+    struct ioring_cqe *cqes = ioring_cqes(ring);
+
+    while (true) {
+        cli();
+        // no work or no room for completion, ring_enter() wakes us up
+        if (ring->sq_head == ring->sq_tail || ring->cq_tail - ring->cq_head > p->ioring_cq_mask) {
+            wait_event(&p->ioring_sq_queue, WAIT_ANY_KEY, 0);
+            continue;
+        }
+        sti();
+
+        // copy, userspace may reuse the slot as soon as sq_head moves
+        struct ioring_sqe sqe = sqes[ring->sq_head & p->ioring_sq_mask];
+        __sync_synchronize();
+        ring->sq_head++;
+
+        int res = ioring_execute(&sqe);
+
+        struct ioring_cqe *cqe = &cqes[ring->cq_tail & p->ioring_cq_mask];
+        cqe->user_data = sqe.user_data;
+        cqe->res = res;
+        __sync_synchronize();
+        ring->cq_tail++;
+        wake_up(&p->ioring_cq_queue, WAIT_ANY_KEY, 0);
+    }
+}
+
+// maps the ring at IORING_ADDR and starts the worker, returns address of struct ioring
+int ring_setup(uint32_t entries)
+{
+    if (entries == 0 || entries > IORING_MAX_ENTRIES || (entries & (entries - 1)) != 0) {
+        return -EINVAL;
+    }
+    if (current_process->ioring != NULL) {
+        return -EBUSY;
+    }
+
+    for (uint32_t addr = IORING_ADDR; addr < IORING_ADDR + IORING_SIZE; addr += 0x1000) {
+        // fork() copies pages of the parent's ring, reuse them
+        if (get_physical_address(addr) == 0) {
+            map_virtual_to_physical(addr, alloc_physical_page(), 0);
+        }
+        memset((void*)addr, 0, 0x1000);
+    }
+
+    struct ioring *ring = (struct ioring*)IORING_ADDR;
+    ring->sq_entries = entries;
+    ring->cq_entries = entries * 2;
+    current_process->ioring_sq_mask = entries - 1;
+    current_process->ioring_cq_mask = entries * 2 - 1;
+    current_process->ioring = ring;
+    start_thread(ioring_worker, 0);
+
+    return IORING_ADDR;
+}
+
+/*
+ * Kicks the worker to consume submitted entries and waits until at least min_complete completions are
+ * available. Returns number of available completions.
+ */
+int ring_enter(uint32_t min_complete)
+{
+    struct process *p = current_process;
+    struct ioring *ring = p->ioring;
+    if (ring == NULL) {
+        return -EINVAL;
+    }
+    if (min_complete > p->ioring_cq_mask + 1) {
+        min_complete = p->ioring_cq_mask + 1;
+    }
+
+    wake_up(&p->ioring_sq_queue, WAIT_ANY_KEY, 0);
+
+    while (true) {
+        cli();
+        uint32_t ready = ring->cq_tail - ring->cq_head;
+        if (ready >= min_complete) {
+            sti();
+            return ready;
+        }
+        wait_event(&p->ioring_cq_queue, WAIT_ANY_KEY, 0);
+    }
+}
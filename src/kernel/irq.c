@@ -4,6 +4,9 @@
 #include "port.h"
 #include "string.h"
 #include "system.h"
+#include "softirq.h"
+#include "apic.h"
+#include <stdbool.h>
 
 static struct idt_entry idt[256];
 static struct idt idt_descriptor;
@@ -59,6 +62,23 @@ extern void _irq44();
 extern void _irq45();
 extern void _irq46();
 extern void _irq47();
+extern void _irq48();
+extern void _irq49();
+extern void _irq50();
+extern void _irq51();
+extern void _irq52();
+extern void _irq53();
+extern void _irq54();
+extern void _irq55();
+extern void _irq56();
+extern void _irq57();
+extern void _irq58();
+extern void _irq59();
+extern void _irq60();
+extern void _irq61();
+extern void _irq62();
+extern void _irq63();
+extern void _irq255();
 extern void _irq128();
 
 static const char *ex_messages[32] = {
@@ -96,23 +116,56 @@ static const char *ex_messages[32] = {
     "Reserved"
 };
 
+static bool is_hardware_irq(uint32_t int_num)
+{
+    return int_num >= IRQ_VECTOR_BASE && int_num <= DYNAMIC_VECTOR_LAST;
+}
+
+static void send_eoi(uint32_t int_num)
+{
+    if (apic_enabled()) {
+        apic_eoi();
+        return;
+    }
+    if (int_num >= 40) {
+        outb(0xA0, 0x20);
+    }
+    outb(0x20, 0x20);
+}
+
+/*
+ * Hardware IRQ handlers are top halves: they run with interrupts disabled (interrupt gate) and can't nest, heavy work
+ * is deferred to softirqs/tasklets which run here with interrupts enabled. CPU exceptions and syscalls run with
+ * interrupts enabled, so hardware IRQs can arrive in the middle of them.
+ */
 void irq_handler(struct regs *r)
 {
-    sti(); // TODO: is it safe to do sti() here? Nested IRQ support must be implemented
-    if (irq_handlers[r->int_num] != NULL) {
-        irq_handlers[r->int_num](r);
-    } else if (r->int_num < 32) {
-        log(KERN_FATAL, "unhandled CPU exception: %s, EIP: %x\n", ex_messages[r->int_num], r->eip);
-        hlt();
+    // LAPIC doesn't expect EOI for spurious interrupt
+    if (r->int_num == SPURIOUS_VECTOR) {
+        return;
     }
 
-    if (r->int_num >= 32 || r->int_num <= 47) {
-        if (r->int_num >= 40) {
-            outb(0xA0, 0x20);
+    if (is_hardware_irq(r->int_num)) {
+        if (irq_handlers[r->int_num] != NULL) {
+            irq_handlers[r->int_num](r);
+        }
+        send_eoi(r->int_num);
+        do_softirq();
+        sti();
+    } else {
+        sti();
+        if (irq_handlers[r->int_num] != NULL) {
+            irq_handlers[r->int_num](r);
+        } else if (r->int_num < 32) {
+            log(KERN_FATAL, "unhandled CPU exception: %s, EIP: %x\n", ex_messages[r->int_num], r->eip);
+            hlt();
         }
-        outb(0x20, 0x20);
     }
-    switch_task();
+
+    // a bottom half interrupted here must finish on this stack, otherwise softirqs would stay disabled
+    if (preemptible()) {
+        switch_task();
+    }
 }
 
 static void set_irq_gate(uint8_t number, void *handler)
@@ -129,6 +182,11 @@ void set_irq_handler(uint8_t number, void *handler)
     irq_handlers[number] = handler;
 }
 
+void *get_irq_handler(uint8_t number)
+{
+    return irq_handlers[number];
+}
+
 static void irq_remap()
 {
     outb(0x20, 0x11);
@@ -146,6 +204,7 @@ static void irq_remap()
 void init_irq()
 {
     irq_remap();
+    init_softirq();
 
     memset(&irq_handlers, 0, sizeof(isr_t) * 256);
 
@@ -201,6 +260,23 @@ void init_irq()
     set_irq_gate(45, _irq45);
     set_irq_gate(46, _irq46);
     set_irq_gate(47, _irq47);
+    set_irq_gate(48, _irq48);
+    set_irq_gate(49, _irq49);
+    set_irq_gate(50, _irq50);
+    set_irq_gate(51, _irq51);
+    set_irq_gate(52, _irq52);
+    set_irq_gate(53, _irq53);
+    set_irq_gate(54, _irq54);
+    set_irq_gate(55, _irq55);
+    set_irq_gate(56, _irq56);
+    set_irq_gate(57, _irq57);
+    set_irq_gate(58, _irq58);
+    set_irq_gate(59, _irq59);
+    set_irq_gate(60, _irq60);
+    set_irq_gate(61, _irq61);
+    set_irq_gate(62, _irq62);
+    set_irq_gate(63, _irq63);
+    set_irq_gate(255, _irq255);
     set_irq_gate(128, _irq128);
 
     asm("lidt idt_descriptor");
@@ -0,0 +1,96 @@
+#include "kernel_data.h"
+#include "task.h"
+#include "mm.h"
+#include "pit.h"
+#include "msr.h"
+#include "log.h"
+#include "liballoc.h"
+#include "string.h"
+#include "system.h"
+#include <stdbool.h>
+
+#define TSC_CALIBRATION_TICKS 60
+
+_Static_assert(KERNEL_DATA_ADDR == USERSPACE_KDATA, "kernel_data.h address doesn't match system.h");
+
+static struct kernel_data *kernel_data = NULL;
+static uint32_t kernel_data_phys = 0;
+static bool tsc_supported = false;
+
+// ~50ms busy wait, interrupts must be enabled
+static uint32_t calibrate_tsc()
+{
+    uint32_t start_tick = get_pit_ticks();
+    while (get_pit_ticks() == start_tick);
+
+    start_tick = get_pit_ticks();
+    uint64_t start = rdtsc();
+    while (get_pit_ticks() - start_tick < TSC_CALIBRATION_TICKS);
+    uint32_t cycles = (uint32_t)(rdtsc() - start);
+
+    // no 64 bit division in kernel, cycles per tick * ticks per second / 1000
+    return cycles / TSC_CALIBRATION_TICKS / 8 * TICK_FREQUENCY / 125;
+}
+
+void init_kernel_data()
+{
+    void *chunk = kmalloc(0x2000);
+    memset(chunk, 0, 0x2000);
+    struct kernel_data *data = (struct kernel_data*)PAGE_ALIGN((uint32_t)chunk);
+    kernel_data_phys = get_physical_address((uint32_t)data);
+    data->tick_frequency = TICK_FREQUENCY;
+
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    tsc_supported = (edx & (1 << 4)) != 0;
+    if (tsc_supported) {
+        data->tsc_khz = calibrate_tsc();
+        log(KERN_INFO, "TSC frequency %i kHz\n", data->tsc_khz);
+    }
+
+    kernel_data = data;
+}
+
+// called by PIT handler
+void kernel_data_tick(uint32_t ticks)
+{
+    if (kernel_data == NULL) {
+        return;
+    }
+
+    kernel_data->seq++;
+    kernel_data->ticks = ticks;
+    if (tsc_supported) {
+        kernel_data->tick_tsc = rdtsc();
+    }
+    kernel_data->seq++;
+}
+
+void alloc_process_data(struct process *p)
+{
+    p->data_chunk = kmalloc(0x2000);
+    memset(p->data_chunk, 0, 0x2000);
+    p->data = (struct process_data*)PAGE_ALIGN((uint32_t)p->data_chunk);
+}
+
+void free_process_data(struct process *p)
+{
+    if (p->data_chunk != NULL) {
+        kfree(p->data_chunk);
+        p->data_chunk = NULL;
+        p->data = NULL;
+    }
+}
+
+// process page directory must be ready, data is refreshed from process fields
+void map_kernel_data(struct process *p)
+{
+    assert(kernel_data != NULL && p->data != NULL);
+
+    p->data->pid = p->id;
+    p->data->ppid = p->parent_id;
+    p->data->gid = p->group_id;
+
+    map_user_page_ro(p->page_dir, KERNEL_DATA_ADDR, kernel_data_phys);
+    map_user_page_ro(p->page_dir, PROCESS_DATA_ADDR, get_physical_address((uint32_t)p->data));
+}
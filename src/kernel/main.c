@@ -13,7 +13,10 @@
 #include "tests.h"
 #include "network.h"
 #include "dhcp.h"
+#include "arp.h"
+#include "udp.h"
 #include "tcp.h"
+#include "loopback.h"
 #include "vfs.h"
 #include "tempfs.h"
 #include "fat16fs.h"
@@ -25,6 +28,7 @@
 #include "shm.h"
 #include "tss.h"
 #include "gdt.h"
+#include "apic.h"
 
 void init_events();
 void setup_syscalls();
@@ -38,7 +42,9 @@ extern char bss_end;
 void init_serial();
 void init_urandom();
 void init_null();
+void init_pcap();
 void init_io();
+void init_kernel_data();
 
 struct event_mdm {
     struct event_data event;
@@ -79,7 +85,9 @@ void main()
     memcpy(ptr, kernel_params, size);
     kernel_params = ptr;
 
+    init_apic();
     init_pit();
+    init_kernel_data();
     init_multitasking();
     init_timer();
     init_shm();
@@ -96,18 +104,23 @@ void main()
     init_serial();
     init_urandom();
     init_null();
+    init_pcap();
 
+    init_net_buffers();
+    // drivers start receiving in init_pci_devices(), so protocols must be ready before it
+    init_arp_protocol();
+    init_udp_protocol();
+    init_tcp_protocol();
     init_pci_devices();
     init_fat16fs();
     init_screen();
     init_keyboard();
     init_mem();
+    init_loopback();
     /*pci_device_t *dev = get_pci_device_by_class(PCI_CLASS_NETWORK_CONTROLLER);
     network_device_t *net_dev = (network_device_t*)dev->logical_driver;
     if (net_dev != 0)
     {
-        init_udp_protocol();
-        init_tcp_protocol();
         net_dev->enable(net_dev);
         uint8_t result = configure_dhcp(net_dev);
         if (result != DHCP_OK)
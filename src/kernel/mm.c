@@ -205,12 +205,34 @@ void map_virtual_to_physical(uint32_t virtual, uint32_t physical, uint8_t flags)
     asm volatile("invlpg (%0)" ::"r" (virtual) : "memory");
 
     // MUST IGNORE CALLS FOR KERNEL MEMORY, fix me
-    // also must ignore shared memory space
-    if ((uint32_t)current_process->brk <= virtual && virtual < 0xE1C00000 && virtual < USERSPACE_SHARED_MEM) {
+    // also must ignore kernel data, thread stacks and shared memory space
+    if ((uint32_t)current_process->brk <= virtual && virtual < 0xE1C00000 && virtual < USERSPACE_BRK_LIMIT) {
         current_process->brk = (void*)virtual + 0x1000;
     }
 }
 
+// read-only user page in any page directory, such pages aren't copied by fork() and freed by free_userspace()
+void map_user_page_ro(page_directory_t *dir, uint32_t virtual, uint32_t physical)
+{
+    uint32_t index = (virtual >> 22);
+    uint32_t page = (virtual >> 12) & 0x03FF;
+
+    if ((dir->directory[index] & 1) == 0) {
+        dir->page_chunks[index] = kmalloc(0x1000 + 0x1000);
+        dir->pages[index] = (uint32_t*)PAGE_ALIGN((uint32_t)dir->page_chunks[index]);
+        for(uint32_t i = 0; i < 1024; i++) {
+            dir->pages[index][i] = 2;
+        }
+
+        dir->directory[index] = get_physical_address((uint32_t)dir->pages[index]) | 7;
+    }
+
+    dir->pages[index][page] = (physical & 0xFFFFF000) | PAGE_PRESENT | PAGE_USER;
+    if (dir == page_directory) {
+        asm volatile("invlpg (%0)" ::"r" (virtual) : "memory");
+    }
+}
+
 void map_virtual_to_physical_range(uint32_t virtual, uint32_t physical, uint8_t flags, uint16_t count)
 {
     for(uint16_t i = 0; i < count; i++) {
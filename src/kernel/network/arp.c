@@ -5,19 +5,38 @@
 #include "log.h"
 #include "timer.h"
 #include "mutex.h"
+#include "pit.h"
+#include "irq.h"
+#include "task.h"
+#include "wait_queue.h"
 
-// probably arp_cache must be in net_dev, but i have no plans to support machines with 2+ network cards
-arp_entry_t *arp_cache = 0;
+// entries are per device, (device, address) is the key; one table keeps aging in one timer pass
+arp_entry_t *arp_table[ARP_HASH_SIZE];
 mutex_t arp_cache_mutex = {0};
+static wait_queue_t arp_timer_queue;
+
+// global request rate limit, requests sent in the current one second window
+static uint32_t rate_window_start = 0;
+static uint32_t rate_window_requests = 0;
+
+static void send_arp_request(network_device_t *net_dev, ip4_addr_t *ip);
 
 void process_arp_request(network_device_t *net_dev, void *packet)
 {
     arp_packet_t *arp_packet = packet;
     if (COMPARE_IP4_ADDR(net_dev->ip4_addr, arp_packet->arp.destination_ip))
     {
+        // sender is going to talk to us, its MAC saves a request in the opposite direction (RFC 826)
+        add_mac_to_arp_cache(net_dev, &arp_packet->arp.source_ip, &arp_packet->arp.source);
+
         // TODO: must be in separate thread or not wait for packet send, because it lock receive thread
         //debug("[arp] Got ARP request for my IP\n");
-        arp_packet_t *reply = kmalloc(sizeof(arp_packet_t));
+        net_buffer_t *buffer = alloc_net_buffer();
+        if (buffer == 0)
+        {
+            return;
+        }
+        arp_packet_t *reply = net_buffer_put(buffer, sizeof(arp_packet_t));
         memset(reply, 0, sizeof(arp_packet_t));
         reply->arp.hardware_type = bswap16(1);
         reply->arp.protocol = bswap16(PROTOCOL_IP);
@@ -33,16 +52,20 @@ void process_arp_request(network_device_t *net_dev, void *packet)
         reply->eth.source = net_dev->mac;
         reply->eth.type = bswap16(PROTOCOL_ARP);
 
-        net_dev->send_packet(net_dev, reply, sizeof(arp_packet_t));
-        kfree(reply);
+        net_dev->send_packet(net_dev, buffer);
     }
 }
 
-void send_arp_request(network_device_t *net_dev, ip4_addr_t *ip)
+static void send_arp_request(network_device_t *net_dev, ip4_addr_t *ip)
 {
     eth_addr_t mac_empty = ETH_ADDR_EMPTY;
 
-    arp_packet_t *packet = kmalloc(sizeof(arp_packet_t));
+    net_buffer_t *buffer = alloc_net_buffer();
+    if (buffer == 0)
+    {
+        return;
+    }
+    arp_packet_t *packet = net_buffer_put(buffer, sizeof(arp_packet_t));
     memset(packet, 0, sizeof(arp_packet_t));
     packet->arp.hardware_type = bswap16(ARP_HARDWARE_TYPE_ETHERNET);
     packet->arp.protocol = bswap16(PROTOCOL_IP);
@@ -59,50 +82,151 @@ void send_arp_request(network_device_t *net_dev, ip4_addr_t *ip)
     packet->eth.source = net_dev->mac;
     packet->eth.type = bswap16(PROTOCOL_ARP);
 
-    net_dev->send_packet(net_dev, packet, sizeof(arp_packet_t));
+    net_dev->send_packet(net_dev, buffer);
 }
 
-void add_mac_to_arp_cache(ip4_addr_t *ip, eth_addr_t *mac)
+static uint32_t arp_hash(network_device_t *net_dev, const ip4_addr_t *ip)
 {
-    mutex_lock(&arp_cache_mutex);
-    arp_entry_t *current = arp_cache;
-    while(current != 0)
+    uint32_t addr = ip->addr ^ ((uint32_t)net_dev >> 4);
+    return (addr ^ (addr >> 8) ^ (addr >> 16) ^ (addr >> 24)) & (ARP_HASH_SIZE - 1);
+}
+
+// arp_cache_mutex must be held
+static arp_entry_t *find_entry(network_device_t *net_dev, const ip4_addr_t *ip)
+{
+    for (arp_entry_t *entry = arp_table[arp_hash(net_dev, ip)]; entry != 0; entry = entry->next)
     {
-        if (COMPARE_IP4_ADDR(current->ip_addr, *ip))
+        if (entry->net_dev == net_dev && COMPARE_IP4_ADDR(entry->ip_addr, *ip))
         {
-            current->mac = *mac;
-            mutex_release(&arp_cache_mutex);
-            return;
+            return entry;
         }
-        current = (arp_entry_t*)current->list.next;
     }
-    arp_entry_t *node = kmalloc(sizeof(arp_entry_t));
-    memset(node, 0, sizeof(arp_entry_t));
-    node->ip_addr = *ip;
-    node->mac = *mac;
-    add_to_list(arp_cache, node);
+    return 0;
+}
+
+// arp_cache_mutex must be held
+static arp_entry_t *create_entry(network_device_t *net_dev, const ip4_addr_t *ip, uint8_t state)
+{
+    arp_entry_t *entry = kmalloc(sizeof(arp_entry_t));
+    memset(entry, 0, sizeof(arp_entry_t));
+    entry->net_dev = net_dev;
+    entry->ip_addr = *ip;
+    entry->state = state;
+    uint32_t bucket = arp_hash(net_dev, ip);
+    entry->next = arp_table[bucket];
+    arp_table[bucket] = entry;
+    return entry;
+}
+
+// arp_cache_mutex must be held, pending packets are dropped
+static void remove_entry(arp_entry_t **link)
+{
+    arp_entry_t *entry = *link;
+    *link = entry->next;
+    while (entry->pending != 0)
+    {
+        net_buffer_t *buffer = entry->pending;
+        entry->pending = buffer->next;
+        buffer->next = 0;
+        release_net_buffer(buffer);
+    }
+    kfree(entry);
+}
+
+// arp_cache_mutex must be held, reachable entry becomes stale when it isn't confirmed for ARP_REACHABLE_TIME
+static void age_entry(arp_entry_t *entry, uint32_t now)
+{
+    if (entry->state == ARP_ENTRY_REACHABLE && now - entry->confirmed > ms_to_ticks(ARP_REACHABLE_TIME))
+    {
+        entry->state = ARP_ENTRY_STALE;
+        entry->requests = 0;
+    }
+}
+
+/*
+ * arp_cache_mutex must be held. Requests for one address are ARP_REQUEST_INTERVAL apart and all requests together
+ * are limited by ARP_MAX_REQUEST_RATE, so a burst of packets to unknown hosts doesn't flood the network.
+ */
+static uint8_t request_allowed(arp_entry_t *entry, uint32_t now)
+{
+    if (entry->requests > 0 && now - entry->requested < ms_to_ticks(ARP_REQUEST_INTERVAL))
+    {
+        return 0;
+    }
+    if (now - rate_window_start >= TICK_FREQUENCY)
+    {
+        rate_window_start = now;
+        rate_window_requests = 0;
+    }
+    if (rate_window_requests >= ARP_MAX_REQUEST_RATE)
+    {
+        return 0;
+    }
+    rate_window_requests++;
+    entry->requests++;
+    entry->requested = now;
+    return 1;
+}
+
+// sends packets which waited for the MAC, they have everything but ethernet destination
+static void flush_pending(network_device_t *net_dev, net_buffer_t *buffer, eth_addr_t *mac)
+{
+    while (buffer != 0)
+    {
+        net_buffer_t *next = buffer->next;
+        buffer->next = 0;
+        ((eth_header_t*)buffer->data)->destination = *mac;
+        net_dev->send_packet(net_dev, buffer);
+        buffer = next;
+    }
+}
+
+// called for replies and requests addressed to us, entry becomes reachable and its queue is sent
+void add_mac_to_arp_cache(network_device_t *net_dev, ip4_addr_t *ip, eth_addr_t *mac)
+{
+    mutex_lock(&arp_cache_mutex);
+    arp_entry_t *entry = find_entry(net_dev, ip);
+    if (entry == 0)
+    {
+        entry = create_entry(net_dev, ip, ARP_ENTRY_REACHABLE);
+    }
+    entry->mac = *mac;
+    entry->state = ARP_ENTRY_REACHABLE;
+    entry->requests = 0;
+    entry->confirmed = get_pit_ticks();
+    net_buffer_t *pending = entry->pending;
+    entry->pending = 0;
+    entry->pending_tail = 0;
+    entry->pending_count = 0;
     mutex_release(&arp_cache_mutex);
+
+    if (pending != 0)
+    {
+        flush_pending(net_dev, pending, mac);
+    }
 }
 
-uint8_t get_mac_from_cache(const ip4_addr_t *ip, eth_addr_t *out)
+// stale MAC is returned as well, it's still the best guess
+uint8_t get_mac_from_cache(network_device_t *net_dev, const ip4_addr_t *ip, eth_addr_t *out)
 {
     mutex_lock(&arp_cache_mutex);
-    arp_entry_t *current = arp_cache;
-    while(current != 0)
+    arp_entry_t *entry = find_entry(net_dev, ip);
+    uint8_t found = entry != 0 && entry->state != ARP_ENTRY_INCOMPLETE;
+    if (found)
     {
-        if (COMPARE_IP4_ADDR(current->ip_addr, *ip))
-        {
-            *out = current->mac;
-            mutex_release(&arp_cache_mutex);
-            return 1;
-        }
-        current = (arp_entry_t*)current->list.next;
+        age_entry(entry, get_pit_ticks());
+        *out = entry->mac;
     }
     mutex_release(&arp_cache_mutex);
-    return 0;
+    return found;
 }
 
-uint8_t get_mac_by_ip(network_device_t *net_dev, ip4_addr_t *ip, eth_addr_t *out)
+/*
+ * ip is the next hop chosen by routing and must be on the link of net_dev. Doesn't block. Returns 1 and MAC if it's known. Otherwise request is sent (if rate limit allows) and buffer, if
+ * given, is queued in the entry and sent by add_mac_to_arp_cache() when reply comes, or dropped when entry expires.
+ * Buffer must have complete ethernet header except destination.
+ */
+uint8_t arp_resolve(network_device_t *net_dev, ip4_addr_t *ip, net_buffer_t *buffer, eth_addr_t *out)
 {
     ip4_addr_t broadcast = IP4_ADDR_BROADCAST;
     if (COMPARE_IP4_ADDR(*ip, broadcast))
@@ -112,35 +236,144 @@ uint8_t get_mac_by_ip(network_device_t *net_dev, ip4_addr_t *ip, eth_addr_t *out
         return 1;
     }
 
-    ip4_addr_t needed = *ip;
+    uint32_t now = get_pit_ticks();
+    uint8_t resolved = 0;
+    uint8_t request = 0;
 
-    if (!COMPARE_SUBNETS(*ip, net_dev->ip4_addr, net_dev->subnet_mask))
+    mutex_lock(&arp_cache_mutex);
+    arp_entry_t *entry = find_entry(net_dev, ip);
+    if (entry == 0)
     {
-        needed = net_dev->router;
+        entry = create_entry(net_dev, ip, ARP_ENTRY_INCOMPLETE);
     }
+    age_entry(entry, now);
 
-    uint8_t found = get_mac_from_cache(&needed, out);
-    if (found)
+    if (entry->state == ARP_ENTRY_INCOMPLETE)
     {
-        return 1;
+        if (buffer != 0 && entry->pending_count < ARP_MAX_PENDING)
+        {
+            buffer->next = 0;
+            if (entry->pending_tail != 0)
+            {
+                entry->pending_tail->next = buffer;
+            }
+            else
+            {
+                entry->pending = buffer;
+            }
+            entry->pending_tail = buffer;
+            entry->pending_count++;
+            buffer = 0;
+        }
+        request = request_allowed(entry, now);
     }
+    else
+    {
+        *out = entry->mac;
+        resolved = 1;
+        // stale MAC is confirmed in background, entry is dropped if nobody answers
+        request = entry->state == ARP_ENTRY_STALE && entry->requests < ARP_MAX_REQUESTS && request_allowed(entry, now);
+    }
+    mutex_release(&arp_cache_mutex);
 
-    uint8_t tries = 3;
-    while(tries > 0)
+    if (!resolved && buffer != 0)
     {
-        send_arp_request(net_dev, &needed);
-        uint16_t sub_tries = 100;
-        while(sub_tries > 0)
+        // queue is full
+        release_net_buffer(buffer);
+    }
+    if (request)
+    {
+        send_arp_request(net_dev, ip);
+    }
+    return resolved;
+}
+
+// blocks up to ARP_MAX_REQUESTS request intervals
+uint8_t get_mac_by_ip(network_device_t *net_dev, ip4_addr_t *ip, eth_addr_t *out)
+{
+    uint32_t finish = get_pit_ticks() + ms_to_ticks(ARP_MAX_REQUESTS * ARP_REQUEST_INTERVAL);
+    while (1)
+    {
+        if (arp_resolve(net_dev, ip, 0, out))
         {
-            found = get_mac_from_cache(&needed, out);
-            if (found)
+            return 1;
+        }
+        if (get_pit_ticks() >= finish)
+        {
+            return 0;
+        }
+        sleep(10);
+    }
+}
+
+void flush_arp_cache()
+{
+    mutex_lock(&arp_cache_mutex);
+    for (uint32_t i = 0; i < ARP_HASH_SIZE; i++)
+    {
+        while (arp_table[i] != 0)
+        {
+            remove_entry(&arp_table[i]);
+        }
+    }
+    mutex_release(&arp_cache_mutex);
+}
+
+/*
+ * Retransmits requests of incomplete entries, drops the ones nobody answered together with their packets and
+ * forgets stale entries which weren't confirmed for ARP_GC_TIME.
+ */
+static void arp_timer()
+{
+    while (1)
+    {
+        cli();
+        wait_event(&arp_timer_queue, WAIT_ANY_KEY, ms_to_ticks(ARP_TIMER_INTERVAL));
+
+        uint32_t now = get_pit_ticks();
+        network_device_t *request_devs[ARP_TIMER_REQUESTS];
+        ip4_addr_t request_ips[ARP_TIMER_REQUESTS];
+        uint32_t requests = 0;
+        mutex_lock(&arp_cache_mutex);
+        for (uint32_t i = 0; i < ARP_HASH_SIZE; i++)
+        {
+            arp_entry_t **link = &arp_table[i];
+            while (*link != 0)
             {
-                return 1;
+                arp_entry_t *entry = *link;
+                age_entry(entry, now);
+                uint8_t expired = now - entry->requested >= ms_to_ticks(ARP_REQUEST_INTERVAL);
+                if (entry->state == ARP_ENTRY_INCOMPLETE && entry->requests >= ARP_MAX_REQUESTS && expired)
+                {
+                    remove_entry(link);
+                    continue;
+                }
+                if (entry->state == ARP_ENTRY_STALE
+                    && (now - entry->confirmed > ms_to_ticks(ARP_GC_TIME) || (entry->requests >= ARP_MAX_REQUESTS && expired)))
+                {
+                    remove_entry(link);
+                    continue;
+                }
+                // requests are sent after the table is unlocked, the ones which don't fit wait for the next pass
+                if (entry->state == ARP_ENTRY_INCOMPLETE && requests < ARP_TIMER_REQUESTS && request_allowed(entry, now))
+                {
+                    request_devs[requests] = entry->net_dev;
+                    request_ips[requests] = entry->ip_addr;
+                    requests++;
+                }
+                link = &entry->next;
             }
-            sleep(10);
-            sub_tries--;
         }
-        tries--;
+        mutex_release(&arp_cache_mutex);
+
+        for (uint32_t i = 0; i < requests; i++)
+        {
+            send_arp_request(request_devs[i], &request_ips[i]);
+        }
     }
-    return 0;
+}
+
+void init_arp_protocol()
+{
+    start_thread(arp_timer, 0);
 }
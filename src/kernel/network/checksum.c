@@ -0,0 +1,93 @@
+#include "checksum.h"
+
+// x86 loads unaligned words fine, the type only tells compiler about aliasing and alignment
+typedef uint32_t __attribute__((may_alias, aligned(1))) unaligned_uint32_t;
+typedef uint16_t __attribute__((may_alias, aligned(1))) unaligned_uint16_t;
+
+/*
+ * Adds 32 bit words into 64 bit accumulator, carries are folded once at the end instead of after every addition.
+ * No SSE: kernel doesn't save FPU/SSE state of interrupted threads.
+ */
+uint32_t checksum_partial(const void *data, uint32_t size, uint32_t sum)
+{
+    const uint8_t *p = data;
+    uint64_t acc = sum;
+
+    while (size >= 32) {
+        const unaligned_uint32_t *w = (const unaligned_uint32_t*)p;
+        acc += w[0];
+        acc += w[1];
+        acc += w[2];
+        acc += w[3];
+        acc += w[4];
+        acc += w[5];
+        acc += w[6];
+        acc += w[7];
+        p += 32;
+        size -= 32;
+    }
+    while (size >= 4) {
+        acc += *(const unaligned_uint32_t*)p;
+        p += 4;
+        size -= 4;
+    }
+    if (size >= 2) {
+        acc += *(const unaligned_uint16_t*)p;
+        p += 2;
+        size -= 2;
+    }
+    // odd byte is padded with zero, on little endian it's the low byte of the word
+    if (size > 0) {
+        acc += *p;
+    }
+
+    acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+    acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+    return (uint32_t)acc;
+}
+
+uint32_t checksum_add(uint32_t a, uint32_t b)
+{
+    a += b;
+    return a + (a < b);
+}
+
+// adds partial sum of block which starts at offset of the checksummed data, odd offset swaps bytes of the block
+uint32_t checksum_block_add(uint32_t sum, uint32_t block, uint32_t offset)
+{
+    if (offset & 1) {
+        block = (block >> 8) | (block << 24);
+    }
+    return checksum_add(sum, block);
+}
+
+// 16 bit one's complement sum, not inverted
+uint16_t checksum_fold(uint32_t sum)
+{
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t)sum;
+}
+
+// checksum to store in header
+uint16_t checksum(const void *data, uint32_t size)
+{
+    return ~checksum_fold(checksum_partial(data, size, 0));
+}
+
+// RFC 1624 eqn. 3: HC' = ~(~HC + ~m + m'), values are in the same byte order as the checksum
+uint16_t checksum_update16(uint16_t check, uint16_t old_value, uint16_t new_value)
+{
+    uint32_t sum = (uint16_t)~check + (uint32_t)(uint16_t)~old_value + new_value;
+    return ~checksum_fold(sum);
+}
+
+uint16_t checksum_update32(uint16_t check, uint32_t old_value, uint32_t new_value)
+{
+    uint32_t sum = (uint16_t)~check;
+    sum += (uint16_t)~(old_value & 0xFFFF);
+    sum += (uint16_t)~(old_value >> 16);
+    sum += new_value & 0xFFFF;
+    sum += new_value >> 16;
+    return ~checksum_fold(sum);
+}
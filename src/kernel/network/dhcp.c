@@ -96,16 +96,18 @@ uint8_t configure_dhcp(network_device_t *net_dev)
     ip4_addr_t dest = IP4_ADDR_BROADCAST;
     send_udp_packet(socket, &dest, 67, header, (uint32_t)options - (uint32_t)header);
 
+    net_buffer_t *reply = 0;
     dhcp_packet_t *response = 0;
-    result = receive_udp_packet(socket, 3000, (void*)&response);
+    result = receive_udp_packet(socket, 3000, &reply);
     if (result != UDP_SOCKET_SUCCESS)
     {
         //debug("[dhcp] no reply from server\n");
         release_udp_socket(socket);
         kfree(header);
-        kfree(response);
+        release_net_buffer(reply);
         return DHCP_NO_REPLY;
     }
+    response = (dhcp_packet_t*)reply->data;
 
     uint8_t valid = validate_dhcp_response(response, DHCP_TYPE_OFFER);
     if (valid != DHCP_OK)
@@ -113,7 +115,7 @@ uint8_t configure_dhcp(network_device_t *net_dev)
         //debug("[dhcp] configure error: DISCROVER response error %i\n", valid);
         release_udp_socket(socket);
         kfree(header);
-        kfree(response);
+        release_net_buffer(reply);
         return valid;
     }
 
@@ -127,8 +129,8 @@ uint8_t configure_dhcp(network_device_t *net_dev)
     uint32_t tmp = extract_option(response_options, 54);
     ip4_addr_t dhcp_server = *(ip4_addr_t*)&tmp;
 
-    kfree(response);
-    response = 0;
+    release_net_buffer(reply);
+    reply = 0;
 
     options = (uint8_t*)(header + 1);
     memset(options, 0, 100);
@@ -148,15 +150,16 @@ uint8_t configure_dhcp(network_device_t *net_dev)
     *options++ = 255;
     send_udp_packet(socket, &dest, 67, header, (uint32_t)options - (uint32_t)header);
 
-    result = receive_udp_packet(socket, 3000, (void*)&response);
+    result = receive_udp_packet(socket, 3000, &reply);
     if (result != UDP_SOCKET_SUCCESS)
     {
         //debug("[dhcp] no reply from server\n");
         release_udp_socket(socket);
         kfree(header);
-        kfree(response);
+        release_net_buffer(reply);
         return DHCP_NO_REPLY;
     }
+    response = (dhcp_packet_t*)reply->data;
 
     valid = validate_dhcp_response(response, DHCP_TYPE_ACK);
     if (valid != DHCP_OK)
@@ -164,7 +167,7 @@ uint8_t configure_dhcp(network_device_t *net_dev)
         //debug("[dhcp] configure error: DISCROVER response error %i\n", valid);
         release_udp_socket(socket);
         kfree(header);
-        kfree(response);
+        release_net_buffer(reply);
         return valid;
     }
 
@@ -175,18 +178,14 @@ uint8_t configure_dhcp(network_device_t *net_dev)
         //debug("[dhcp] IP address assigned by DHCP server is already in use.\n");
         release_udp_socket(socket);
         kfree(header);
-        kfree(response);
+        release_net_buffer(reply);
         return DHCP_INVALID_IP;
     }
 
-    mutex_lock(&net_dev->mutex);
-    net_dev->subnet_mask = subnet_mask;
-    net_dev->router = default_router;
-    net_dev->ip4_addr = my_ip;
-    mutex_release(&net_dev->mutex);
+    set_network_address(net_dev, &my_ip, &subnet_mask, &default_router);
 
     release_udp_socket(socket);
     kfree(header);
-    kfree(response);
+    release_net_buffer(reply);
     return DHCP_OK;
 }
@@ -3,45 +3,108 @@
 #include "log.h"
 #include "arp.h"
 #include "string.h"
+#include "checksum.h"
+#include "route.h"
 
-void send_ip4_packet(network_device_t *net_dev, ip4_addr_t* destination, uint8_t protocol, void *packet, size_t size)
+// folded, not inverted sum of pseudo header, it's also the seed hardware expects in TCP/UDP checksum field
+uint16_t ip4_pseudo_checksum(ip4_addr_t *source, ip4_addr_t *destination, uint8_t protocol, uint16_t length)
 {
-    ip_packet_t *ip_packet = packet;
-    memset(&ip_packet->ip, 0, sizeof(ip4_header_t));
+    ip4_pseudo_header_t ps;
+    ps.destination = *destination;
+    ps.source = *source;
+    ps.protocol = protocol;
+    ps.reserved = 0;
+    ps.length = bswap16(length);
+    return checksum_fold(checksum_partial(&ps, sizeof(ip4_pseudo_header_t), 0));
+}
+
+// IP header of received packet, checked in software unless hardware did it
+bool ip4_header_valid(net_buffer_t *buffer)
+{
+    if (buffer->offload & NET_OFFLOAD_RX_IP_OK)
+    {
+        return true;
+    }
+    ip_packet_t *packet = (ip_packet_t*)buffer->data;
+    uint32_t header_size = packet->ip.header_size * 4;
+    if (header_size < sizeof(ip4_header_t) || sizeof(eth_header_t) + header_size > buffer->len)
+    {
+        return false;
+    }
+    return checksum_fold(checksum_partial(&packet->ip, header_size, 0)) == 0xFFFF;
+}
+
+// TCP or UDP segment of received packet, checked in software unless hardware did it
+bool ip4_payload_valid(net_buffer_t *buffer)
+{
+    if (buffer->offload & NET_OFFLOAD_RX_L4_OK)
+    {
+        return true;
+    }
+    ip_packet_t *packet = (ip_packet_t*)buffer->data;
+    uint32_t header_size = packet->ip.header_size * 4;
+    uint32_t total_size = bswap16(packet->ip.total_size);
+    uint32_t length = total_size - header_size;
+    uint32_t offset = sizeof(eth_header_t) + header_size;
+    if (total_size < header_size || offset + length > net_buffer_total_len(buffer))
+    {
+        return false;
+    }
+    uint32_t sum = ip4_pseudo_checksum(&packet->ip.source_ip, &packet->ip.destination_ip, packet->ip.protocol, length);
+    return checksum_fold(net_buffer_checksum(buffer, offset, length, sum)) == 0xFFFF;
+}
+
+// buffer data starts with protocol header, IP and ethernet headers are prepended in the headroom
+void send_ip4_packet(network_device_t *net_dev, ip4_addr_t* destination, uint8_t protocol, net_buffer_t *buffer)
+{
+    if (net_buffer_push(buffer, sizeof(ip_packet_t)) == NULL)
+    {
+        release_net_buffer(buffer);
+        return;
+    }
+    size_t size = net_buffer_total_len(buffer);
+    if (!(buffer->offload & NET_OFFLOAD_TSO) && size - sizeof(eth_header_t) > net_dev->mtu)
+    {
+        // there is no fragmentation, protocols size packets by MTU of the device
+        release_net_buffer(buffer);
+        return;
+    }
+    ip_packet_t *ip_packet = (ip_packet_t*)buffer->data;
+    memset(ip_packet, 0, sizeof(ip_packet_t));
     ip_packet->ip.version = IP_VERSION;
     ip_packet->ip.header_size = sizeof(ip4_header_t) / 4;
-    ip_packet->ip.total_size = bswap16(size - sizeof(eth_header_t));
+    // with TSO hardware writes length (and checksum) of every segment
+    if (!(buffer->offload & NET_OFFLOAD_TSO))
+    {
+        ip_packet->ip.total_size = bswap16(size - sizeof(eth_header_t));
+    }
     ip_packet->ip.ttl = IP_DEFAULT_TTL;
     ip_packet->ip.protocol = protocol;
     ip_packet->ip.destination_ip = *destination;
     ip_packet->ip.source_ip = net_dev->ip4_addr;
 
-    uint32_t checksum = 0;
-    uint16_t *p = (uint16_t*)&ip_packet->ip;
-    for(uint8_t i = 0; i < sizeof(ip4_header_t) / 2; i++)
+    if (net_dev->features & NET_FEATURE_IP_CSUM || buffer->offload & NET_OFFLOAD_TSO)
+    {
+        buffer->offload |= NET_OFFLOAD_TX_IP_CSUM;
+    }
+    else
     {
-        checksum += *p; // we dont worry about checksum field, because it's 0
-        while(checksum > 0xFFFF)
-        {
-            checksum = (checksum >> 16) + (checksum & 0x0FFFF);
-        }
-        p++;
+        // checksum field is 0 while it's computed
+        ip_packet->ip.header_checksum = checksum(&ip_packet->ip, sizeof(ip4_header_t));
     }
-    checksum = ~checksum;
-    ip_packet->ip.header_checksum = (uint16_t)checksum;
+    buffer->l4_protocol = protocol;
+
+    ip_packet->eth.source = net_dev->mac;
+    ip_packet->eth.type = bswap16(PROTOCOL_IP);
 
-    eth_addr_t destination_mac;
-    uint8_t success = get_mac_by_ip(net_dev, destination, &destination_mac);
-    if (success == 0)
+    // unresolved packet is kept by ARP and sent when reply comes
+    eth_addr_t destination_mac = ETH_ADDR_EMPTY;
+    ip4_addr_t next_hop = route_next_hop(net_dev, destination);
+    if (!(net_dev->flags & NET_DEV_LOOPBACK) && !arp_resolve(net_dev, &next_hop, buffer, &destination_mac))
     {
-        char addr[16];
-        ip4_to_str(destination, addr);
-        //debug("[ip] MAC address not found for %s\n", addr);
         return;
     }
     ip_packet->eth.destination = destination_mac;
-    ip_packet->eth.source = net_dev->mac;
-    ip_packet->eth.type = bswap16(PROTOCOL_IP);
 
-    net_dev->send_packet(net_dev, ip_packet, size);
+    net_dev->send_packet(net_dev, buffer);
 }
@@ -0,0 +1,266 @@
+#include "net_buffer.h"
+#include "mm.h"
+#include "irq.h"
+#include "liballoc.h"
+#include "string.h"
+#include "log.h"
+#include "checksum.h"
+
+static net_buffer_t *free_list = NULL;
+static uint32_t free_count = 0;
+
+/*
+ * Pool is allocated at boot and grows when drivers reserve buffers for their RX rings, two buffers per physical
+ * page, so a buffer never crosses a page boundary and can be given to hardware as is. Pages are cached: PCI DMA on
+ * x86 is coherent. Buffers are never returned to the system.
+ */
+void net_buffer_reserve(uint32_t count)
+{
+    uint32_t pages = (count * NET_BUFFER_SIZE + 0xFFF) / 0x1000;
+    count = pages * 0x1000 / NET_BUFFER_SIZE;
+    uint32_t virtual = alloc_hardware_space_chunk(pages);
+    for (uint32_t i = 0; i < pages; i++) {
+        map_virtual_to_physical(virtual + i * 0x1000, alloc_physical_page(), 0);
+    }
+
+    net_buffer_t *buffers = kmalloc(sizeof(net_buffer_t) * count);
+    memset(buffers, 0, sizeof(net_buffer_t) * count);
+    for (uint32_t i = 0; i < count; i++) {
+        buffers[i].head = (uint8_t*)(virtual + i * NET_BUFFER_SIZE);
+        buffers[i].physical = get_physical_address((uint32_t)buffers[i].head);
+    }
+
+    uint32_t flags = irq_save();
+    for (uint32_t i = 0; i < count; i++) {
+        buffers[i].next = free_list;
+        free_list = &buffers[i];
+    }
+    free_count += count;
+    irq_restore(flags);
+}
+
+void init_net_buffers()
+{
+    net_buffer_reserve(NET_BUFFER_POOL_SIZE);
+}
+
+// returns empty buffer with NET_BUFFER_HEADROOM reserved, NULL if pool is exhausted; safe in any context
+net_buffer_t *alloc_net_buffer()
+{
+    uint32_t flags = irq_save();
+    net_buffer_t *buffer = free_list;
+    if (buffer != NULL) {
+        free_list = buffer->next;
+        free_count--;
+    }
+    irq_restore(flags);
+
+    if (buffer == NULL) {
+        return NULL;
+    }
+    buffer->next = NULL;
+    buffer->ref_count = 1;
+    buffer->data = buffer->head + NET_BUFFER_HEADROOM;
+    buffer->len = 0;
+    buffer->next_frag = NULL;
+    buffer->offload = 0;
+    buffer->l4_protocol = 0;
+    buffer->mss = 0;
+    return buffer;
+}
+
+void hold_net_buffer(net_buffer_t *buffer)
+{
+    __sync_add_and_fetch(&buffer->ref_count, 1);
+}
+
+// drops a reference, buffer goes back to the pool with the last one and takes its fragments with it
+void release_net_buffer(net_buffer_t *buffer)
+{
+    while (buffer != NULL && __sync_sub_and_fetch(&buffer->ref_count, 1) == 0) {
+        net_buffer_t *frag = buffer->next_frag;
+
+        uint32_t flags = irq_save();
+        buffer->next = free_list;
+        free_list = buffer;
+        free_count++;
+        irq_restore(flags);
+
+        buffer = frag;
+    }
+}
+
+// prepends size bytes (header) to the packet
+void *net_buffer_push(net_buffer_t *buffer, uint32_t size)
+{
+    if (net_buffer_headroom(buffer) < size) {
+        log(KERN_ERR, "[net] no headroom for %i bytes\n", size);
+        return NULL;
+    }
+    buffer->data -= size;
+    buffer->len += size;
+    return buffer->data;
+}
+
+// strips size bytes (header) from the start of the packet, returns the stripped header
+void *net_buffer_pull(net_buffer_t *buffer, uint32_t size)
+{
+    if (buffer->len < size) {
+        return NULL;
+    }
+    void *header = buffer->data;
+    buffer->data += size;
+    buffer->len -= size;
+    return header;
+}
+
+// appends size bytes to the packet, returns pointer to them
+void *net_buffer_put(net_buffer_t *buffer, uint32_t size)
+{
+    if (net_buffer_tailroom(buffer) < size) {
+        return NULL;
+    }
+    void *tail = buffer->data + buffer->len;
+    buffer->len += size;
+    return tail;
+}
+
+uint32_t net_buffer_headroom(net_buffer_t *buffer)
+{
+    return buffer->data - buffer->head;
+}
+
+uint32_t net_buffer_tailroom(net_buffer_t *buffer)
+{
+    return NET_BUFFER_SIZE - net_buffer_headroom(buffer) - buffer->len;
+}
+
+uint32_t net_buffer_free_count()
+{
+    return free_count;
+}
+
+// length of the packet including fragments
+uint32_t net_buffer_total_len(net_buffer_t *buffer)
+{
+    uint32_t len = 0;
+    for (; buffer != NULL; buffer = buffer->next_frag) {
+        len += buffer->len;
+    }
+    return len;
+}
+
+// adds size bytes of the packet starting at offset to partial checksum, fragments are summed separately and combined
+uint32_t net_buffer_checksum(net_buffer_t *buffer, uint32_t offset, uint32_t size, uint32_t sum)
+{
+    uint32_t position = 0; // position in checksummed data, odd blocks are byte swapped when combined
+    for (; buffer != NULL && size > 0; buffer = buffer->next_frag) {
+        if (offset >= buffer->len) {
+            offset -= buffer->len;
+            continue;
+        }
+        uint32_t chunk = buffer->len - offset < size ? buffer->len - offset : size;
+        sum = checksum_block_add(sum, checksum_partial(buffer->data + offset, chunk, 0), position);
+        position += chunk;
+        size -= chunk;
+        offset = 0;
+    }
+    return sum;
+}
+
+// copies size bytes of the packet starting at offset, returns how many were there
+uint32_t net_buffer_copy(net_buffer_t *buffer, uint32_t offset, void *out, uint32_t size)
+{
+    uint32_t copied = 0;
+    for (; buffer != NULL && copied < size; buffer = buffer->next_frag) {
+        if (offset >= buffer->len) {
+            offset -= buffer->len;
+            continue;
+        }
+        uint32_t chunk = buffer->len - offset < size - copied ? buffer->len - offset : size - copied;
+        memcpy((uint8_t*)out + copied, buffer->data + offset, chunk);
+        copied += chunk;
+        offset = 0;
+    }
+    return copied;
+}
+
+/*
+ * Appends data to the end of the packet, fragments without headroom are chained when the last one is full. Returns
+ * false if the pool is exhausted, part of data may be appended then.
+ */
+bool net_buffer_append(net_buffer_t *buffer, const void *data, uint32_t size)
+{
+    net_buffer_t *last = buffer;
+    while (last->next_frag != NULL) {
+        last = last->next_frag;
+    }
+    while (size > 0) {
+        if (net_buffer_tailroom(last) == 0) {
+            net_buffer_t *frag = alloc_net_buffer();
+            if (frag == NULL) {
+                return false;
+            }
+            frag->data = frag->head;
+            last->next_frag = frag;
+            last = frag;
+        }
+        uint32_t chunk = size < net_buffer_tailroom(last) ? size : net_buffer_tailroom(last);
+        memcpy(net_buffer_put(last, chunk), data, chunk);
+        data = (const uint8_t*)data + chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+// private copy of the whole packet, NULL if the pool is exhausted
+net_buffer_t *copy_net_buffer(net_buffer_t *buffer)
+{
+    net_buffer_t *copy = alloc_net_buffer();
+    if (copy == NULL) {
+        return NULL;
+    }
+    for (net_buffer_t *frag = buffer; frag != NULL; frag = frag->next_frag) {
+        if (!net_buffer_append(copy, frag->data, frag->len)) {
+            release_net_buffer(copy);
+            return NULL;
+        }
+    }
+    copy->offload = buffer->offload;
+    copy->l4_protocol = buffer->l4_protocol;
+    copy->mss = buffer->mss;
+    return copy;
+}
+
+// buffers taken from the pool by the packet, fragments included
+uint32_t net_buffer_count(net_buffer_t *buffer)
+{
+    uint32_t count = 0;
+    for (; buffer != NULL; buffer = buffer->next_frag) {
+        count++;
+    }
+    return count;
+}
+
+/*
+ * Receive accounting: held counts pool buffers queued on a socket, the packet is charged before it's queued and
+ * uncharged when it leaves the queue. Fails when the socket has NET_SOCKET_RX_BUFFERS or when the pool is below
+ * NET_BUFFER_LOW_WATERMARK and the socket already holds something, so sockets which aren't read can't take the
+ * pool from the rest of the stack, while an empty socket still accepts a packet. Safe in any context.
+ */
+bool net_buffer_charge(volatile uint32_t *held, net_buffer_t *buffer)
+{
+    uint32_t count = net_buffer_count(buffer);
+    uint32_t flags = irq_save();
+    bool ok = *held + count <= NET_SOCKET_RX_BUFFERS && (*held == 0 || free_count >= NET_BUFFER_LOW_WATERMARK);
+    if (ok) {
+        *held += count;
+    }
+    irq_restore(flags);
+    return ok;
+}
+
+void net_buffer_uncharge(volatile uint32_t *held, net_buffer_t *buffer)
+{
+    __sync_sub_and_fetch(held, net_buffer_count(buffer));
+}
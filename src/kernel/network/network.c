@@ -7,7 +7,10 @@
 #include "ip.h"
 #include "tcp.h"
 #include "udp.h"
+#include "route.h"
+#include "errno.h"
 #include "stdlib.h"
+#include "pcap.h"
 
 network_device_t *network_devices = 0;
 mutex_t network_devices_mutex = {0};
@@ -36,18 +39,21 @@ void ip4_to_str(ip4_addr_t *addr, char *buff)
     itoa((addr->addr >> 24) & 0xFF, buff, 10);
 }
 
-void receive_packet(struct network_device *net_dev, eth_packet_t *packet)
+void receive_packet(struct network_device *net_dev, net_buffer_t *buffer)
 {
+    eth_packet_t *packet = (eth_packet_t*)buffer->data;
     uint16_t type = bswap16(packet->eth.type);
+    __sync_add_and_fetch(&net_dev->stats.packets_received, 1);
+    pcap_tap(buffer);
 
-    if (type == PROTOCOL_ARP)
+    if (type == PROTOCOL_ARP && buffer->len >= sizeof(arp_packet_t))
     {
         arp_packet_t *arp_packet = (arp_packet_t*)packet;
         if (bswap16(arp_packet->arp.operation) == ARP_REPLY)
         {
             if (COMPARE_ETH_ADDR(arp_packet->eth.destination, net_dev->mac))
             {
-                add_mac_to_arp_cache(&arp_packet->arp.source_ip, &arp_packet->arp.source);
+                add_mac_to_arp_cache(net_dev, &arp_packet->arp.source_ip, &arp_packet->arp.source);
             }
         }
         else
@@ -55,28 +61,110 @@ void receive_packet(struct network_device *net_dev, eth_packet_t *packet)
             process_arp_request(net_dev, packet);
         }
     }
-    else if (type == PROTOCOL_IP)
+    else if (type == PROTOCOL_IP && buffer->len >= sizeof(ip_packet_t) && ip4_header_valid(buffer))
     {
         ip_packet_t *ip_packet = (ip_packet_t*)packet;
 
+        // sockets keep the buffer, payload isn't copied
         if (ip_packet->ip.protocol == PROTOCOL_UDP)
         {
-            process_udp_packet(net_dev, ip_packet);
+            process_udp_packet(net_dev, buffer);
+            return;
         }
         else if (ip_packet->ip.protocol == PROTOCOL_TCP)
         {
-            process_tcp_packet(net_dev, ip_packet);
+            process_tcp_packet(net_dev, buffer);
+            return;
         }
     }
 
-    __sync_add_and_fetch(&net_dev->stats.packets_received, 1);
+    release_net_buffer(buffer);
+}
+
+// frames sent until matching net_tx_batch_end() may be handed to hardware with one doorbell write
+void net_tx_batch_begin(network_device_t *net_dev)
+{
+    __sync_add_and_fetch(&net_dev->tx_batch, 1);
+}
+
+void net_tx_batch_end(network_device_t *net_dev)
+{
+    if (__sync_sub_and_fetch(&net_dev->tx_batch, 1) == 0 && net_dev->flush != NULL)
+    {
+        net_dev->flush(net_dev);
+    }
 }
 
+// connected route of the address and default route through the router, if device has them
+static void install_routes(network_device_t *net_dev)
+{
+    remove_device_routes(net_dev);
+    mutex_lock(&net_dev->mutex);
+    ip4_addr_t addr = net_dev->ip4_addr;
+    ip4_addr_t mask = net_dev->subnet_mask;
+    ip4_addr_t router = net_dev->router;
+    mutex_release(&net_dev->mutex);
+
+    ip4_addr_t any = IP4_ADDR_EMPTY;
+    if (addr.addr != 0)
+    {
+        add_route(&addr, &mask, &any, net_dev);
+    }
+    if (router.addr != 0)
+    {
+        add_route(&any, &any, &router, net_dev);
+    }
+}
+
+// device can be registered at any time, it's reachable through routing as soon as it has an address
 void register_network_device(network_device_t *net_dev)
 {
     mutex_lock(&network_devices_mutex);
     add_to_list(network_devices, net_dev);
     mutex_release(&network_devices_mutex);
+    install_routes(net_dev);
+}
+
+// replaces routes of the device
+void set_network_address(network_device_t *net_dev, ip4_addr_t *addr, ip4_addr_t *mask, ip4_addr_t *router)
+{
+    mutex_lock(&net_dev->mutex);
+    net_dev->ip4_addr = *addr;
+    net_dev->subnet_mask = *mask;
+    net_dev->router = *router;
+    mutex_release(&net_dev->mutex);
+    install_routes(net_dev);
+}
+
+// MTU above NET_DEFAULT_MTU needs driver support, sockets opened before the change keep their TCP MSS
+int set_network_mtu(network_device_t *net_dev, uint32_t mtu)
+{
+    if (mtu < NET_MIN_MTU || mtu > NET_MAX_MTU || (mtu > NET_DEFAULT_MTU && net_dev->set_mtu == NULL))
+    {
+        return -EINVAL;
+    }
+    if (net_dev->set_mtu != NULL && !net_dev->set_mtu(net_dev, mtu))
+    {
+        return -EINVAL;
+    }
+    net_dev->mtu = mtu;
+    return 0;
+}
+
+// device which owns the local address, 0 if there is none
+network_device_t *get_network_device_by_ip(ip4_addr_t *addr)
+{
+    network_device_t *result = 0;
+    mutex_lock(&network_devices_mutex);
+    FOR_EACH(net_dev, network_devices, network_device_t)
+    {
+        if (net_dev->ip4_addr.addr != 0 && COMPARE_IP4_ADDR(net_dev->ip4_addr, *addr))
+        {
+            result = net_dev;
+        }
+    }
+    mutex_release(&network_devices_mutex);
+    return result;
 }
 
 network_device_t* create_network_device(pci_device_t *pci_dev)
@@ -85,6 +173,7 @@ network_device_t* create_network_device(pci_device_t *pci_dev)
     memset(net_dev, 0, sizeof(network_device_t));
     net_dev->pci_dev = pci_dev;
     net_dev->receive_packet = &receive_packet;
+    net_dev->mtu = NET_DEFAULT_MTU;
 
     return net_dev;
 }
@@ -0,0 +1,430 @@
+#include "pcap.h"
+#include "vfs.h"
+#include "poll.h"
+#include "pit.h"
+#include "irq.h"
+#include "task.h"
+#include "mutex.h"
+#include "wait_queue.h"
+#include "liballoc.h"
+#include "string.h"
+#include "system.h"
+#include "errno.h"
+#include "log.h"
+
+// ring slot, sequence is ticket + 1 when the record of the ticket is complete
+typedef struct pcap_slot
+{
+    volatile uint32_t sequence;
+    pcap_record_t record;
+    uint8_t data[PCAP_SNAPLEN]; // follows the record, so both are read as one chunk
+} __attribute__((packed)) pcap_slot_t;
+
+typedef struct pcap_state
+{
+    pcap_slot_t *slots;
+    volatile uint32_t head; // next ticket of producers
+    volatile uint32_t tail; // record which is read now, advanced only by the reader
+    uint32_t read_offset; // bytes of the tail record already read
+    uint32_t header_offset; // bytes of file header already read
+    volatile uint32_t producers; // taps inside of pcap_capture()
+    volatile uint32_t dropped;
+    bpf_insn_t filter[BPF_MAX_INSNS];
+    uint32_t filter_len; // 0 - every frame is captured
+    wait_queue_t readers;
+    mutex_t mutex; // reader side: read, filter update, open and close
+} pcap_state_t;
+
+volatile uint32_t pcap_active = 0;
+static pcap_state_t pcap = {0};
+
+static const pcap_file_header_t pcap_header = {
+    .magic = PCAP_MAGIC,
+    .version_major = PCAP_VERSION_MAJOR,
+    .version_minor = PCAP_VERSION_MINOR,
+    .thiszone = 0,
+    .sigfigs = 0,
+    .snaplen = PCAP_SNAPLEN,
+    .linktype = PCAP_LINKTYPE_ETHERNET
+};
+
+// big endian load of size bytes, false if the packet is shorter
+static bool bpf_load(net_buffer_t *buffer, uint32_t offset, uint32_t size, uint32_t *out)
+{
+    uint8_t bytes[4];
+    if (size > sizeof(bytes) || offset > offset + size || net_buffer_copy(buffer, offset, bytes, size) != size)
+    {
+        return false;
+    }
+    *out = 0;
+    for (uint32_t i = 0; i < size; i++)
+    {
+        *out = (*out << 8) | bytes[i];
+    }
+    return true;
+}
+
+// jumps go only forward and stay inside of the program, so every program terminates
+bool bpf_validate(bpf_insn_t *program, uint32_t count)
+{
+    if (count == 0 || count > BPF_MAX_INSNS || BPF_CLASS(program[count - 1].code) != BPF_RET)
+    {
+        return false;
+    }
+    for (uint32_t pc = 0; pc < count; pc++)
+    {
+        bpf_insn_t *insn = &program[pc];
+        uint32_t left = count - pc - 1;
+        switch (BPF_CLASS(insn->code))
+        {
+        case BPF_LD:
+        case BPF_LDX:
+            if (BPF_MODE(insn->code) == BPF_MEM && insn->k >= BPF_MEMWORDS)
+            {
+                return false;
+            }
+            if (BPF_CLASS(insn->code) == BPF_LDX && BPF_MODE(insn->code) != BPF_IMM && BPF_MODE(insn->code) != BPF_LEN
+                && BPF_MODE(insn->code) != BPF_MEM && insn->code != (BPF_LDX | BPF_B | BPF_MSH))
+            {
+                return false;
+            }
+            // size 0x18 has no meaning, packet loads index their sizes by it
+            if (BPF_CLASS(insn->code) == BPF_LD && (BPF_MODE(insn->code) > BPF_LEN
+                || ((BPF_MODE(insn->code) == BPF_ABS || BPF_MODE(insn->code) == BPF_IND) && BPF_SIZE(insn->code) == 0x18)))
+            {
+                return false;
+            }
+            break;
+        case BPF_ST:
+        case BPF_STX:
+            if (insn->k >= BPF_MEMWORDS)
+            {
+                return false;
+            }
+            break;
+        case BPF_ALU:
+            if (BPF_OP(insn->code) > BPF_NEG || (BPF_OP(insn->code) == BPF_DIV && BPF_SRC(insn->code) == BPF_K && insn->k == 0))
+            {
+                return false;
+            }
+            break;
+        case BPF_JMP:
+            if (BPF_OP(insn->code) == BPF_JA ? insn->k >= left : (insn->jt >= left || insn->jf >= left))
+            {
+                return false;
+            }
+            if (BPF_OP(insn->code) > BPF_JSET)
+            {
+                return false;
+            }
+            break;
+        case BPF_RET:
+            break;
+        case BPF_MISC:
+            if (BPF_MISCOP(insn->code) != BPF_TAX && BPF_MISCOP(insn->code) != BPF_TXA)
+            {
+                return false;
+            }
+            break;
+        }
+    }
+    return true;
+}
+
+// program must be validated, returns bytes to capture; load outside of the packet drops it as in BPF
+uint32_t bpf_run(bpf_insn_t *program, net_buffer_t *buffer)
+{
+    uint32_t a = 0, x = 0;
+    uint32_t mem[BPF_MEMWORDS] = {0};
+    uint32_t len = net_buffer_total_len(buffer);
+    static const uint8_t sizes[] = {[BPF_W >> 3] = 4, [BPF_H >> 3] = 2, [BPF_B >> 3] = 1};
+
+    for (bpf_insn_t *insn = program; ; insn++)
+    {
+        uint32_t src = BPF_SRC(insn->code) == BPF_X ? x : insn->k;
+        switch (BPF_CLASS(insn->code))
+        {
+        case BPF_LD:
+            switch (BPF_MODE(insn->code))
+            {
+            case BPF_IMM:
+                a = insn->k;
+                break;
+            case BPF_LEN:
+                a = len;
+                break;
+            case BPF_MEM:
+                a = mem[insn->k];
+                break;
+            case BPF_ABS:
+            case BPF_IND:
+                if (!bpf_load(buffer, insn->k + (BPF_MODE(insn->code) == BPF_IND ? x : 0),
+                              sizes[BPF_SIZE(insn->code) >> 3], &a))
+                {
+                    return 0;
+                }
+                break;
+            }
+            break;
+        case BPF_LDX:
+            if (BPF_MODE(insn->code) == BPF_MSH)
+            {
+                // IP header length: 4 * (byte & 0xf)
+                if (!bpf_load(buffer, insn->k, 1, &x))
+                {
+                    return 0;
+                }
+                x = (x & 0xf) << 2;
+            }
+            else
+            {
+                x = BPF_MODE(insn->code) == BPF_LEN ? len : (BPF_MODE(insn->code) == BPF_MEM ? mem[insn->k] : insn->k);
+            }
+            break;
+        case BPF_ST:
+            mem[insn->k] = a;
+            break;
+        case BPF_STX:
+            mem[insn->k] = x;
+            break;
+        case BPF_ALU:
+            switch (BPF_OP(insn->code))
+            {
+            case BPF_ADD: a += src; break;
+            case BPF_SUB: a -= src; break;
+            case BPF_MUL: a *= src; break;
+            case BPF_DIV:
+                if (src == 0)
+                {
+                    return 0;
+                }
+                a /= src;
+                break;
+            case BPF_OR: a |= src; break;
+            case BPF_AND: a &= src; break;
+            case BPF_LSH: a = src < 32 ? a << src : 0; break;
+            case BPF_RSH: a = src < 32 ? a >> src : 0; break;
+            case BPF_NEG: a = -a; break;
+            }
+            break;
+        case BPF_JMP:
+            switch (BPF_OP(insn->code))
+            {
+            case BPF_JA: insn += insn->k; break;
+            case BPF_JEQ: insn += a == src ? insn->jt : insn->jf; break;
+            case BPF_JGT: insn += a > src ? insn->jt : insn->jf; break;
+            case BPF_JGE: insn += a >= src ? insn->jt : insn->jf; break;
+            case BPF_JSET: insn += (a & src) ? insn->jt : insn->jf; break;
+            }
+            break;
+        case BPF_RET:
+            return BPF_RVAL(insn->code) == BPF_A ? a : insn->k;
+        case BPF_MISC:
+            if (BPF_MISCOP(insn->code) == BPF_TAX)
+            {
+                x = a;
+            }
+            else
+            {
+                a = x;
+            }
+            break;
+        }
+    }
+}
+
+/*
+ * Producers take tickets with CAS on head and fill their slots in parallel, a slot is published by its sequence.
+ * Slot is reused only after the reader moved tail past it, so a slow reader costs dropped frames, not waiting.
+ */
+void pcap_capture(net_buffer_t *buffer)
+{
+    // pcap_stop() waits for producers which saw the capture active
+    __sync_add_and_fetch(&pcap.producers, 1);
+    if (!pcap_active)
+    {
+        __sync_sub_and_fetch(&pcap.producers, 1);
+        return;
+    }
+
+    uint32_t snaplen = pcap.filter_len == 0 ? PCAP_SNAPLEN : bpf_run(pcap.filter, buffer);
+    uint32_t ticket = pcap.head;
+    while (snaplen > 0)
+    {
+        if (ticket - pcap.tail >= PCAP_RING_SLOTS)
+        {
+            __sync_add_and_fetch(&pcap.dropped, 1);
+            break;
+        }
+        uint32_t seen = __sync_val_compare_and_swap(&pcap.head, ticket, ticket + 1);
+        if (seen != ticket)
+        {
+            ticket = seen;
+            continue;
+        }
+
+        pcap_slot_t *slot = &pcap.slots[ticket & (PCAP_RING_SLOTS - 1)];
+        uint32_t ticks = get_pit_ticks();
+        uint32_t len = net_buffer_total_len(buffer);
+        slot->record.ts_sec = ticks / TICK_FREQUENCY;
+        slot->record.ts_usec = (ticks % TICK_FREQUENCY) * 1000000 / TICK_FREQUENCY;
+        slot->record.orig_len = len;
+        slot->record.incl_len = net_buffer_copy(buffer, 0, slot->data, MIN(MIN(snaplen, PCAP_SNAPLEN), len));
+        __sync_synchronize();
+        slot->sequence = ticket + 1;
+        wake_up(&pcap.readers, WAIT_ANY_KEY, 0);
+        break;
+    }
+
+    __sync_sub_and_fetch(&pcap.producers, 1);
+}
+
+// taps are off when it returns, so the filter can be changed and the ring freed
+static void pcap_stop()
+{
+    pcap_active = 0;
+    __sync_synchronize();
+    while (pcap.producers != 0)
+    {
+        force_task_switch();
+    }
+}
+
+static bool pcap_readable()
+{
+    return pcap.header_offset < sizeof(pcap_file_header_t)
+        || pcap.slots[pcap.tail & (PCAP_RING_SLOTS - 1)].sequence == pcap.tail + 1;
+}
+
+// one user at a time, dup()ed and inherited descriptors share it
+static int pcap_open(vfs_file_t *file, uint32_t flags)
+{
+    if (!__sync_bool_compare_and_swap(&file->node->ref_count, 0, 1))
+    {
+        return -EBUSY;
+    }
+    mutex_lock(&pcap.mutex);
+    pcap.slots = kmalloc(sizeof(pcap_slot_t) * PCAP_RING_SLOTS);
+    for (uint32_t i = 0; i < PCAP_RING_SLOTS; i++)
+    {
+        pcap.slots[i].sequence = i + 1 - PCAP_RING_SLOTS;
+    }
+    pcap.head = 0;
+    pcap.tail = 0;
+    pcap.read_offset = 0;
+    pcap.header_offset = 0;
+    pcap.dropped = 0;
+    pcap.filter_len = 0;
+    pcap_active = 1;
+    mutex_release(&pcap.mutex);
+    return 0;
+}
+
+static int pcap_close(vfs_file_t *file)
+{
+    if (ref_dec(&file->node->ref_count) > 0)
+    {
+        return 0;
+    }
+    mutex_lock(&pcap.mutex);
+    pcap_stop();
+    if (pcap.dropped > 0)
+    {
+        log(KERN_INFO, "[pcap] %i frames dropped, reader was too slow\n", pcap.dropped);
+    }
+    kfree(pcap.slots);
+    pcap.slots = NULL;
+    mutex_release(&pcap.mutex);
+    return 0;
+}
+
+// stream of the file header and records, a record may be split between reads
+static int pcap_read(vfs_file_t *file, void *buf, uint32_t size, uint32_t *offset)
+{
+    mutex_lock(&pcap.mutex);
+    while (!pcap_readable())
+    {
+        mutex_release(&pcap.mutex);
+        if (FILE_NONBLOCK(file))
+        {
+            return -EAGAIN;
+        }
+        cli();
+        if (!pcap_readable())
+        {
+            wait_event(&pcap.readers, WAIT_ANY_KEY, 0);
+        }
+        else
+        {
+            sti();
+        }
+        mutex_lock(&pcap.mutex);
+    }
+
+    uint32_t done = 0;
+    if (pcap.header_offset < sizeof(pcap_file_header_t))
+    {
+        uint32_t chunk = MIN(size, sizeof(pcap_file_header_t) - pcap.header_offset);
+        memcpy(buf, (uint8_t*)&pcap_header + pcap.header_offset, chunk);
+        pcap.header_offset += chunk;
+        done += chunk;
+    }
+    while (done < size && pcap.header_offset == sizeof(pcap_file_header_t))
+    {
+        pcap_slot_t *slot = &pcap.slots[pcap.tail & (PCAP_RING_SLOTS - 1)];
+        if (slot->sequence != pcap.tail + 1)
+        {
+            break;
+        }
+        uint32_t record_size = sizeof(pcap_record_t) + slot->record.incl_len;
+        uint32_t chunk = MIN(size - done, record_size - pcap.read_offset);
+        memcpy((uint8_t*)buf + done, (uint8_t*)&slot->record + pcap.read_offset, chunk);
+        pcap.read_offset += chunk;
+        done += chunk;
+        if (pcap.read_offset == record_size)
+        {
+            // slot is free for the ticket which wraps onto it, its old sequence doesn't match that ticket
+            pcap.read_offset = 0;
+            __sync_synchronize();
+            pcap.tail++;
+        }
+    }
+    mutex_release(&pcap.mutex);
+    return done;
+}
+
+// replaces the filter, capture is paused meanwhile; size 0 removes it
+static int pcap_write(vfs_file_t *file, void *buf, uint32_t size, uint32_t *offset)
+{
+    uint32_t count = size / sizeof(bpf_insn_t);
+    if (size % sizeof(bpf_insn_t) != 0 || (count > 0 && !bpf_validate(buf, count)))
+    {
+        return -EINVAL;
+    }
+    mutex_lock(&pcap.mutex);
+    pcap_stop();
+    memcpy(pcap.filter, buf, size);
+    pcap.filter_len = count;
+    pcap_active = 1;
+    mutex_release(&pcap.mutex);
+    return size;
+}
+
+static uint32_t pcap_poll(vfs_file_t *file, poll_table_t *table)
+{
+    poll_wait(table, &pcap.readers);
+    return (pcap_readable() ? POLLIN : 0) | POLLOUT;
+}
+
+static vfs_file_operations_t pcap_file_ops = {
+    .open = &pcap_open,
+    .close = &pcap_close,
+    .write = &pcap_write,
+    .read = &pcap_read,
+    .poll = &pcap_poll
+};
+
+void init_pcap()
+{
+    create_vfs_node("/dev/pcap", S_IFCHR, &pcap_file_ops, NULL, NULL);
+}
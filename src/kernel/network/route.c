@@ -0,0 +1,104 @@
+#include "route.h"
+#include "mutex.h"
+#include "liballoc.h"
+#include "string.h"
+
+route_t *routes = 0;
+static mutex_t routes_mutex = {0};
+
+static uint8_t prefix_length(ip4_addr_t *mask)
+{
+    uint8_t length = 0;
+    for (uint32_t bits = mask->addr; bits != 0; bits &= bits - 1)
+    {
+        length++;
+    }
+    return length;
+}
+
+void add_route(ip4_addr_t *destination, ip4_addr_t *mask, ip4_addr_t *gateway, network_device_t *net_dev)
+{
+    route_t *route = kmalloc(sizeof(route_t));
+    memset(route, 0, sizeof(route_t));
+    route->destination.addr = destination->addr & mask->addr;
+    route->mask = *mask;
+    route->gateway = *gateway;
+    route->net_dev = net_dev;
+    route->prefix_length = prefix_length(mask);
+
+    mutex_lock(&routes_mutex);
+    route_t **link = &routes;
+    while (*link != 0 && (*link)->prefix_length >= route->prefix_length)
+    {
+        link = &(*link)->next;
+    }
+    route->next = *link;
+    *link = route;
+    mutex_release(&routes_mutex);
+}
+
+void remove_device_routes(network_device_t *net_dev)
+{
+    mutex_lock(&routes_mutex);
+    route_t **link = &routes;
+    while (*link != 0)
+    {
+        route_t *route = *link;
+        if (route->net_dev == net_dev)
+        {
+            *link = route->next;
+            kfree(route);
+            continue;
+        }
+        link = &route->next;
+    }
+    mutex_release(&routes_mutex);
+}
+
+// limited broadcast never goes to a gateway
+static ip4_addr_t gateway_or_destination(route_t *route, ip4_addr_t *destination)
+{
+    ip4_addr_t broadcast = IP4_ADDR_BROADCAST;
+    if (route == 0 || route->gateway.addr == 0 || COMPARE_IP4_ADDR(*destination, broadcast))
+    {
+        return *destination;
+    }
+    return route->gateway;
+}
+
+// routes_mutex must be held, net_dev 0 - any device
+static route_t *find_route(network_device_t *net_dev, ip4_addr_t *destination)
+{
+    for (route_t *route = routes; route != 0; route = route->next)
+    {
+        if ((net_dev == 0 || route->net_dev == net_dev) && (destination->addr & route->mask.addr) == route->destination.addr)
+        {
+            return route;
+        }
+    }
+    return 0;
+}
+
+// returns egress device and next hop for destination, 0 if there is no route
+network_device_t *route_lookup(ip4_addr_t *destination, ip4_addr_t *next_hop)
+{
+    network_device_t *net_dev = 0;
+    mutex_lock(&routes_mutex);
+    route_t *route = find_route(0, destination);
+    if (route != 0)
+    {
+        net_dev = route->net_dev;
+        *next_hop = gateway_or_destination(route, destination);
+    }
+    mutex_release(&routes_mutex);
+    return net_dev;
+}
+
+// for packets which have to leave through net_dev (socket bound to it), unknown destinations are treated as on-link
+ip4_addr_t route_next_hop(network_device_t *net_dev, ip4_addr_t *destination)
+{
+    mutex_lock(&routes_mutex);
+    ip4_addr_t next_hop = gateway_or_destination(find_route(net_dev, destination), destination);
+    mutex_release(&routes_mutex);
+    return next_hop;
+}
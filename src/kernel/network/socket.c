@@ -0,0 +1,624 @@
+#include "socket.h"
+#include "vfs.h"
+#include "task.h"
+#include "pit.h"
+#include "errno.h"
+#include "string.h"
+#include "liballoc.h"
+#include "system.h"
+#include "poll.h"
+
+extern struct process *current_process;
+
+static uint32_t next_ephemeral_port = 0;
+
+static int socket_read(vfs_file_t *file, void *buf, uint32_t size, uint32_t *offset);
+static int socket_write(vfs_file_t *file, void *buf, uint32_t size, uint32_t *offset);
+static int socket_close(vfs_file_t *file);
+static uint32_t socket_poll(vfs_file_t *file, poll_table_t *table);
+
+static vfs_file_operations_t socket_file_ops = {
+    .open = 0,
+    .read = &socket_read,
+    .readdir = 0,
+    .write = &socket_write,
+    .close = &socket_close,
+    .poll = &socket_poll
+};
+
+static socket_t *create_socket(uint8_t type, network_device_t *net_dev)
+{
+    socket_t *socket = kmalloc(sizeof(socket_t));
+    memset(socket, 0, sizeof(socket_t));
+    socket->type = type;
+    socket->net_dev = net_dev;
+    return socket;
+}
+
+static int get_socket(int fd, socket_t **out)
+{
+    vfs_file_t *file = get_file(fd);
+    if (file == 0)
+    {
+        return -EBADF;
+    }
+    if ((file->node->mode & S_IFMT) != S_IFSOCK)
+    {
+        return -ENOTSOCK;
+    }
+    *out = file->node->obj;
+    return 0;
+}
+
+static void release_socket(socket_t *socket)
+{
+    if (socket->tcp != 0)
+    {
+        // connection is finished and freed by TCP worker
+        close_tcp_connection(socket->tcp);
+    }
+    if (socket->binder != 0)
+    {
+        release_tcp_binder(socket->binder);
+    }
+    if (socket->udp != 0)
+    {
+        release_udp_socket(socket->udp);
+    }
+    kfree(socket);
+}
+
+// socket->mutex is held
+static int bind_port(socket_t *socket, uint16_t port)
+{
+    if (socket->type == SOCK_STREAM)
+    {
+        if (tcp_bind(socket->net_dev, port, &socket->binder) != TCP_SOCKET_SUCCESS)
+        {
+            return -EADDRINUSE;
+        }
+    }
+    else if (create_udp_socket(socket->net_dev, port, &socket->udp) != UDP_SOCKET_SUCCESS)
+    {
+        return -EADDRINUSE;
+    }
+    socket->port = port;
+    return 0;
+}
+
+// binds to a free port of the ephemeral range, busy ports are skipped; socket->mutex is held
+static int bind_ephemeral_port(socket_t *socket)
+{
+    if (socket->type == SOCK_DGRAM)
+    {
+        // UDP picks the port itself under its table lock
+        int err = bind_port(socket, 0);
+        if (err == 0)
+        {
+            socket->port = socket->udp->port;
+        }
+        return err;
+    }
+    uint32_t range = SOCKET_EPHEMERAL_PORT_LAST - SOCKET_EPHEMERAL_PORT_FIRST + 1;
+    for (uint32_t i = 0; i < range; i++)
+    {
+        uint16_t port = SOCKET_EPHEMERAL_PORT_FIRST + __sync_fetch_and_add(&next_ephemeral_port, 1) % range;
+        if (bind_port(socket, port) == 0)
+        {
+            return 0;
+        }
+    }
+    return -EADDRINUSE;
+}
+
+static int check_address(struct sockaddr_in *addr, socklen_t addrlen)
+{
+    if (addr == 0 || addrlen < sizeof(struct sockaddr_in))
+    {
+        return -EINVAL;
+    }
+    if (addr->sin_family != AF_INET)
+    {
+        return -EAFNOSUPPORT;
+    }
+    return 0;
+}
+
+static void fill_address(struct sockaddr_in *addr, ip4_addr_t *host, uint16_t port)
+{
+    memset(addr, 0, sizeof(struct sockaddr_in));
+    addr->sin_family = AF_INET;
+    addr->sin_port = bswap16(port);
+    addr->sin_addr = *host;
+}
+
+int sys_socket(int domain, int type, int protocol)
+{
+    if (domain != AF_INET)
+    {
+        return -EAFNOSUPPORT;
+    }
+    if ((type != SOCK_STREAM && type != SOCK_DGRAM) || protocol != 0)
+    {
+        return -EPROTONOSUPPORT;
+    }
+    // device is chosen by routing unless socket is bound to an address
+    socket_t *socket = create_socket(type, 0);
+    int fd = open_anonymous_file("socket", S_IFSOCK, &socket_file_ops, socket);
+    if (fd < 0)
+    {
+        kfree(socket);
+    }
+    return fd;
+}
+
+// there is one address per device, binding to it restricts the socket to the device
+int sys_bind(int fd, struct sockaddr_in *addr, socklen_t addrlen)
+{
+    socket_t *socket;
+    int err = get_socket(fd, &socket);
+    if (err)
+    {
+        return err;
+    }
+    err = check_address(addr, addrlen);
+    if (err)
+    {
+        return err;
+    }
+    network_device_t *net_dev = 0;
+    if (addr->sin_addr.addr != INADDR_ANY && (net_dev = get_network_device_by_ip(&addr->sin_addr)) == 0)
+    {
+        return -EADDRNOTAVAIL;
+    }
+
+    mutex_lock(&socket->mutex);
+    if (socket->port != 0 || socket->tcp != 0)
+    {
+        err = -EINVAL;
+    }
+    else
+    {
+        socket->net_dev = net_dev;
+        err = addr->sin_port == 0 ? bind_ephemeral_port(socket) : bind_port(socket, bswap16(addr->sin_port));
+        if (err)
+        {
+            socket->net_dev = 0;
+        }
+    }
+    mutex_release(&socket->mutex);
+    return err;
+}
+
+// backlog limits half-open connections and connections waiting for accept, it's clamped to 1..TCP_MAX_BACKLOG
+int sys_listen(int fd, int backlog)
+{
+    socket_t *socket;
+    int err = get_socket(fd, &socket);
+    if (err)
+    {
+        return err;
+    }
+    if (socket->type != SOCK_STREAM)
+    {
+        return -EOPNOTSUPP;
+    }
+
+    mutex_lock(&socket->mutex);
+    if (socket->tcp != 0)
+    {
+        err = -EISCONN;
+    }
+    else if (socket->port == 0)
+    {
+        err = bind_ephemeral_port(socket);
+    }
+    if (!err)
+    {
+        tcp_listen(socket->binder, backlog);
+        socket->listening = 1;
+    }
+    mutex_release(&socket->mutex);
+    return err;
+}
+
+int sys_accept(int fd, struct sockaddr_in *addr, socklen_t *addrlen)
+{
+    socket_t *socket;
+    int err = get_socket(fd, &socket);
+    if (err)
+    {
+        return err;
+    }
+    if (!socket->listening)
+    {
+        return -EINVAL;
+    }
+
+    if (FILE_NONBLOCK(get_file(fd)) && tcp_binder_poll_events(socket->binder) == 0)
+    {
+        return -EAGAIN;
+    }
+    tcp_socket_t *tcp;
+    accept_tcp_connection(socket->binder, &tcp, 0);
+
+    socket_t *connection = create_socket(SOCK_STREAM, tcp->net_dev);
+    connection->port = socket->port;
+    connection->tcp = tcp;
+    connection->connected = 1;
+    connection->remote_host = tcp->remote_host;
+    connection->remote_port = tcp->remote_port;
+    int new_fd = open_anonymous_file("socket", S_IFSOCK, &socket_file_ops, connection);
+    if (new_fd < 0)
+    {
+        release_socket(connection);
+        return new_fd;
+    }
+
+    if (addr != 0 && addrlen != 0 && *addrlen >= sizeof(struct sockaddr_in))
+    {
+        fill_address(addr, &tcp->remote_host, tcp->remote_port);
+        *addrlen = sizeof(struct sockaddr_in);
+    }
+    return new_fd;
+}
+
+// UDP socket only remembers the peer, send() goes to it and datagrams from other hosts are dropped
+int sys_connect(int fd, struct sockaddr_in *addr, socklen_t addrlen)
+{
+    socket_t *socket;
+    int err = get_socket(fd, &socket);
+    if (err)
+    {
+        return err;
+    }
+    err = check_address(addr, addrlen);
+    if (err)
+    {
+        return err;
+    }
+
+    mutex_lock(&socket->mutex);
+    if (socket->listening)
+    {
+        err = -EINVAL;
+    }
+    else if (socket->type == SOCK_STREAM && socket->connected)
+    {
+        err = -EISCONN;
+    }
+    else if (socket->port == 0)
+    {
+        err = bind_ephemeral_port(socket);
+    }
+
+    if (!err && socket->type == SOCK_STREAM)
+    {
+        uint8_t result = tcp_connect(socket->net_dev, &addr->sin_addr, bswap16(addr->sin_port), socket->binder, &socket->tcp);
+        if (result != TCP_SOCKET_SUCCESS)
+        {
+            err = result == TCP_SOCKET_NO_ROUTE ? -ENETUNREACH : -ETIMEDOUT;
+        }
+    }
+    if (!err)
+    {
+        socket->remote_host = addr->sin_addr;
+        socket->remote_port = bswap16(addr->sin_port);
+        socket->connected = 1;
+    }
+    mutex_release(&socket->mutex);
+    return err;
+}
+
+static int send_stream(socket_t *socket, void *buf, uint32_t size, uint8_t nonblock)
+{
+    if (socket->tcp == 0)
+    {
+        return -ENOTCONN;
+    }
+    if (nonblock && size > 0)
+    {
+        // only what fits into transmit buffer is queued
+        if (socket->tcp->state != TCP_CONNECTION_ESTABLISHED)
+        {
+            return -EPIPE;
+        }
+        buffer_t *transmit = socket->tcp->transmit_buffer;
+        uint32_t chunk = MIN(size, transmit->get_free_space(transmit));
+        if (chunk == 0)
+        {
+            return -EAGAIN;
+        }
+        return write_to_tcp_socket(socket->tcp, buf, chunk) == TCP_SOCKET_SUCCESS ? (int)chunk : -EPIPE;
+    }
+    uint32_t written = write_all_to_tcp_socket(socket->tcp, buf, size);
+    if (written == 0 && size > 0)
+    {
+        return -EPIPE;
+    }
+    return written;
+}
+
+static int send_datagram(socket_t *socket, void *buf, uint32_t size, struct sockaddr_in *addr)
+{
+    ip4_addr_t host = socket->remote_host;
+    uint16_t port = socket->remote_port;
+    if (addr != 0)
+    {
+        if (addr->sin_family != AF_INET)
+        {
+            return -EAFNOSUPPORT;
+        }
+        host = addr->sin_addr;
+        port = bswap16(addr->sin_port);
+    }
+    else if (!socket->connected)
+    {
+        return -EDESTADDRREQ;
+    }
+
+    if (socket->udp == 0)
+    {
+        mutex_lock(&socket->mutex);
+        int err = socket->udp == 0 ? bind_ephemeral_port(socket) : 0;
+        mutex_release(&socket->mutex);
+        if (err)
+        {
+            return err;
+        }
+    }
+
+    switch (send_udp_packet(socket->udp, &host, port, buf, size))
+    {
+        case UDP_SOCKET_SUCCESS:
+            return size;
+        case UDP_SOCKET_TOO_BIG_PACKET:
+            return -EMSGSIZE;
+        case UDP_SOCKET_NO_ROUTE:
+            return -ENETUNREACH;
+        default:
+            return -ENOBUFS;
+    }
+}
+
+// scatters the datagram payload over iov and releases the buffer, returns -1 if the datagram isn't for this socket
+static int deliver_datagram(socket_t *socket, net_buffer_t *buffer, struct iovec *iov, uint32_t iovlen, struct sockaddr_in *addr, uint8_t *truncated)
+{
+    udp_packet_t *packet = (udp_packet_t*)buffer->data;
+    uint16_t remote_port = bswap16(packet->udp.source_port);
+    uint8_t from_peer = COMPARE_IP4_ADDR(packet->ip.source_ip, socket->remote_host) && remote_port == socket->remote_port;
+    if (socket->connected && !from_peer)
+    {
+        release_net_buffer(buffer);
+        return -1;
+    }
+
+    // jumbo datagram continues in fragments of the buffer
+    uint32_t payload_size = bswap16(packet->udp.length) - sizeof(udp_header_t);
+    if (payload_size > net_buffer_total_len(buffer) - sizeof(udp_packet_t))
+    {
+        payload_size = net_buffer_total_len(buffer) - sizeof(udp_packet_t);
+    }
+    uint32_t copied = 0;
+    for (uint32_t i = 0; i < iovlen && copied < payload_size; i++)
+    {
+        uint32_t chunk = MIN(iov[i].iov_len, payload_size - copied);
+        copied += net_buffer_copy(buffer, sizeof(udp_packet_t) + copied, iov[i].iov_base, chunk);
+    }
+    *truncated = copied < payload_size;
+    if (addr != 0)
+    {
+        fill_address(addr, &packet->ip.source_ip, remote_port);
+    }
+    release_net_buffer(buffer);
+    return copied;
+}
+
+// datagram which doesn't fit into buf is truncated
+static int receive_datagram(socket_t *socket, void *buf, uint32_t size, struct sockaddr_in *addr, uint8_t nonblock)
+{
+    if (socket->udp == 0)
+    {
+        return nonblock ? -EAGAIN : -EINVAL;
+    }
+
+    struct iovec iov = {buf, size};
+    while (1)
+    {
+        net_buffer_t *buffer;
+        if (receive_udp_packet(socket->udp, nonblock ? 0 : UDP_WAIT_FOREVER, &buffer) != UDP_SOCKET_SUCCESS)
+        {
+            return -EAGAIN;
+        }
+        uint8_t truncated;
+        int copied = deliver_datagram(socket, buffer, &iov, 1, addr, &truncated);
+        if (copied >= 0)
+        {
+            return copied;
+        }
+    }
+}
+
+// datagrams are sent without queueing, so only stream sockets can block
+static int socket_send(socket_t *socket, void *buf, uint32_t size, struct sockaddr_in *addr, uint8_t nonblock)
+{
+    // destination of connected TCP socket can't be changed, so addr is ignored as in BSD
+    return socket->type == SOCK_STREAM ? send_stream(socket, buf, size, nonblock) : send_datagram(socket, buf, size, addr);
+}
+
+// blocks until data arrives unless nonblock is set, 0 means that remote side closed TCP connection
+static int socket_receive(socket_t *socket, void *buf, uint32_t size, struct sockaddr_in *addr, uint8_t nonblock)
+{
+    if (socket->type == SOCK_DGRAM)
+    {
+        return receive_datagram(socket, buf, size, addr, nonblock);
+    }
+    if (socket->tcp == 0)
+    {
+        return -ENOTCONN;
+    }
+    if (nonblock && !(tcp_poll_events(socket->tcp) & POLLIN))
+    {
+        return -EAGAIN;
+    }
+    if (addr != 0)
+    {
+        fill_address(addr, &socket->remote_host, socket->remote_port);
+    }
+    return read_from_tcp_socket(socket->tcp, buf, size, 0);
+}
+
+// only MSG_DONTWAIT is supported
+int sys_sendto(int fd, void *buf, uint32_t size, int flags, struct sockaddr_in *addr)
+{
+    socket_t *socket;
+    int err = get_socket(fd, &socket);
+    if (err)
+    {
+        return err;
+    }
+    if (flags & ~MSG_DONTWAIT)
+    {
+        return -EOPNOTSUPP;
+    }
+    return socket_send(socket, buf, size, addr, (flags & MSG_DONTWAIT) || FILE_NONBLOCK(get_file(fd)));
+}
+
+int sys_recvfrom(int fd, void *buf, uint32_t size, int flags, struct sockaddr_in *addr)
+{
+    socket_t *socket;
+    int err = get_socket(fd, &socket);
+    if (err)
+    {
+        return err;
+    }
+    if (flags & ~MSG_DONTWAIT)
+    {
+        return -EOPNOTSUPP;
+    }
+    return socket_receive(socket, buf, size, addr, (flags & MSG_DONTWAIT) || FILE_NONBLOCK(get_file(fd)));
+}
+
+/*
+ * Receives up to vlen datagrams in one call, msg_len of each message is set to the size of its payload.
+ * Blocks until vlen datagrams are received or timeout (NULL - forever) expires, MSG_WAITFORONE stops waiting after
+ * the first one. Datagrams already queued are taken from the socket in batches. Stream sockets aren't supported.
+ */
+int sys_recvmmsg(int fd, struct mmsghdr *msgvec, uint32_t vlen, int flags, struct timespec *timeout)
+{
+    socket_t *socket;
+    int err = get_socket(fd, &socket);
+    if (err)
+    {
+        return err;
+    }
+    if (socket->type != SOCK_DGRAM)
+    {
+        return -EOPNOTSUPP;
+    }
+    if (flags & ~(MSG_DONTWAIT | MSG_WAITFORONE))
+    {
+        return -EOPNOTSUPP;
+    }
+    if (timeout != 0 && (timeout->tv_sec < 0 || timeout->tv_nsec < 0 || timeout->tv_nsec >= 1000000000))
+    {
+        return -EINVAL;
+    }
+    if (socket->udp == 0 || vlen == 0)
+    {
+        return socket->udp == 0 && vlen != 0 ? -EAGAIN : 0;
+    }
+
+    uint8_t nonblock = (flags & MSG_DONTWAIT) || FILE_NONBLOCK(get_file(fd));
+    uint32_t finish = 0;
+    if (timeout != 0)
+    {
+        finish = get_pit_ticks() + ms_to_ticks(timeout->tv_sec * 1000 + timeout->tv_nsec / 1000000);
+    }
+
+    uint32_t received = 0;
+    net_buffer_t *buffers[RECVMMSG_BATCH];
+    while (received < vlen)
+    {
+        uint32_t wait = UDP_WAIT_FOREVER;
+        if (nonblock || (received > 0 && (flags & MSG_WAITFORONE)))
+        {
+            wait = 0;
+        }
+        else if (timeout != 0)
+        {
+            uint32_t now = get_pit_ticks();
+            wait = finish > now ? finish - now : 0;
+        }
+
+        uint32_t count = receive_udp_packets(socket->udp, buffers, MIN(vlen - received, RECVMMSG_BATCH), wait);
+        if (count == 0)
+        {
+            break;
+        }
+        for (uint32_t i = 0; i < count; i++)
+        {
+            // batch is never bigger than the rest of msgvec, but filtered datagrams leave free slots
+            struct msghdr *msg = &msgvec[received].msg_hdr;
+            struct sockaddr_in *addr = msg->msg_name != 0 && msg->msg_namelen >= sizeof(struct sockaddr_in) ? msg->msg_name : 0;
+            uint8_t truncated;
+            int copied = deliver_datagram(socket, buffers[i], msg->msg_iov, msg->msg_iovlen, addr, &truncated);
+            if (copied < 0)
+            {
+                continue;
+            }
+            if (addr != 0)
+            {
+                msg->msg_namelen = sizeof(struct sockaddr_in);
+            }
+            msg->msg_controllen = 0;
+            msg->msg_flags = truncated ? MSG_TRUNC : 0;
+            msgvec[received++].msg_len = copied;
+        }
+    }
+    return received > 0 ? (int)received : -EAGAIN;
+}
+
+static int socket_read(vfs_file_t *file, void *buf, uint32_t size, uint32_t *offset)
+{
+    return socket_receive(file->node->obj, buf, size, 0, FILE_NONBLOCK(file));
+}
+
+static int socket_write(vfs_file_t *file, void *buf, uint32_t size, uint32_t *offset)
+{
+    return socket_send(file->node->obj, buf, size, 0, FILE_NONBLOCK(file));
+}
+
+// called for every descriptor of the socket, the last one releases it
+static int socket_close(vfs_file_t *file)
+{
+    vfs_node_t *node = file->node;
+    if (ref_dec(&node->ref_count) == 0)
+    {
+        release_socket(node->obj);
+        kfree(node);
+    }
+    return 0;
+}
+
+static uint32_t socket_poll(vfs_file_t *file, poll_table_t *table)
+{
+    socket_t *socket = file->node->obj;
+    if (socket->udp != 0)
+    {
+        poll_wait(table, &socket->udp->wait);
+        return udp_poll_events(socket->udp);
+    }
+    if (socket->tcp != 0)
+    {
+        poll_wait(table, &socket->tcp->wait);
+        return tcp_poll_events(socket->tcp);
+    }
+    if (socket->listening)
+    {
+        poll_wait(table, &socket->binder->accept_queue);
+        return tcp_binder_poll_events(socket->binder);
+    }
+    // unbound datagram socket can send, new stream socket has nothing to report
+    return socket->type == SOCK_DGRAM ? POLLOUT : 0;
+}
@@ -2,35 +2,217 @@
 #include "pit.h"
 #include "mutex.h"
 #include "task.h"
+#include "irq.h"
 #include "liballoc.h"
 #include "string.h"
 #include "log.h"
-
-#define TCP_SOCKET_BUFFER_SIZE 65535
+#include "checksum.h"
+#include "poll.h"
+#include "route.h"
+
+// buffers start small, so idle and half-open connections are cheap, and grow while they limit the window
+#define TCP_SOCKET_BUFFER_SIZE (16 * 1024)
+// large buffers fill high bandwidth-delay paths, window scale of 6 covers 4MB
+#define TCP_SOCKET_MAX_BUFFER_SIZE (2 * 1024 * 1024)
 #define TCP_SOCKET_RING_SIZE 128
+// out-of-order segments hold net buffers from the shared pool
+#define TCP_OOO_MAX_SEGMENTS 128
 #define TCP_CONNECT_TIMEOUT 5000
-
-// TCP sockets data must be stored in net_dev, but i have no plans to support machines with 2+ lan cards
+#define TCP_INITIAL_WINDOW (10 * TCP_MAX_PAYLOAD_SIZE)
+#define TCP_DUP_ACK_THRESHOLD 3
+// RFC 6298 suggests 1s minimum, it's far above RTT of a LAN, so 200ms like other stacks
+#define TCP_RTO_INITIAL 1000
+#define TCP_RTO_MIN 200
+#define TCP_RTO_MAX 60000
+#define TCP_MAX_RETRANSMITS 10
+// half-open connection gives up sooner, its slot in the listener's backlog is taken meanwhile
+#define TCP_MAX_SYNACK_RETRANSMITS 3
+
+/*
+ * RX thread demultiplexes segments through the connection hash (4-tuple) or, for new connections, the port table
+ * of listeners, queues the segment on the socket and the socket on TCP worker. Worker handles only sockets with
+ * pending input, output or expired timer, so per-packet cost doesn't depend on number of connections.
+ * Sockets, hash and binders are protected by tcp_mutex, worker queue is IRQ-safe.
+ */
+
+// bound ports and listeners
 tcp_socket_binder_t **tcp_binders = 0;
-mutex_t tcp_binders_mutex = {0};
+static tcp_socket_t *connections[TCP_HASH_SIZE];
+static mutex_t tcp_mutex = {0};
+
+static tcp_socket_t *pending_head = 0;
+static tcp_socket_t *pending_tail = 0;
+static wait_queue_t worker_queue;
+
+static tcp_socket_t *timers = 0;
+static uint32_t next_timer = 0; // earliest deadline of timers, 0 - no timers
 
 uint8_t send_tcp_packet(tcp_socket_t *socket, uint8_t flags, void* payload, uint16_t size);
+uint8_t send_tcp_buffer(tcp_socket_t *socket, uint8_t flags, net_buffer_t *buffer);
+static void transmit_segment(tcp_socket_t *socket, uint8_t flags, uint32_t seq_number, net_buffer_t *buffer);
+static void free_ooo_queue(tcp_socket_t *socket);
+static void leave_half_open(tcp_socket_t *socket);
 
-tcp_socket_t *get_tcp_socket_by_remote(tcp_socket_t *list, ip4_addr_t *ip, uint16_t port)
+static uint32_t connection_hash(ip4_addr_t *local, uint16_t port, ip4_addr_t *remote, uint16_t remote_port)
 {
-    tcp_socket_t *current = list;
-    while(current != 0)
+    uint32_t hash = local->addr ^ remote->addr ^ (((uint32_t)remote_port << 16) | port);
+    hash ^= hash >> 16;
+    hash *= 0x45D9F3B;
+    hash ^= hash >> 16;
+    return hash & (TCP_HASH_SIZE - 1);
+}
+
+tcp_socket_t *lookup_connection(ip4_addr_t *local, uint16_t port, ip4_addr_t *remote, uint16_t remote_port)
+{
+    tcp_socket_t *socket = connections[connection_hash(local, port, remote, remote_port)];
+    for (; socket != 0; socket = socket->hash_next)
     {
-        if (current->remote_port == port && COMPARE_IP4_ADDR(current->remote_host, *ip))
+        if (socket->port == port && socket->remote_port == remote_port
+            && COMPARE_IP4_ADDR(socket->remote_host, *remote) && COMPARE_IP4_ADDR(socket->local_host, *local))
         {
-            return current;
+            return socket;
         }
-        current = (tcp_socket_t*)current->list.next;
     }
-
     return 0;
 }
 
+void hash_connection(tcp_socket_t *socket)
+{
+    uint32_t index = connection_hash(&socket->local_host, socket->port, &socket->remote_host, socket->remote_port);
+    socket->hash_next = connections[index];
+    connections[index] = socket;
+    socket->hashed = 1;
+}
+
+void unhash_connection(tcp_socket_t *socket)
+{
+    if (!socket->hashed)
+    {
+        return;
+    }
+    uint32_t index = connection_hash(&socket->local_host, socket->port, &socket->remote_host, socket->remote_port);
+    tcp_socket_t **p = &connections[index];
+    while (*p != socket)
+    {
+        p = &(*p)->hash_next;
+    }
+    *p = socket->hash_next;
+    socket->hashed = 0;
+}
+
+// queues socket for TCP worker, callable from any thread
+static void tcp_mark_pending(tcp_socket_t *socket, uint8_t flags)
+{
+    uint32_t irq = irq_save();
+    socket->pending |= flags;
+    if (!socket->queued)
+    {
+        socket->queued = 1;
+        socket->pending_next = 0;
+        if (pending_tail != 0)
+        {
+            pending_tail->pending_next = socket;
+        }
+        else
+        {
+            pending_head = socket;
+        }
+        pending_tail = socket;
+    }
+    irq_restore(irq);
+    wake_up(&worker_queue, WAIT_ANY_KEY, 0);
+}
+
+static void unqueue_pending(tcp_socket_t *socket)
+{
+    uint32_t irq = irq_save();
+    if (socket->queued)
+    {
+        tcp_socket_t *prev = 0;
+        tcp_socket_t *current = pending_head;
+        while (current != socket)
+        {
+            prev = current;
+            current = current->pending_next;
+        }
+        if (prev != 0)
+        {
+            prev->pending_next = socket->pending_next;
+        }
+        else
+        {
+            pending_head = socket->pending_next;
+        }
+        if (pending_tail == socket)
+        {
+            pending_tail = prev;
+        }
+        socket->queued = 0;
+    }
+    irq_restore(irq);
+}
+
+// tcp_mutex is held
+void arm_timer(tcp_socket_t *socket, uint32_t deadline)
+{
+    socket->ttl = deadline;
+    if (!socket->timer_armed)
+    {
+        socket->timer_next = timers;
+        timers = socket;
+        socket->timer_armed = 1;
+    }
+    if (next_timer == 0 || deadline < next_timer)
+    {
+        next_timer = deadline;
+    }
+}
+
+static void disarm_timer(tcp_socket_t *socket)
+{
+    if (!socket->timer_armed)
+    {
+        return;
+    }
+    tcp_socket_t **p = &timers;
+    while (*p != socket)
+    {
+        p = &(*p)->timer_next;
+    }
+    *p = socket->timer_next;
+    socket->timer_armed = 0;
+}
+
+// expired timers become pending work, list holds only sockets with armed timer
+static void run_timers()
+{
+    uint32_t now = get_pit_ticks();
+    next_timer = 0;
+    tcp_socket_t **p = &timers;
+    while (*p != 0)
+    {
+        tcp_socket_t *socket = *p;
+        if (socket->ttl <= now)
+        {
+            *p = socket->timer_next;
+            socket->timer_armed = 0;
+            tcp_mark_pending(socket, TCP_PENDING_TIMER);
+            continue;
+        }
+        if (next_timer == 0 || socket->ttl < next_timer)
+        {
+            next_timer = socket->ttl;
+        }
+        p = &socket->timer_next;
+    }
+}
+
+// largest segment payload fitting into MTU of the device, options excluded
+static uint32_t tcp_device_mss(network_device_t *net_dev)
+{
+    return net_dev->mtu - sizeof(ip4_header_t) - sizeof(tcp_header_t);
+}
+
 tcp_socket_t *create_tcp_socket(network_device_t *net_dev, uint16_t port, ip4_addr_t *remote_ip, uint16_t remote_port)
 {
     tcp_socket_t *socket = kmalloc(sizeof(tcp_socket_t));
@@ -40,6 +222,14 @@ tcp_socket_t *create_tcp_socket(network_device_t *net_dev, uint16_t port, ip4_ad
     socket->remote_host = *remote_ip;
     socket->port = port;
     socket->net_dev = net_dev;
+    // initial sequence number from 4us clock as in RFC 793
+    socket->seq_number = get_pit_ticks() * 250;
+    socket->snd_una = socket->seq_number;
+    socket->snd_max = socket->seq_number;
+    socket->cwnd = TCP_INITIAL_WINDOW;
+    socket->ssthresh = 0xFFFFFFFF;
+    socket->rto = TCP_RTO_INITIAL;
+    socket->mss = tcp_device_mss(net_dev);
     socket->ring = create_ring(TCP_SOCKET_RING_SIZE);
     socket->receive_buffer = create_buffer(TCP_SOCKET_BUFFER_SIZE);
     socket->transmit_buffer = create_buffer(TCP_SOCKET_BUFFER_SIZE);
@@ -47,523 +237,1433 @@ tcp_socket_t *create_tcp_socket(network_device_t *net_dev, uint16_t port, ip4_ad
     return socket;
 }
 
-void process_tcp_packet(network_device_t *net_dev, void* packet)
+// connection left SYN_RECEIVED, it doesn't take a slot of the listener's backlog anymore; tcp_mutex is held
+static void leave_half_open(tcp_socket_t *socket)
+{
+    if (socket->half_open)
+    {
+        socket->half_open = 0;
+        if (socket->binder != 0)
+        {
+            socket->binder->syn_count--;
+        }
+    }
+}
+
+/*
+ * Doubles the buffer up to TCP_SOCKET_MAX_BUFFER_SIZE, window beyond 64KB needs window scale (shift of the window
+ * the buffer backs) negotiated in SYN.
+ */
+static void grow_tcp_buffer(buffer_t *buffer, uint8_t window_scale)
+{
+    uint32_t limit = window_scale != 0 ? TCP_SOCKET_MAX_BUFFER_SIZE : 0x10000;
+    if (buffer->size < limit)
+    {
+        buffer->resize(buffer, buffer->size * 2 < limit ? buffer->size * 2 : limit);
+    }
+}
+
+// tcp_mutex is held
+static void free_tcp_socket(tcp_socket_t *socket)
+{
+    unhash_connection(socket);
+    disarm_timer(socket);
+    unqueue_pending(socket);
+    leave_half_open(socket);
+    if (socket->in_accept_queue)
+    {
+        delete_from_list((void*)&socket->binder->accept_wait, socket);
+        socket->binder->accept_count--;
+    }
+
+    free_ooo_queue(socket);
+    net_buffer_t *buffer;
+    while ((buffer = socket->ring->pop(socket->ring)) != 0)
+    {
+        release_net_buffer(buffer);
+    }
+    socket->ring->free(socket->ring);
+    socket->transmit_buffer->free(socket->transmit_buffer);
+    socket->receive_buffer->free(socket->receive_buffer);
+    kfree(socket);
+}
+
+static uint8_t buffer_is_empty(buffer_t *buffer)
+{
+    return buffer->head == buffer->tail && !buffer->is_full;
+}
+
+// remote side can still send data
+static uint8_t tcp_can_receive(tcp_socket_t *socket)
 {
-    tcp_packet_t *tcp_packet = packet;
-    create_tcp_socket(net_dev, bswap16(tcp_packet->tcp.destination_port), &tcp_packet->ip.source_ip, bswap16(tcp_packet->tcp.source_port));
+    return socket->state == TCP_CONNECTION_SYN_SENT || socket->state == TCP_CONNECTION_SYN_RECEIVED
+        || socket->state == TCP_CONNECTION_ESTABLISHED || socket->state == TCP_CONNECTION_FIN_1
+        || socket->state == TCP_CONNECTION_FIN_2;
+}
+
+// segment for existing connection or SYN for listener, called by RX thread; the socket ring takes the buffer
+void process_tcp_packet(network_device_t *net_dev, net_buffer_t *buffer)
+{
+    tcp_packet_t *tcp_packet = (tcp_packet_t*)buffer->data;
+    uint32_t header_size = sizeof(ip4_header_t) + tcp_packet->tcp.data_offset * 4;
+    if (buffer->len < sizeof(tcp_packet_t) || tcp_packet->tcp.data_offset * 4 < sizeof(tcp_header_t)
+        || bswap16(tcp_packet->ip.total_size) < header_size || !ip4_payload_valid(buffer))
+    {
+        release_net_buffer(buffer);
+        return;
+    }
+
     uint16_t port = bswap16(tcp_packet->tcp.destination_port);
+    uint16_t remote_port = bswap16(tcp_packet->tcp.source_port);
 
-    if (tcp_binders[port] != 0)
+    mutex_lock(&tcp_mutex);
+    tcp_socket_t *socket = lookup_connection(&tcp_packet->ip.destination_ip, port, &tcp_packet->ip.source_ip, remote_port);
+
+    // connection lookup goes first, so SYN for a connection in TIME_WAIT doesn't create second socket
+    uint8_t syn = (tcp_packet->tcp.flags & (TCP_FLAG_SYN | TCP_FLAG_ACK | TCP_FLAG_RST)) == TCP_FLAG_SYN;
+    tcp_socket_binder_t *binder = tcp_binders[port];
+    // SYN beyond backlog is dropped, the peer retransmits it
+    if (socket == 0 && syn && binder != 0 && binder->is_listening && (binder->net_dev == 0 || binder->net_dev == net_dev)
+        && binder->syn_count < binder->backlog && binder->accept_count < binder->backlog)
+    {
+        socket = create_tcp_socket(net_dev, port, &tcp_packet->ip.source_ip, remote_port);
+        socket->local_host = tcp_packet->ip.destination_ip;
+        socket->binder = binder;
+        socket->half_open = 1;
+        binder->syn_count++;
+        hash_connection(socket);
+    }
+
+    if (socket == 0)
+    {
+        //debug("[tcp] received packet for unknown socket from port %i\n", remote_port);
+        mutex_release(&tcp_mutex);
+        release_net_buffer(buffer);
+        return;
+    }
+
+    if (!net_buffer_charge(&socket->rx_buffers, buffer))
+    {
+        release_net_buffer(buffer);
+    }
+    else if (socket->ring->push(socket->ring, buffer) == RING_BUFFER_OK)
+    {
+        tcp_mark_pending(socket, TCP_PENDING_INPUT);
+    }
+    else
+    {
+        //debug("[tcp] socket ring is full\n");
+        net_buffer_uncharge(&socket->rx_buffers, buffer);
+        release_net_buffer(buffer);
+    }
+    mutex_release(&tcp_mutex);
+}
+
+static void enter_time_wait(tcp_socket_t *socket)
+{
+    // connection which wasn't established has no old duplicates to wait for, it's removed at once
+    uint8_t established = socket->state != TCP_CONNECTION_CLOSED && socket->state != TCP_CONNECTION_SYN_RECEIVED;
+    leave_half_open(socket);
+    socket->state = TCP_CONNECTION_TIME_WAIT;
+    arm_timer(socket, get_pit_ticks() + (established ? TCP_SOCKET_TIME_WAIT : 1));
+}
+
+static uint32_t read_be32(uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void write_be32(uint8_t *p, uint32_t value)
+{
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+static void parse_tcp_options(tcp_packet_t *packet, tcp_options_t *options)
+{
+    memset(options, 0, sizeof(tcp_options_t));
+    uint8_t *option = (uint8_t*)&packet->tcp + sizeof(tcp_header_t);
+    uint8_t *end = (uint8_t*)&packet->tcp + packet->tcp.data_offset * 4;
+    while (option < end && option[0] != TCP_OPTION_END)
+    {
+        if (option[0] == TCP_OPTION_NOP)
+        {
+            option++;
+            continue;
+        }
+        uint8_t length = option + 1 < end ? option[1] : 0;
+        if (length < 2 || option + length > end)
+        {
+            break;
+        }
+
+        if (option[0] == TCP_OPTION_MSS && length == 4)
+        {
+            options->mss = (option[2] << 8) | option[3];
+        }
+        else if (option[0] == TCP_OPTION_WINDOW_SCALE && length == 3)
+        {
+            options->has_window_scale = 1;
+            options->window_scale = option[2] > TCP_MAX_WINDOW_SCALE ? TCP_MAX_WINDOW_SCALE : option[2];
+        }
+        else if (option[0] == TCP_OPTION_SACK_PERMITTED && length == 2)
+        {
+            options->sack_permitted = 1;
+        }
+        else if (option[0] == TCP_OPTION_TIMESTAMP && length == 10)
+        {
+            options->has_timestamp = 1;
+            options->ts_value = read_be32(option + 2);
+            options->ts_echo = read_be32(option + 6);
+        }
+        else if (option[0] == TCP_OPTION_SACK)
+        {
+            for (uint8_t *block = option + 2; block + 8 <= option + length && options->sack_count < TCP_MAX_SACK_BLOCKS; block += 8)
+            {
+                options->sack_left[options->sack_count] = read_be32(block);
+                options->sack_right[options->sack_count] = read_be32(block + 4);
+                options->sack_count++;
+            }
+        }
+        option += length;
+    }
+}
+
+// options are enabled only when both sides sent them in SYN
+static void negotiate_options(tcp_socket_t *socket, tcp_options_t *options)
+{
+    // RFC 1122 default when option is missing
+    uint32_t mss = options->mss != 0 ? options->mss : 536;
+    uint32_t device_mss = tcp_device_mss(socket->net_dev);
+    socket->mss = mss < device_mss ? mss : device_mss;
+    if (options->has_window_scale)
+    {
+        socket->snd_window_scale = options->window_scale;
+        socket->rcv_window_scale = TCP_WINDOW_SCALE;
+    }
+    socket->sack_ok = options->sack_permitted;
+    socket->ts_ok = options->has_timestamp;
+    if (socket->ts_ok)
+    {
+        socket->ts_recent = options->ts_value;
+        // timestamps are in every segment and take space of payload
+        socket->mss -= TCP_TIMESTAMP_OPTION_SIZE;
+    }
+}
+
+static uint32_t segment_seq(tcp_packet_t *packet)
+{
+    return bswap32(packet->tcp.seq_number);
+}
+
+static uint32_t segment_payload_size(tcp_packet_t *packet)
+{
+    return bswap16(packet->ip.total_size) - sizeof(ip4_header_t) - packet->tcp.data_offset * 4;
+}
+
+// sequence number after the segment, FIN takes one
+static uint32_t segment_end(tcp_packet_t *packet)
+{
+    return segment_seq(packet) + segment_payload_size(packet) + ((packet->tcp.flags & TCP_FLAG_FIN) ? 1 : 0);
+}
+
+// FIN is processed only when all data before it is received
+static uint8_t fin_in_order(tcp_socket_t *socket, tcp_packet_t *packet)
+{
+    return (packet->tcp.flags & TCP_FLAG_FIN) && segment_seq(packet) + segment_payload_size(packet) == socket->ack_number;
+}
+
+/*
+ * Keeps segment received beyond ack_number, the queue is sorted by sequence number and holds a reference of the
+ * buffer. Segment is dropped when queue is full, the socket can't be charged for it or it doesn't fit into receive
+ * window.
+ */
+static void ooo_insert(tcp_socket_t *socket, net_buffer_t *buffer)
+{
+    tcp_packet_t *packet = (tcp_packet_t*)buffer->data;
+    uint32_t seq = segment_seq(packet);
+    uint32_t window_end = socket->ack_number + socket->receive_buffer->get_free_space(socket->receive_buffer);
+    if (socket->ooo_count >= TCP_OOO_MAX_SEGMENTS || segment_end(packet) == seq || SEQ_GT(segment_end(packet), window_end))
+    {
+        return;
+    }
+
+    net_buffer_t **p = &socket->ooo_queue;
+    while (*p != 0 && SEQ_LT(segment_seq((tcp_packet_t*)(*p)->data), seq))
+    {
+        p = &(*p)->next;
+    }
+    if (*p != 0 && segment_seq((tcp_packet_t*)(*p)->data) == seq && SEQ_GEQ(segment_end((tcp_packet_t*)(*p)->data), segment_end(packet)))
+    {
+        // duplicate
+        return;
+    }
+    if (!net_buffer_charge(&socket->ooo_buffers, buffer))
+    {
+        return;
+    }
+
+    hold_net_buffer(buffer);
+    buffer->next = *p;
+    *p = buffer;
+    socket->ooo_count++;
+    socket->ooo_last_seq = seq;
+}
+
+static void free_ooo_queue(tcp_socket_t *socket)
+{
+    while (socket->ooo_queue != 0)
+    {
+        net_buffer_t *buffer = socket->ooo_queue;
+        socket->ooo_queue = buffer->next;
+        buffer->next = 0;
+        release_net_buffer(buffer);
+    }
+    socket->ooo_count = 0;
+    socket->ooo_buffers = 0;
+}
+
+void handle_syn_state(tcp_socket_t *socket, uint8_t *reply_flags, tcp_packet_t *packet)
+{
+    if (packet->tcp.flags == (TCP_FLAG_ACK | TCP_FLAG_SYN) && socket->snd_una == socket->snd_max)
+    {
+        uint32_t seq_number = bswap32(packet->tcp.seq_number);
+        socket->ack_number = seq_number + 1;
+        *reply_flags |= TCP_FLAG_ACK;
+        socket->state = TCP_CONNECTION_ESTABLISHED;
+        //debug("[tcp] connected to remote port %i\n", socket->remote_port);
+    }
+    else
+    {
+        *reply_flags |= TCP_FLAG_RST;
+    }
+}
+
+// segment starts at or before ack_number, already received part is skipped; jumbo segment spans fragments
+void handle_received_payload(tcp_socket_t *socket, uint8_t *reply_flags, net_buffer_t *buffer)
+{
+    tcp_packet_t *packet = (tcp_packet_t*)buffer->data;
+    uint32_t payload_size = segment_payload_size(packet);
+    uint32_t skip = socket->ack_number - segment_seq(packet);
+    if (payload_size > skip)
+    {
+        payload_size -= skip;
+        if (payload_size <= socket->receive_buffer->get_free_space(socket->receive_buffer))
+        {
+            uint32_t offset = sizeof(ip_packet_t) + packet->tcp.data_offset * 4 + skip;
+            uint32_t left = payload_size;
+            for (net_buffer_t *frag = buffer; frag != NULL && left > 0; frag = frag->next_frag)
+            {
+                if (offset >= frag->len)
+                {
+                    offset -= frag->len;
+                    continue;
+                }
+                uint32_t chunk = frag->len - offset < left ? frag->len - offset : left;
+                socket->receive_buffer->add(socket->receive_buffer, frag->data + offset, chunk);
+                left -= chunk;
+                offset = 0;
+            }
+            socket->ack_number += payload_size;
+        }
+        else
+        {
+            // Simply print debug message, remote host will receive our window size in reply.
+            // Probably socket must wait some time for a free space in buffer and only then ask about packet resend.
+            //debug("[tcp] not enough free space in receive_buffer, remote port %i\n", socket->remote_port);
+        }
+
+        *reply_flags |= TCP_FLAG_ACK;
+    }
+}
+
+void handle_established_state(tcp_socket_t *socket, uint8_t *reply_flags, net_buffer_t *buffer)
+{
+    tcp_packet_t *packet = (tcp_packet_t*)buffer->data;
+    handle_received_payload(socket, reply_flags, buffer);
+
+    if (fin_in_order(socket, packet))
+    {
+        socket->state = TCP_CONNECTION_CLOSE_WAIT;
+        *reply_flags |= TCP_FLAG_ACK;
+        socket->ack_number++;
+        //debug("[tcp] received FIN from remote port %i, socket state is CLOSE_WAIT\n", socket->remote_port);
+    }
+}
+
+void handle_syn_received_state(tcp_socket_t *socket, uint8_t *reply_flags, net_buffer_t *buffer)
+{
+    tcp_packet_t *packet = (tcp_packet_t*)buffer->data;
+    // listener was closed before the handshake finished
+    if (socket->binder == 0)
+    {
+        enter_time_wait(socket);
+        return;
+    }
+    if (packet->tcp.flags & TCP_FLAG_ACK && socket->snd_una == socket->snd_max)
+    {
+        leave_half_open(socket);
+        socket->state = TCP_CONNECTION_ESTABLISHED;
+        add_to_list(socket->binder->accept_wait, socket);
+        socket->in_accept_queue = 1;
+        socket->binder->accept_count++;
+        wake_up(&socket->binder->accept_queue, WAIT_ANY_KEY, 0);
+        //debug("[tcp] established connection on local port %i\n", socket->port);
+
+        handle_established_state(socket, reply_flags, buffer);
+    }
+}
+
+void handle_last_ask_state(tcp_socket_t *socket, uint8_t *reply_flags, tcp_packet_t *packet)
+{
+    // our FIN is acknowledged
+    if (socket->snd_una == socket->snd_max)
+    {
+        enter_time_wait(socket);
+        //debug("[tcp] received LAST_ASK from remote port %i, socket is in TIME_WAIT\n", socket->remote_port);
+    }
+}
+
+void handle_fin_1_state(tcp_socket_t *socket, uint8_t *reply_flags, net_buffer_t *buffer)
+{
+    tcp_packet_t *packet = (tcp_packet_t*)buffer->data;
+    handle_received_payload(socket, reply_flags, buffer);
+
+    if (fin_in_order(socket, packet))
     {
-        mutex_lock(&tcp_binders[port]->mutex);
-        // TODO: add validation for socket state... it can be deleted
-        uint16_t buffer_size = bswap16(tcp_packet->ip.total_size) + sizeof(eth_header_t);
-        uint16_t remote_port = bswap16(tcp_packet->tcp.source_port);
-        tcp_socket_t *socket = 0;
+        *reply_flags |= TCP_FLAG_ACK;
+        socket->ack_number++;
+        enter_time_wait(socket);
+        //debug("[tcp] received LAST_ASK AND FIN from remote port %i, socket is in TIME_WAIT\n", socket->remote_port);
+    }
+}
 
-        // try to find socket
-        if (socket == 0)
+void handle_closed_state(tcp_socket_t *socket, uint8_t *reply_flags, tcp_packet_t *packet)
+{
+    if ((packet->tcp.flags & (TCP_FLAG_SYN | TCP_FLAG_ACK)) == TCP_FLAG_SYN && socket->binder != 0 && socket->binder->is_listening == 1)
+    {
+        uint32_t seq_number = bswap32(packet->tcp.seq_number);
+        socket->ack_number = seq_number + 1;
+        // SYN goes out with the reply, see process_output()
+        *reply_flags |= TCP_FLAG_ACK;
+        socket->state = TCP_CONNECTION_SYN_RECEIVED;
+    }
+    else
+    {
+        // Socket is created only for SYN to listening port, it's just a failsafe.
+        enter_time_wait(socket);
+    }
+}
+
+void handle_fin_2_state(tcp_socket_t *socket, uint8_t *reply_flags, net_buffer_t *buffer)
+{
+    tcp_packet_t *packet = (tcp_packet_t*)buffer->data;
+    // remote side can still send data after our FIN
+    handle_received_payload(socket, reply_flags, buffer);
+
+    if (fin_in_order(socket, packet))
+    {
+        *reply_flags |= TCP_FLAG_ACK;
+        socket->ack_number++;
+        enter_time_wait(socket);
+        //debug("[tcp] closing connection with remote port %i, local socket moved to TIME_WAIT state\n", socket->remote_port);
+    }
+}
+
+static void restart_retransmit_timer(tcp_socket_t *socket)
+{
+    if (socket->state == TCP_CONNECTION_TIME_WAIT)
+    {
+        return;
+    }
+    if (socket->snd_una == socket->snd_max && socket->probe == 0)
+    {
+        disarm_timer(socket);
+    }
+    else
+    {
+        arm_timer(socket, get_pit_ticks() + socket->rto);
+    }
+}
+
+// RFC 6298, srtt and rttvar are scaled by 8 and 4 to keep precision of sub-tick parts
+static void update_rtt(tcp_socket_t *socket, uint32_t rtt)
+{
+    if (!socket->rtt_measured)
+    {
+        socket->srtt = rtt << 3;
+        socket->rttvar = rtt << 1;
+        socket->rtt_measured = 1;
+    }
+    else
+    {
+        int32_t delta = rtt - (socket->srtt >> 3);
+        socket->srtt += delta;
+        if (delta < 0)
         {
-            socket = get_tcp_socket_by_remote(tcp_binders[port]->connected, &tcp_packet->ip.source_ip, remote_port);
+            delta = -delta;
         }
-        if (socket == 0)
+        socket->rttvar += delta - (socket->rttvar >> 2);
+    }
+
+    // clock granularity is 1 tick
+    uint32_t rto = (socket->srtt >> 3) + (socket->rttvar > 1 ? socket->rttvar : 1);
+    socket->rto = rto < TCP_RTO_MIN ? TCP_RTO_MIN : (rto > TCP_RTO_MAX ? TCP_RTO_MAX : rto);
+}
+
+// sends up to size bytes starting at seq again, sequence space of the socket isn't changed
+static void retransmit_segment(tcp_socket_t *socket, uint32_t seq, uint32_t size)
+{
+    net_buffer_t *buffer = alloc_net_buffer();
+    if (buffer == 0)
+    {
+        return;
+    }
+    uint32_t offset = seq - socket->snd_una;
+    uint32_t used = socket->transmit_buffer->get_used(socket->transmit_buffer);
+    uint32_t left = used > offset ? used - offset : 0;
+    size = left < size ? left : size;
+    socket->transmit_buffer->peek(socket->transmit_buffer, net_buffer_put(buffer, size), offset, size);
+
+    uint8_t flags = TCP_FLAG_ACK;
+    if (socket->fin_sent && size == left)
+    {
+        flags |= TCP_FLAG_FIN;
+    }
+    transmit_segment(socket, flags, seq, buffer);
+}
+
+static void sack_scoreboard_remove(tcp_socket_t *socket, uint8_t index)
+{
+    socket->sack_count--;
+    for (uint8_t i = index; i < socket->sack_count; i++)
+    {
+        socket->sack_left[i] = socket->sack_left[i + 1];
+        socket->sack_right[i] = socket->sack_right[i + 1];
+    }
+}
+
+// SACK scoreboard holds blocks above snd_una sorted by sequence number, adjacent blocks are merged
+static void sack_scoreboard_add(tcp_socket_t *socket, uint32_t left, uint32_t right)
+{
+    left = SEQ_LT(left, socket->snd_una) ? socket->snd_una : left;
+    right = SEQ_GT(right, socket->snd_max) ? socket->snd_max : right;
+    if (!SEQ_LT(left, right))
+    {
+        return;
+    }
+
+    uint8_t i = 0;
+    while (i < socket->sack_count)
+    {
+        if (SEQ_LEQ(socket->sack_left[i], right) && SEQ_LEQ(left, socket->sack_right[i]))
         {
-            socket = get_tcp_socket_by_remote(tcp_binders[port]->handshake, &tcp_packet->ip.source_ip, remote_port);
+            left = SEQ_LT(socket->sack_left[i], left) ? socket->sack_left[i] : left;
+            right = SEQ_GT(socket->sack_right[i], right) ? socket->sack_right[i] : right;
+            sack_scoreboard_remove(socket, i);
+            continue;
         }
-        if (socket == 0)
+        i++;
+    }
+
+    uint8_t position = 0;
+    while (position < socket->sack_count && SEQ_LT(socket->sack_left[position], left))
+    {
+        position++;
+    }
+    if (position == TCP_MAX_SACK_BLOCKS)
+    {
+        // lowest holes are repaired first, the highest block can be forgotten
+        return;
+    }
+    if (socket->sack_count == TCP_MAX_SACK_BLOCKS)
+    {
+        socket->sack_count--;
+    }
+    for (uint8_t i = socket->sack_count; i > position; i--)
+    {
+        socket->sack_left[i] = socket->sack_left[i - 1];
+        socket->sack_right[i] = socket->sack_right[i - 1];
+    }
+    socket->sack_left[position] = left;
+    socket->sack_right[position] = right;
+    socket->sack_count++;
+}
+
+static void sack_scoreboard_clean(tcp_socket_t *socket)
+{
+    while (socket->sack_count > 0 && SEQ_LEQ(socket->sack_right[0], socket->snd_una))
+    {
+        sack_scoreboard_remove(socket, 0);
+    }
+}
+
+// retransmits the next hole below the highest SACKed byte (RFC 6675 simplified), returns 0 when there is none
+static uint8_t retransmit_next_hole(tcp_socket_t *socket)
+{
+    uint32_t seq = SEQ_LT(socket->rexmit_next, socket->snd_una) ? socket->snd_una : socket->rexmit_next;
+    for (uint8_t i = 0; i < socket->sack_count; i++)
+    {
+        if (SEQ_GEQ(seq, socket->sack_right[i]))
         {
-            socket = get_tcp_socket_by_remote(tcp_binders[port]->accept_wait, &tcp_packet->ip.source_ip, remote_port);
+            continue;
         }
+        if (SEQ_GEQ(seq, socket->sack_left[i]))
+        {
+            seq = socket->sack_right[i];
+            continue;
+        }
+
+        uint32_t size = socket->sack_left[i] - seq;
+        size = size < socket->mss ? size : socket->mss;
+        retransmit_segment(socket, seq, size);
+        socket->rexmit_next = seq + size;
+        return 1;
+    }
+    return 0;
+}
+
+static void enter_fast_recovery(tcp_socket_t *socket)
+{
+    uint32_t flight = socket->snd_max - socket->snd_una;
+    socket->ssthresh = flight / 2 > 2 * socket->mss ? flight / 2 : 2 * socket->mss;
+    socket->recover = socket->snd_max;
+    socket->in_recovery = 1;
+    socket->rtt_timing = 0;
+    socket->rexmit_next = socket->snd_una;
+    if (!retransmit_next_hole(socket))
+    {
+        retransmit_segment(socket, socket->snd_una, socket->mss);
+        socket->rexmit_next = socket->snd_una + socket->mss;
+    }
+    socket->cwnd = socket->ssthresh + TCP_DUP_ACK_THRESHOLD * socket->mss;
+    //debug("[tcp] fast retransmit to remote port %i\n", socket->remote_port);
+}
 
-        // if no our side has no socket and packet is connection request and system listens local port -> create new socket
-        // this block of code must be after get_tcp_socket_by_remote() because system can receive request for socket in TIME_WAIT state
-        if (socket == 0 && tcp_binders[port]->is_listening == 1 && tcp_packet->tcp.flags == TCP_FLAG_SYN)
+// NewReno (RFC 5681, RFC 6582), lost segments are found through SACK when the peer supports it
+static void process_ack(tcp_socket_t *socket, tcp_packet_t *packet, tcp_options_t *options)
+{
+    uint32_t ack = bswap32(packet->tcp.ack_number);
+    // window in SYN is never scaled
+    uint32_t window = bswap16(packet->tcp.window_size);
+    if (!(packet->tcp.flags & TCP_FLAG_SYN))
+    {
+        window <<= socket->snd_window_scale;
+    }
+    int32_t acked = (int32_t)(ack - socket->snd_una);
+    if (acked < 0 || SEQ_GT(ack, socket->snd_max))
+    {
+        // old or acknowledges something which wasn't sent
+        return;
+    }
+
+    for (uint8_t i = 0; socket->sack_ok && i < options->sack_count; i++)
+    {
+        sack_scoreboard_add(socket, options->sack_left[i], options->sack_right[i]);
+    }
+
+    if (acked == 0)
+    {
+        // duplicate ACK: nothing new, no data, same window and something is in flight
+        if (segment_payload_size(packet) == 0 && window == socket->remote_window_size && socket->snd_max != socket->snd_una)
         {
-            socket = create_tcp_socket(net_dev, port, &tcp_packet->ip.source_ip, bswap16(tcp_packet->tcp.source_port));
-            socket->state = TCP_CONNECTION_CLOSED;
-            add_to_list(tcp_binders[port]->handshake, socket);
-            mutex_release(&tcp_binders[port]->mutex);
+            socket->dup_acks++;
+            if (socket->dup_acks == TCP_DUP_ACK_THRESHOLD && !socket->in_recovery)
+            {
+                enter_fast_recovery(socket);
+            }
+            else if (socket->dup_acks > TCP_DUP_ACK_THRESHOLD && socket->in_recovery)
+            {
+                // every duplicate means a segment left the network
+                socket->cwnd += socket->mss;
+                retransmit_next_hole(socket);
+            }
+        }
+        socket->remote_window_size = window;
+        return;
+    }
+
+    // new data is acknowledged, data is dropped from transmit_buffer, SYN and FIN have no bytes there
+    socket->transmit_buffer->drop(socket->transmit_buffer, acked);
+    socket->snd_una = ack;
+    if (SEQ_LT(socket->seq_number, ack))
+    {
+        // ACK for data sent before retransmission timeout rewind
+        socket->seq_number = ack;
+    }
+    sack_scoreboard_clean(socket);
+    socket->remote_window_size = window;
+    socket->dup_acks = 0;
+    socket->retransmits = 0;
+    wake_up(&socket->wait, WAIT_ANY_KEY, 0);
+
+    // echoed timestamp gives RTT sample for every ACK, Karn's algorithm is needed only without it
+    if (socket->ts_ok && options->has_timestamp && options->ts_echo != 0)
+    {
+        update_rtt(socket, get_pit_ticks() - options->ts_echo);
+    }
+    else if (socket->rtt_timing && SEQ_GEQ(ack, socket->rtt_seq))
+    {
+        socket->rtt_timing = 0;
+        update_rtt(socket, get_pit_ticks() - socket->rtt_start);
+    }
 
-            char ip_string[16];
-            memset(&ip_string, 0, 16);
-            ip4_to_str(&tcp_packet->ip.source_ip, ip_string);
-            //debug("[tcp] created new socket for income connection from %s:%i\n", ip_string, remote_port);
+    if (socket->in_recovery)
+    {
+        if (SEQ_GEQ(ack, socket->recover))
+        {
+            socket->in_recovery = 0;
+            socket->cwnd = socket->ssthresh;
+        }
+        else
+        {
+            // partial ACK, next hole is lost too
+            if (!retransmit_next_hole(socket))
+            {
+                retransmit_segment(socket, socket->snd_una, socket->mss);
+            }
+            socket->cwnd = (socket->cwnd > (uint32_t)acked ? socket->cwnd - acked : 0) + socket->mss;
         }
+    }
+    else if (socket->cwnd < socket->ssthresh)
+    {
+        socket->cwnd += (uint32_t)acked < socket->mss ? (uint32_t)acked : socket->mss;
+    }
+    else
+    {
+        uint32_t increment = socket->mss * socket->mss / socket->cwnd;
+        socket->cwnd += increment > 0 ? increment : 1;
+    }
+
+    restart_retransmit_timer(socket);
+}
+
+// go-back-N from the oldest unacknowledged byte with one segment window
+static void retransmit_timeout(tcp_socket_t *socket)
+{
+    if (socket->snd_una == socket->snd_max)
+    {
+        // persist timer, window probe is sent by process_output()
+        if (socket->remote_window_size == 0)
+        {
+            socket->probe = 1;
+        }
+        return;
+    }
+
+    uint8_t max_retransmits = socket->state == TCP_CONNECTION_SYN_RECEIVED ? TCP_MAX_SYNACK_RETRANSMITS : TCP_MAX_RETRANSMITS;
+    if (++socket->retransmits > max_retransmits)
+    {
+        //debug("[tcp] connection to remote port %i timed out\n", socket->remote_port);
+        net_buffer_t *reset = alloc_net_buffer();
+        if (reset != 0)
+        {
+            transmit_segment(socket, TCP_FLAG_RST, socket->seq_number, reset);
+        }
+        enter_time_wait(socket);
+        wake_up(&socket->wait, WAIT_ANY_KEY, 0);
+        return;
+    }
+
+    uint32_t flight = socket->snd_max - socket->snd_una;
+    socket->ssthresh = flight / 2 > 2 * socket->mss ? flight / 2 : 2 * socket->mss;
+    socket->cwnd = socket->mss;
+    socket->seq_number = socket->snd_una;
+    socket->fin_sent = 0;
+    socket->in_recovery = 0;
+    socket->dup_acks = 0;
+    socket->rtt_timing = 0;
+    // receiver may renege on SACKed data (RFC 2018)
+    socket->sack_count = 0;
+    socket->rto = socket->rto * 2 > TCP_RTO_MAX ? TCP_RTO_MAX : socket->rto * 2;
+    // lost window probe is resent into zero window too
+    socket->probe = socket->remote_window_size == 0;
+}
+
+// segment at or before ack_number, handled by state of the socket
+static void process_segment_data(tcp_socket_t *socket, uint8_t *reply_flags, net_buffer_t *buffer)
+{
+    tcp_packet_t *packet = (tcp_packet_t*)buffer->data;
+    if (socket->state == TCP_CONNECTION_SYN_RECEIVED)
+    {
+        handle_syn_received_state(socket, reply_flags, buffer);
+    }
+    else if (socket->state == TCP_CONNECTION_ESTABLISHED)
+    {
+        handle_established_state(socket, reply_flags, buffer);
+    }
+    else if (socket->state == TCP_CONNECTION_CLOSE_WAIT)
+    {
+        // socket ignores all income data packets, we need to send all data in our transmit_buffer and close connection
+    }
+    else if (socket->state == TCP_CONNECTION_LAST_ACK)
+    {
+        handle_last_ask_state(socket, reply_flags, packet);
+    }
+    else if (socket->state == TCP_CONNECTION_FIN_1)
+    {
+        handle_fin_1_state(socket, reply_flags, buffer);
+    }
+    else if (socket->state == TCP_CONNECTION_FIN_2)
+    {
+        handle_fin_2_state(socket, reply_flags, buffer);
+    }
+}
+
+// queued segments which became in order are processed as if they just arrived
+static void ooo_drain(tcp_socket_t *socket, uint8_t *reply_flags)
+{
+    while (socket->ooo_queue != 0 && SEQ_LEQ(segment_seq((tcp_packet_t*)socket->ooo_queue->data), socket->ack_number))
+    {
+        net_buffer_t *buffer = socket->ooo_queue;
+        socket->ooo_queue = buffer->next;
+        buffer->next = 0;
+        socket->ooo_count--;
+        net_buffer_uncharge(&socket->ooo_buffers, buffer);
+
+        tcp_packet_t *packet = (tcp_packet_t*)buffer->data;
+        if (SEQ_GT(segment_end(packet), socket->ack_number))
+        {
+            process_segment_data(socket, reply_flags, buffer);
+        }
+        release_net_buffer(buffer);
+    }
+}
+
+void process_segment(tcp_socket_t *socket, uint8_t *reply_flags, net_buffer_t *buffer)
+{
+    tcp_packet_t *packet = (tcp_packet_t*)buffer->data;
+    if (packet->tcp.flags & TCP_FLAG_RST)
+    {
+        //debug("[tcp] received RST packet from port %i\n", socket->remote_port);
+        enter_time_wait(socket);
+        return;
+    }
+
+    tcp_options_t options;
+    parse_tcp_options(packet, &options);
+    uint8_t synchronized = socket->state != TCP_CONNECTION_CLOSED && socket->state != TCP_CONNECTION_SYN_SENT;
+    if (synchronized && socket->ts_ok && options.has_timestamp && SEQ_LT(options.ts_value, socket->ts_recent))
+    {
+        // PAWS (RFC 7323), old duplicate from previous wrap of sequence numbers
+        *reply_flags |= TCP_FLAG_ACK;
+        return;
+    }
+
+    if (packet->tcp.flags & TCP_FLAG_ACK && socket->state != TCP_CONNECTION_CLOSED)
+    {
+        process_ack(socket, packet, &options);
+    }
+    else
+    {
+        socket->remote_window_size = bswap16(packet->tcp.window_size);
+    }
+
+    if (!synchronized)
+    {
+        if (packet->tcp.flags & TCP_FLAG_SYN)
+        {
+            negotiate_options(socket, &options);
+        }
+        if (socket->state == TCP_CONNECTION_CLOSED)
+        {
+            handle_closed_state(socket, reply_flags, packet);
+        }
+        else
+        {
+            handle_syn_state(socket, reply_flags, packet);
+        }
+        return;
+    }
+
+    uint32_t seq = segment_seq(packet);
+    if (SEQ_GT(seq, socket->ack_number))
+    {
+        // hole before the segment, it waits for reassembly; immediate ACK is duplicate one with SACK blocks
+        ooo_insert(socket, buffer);
+        *reply_flags |= TCP_FLAG_ACK;
+        return;
+    }
+    if (SEQ_LEQ(segment_end(packet), socket->ack_number) && segment_end(packet) != seq)
+    {
+        // everything is already received
+        *reply_flags |= TCP_FLAG_ACK;
+        return;
+    }
+
+    if (socket->ts_ok && options.has_timestamp)
+    {
+        socket->ts_recent = options.ts_value;
+    }
+    process_segment_data(socket, reply_flags, buffer);
+    ooo_drain(socket, reply_flags);
+}
+
+/*
+ * Copies up to size bytes of transmit_buffer starting at offset into buffer, fragments are chained when they don't
+ * fit (TSO). Data stays in transmit_buffer until it's acknowledged, so it serves as retransmission queue.
+ */
+static uint32_t fill_transmit_buffer(tcp_socket_t *socket, net_buffer_t *buffer, uint32_t offset, uint32_t size)
+{
+    uint32_t chunk = size < net_buffer_tailroom(buffer) ? size : net_buffer_tailroom(buffer);
+    uint32_t copied = socket->transmit_buffer->peek(socket->transmit_buffer, buffer->data, offset, chunk);
+    net_buffer_put(buffer, copied);
+
+    net_buffer_t *last = buffer;
+    while (copied == chunk && copied < size)
+    {
+        net_buffer_t *frag = alloc_net_buffer();
+        if (frag == 0)
+        {
+            break;
+        }
+        // fragments carry no headers, whole storage is used
+        frag->data = frag->head;
+        chunk = size - copied < NET_BUFFER_SIZE ? size - copied : NET_BUFFER_SIZE;
+        uint32_t got = socket->transmit_buffer->peek(socket->transmit_buffer, frag->data, offset + copied, chunk);
+        if (got == 0)
+        {
+            release_net_buffer(frag);
+            break;
+        }
+        net_buffer_put(frag, got);
+        last->next_frag = frag;
+        last = frag;
+        copied += got;
+        if (got < chunk)
+        {
+            break;
+        }
+    }
+    return copied;
+}
 
-        if (socket == 0)
+
+// states in which data can be sent, FIN_2 and LAST_ACK have it only after retransmission timeout
+static uint8_t tcp_can_send(tcp_socket_t *socket)
+{
+    return socket->state == TCP_CONNECTION_ESTABLISHED || socket->state == TCP_CONNECTION_CLOSE_WAIT
+        || socket->state == TCP_CONNECTION_FIN_1 || socket->state == TCP_CONNECTION_FIN_2
+        || socket->state == TCP_CONNECTION_LAST_ACK;
+}
+
+// bytes of transmit_buffer which weren't sent since the last rewind
+static uint32_t tcp_unsent(tcp_socket_t *socket)
+{
+    uint32_t sent = socket->seq_number - socket->snd_una - socket->fin_sent;
+    uint32_t used = socket->transmit_buffer->get_used(socket->transmit_buffer);
+    return used > sent ? used - sent : 0;
+}
+
+// window left by congestion control and the receiver
+static uint32_t tcp_usable_window(tcp_socket_t *socket)
+{
+    uint32_t flight = socket->seq_number - socket->snd_una;
+    uint32_t window = socket->cwnd < socket->remote_window_size ? socket->cwnd : socket->remote_window_size;
+    return window > flight ? window - flight : 0;
+}
+
+static void process_output(tcp_socket_t *socket, uint8_t reply_flags)
+{
+    // SYN is sent until it's acknowledged, retransmission timeout rewinds seq_number to resend it
+    if ((socket->state == TCP_CONNECTION_SYN_SENT || socket->state == TCP_CONNECTION_SYN_RECEIVED)
+        && socket->seq_number == socket->snd_una)
+    {
+        reply_flags |= TCP_FLAG_SYN;
+    }
+
+    // payload goes from transmit_buffer straight into the frame
+    net_buffer_t *transmit = alloc_net_buffer();
+    uint32_t copied = 0;
+    if (transmit != 0 && tcp_can_send(socket))
+    {
+        uint32_t max_payload_size = (socket->net_dev->features & NET_FEATURE_TSO) ? TCP_TSO_MAX_PAYLOAD_SIZE : socket->mss;
+        uint32_t window = tcp_usable_window(socket);
+        if (socket->probe)
+        {
+            window = window > 0 ? window : 1;
+            socket->probe = 0;
+        }
+        if (window < max_payload_size)
+        {
+            max_payload_size = window;
+        }
+        uint32_t offset = socket->seq_number - socket->snd_una;
+        copied = fill_transmit_buffer(socket, transmit, offset, max_payload_size);
+    }
+
+    // FIN follows the last byte of data
+    uint8_t closing = socket->state == TCP_CONNECTION_CLOSE_WAIT || socket->state == TCP_CONNECTION_FIN_1
+        || socket->state == TCP_CONNECTION_FIN_2 || socket->state == TCP_CONNECTION_LAST_ACK;
+    if (transmit != 0 && closing && !socket->fin_sent && tcp_unsent(socket) == copied)
+    {
+        reply_flags |= TCP_FLAG_FIN;
+        socket->fin_sent = 1;
+        if (socket->state == TCP_CONNECTION_CLOSE_WAIT)
+        {
+            socket->state = TCP_CONNECTION_LAST_ACK;
+            //debug("[tcp] sending FIN confirm to remote port %i, socket is in LAST_ASK state\n", socket->remote_port);
+        }
+        else if (socket->state == TCP_CONNECTION_FIN_1)
+        {
+            socket->state = TCP_CONNECTION_FIN_2;
+            //debug("[tcp] sending FIN to remote port %i, socket is in FIN_2 state\n", socket->remote_port);
+        }
+    }
+
+    if (transmit != 0 && (copied > 0 || reply_flags != 0))
+    {
+        // one segment at a time is timed, retransmitted ones are not
+        if (copied > 0 && !socket->rtt_timing && socket->seq_number == socket->snd_max)
         {
-            char ip_string[16];
-            memset(&ip_string, 0, 16);
-            ip4_to_str(&tcp_packet->ip.source_ip, ip_string);
-            //debug("[tcp] received packet for unknown socket from %s:%i\n", ip_string, remote_port);
-            mutex_release(&tcp_binders[port]->mutex);
-            return;
+            socket->rtt_timing = 1;
+            socket->rtt_seq = socket->seq_number + copied;
+            socket->rtt_start = get_pit_ticks();
         }
-
-        void *buffer = kmalloc(buffer_size);
-        memcpy(buffer, packet, buffer_size);
-        uint8_t result = socket->ring->push(socket->ring, buffer);
-        if (result != RING_BUFFER_OK)
+        reply_flags |= TCP_FLAG_ACK;
+        send_tcp_buffer(socket, reply_flags, transmit);
+        if (!socket->timer_armed && socket->snd_una != socket->snd_max)
         {
-            //debug("[tcp] socket ring is full\n");
-            hlt();
+            arm_timer(socket, get_pit_ticks() + socket->rto);
         }
     }
-
-    mutex_release(&tcp_binders[port]->mutex);
-}
-
-void handle_syn_state(tcp_socket_t *socket, uint8_t *reply_flags, tcp_packet_t *packet)
-{
-    uint16_t port = socket->port;
-
-    if (packet->tcp.flags == (TCP_FLAG_ACK | TCP_FLAG_SYN))
+    else
     {
-        uint32_t seq_number = bswap32(packet->tcp.seq_number);
-        socket->ack_number = seq_number + 1;
-        *reply_flags |= TCP_FLAG_ACK;
-        socket->state = TCP_CONNECTION_ESTABLISHED;
-        delete_from_list((void*)&tcp_binders[port]->handshake, socket);
-        add_to_list(tcp_binders[port]->connected, socket);
-
-        char ip_string[16];
-        memset(&ip_string, 0, 16);
-        ip4_to_str(&socket->remote_host, ip_string);
-        //debug("[tcp] connected to remote %s:%i\n", ip_string, socket->remote_port);
+        release_net_buffer(transmit);
     }
-    else
+
+    // everything in full transmit_buffer is in flight and the window allows more, so the buffer is the limit
+    buffer_t *transmit_buffer = socket->transmit_buffer;
+    if (tcp_can_send(socket) && transmit_buffer->get_free_space(transmit_buffer) == 0 && tcp_unsent(socket) == 0
+        && tcp_usable_window(socket) >= socket->mss)
     {
-        *reply_flags |= TCP_FLAG_RST;
+        grow_tcp_buffer(transmit_buffer, socket->snd_window_scale);
+        wake_up(&socket->wait, WAIT_ANY_KEY, 0);
     }
-}
 
-void handle_received_payload(tcp_socket_t *socket, uint8_t *reply_flags, tcp_packet_t *packet)
-{
-    uint32_t payload_size = bswap16(packet->ip.total_size) - sizeof(ip4_header_t) - packet->tcp.data_offset * 4;
-    if (payload_size > 0)
+    if (tcp_can_send(socket) && tcp_unsent(socket) > 0)
     {
-        if (payload_size <= socket->receive_buffer->get_free_space(socket->receive_buffer))
+        if (tcp_usable_window(socket) > 0)
         {
-            void* payload = (void*)packet + sizeof(ip_packet_t) + packet->tcp.data_offset * 4;
-            socket->receive_buffer->add(socket->receive_buffer, payload, payload_size);
-            socket->ack_number += payload_size;
-
-            char ip_string[16];
-            memset(&ip_string, 0, 16);
-            ip4_to_str(&socket->remote_host, ip_string);
-            //debug("[tcp] received %i bytes from remote %s:%i\n", payload_size, ip_string, socket->remote_port);
+            // rest of the data goes after other sockets had their turn
+            tcp_mark_pending(socket, TCP_PENDING_OUTPUT);
         }
-        else
+        else if (socket->remote_window_size == 0 && !socket->timer_armed)
         {
-            // Simply print debug message, remote host will receive our window size in reply.
-            // Probably socket must wait some time for a free space in buffer and only then ask about packet resend.
-            char ip_string[16];
-            memset(&ip_string, 0, 16);
-            ip4_to_str(&socket->remote_host, ip_string);
-            //debug("[tcp] not enough free space in receive_buffer, remote: %s:%i\n", ip_string, socket->remote_port);
+            // persist timer, window update could be lost
+            arm_timer(socket, get_pit_ticks() + socket->rto);
         }
-
-        *reply_flags |= TCP_FLAG_ACK;
     }
 }
 
-void handle_established_state(tcp_socket_t *socket, uint8_t *reply_flags, tcp_packet_t *packet)
+// tcp_mutex is held
+static void process_socket(tcp_socket_t *socket, uint8_t pending)
 {
-    handle_received_payload(socket, reply_flags, packet);
-
-    if (packet->tcp.flags & TCP_FLAG_FIN)
+    if ((pending & TCP_PENDING_TIMER) && socket->state == TCP_CONNECTION_TIME_WAIT)
     {
-        socket->state = TCP_CONNECTION_CLOSE_WAIT;
-        *reply_flags |= TCP_FLAG_ACK;
-        socket->ack_number++;
-
-        char ip_string[16];
-        memset(&ip_string, 0, 16);
-        ip4_to_str(&socket->remote_host, ip_string);
-        //debug("[tcp] received FIN from remote: %s:%i, socket state is CLOSE_WAIT\n", ip_string, socket->remote_port);
+        //debug("[tcp] socket for remote port %i removed from TIME_WAIT\n", socket->remote_port);
+        unhash_connection(socket);
+        wake_up(&socket->wait, WAIT_ANY_KEY, 0);
+        // owner frees it in close_tcp_connection()
+        if (!socket->owned)
+        {
+            free_tcp_socket(socket);
+        }
+        return;
     }
-}
-
-void handle_last_ask_state(tcp_socket_t *socket, uint8_t *reply_flags, tcp_packet_t *packet)
-{
-    if (packet->tcp.flags & TCP_FLAG_ACK)
+    // timer could be restarted by ACK after it fired
+    if ((pending & TCP_PENDING_TIMER) && !socket->timer_armed)
     {
-        socket->state = TCP_CONNECTION_TIME_WAIT;
-        socket->ttl = TCP_SOCKET_TIME_WAIT + get_pit_ticks();
-        delete_from_list((void*)&tcp_binders[socket->port]->connected, socket);
-        // TODO: socket must know about own queue, so we don't need to try delete from 2 queues
-        delete_from_list((void*)&tcp_binders[socket->port]->accept_wait, socket);
-        add_to_list(tcp_binders[socket->port]->time_wait, socket);
-
-        char ip_string[16];
-        memset(&ip_string, 0, 16);
-        ip4_to_str(&socket->remote_host, ip_string);
-        //debug("[tcp] received LAST_ASK from remote: %s:%i, socket is moved to time_wait queue\n", ip_string, socket->remote_port);
+        retransmit_timeout(socket);
     }
-}
-
-void handle_fin_1_state(tcp_socket_t *socket, uint8_t *reply_flags, tcp_packet_t *packet)
-{
-    handle_received_payload(socket, reply_flags, packet);
 
-    if (packet->tcp.flags & TCP_FLAG_FIN)
+    // all queued segments are handled before reply, so they are acknowledged at once
+    uint8_t reply_flags = (pending & TCP_PENDING_ACK) ? TCP_FLAG_ACK : 0;
+    net_buffer_t *received;
+    while ((received = socket->ring->pop(socket->ring)) != 0)
     {
-        socket->state = TCP_CONNECTION_TIME_WAIT;
-        *reply_flags |= TCP_FLAG_ACK;
-        socket->ack_number++;
-        socket->ttl = TCP_SOCKET_TIME_WAIT + get_pit_ticks();
-        delete_from_list((void*)&tcp_binders[socket->port]->connected, socket);
-        add_to_list(tcp_binders[socket->port]->time_wait, socket);
-
-        char ip_string[16];
-        memset(&ip_string, 0, 16);
-        ip4_to_str(&socket->remote_host, ip_string);
-        //debug("[tcp] received LAST_ASK AND FIN from remote: %s:%i, socket is moved to time_wait queue\n", ip_string, socket->remote_port);
+        net_buffer_uncharge(&socket->rx_buffers, received);
+        process_segment(socket, &reply_flags, received);
+        release_net_buffer(received);
     }
+    if (pending & TCP_PENDING_INPUT)
+    {
+        wake_up(&socket->wait, WAIT_ANY_KEY, 0);
+    }
+
+    process_output(socket, reply_flags);
 }
 
-void handle_closed_state(tcp_socket_t *socket, uint8_t *reply_flags, tcp_packet_t *packet)
+// one pass of TCP worker: expired timers and sockets with pending work
+void tcp_worker_run()
 {
-    uint16_t port = socket->port;
-    if (packet->tcp.flags == TCP_FLAG_SYN && tcp_binders[port]->is_listening == 1)
+    mutex_lock(&tcp_mutex);
+    if (next_timer != 0 && next_timer <= get_pit_ticks())
     {
-        uint32_t seq_number = bswap32(packet->tcp.seq_number);
-        socket->ack_number = seq_number + 1;
-        *reply_flags |= TCP_FLAG_SYN;
-        socket->state = TCP_CONNECTION_ESTABLISHED;
-        delete_from_list((void*)&tcp_binders[port]->handshake, socket);
-        add_to_list(tcp_binders[port]->accept_wait, socket);
-        char ip_string[16];
-        memset(&ip_string, 0, 16);
-        ip4_to_str(&packet->ip.source_ip, ip_string);
-        //debug("[tcp] established connection on local port %i with remote %s:%i\n", port, ip_string, bswap16(packet->tcp.source_port));
+        run_timers();
     }
-    else
-    {
-        // Probably this code is never executed, because we create new socket only if packet flags are ok and binder is listening.
-        // Just a failsafe.
-        socket->state = TCP_CONNECTION_TIME_WAIT;
-        socket->ttl = TCP_SOCKET_TIME_WAIT + get_pit_ticks();
-        delete_from_list((void*)&tcp_binders[port]->handshake, socket);
-        add_to_list(tcp_binders[port]->time_wait, socket);
 
-        char ip_string[16];
-        memset(&ip_string, 0, 16);
-        ip4_to_str(&packet->ip.source_ip, ip_string);
-        //debug("[tcp] can't establish connection with remote %s:%i, local socket is in closed state, packet flags is %i, binder is_listening %i\n",
-        //    ip_string, bswap16(packet->tcp.source_port), packet->tcp.flags, tcp_binders[port]->is_listening);
+    // only sockets queued so far, sockets requeued meanwhile are handled after tcp_mutex is released once
+    uint32_t irq = irq_save();
+    tcp_socket_t *socket = pending_head;
+    pending_head = 0;
+    pending_tail = 0;
+    irq_restore(irq);
+
+    while (socket != 0)
+    {
+        irq = irq_save();
+        tcp_socket_t *next = socket->pending_next;
+        uint8_t pending = socket->pending;
+        socket->pending = 0;
+        socket->queued = 0;
+        irq_restore(irq);
+
+        process_socket(socket, pending);
+        socket = next;
     }
+    mutex_release(&tcp_mutex);
 }
 
-void handle_fin_2_state(tcp_socket_t *socket, uint8_t *reply_flags, tcp_packet_t *packet)
+// sleeps until some socket has pending work or the nearest timer expires
+static void tcp_worker()
 {
-    if (packet->tcp.flags & TCP_FLAG_FIN)
+    while (1)
     {
-        *reply_flags |= TCP_FLAG_ACK;
-        socket->ack_number++;
-        socket->state = TCP_CONNECTION_TIME_WAIT;
-        socket->ttl = TCP_SOCKET_TIME_WAIT + get_pit_ticks();
-        delete_from_list((void*)&tcp_binders[socket->port]->connected, socket);
-        add_to_list(tcp_binders[socket->port]->time_wait, socket);
-
-        char ip_string[16];
-        memset(&ip_string, 0, 16);
-        ip4_to_str(&socket->remote_host, ip_string);
-        //debug("[tcp] closing connection with remote %s:%i, local socket moved to TIME_WAIT state\n", ip_string, socket->remote_port);
+        cli();
+        if (pending_head == 0)
+        {
+            uint32_t now = get_pit_ticks();
+            uint32_t timeout = next_timer == 0 ? 0 : (next_timer > now ? next_timer - now : 1);
+            wait_event(&worker_queue, WAIT_ANY_KEY, timeout);
+        }
+        else
+        {
+            sti();
+        }
+        tcp_worker_run();
     }
 }
 
-void process_socket_queue(tcp_socket_t **list, void* transmit_payload)
+void init_tcp_protocol()
 {
-    tcp_packet_t *received_packet = 0;
-    tcp_socket_t *socket = *list;
-    tcp_socket_t *next = 0;
+    tcp_binders = kmalloc(sizeof(tcp_socket_binder_t*) * 0xFFFF);
+    memset(tcp_binders, 0, sizeof(tcp_socket_binder_t*) * 0xFFFF);
+    start_thread(tcp_worker, 0);
+}
 
-    while(socket != 0)
+// timeout 0 waits forever
+uint8_t accept_tcp_connection(tcp_socket_binder_t *binder, tcp_socket_t **out, uint32_t timeout)
+{
+    uint32_t finish = get_pit_ticks() + timeout;
+    while (1)
     {
-        // socket can be moved to other queue, so we need our next item backup
-        next = (tcp_socket_t*)socket->list.next;
-
-        uint8_t reply_flags = 0;
-        uint16_t port = socket->port;
-        received_packet = socket->ring->pop(socket->ring);
-        if (received_packet != 0)
+        mutex_lock(&tcp_mutex);
+        if (binder->accept_wait != 0)
         {
-            if (received_packet->tcp.flags & TCP_FLAG_RST)
+            // list is filled from the head, the oldest connection is the last one
+            tcp_socket_t *socket = binder->accept_wait;
+            while (socket->list.next != 0)
             {
-                socket->state = TCP_CONNECTION_TIME_WAIT;
-                socket->ttl = TCP_SOCKET_TIME_WAIT + get_pit_ticks();
-                delete_from_list((void*)list, socket);
-                add_to_list(tcp_binders[port]->time_wait, socket);
-
                 socket = (tcp_socket_t*)socket->list.next;
-
-                char ip_string[16];
-                memset(&ip_string, 0, 16);
-                ip4_to_str(&received_packet->ip.source_ip, ip_string);
-                //debug("[tcp] received RST packet from %s:%i\n", ip_string, bswap16(received_packet->tcp.source_port));
-
-                kfree(received_packet);
-
-                socket = next;
-                continue;
-            }
-
-            socket->remote_window_size = bswap16(received_packet->tcp.window_size);
-
-            if (socket->state == TCP_CONNECTION_CLOSED)
-            {
-                handle_closed_state(socket, &reply_flags, received_packet);
-            }
-            else if (bswap32(received_packet->tcp.seq_number) < socket->ack_number)
-            {
-                // simply ignore packet with seq_number < our ack_number
-                reply_flags |= TCP_FLAG_ACK;
-            }
-            else if (bswap32(received_packet->tcp.seq_number) > socket->ack_number)
-            {
-                // seems we got packet from future, but we have no reorder support
-                reply_flags |= TCP_FLAG_ACK;
-            }
-            else if (socket->state == TCP_CONNECTION_ESTABLISHED)
-            {
-                handle_established_state(socket, &reply_flags, received_packet);
-            }
-            else if (socket->state == TCP_CONNECTION_CLOSE_WAIT)
-            {
-                // socket ignores all income data packets, we need to send all data in our transmit_buffer and close connection
-            }
-            else if (socket->state == TCP_CONNECTION_LAST_ACK)
-            {
-                handle_last_ask_state(socket, &reply_flags, received_packet);
-            }
-            else if (socket->state == TCP_CONNECTION_FIN_1)
-            {
-                handle_fin_1_state(socket, &reply_flags, received_packet);
-            }
-            else if (socket->state == TCP_CONNECTION_FIN_2)
-            {
-                handle_fin_2_state(socket, &reply_flags, received_packet);
-            }
-            if (socket->state == TCP_CONNECTION_SYN_SENT)
-            {
-                handle_syn_state(socket, &reply_flags, received_packet);
             }
-
-            kfree(received_packet);
-        }
-
-        uint32_t copied = 0;
-        if (socket->state == TCP_CONNECTION_ESTABLISHED || socket->state == TCP_CONNECTION_CLOSE_WAIT || socket->state == TCP_CONNECTION_FIN_1)
-        {
-            uint32_t max_payload_size = (socket->remote_window_size < TCP_MAX_PAYLOAD_SIZE ? socket->remote_window_size : TCP_MAX_PAYLOAD_SIZE);
-            copied = socket->transmit_buffer->get(socket->transmit_buffer, transmit_payload, max_payload_size);
+            delete_from_list((void*)&binder->accept_wait, socket);
+            socket->in_accept_queue = 0;
+            binder->accept_count--;
+            socket->owned = 1;
+            *out = socket;
+            mutex_release(&tcp_mutex);
+            return TCP_SOCKET_SUCCESS;
         }
+        mutex_release(&tcp_mutex);
 
-        if (socket->state == TCP_CONNECTION_CLOSE_WAIT && socket->transmit_buffer->get_free_space(socket->transmit_buffer) == TCP_SOCKET_BUFFER_SIZE)
+        uint32_t now = get_pit_ticks();
+        if (timeout != 0 && now >= finish)
         {
-            socket->state = TCP_CONNECTION_LAST_ACK;
-            reply_flags |= TCP_FLAG_FIN;
-
-            char ip_string[16];
-            memset(&ip_string, 0, 16);
-            ip4_to_str(&socket->remote_host, ip_string);
-            //debug("[tcp] sending FIN confirm to remote: %s:%i, socket is in LAST_ASK state\n", ip_string, socket->remote_port);
+            return TCP_SOCKET_TIMEOUT;
         }
-
-        if (socket->state == TCP_CONNECTION_FIN_1)
+        cli();
+        if (binder->accept_wait == 0)
         {
-            if (socket->transmit_buffer->get_free_space(socket->transmit_buffer) == TCP_SOCKET_BUFFER_SIZE)
-            {
-                socket->state = TCP_CONNECTION_FIN_2;
-                reply_flags |= TCP_FLAG_FIN;
-
-                char ip_string[16];
-                memset(&ip_string, 0, 16);
-                ip4_to_str(&socket->remote_host, ip_string);
-                //debug("[tcp] sending FIN confirm to remote: %s:%i, socket is in FIN_2 state\n", ip_string, socket->remote_port);
-            }
+            wait_event(&binder->accept_queue, WAIT_ANY_KEY, timeout == 0 ? 0 : finish - now);
         }
-
-        if (copied > 0 || reply_flags != 0)
+        else
         {
-            reply_flags |= TCP_FLAG_ACK;
-            send_tcp_packet(socket, reply_flags, transmit_payload, copied);
+            sti();
         }
-
-        socket = next;
     }
 }
 
-void process_tcp_data()
+// POLL* readiness of connection, end of stream is readable as read() returns 0 without blocking
+uint32_t tcp_poll_events(tcp_socket_t *socket)
 {
-    uint8_t *transmit_payload = kmalloc(TCP_MAX_PAYLOAD_SIZE);
-
-    while(1)
+    uint32_t events = 0;
+    if (!buffer_is_empty(socket->receive_buffer) || !tcp_can_receive(socket))
+    {
+        events |= POLLIN;
+    }
+    if (socket->state == TCP_CONNECTION_ESTABLISHED)
     {
-        for(uint16_t port = 0; port < 0xFFFF; port++)
+        if (socket->transmit_buffer->get_free_space(socket->transmit_buffer) > 0)
         {
-            if(tcp_binders[port] == 0)
-            {
-                continue;
-            }
-
-            assert(0 && "sleep queue isn't used becauf of direct flag usage");
-            if (__sync_lock_test_and_set(&tcp_binders[port]->mutex.flag, 1))
-            {
-                // binder will be handled next time
-                continue;
-            }
-
-            process_socket_queue(&tcp_binders[port]->handshake, transmit_payload);
-            process_socket_queue(&tcp_binders[port]->connected, transmit_payload);
-            process_socket_queue(&tcp_binders[port]->accept_wait, transmit_payload);
-
-            tcp_socket_t *socket = tcp_binders[port]->time_wait;
-            while(socket != 0)
-            {
-                tcp_socket_t *next = (tcp_socket_t*)socket->list.next;
-                if (socket->ttl <= get_pit_ticks())
-                {
-                    delete_from_list((void*)&tcp_binders[port]->time_wait, socket);
-
-                    char ip_string[16];
-                    memset(&ip_string, 0, 16);
-                    ip4_to_str(&socket->remote_host, ip_string);
-                    //debug("[tcp] socket for remote %s:%i removed from TIME_WAIT queue\n", ip_string, socket->remote_port);
-
-                    socket->ring->free(socket->ring);
-                    socket->transmit_buffer->free(socket->transmit_buffer);
-                    socket->receive_buffer->free(socket->receive_buffer);
-                    kfree(socket);
-                }
-                socket = next;
-            }
-
-            mutex_release(&tcp_binders[port]->mutex);
+            events |= POLLOUT;
         }
     }
+    else if (socket->state != TCP_CONNECTION_SYN_SENT && socket->state != TCP_CONNECTION_SYN_RECEIVED
+        && socket->state != TCP_CONNECTION_CLOSE_WAIT)
+    {
+        events |= POLLHUP;
+    }
+    return events;
+}
 
-    //this code can't be executed... just a failsafe
-    kfree(transmit_payload);
-    //debug("[tcp] end of process_tcp_data()...\n");
+// listener is readable when accept() won't block
+uint32_t tcp_binder_poll_events(tcp_socket_binder_t *binder)
+{
+    return binder->accept_wait != 0 ? POLLIN : 0;
 }
 
-void init_tcp_protocol()
+void fill_tcp_checksum(tcp_header_t *tcp, ip4_addr_t *source, ip4_addr_t *dest, uint16_t data_size)
 {
-    tcp_binders = kmalloc(sizeof(tcp_socket_binder_t*) * 0xFFFF);
-    memset(tcp_binders, 0, sizeof(tcp_socket_binder_t*) * 0xFFFF);
-    start_thread(process_tcp_data, 0);
+    // checksum field is 0 while it's computed
+    uint32_t size = tcp->data_offset * 4 + data_size;
+    uint32_t sum = ip4_pseudo_checksum(source, dest, PROTOCOL_TCP, size);
+    tcp->checksum = ~checksum_fold(checksum_partial(tcp, size, sum));
 }
 
-uint8_t accept_tcp_connection(tcp_socket_binder_t *binder, tcp_socket_t **out, uint32_t timeout)
+static uint8_t *put_timestamp(tcp_socket_t *socket, uint8_t *option)
 {
-    uint32_t finish = get_pit_ticks() + timeout;
-    while(finish > get_pit_ticks())
+    option[0] = TCP_OPTION_NOP;
+    option[1] = TCP_OPTION_NOP;
+    option[2] = TCP_OPTION_TIMESTAMP;
+    option[3] = 10;
+    write_be32(option + 4, get_pit_ticks());
+    write_be32(option + 8, socket->ts_recent);
+    return option + TCP_TIMESTAMP_OPTION_SIZE;
+}
+
+// contiguous ranges of out-of-order queue, the one with the latest segment goes first (RFC 2018)
+static uint8_t *put_sack_blocks(tcp_socket_t *socket, uint8_t *option, uint32_t max_blocks)
+{
+    uint32_t left[TCP_MAX_SACK_BLOCKS];
+    uint32_t right[TCP_MAX_SACK_BLOCKS];
+    uint32_t count = 0;
+    uint32_t first = 0;
+    for (net_buffer_t *buffer = socket->ooo_queue; buffer != 0; buffer = buffer->next)
     {
-        // TODO: accept from end of list & use mutex
-        if (binder->accept_wait != 0)
+        tcp_packet_t *packet = (tcp_packet_t*)buffer->data;
+        uint32_t seq = segment_seq(packet);
+        uint32_t end = segment_end(packet);
+        if (count > 0 && SEQ_LEQ(seq, right[count - 1]))
         {
-            mutex_lock(&binder->mutex);
-            *out = binder->accept_wait;
-            delete_from_list((void*)&binder->accept_wait, *out);
-            add_to_list(binder->connected, *out);
-            mutex_release(&binder->mutex);
-            return TCP_SOCKET_SUCCESS;
+            right[count - 1] = SEQ_GT(end, right[count - 1]) ? end : right[count - 1];
+        }
+        else if (count < max_blocks)
+        {
+            left[count] = seq;
+            right[count] = end;
+            count++;
+        }
+        else
+        {
+            break;
+        }
+        if (seq == socket->ooo_last_seq)
+        {
+            first = count - 1;
         }
     }
 
-    return TCP_SOCKET_TIMEOUT;
+    option[0] = TCP_OPTION_NOP;
+    option[1] = TCP_OPTION_NOP;
+    option[2] = TCP_OPTION_SACK;
+    option[3] = 2 + count * 8;
+    option += 4;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        // first block and the block at its place are swapped
+        uint32_t block = i == 0 ? first : (i == first ? 0 : i);
+        write_be32(option, left[block]);
+        write_be32(option + 4, right[block]);
+        option += 8;
+    }
+    return option;
 }
 
-void fill_tcp_checksum(tcp_packet_t *packet, ip4_addr_t *source, ip4_addr_t *dest, uint16_t data_size)
+// writes options of the segment, every option set is padded to 4 bytes; returns their size
+uint32_t build_tcp_options(tcp_socket_t *socket, uint8_t flags, uint32_t payload_size, uint8_t *options)
 {
-    uint32_t checksum = 0;
-    tcp_pseudo_header_t ps;
-    ps.destination = *dest;
-    ps.source = *source;
-    ps.protocol = PROTOCOL_TCP;
-    ps.reserved = 0;
-    ps.tcp_length = bswap16(sizeof(tcp_header_t) + data_size);
-
-    uint16_t *p = (uint16_t*)&ps;
-    for(uint8_t i = 0; i < sizeof(tcp_pseudo_header_t) / 2; i++)
+    uint8_t *option = options;
+    if (flags & TCP_FLAG_SYN)
     {
-        checksum += *p;
-        while(checksum > 0xFFFF)
+        option[0] = TCP_OPTION_MSS;
+        option[1] = 4;
+        option[2] = tcp_device_mss(socket->net_dev) >> 8;
+        option[3] = tcp_device_mss(socket->net_dev) & 0xFF;
+        option += 4;
+
+        // everything is offered in SYN, SYN-ACK answers only what the peer offered
+        uint8_t active = socket->state == TCP_CONNECTION_SYN_SENT;
+        if (active || socket->sack_ok)
         {
-            checksum = (checksum >> 16) + (checksum & 0x0FFFF);
+            option[0] = TCP_OPTION_NOP;
+            option[1] = TCP_OPTION_NOP;
+            option[2] = TCP_OPTION_SACK_PERMITTED;
+            option[3] = 2;
+            option += 4;
         }
-        p++;
-    }
-
-    p = (uint16_t*)&packet->tcp;
-    for(uint32_t i = 0; i < (sizeof(tcp_header_t) + data_size) / 2; i++)
-    {
-        checksum += *p; // we dont worry about checksum field, because it's 0
-        while(checksum > 0xFFFF)
+        if (active || socket->ts_ok)
+        {
+            option = put_timestamp(socket, option);
+        }
+        if (active || socket->rcv_window_scale != 0)
         {
-            checksum = (checksum >> 16) + (checksum & 0x0FFFF);
+            option[0] = TCP_OPTION_NOP;
+            option[1] = TCP_OPTION_WINDOW_SCALE;
+            option[2] = 3;
+            option[3] = TCP_WINDOW_SCALE;
+            option += 4;
         }
-        p++;
+        return option - options;
     }
 
-    if ((sizeof(tcp_header_t) + data_size) % 2 != 0)
+    if (socket->ts_ok)
     {
-        checksum += *(uint8_t*)p;
+        option = put_timestamp(socket, option);
     }
-
-    while(checksum > 0xFFFF)
+    // SACK blocks don't fit into MSS sized segment, so they go with pure ACKs only
+    if (socket->sack_ok && socket->ooo_queue != 0 && payload_size == 0)
     {
-        checksum = (checksum >> 16) + (checksum & 0x0FFFF);
+        option = put_sack_blocks(socket, option, socket->ts_ok ? 3 : TCP_MAX_SACK_BLOCKS);
     }
-
-    checksum = ~checksum;
-    packet->tcp.checksum = (uint16_t)checksum;
+    return option - options;
 }
 
-uint8_t send_tcp_packet(tcp_socket_t *socket, uint8_t flags, void* payload, uint16_t size)
+// buffer holds the payload, TCP header is prepended; payload larger than MSS is sent as TSO super-segment
+static void transmit_segment(tcp_socket_t *socket, uint8_t flags, uint32_t seq_number, net_buffer_t *buffer)
 {
-    tcp_packet_t *packet = kmalloc(sizeof(tcp_packet_t) + size);
-    memset(packet, 0, sizeof(tcp_packet_t) + size);
-    packet->tcp.flags = flags;
-    packet->tcp.destination_port = bswap16(socket->remote_port);
-    packet->tcp.source_port = bswap16(socket->port);
-    packet->tcp.window_size = bswap16(socket->receive_buffer->get_free_space(socket->receive_buffer));
-    packet->tcp.data_offset = sizeof(tcp_header_t) / 4; //in uint32_t
-    // probably must be added mutex lock or we can go out of sync
-    packet->tcp.seq_number = bswap32(socket->seq_number);
-    packet->tcp.ack_number = bswap32(socket->ack_number);
-
-    memcpy((void*)(packet + 1), payload, size);
+    uint32_t size = net_buffer_total_len(buffer);
+    uint8_t options[TCP_MAX_OPTIONS_SIZE];
+    uint32_t options_size = build_tcp_options(socket, flags, size, options);
+    uint32_t header_size = sizeof(tcp_header_t) + options_size;
 
-    fill_tcp_checksum(packet, &socket->net_dev->ip4_addr, &socket->remote_host, size);
+    tcp_header_t *tcp = net_buffer_push(buffer, header_size);
+    if (tcp == NULL)
+    {
+        release_net_buffer(buffer);
+        return;
+    }
+    memset(tcp, 0, sizeof(tcp_header_t));
+    memcpy((uint8_t*)tcp + sizeof(tcp_header_t), options, options_size);
+    tcp->flags = flags;
+    tcp->destination_port = bswap16(socket->remote_port);
+    tcp->source_port = bswap16(socket->port);
+    tcp->data_offset = header_size / 4; //in uint32_t
+    tcp->seq_number = bswap32(seq_number);
+    tcp->ack_number = bswap32(socket->ack_number);
+
+    // window in SYN is never scaled
+    uint32_t window = socket->receive_buffer->get_free_space(socket->receive_buffer);
+    if (!(flags & TCP_FLAG_SYN))
+    {
+        window >>= socket->rcv_window_scale;
+    }
+    tcp->window_size = bswap16(window > 0xFFFF ? 0xFFFF : window);
 
-    if (flags & TCP_FLAG_SYN || flags & TCP_FLAG_FIN || flags & TCP_FLAG_RST)
+    if (size > socket->mss)
     {
-        __sync_fetch_and_add(&socket->seq_number, 1);
+        // hardware adds length of every segment to the seed
+        buffer->offload |= NET_OFFLOAD_TSO | NET_OFFLOAD_TX_L4_CSUM;
+        buffer->mss = socket->mss;
+        tcp->checksum = ip4_pseudo_checksum(&socket->net_dev->ip4_addr, &socket->remote_host, PROTOCOL_TCP, 0);
     }
-    __sync_fetch_and_add(&socket->seq_number, size);
+    else if (socket->net_dev->features & NET_FEATURE_TCP_CSUM)
+    {
+        buffer->offload |= NET_OFFLOAD_TX_L4_CSUM;
+        tcp->checksum = ip4_pseudo_checksum(&socket->net_dev->ip4_addr, &socket->remote_host, PROTOCOL_TCP, header_size + size);
+    }
+    else
+    {
+        fill_tcp_checksum(tcp, &socket->net_dev->ip4_addr, &socket->remote_host, size);
+    }
+
+    send_ip4_packet(socket->net_dev, &socket->remote_host, PROTOCOL_TCP, buffer);
+}
 
-    send_ip4_packet(socket->net_dev, &socket->remote_host, PROTOCOL_TCP, packet, sizeof(tcp_packet_t) + size);
+// sends next segment of the sequence space, called by TCP worker only
+uint8_t send_tcp_buffer(tcp_socket_t *socket, uint8_t flags, net_buffer_t *buffer)
+{
+    uint32_t seq_number = socket->seq_number;
+    socket->seq_number += net_buffer_total_len(buffer);
+    if (flags & TCP_FLAG_SYN || flags & TCP_FLAG_FIN)
+    {
+        socket->seq_number++;
+    }
+    if ((int32_t)(socket->seq_number - socket->snd_max) > 0)
+    {
+        socket->snd_max = socket->seq_number;
+    }
 
-    kfree(packet);
+    transmit_segment(socket, flags, seq_number, buffer);
     return TCP_SOCKET_SUCCESS;
 }
 
+uint8_t send_tcp_packet(tcp_socket_t *socket, uint8_t flags, void* payload, uint16_t size)
+{
+    net_buffer_t *buffer = alloc_net_buffer();
+    if (buffer == 0)
+    {
+        return TCP_SOCKET_NO_BUFFER;
+    }
+    memcpy(net_buffer_put(buffer, size), payload, size);
+    return send_tcp_buffer(socket, flags, buffer);
+}
+
+// returns 0 when remote side closed the connection or timeout expired, timeout 0 waits forever
 uint32_t read_from_tcp_socket(tcp_socket_t *socket, void *buffer, uint32_t size, uint32_t timeout)
 {
     uint32_t finish = get_pit_ticks() + timeout;
-    while(finish > get_pit_ticks())
+    while (1)
     {
+        uint32_t free_space = socket->receive_buffer->get_free_space(socket->receive_buffer);
         uint32_t received = socket->receive_buffer->get(socket->receive_buffer, buffer, size);
         if (received > 0)
         {
+            // reader keeps up with the sender which fills most of the window, so the window limits the throughput
+            if (free_space < socket->receive_buffer->size / 2 && buffer_is_empty(socket->receive_buffer))
+            {
+                grow_tcp_buffer(socket->receive_buffer, socket->rcv_window_scale);
+            }
+            // sender could be stopped by small window, it learns about free space from window update
+            if (free_space < socket->receive_buffer->size / 4)
+            {
+                tcp_mark_pending(socket, TCP_PENDING_ACK);
+            }
             return received;
         }
-    }
+        // remote side closed the connection, no more data
+        if (!tcp_can_receive(socket))
+        {
+            return 0;
+        }
 
-    return 0;
+        uint32_t now = get_pit_ticks();
+        if (timeout != 0 && now >= finish)
+        {
+            return 0;
+        }
+        cli();
+        if (buffer_is_empty(socket->receive_buffer) && tcp_can_receive(socket))
+        {
+            wait_event(&socket->wait, WAIT_ANY_KEY, timeout == 0 ? 0 : finish - now);
+        }
+        else
+        {
+            sti();
+        }
+    }
 }
 
 uint8_t write_to_tcp_socket(tcp_socket_t *socket, void *buffer, uint32_t size)
@@ -579,72 +1679,172 @@ uint8_t write_to_tcp_socket(tcp_socket_t *socket, void *buffer, uint32_t size)
     {
         return TCP_SOCKET_BUFFER_IS_FULL;
     }
+    tcp_mark_pending(socket, TCP_PENDING_OUTPUT);
     return TCP_SOCKET_SUCCESS;
 }
 
+/*
+ * Blocks until all data is in transmit buffer, returns number of queued bytes, which is less than size only if
+ * connection is closing. Writer is woken by ACKs which free the buffer, short sleeps cover connection reset.
+ */
+uint32_t write_all_to_tcp_socket(tcp_socket_t *socket, void *buffer, uint32_t size)
+{
+    uint32_t written = 0;
+    while (written < size && socket->state == TCP_CONNECTION_ESTABLISHED)
+    {
+        uint32_t free_space = socket->transmit_buffer->get_free_space(socket->transmit_buffer);
+        uint32_t chunk = size - written < free_space ? size - written : free_space;
+        if (chunk > 0 && write_to_tcp_socket(socket, (uint8_t*)buffer + written, chunk) == TCP_SOCKET_SUCCESS)
+        {
+            written += chunk;
+            continue;
+        }
+
+        cli();
+        if (socket->transmit_buffer->get_free_space(socket->transmit_buffer) == 0)
+        {
+            wait_event(&socket->wait, WAIT_ANY_KEY, TCP_RTO_MIN);
+        }
+        else
+        {
+            sti();
+        }
+    }
+    return written;
+}
+
 uint8_t tcp_bind(network_device_t* net_dev, uint16_t port, tcp_socket_binder_t **out)
 {
-    mutex_lock(&tcp_binders_mutex);
+    mutex_lock(&tcp_mutex);
     if (tcp_binders[port] != 0)
     {
-        mutex_release(&tcp_binders_mutex);
+        mutex_release(&tcp_mutex);
         return TCP_SOCKET_PORT_BUSY;
     }
 
     tcp_binders[port] = kmalloc(sizeof(tcp_socket_binder_t));
-    mutex_release(&tcp_binders_mutex);
-
     memset(tcp_binders[port], 0, sizeof(tcp_socket_binder_t));
     tcp_binders[port]->port = port;
+    tcp_binders[port]->net_dev = net_dev;
     *out = tcp_binders[port];
+    mutex_release(&tcp_mutex);
     //debug("[tcp] port %i binded\n", port);
     return TCP_SOCKET_SUCCESS;
 }
 
+// net_dev 0 - device is chosen by routing
 uint8_t tcp_connect(network_device_t *net_dev, ip4_addr_t *ip, uint16_t port, tcp_socket_binder_t *binder, tcp_socket_t **out)
 {
-    tcp_socket_t *socket = kmalloc(sizeof(tcp_socket_t));
-    memset(socket, 0, sizeof(tcp_socket_t));
+    ip4_addr_t next_hop;
+    if (net_dev == 0 && (net_dev = route_lookup(ip, &next_hop)) == 0)
+    {
+        return TCP_SOCKET_NO_ROUTE;
+    }
+    tcp_socket_t *socket = create_tcp_socket(net_dev, binder->port, ip, port);
     socket->state = TCP_CONNECTION_SYN_SENT;
-    socket->remote_port = port;
-    socket->remote_host = *ip;
-    socket->port = binder->port;
-    socket->net_dev = net_dev;
-    socket->ring = create_ring(TCP_SOCKET_RING_SIZE);
-    socket->receive_buffer = create_buffer(TCP_SOCKET_BUFFER_SIZE);
-    socket->transmit_buffer = create_buffer(TCP_SOCKET_BUFFER_SIZE);
+    socket->local_host = net_dev->ip4_addr;
+    socket->binder = binder;
+    socket->owned = 1;
 
-    mutex_lock(&binder->mutex);
-    add_to_list(binder->handshake, socket);
-    mutex_release(&binder->mutex);
+    mutex_lock(&tcp_mutex);
+    hash_connection(socket);
+    mutex_release(&tcp_mutex);
 
-    send_tcp_packet(socket, TCP_FLAG_SYN, 0, 0);
+    // SYN is sent and retransmitted by TCP worker
+    tcp_mark_pending(socket, TCP_PENDING_OUTPUT);
     uint32_t finish = get_pit_ticks() + TCP_CONNECT_TIMEOUT;
-    while(finish > get_pit_ticks())
+    uint32_t now;
+    while (socket->state == TCP_CONNECTION_SYN_SENT && (now = get_pit_ticks()) < finish)
     {
-        if (socket->state == TCP_CONNECTION_ESTABLISHED)
+        cli();
+        if (socket->state == TCP_CONNECTION_SYN_SENT)
         {
-            *out = socket;
-            return TCP_SOCKET_SUCCESS;
+            wait_event(&socket->wait, WAIT_ANY_KEY, finish - now);
+        }
+        else
+        {
+            sti();
         }
     }
+
+    if (socket->state == TCP_CONNECTION_ESTABLISHED)
+    {
+        *out = socket;
+        return TCP_SOCKET_SUCCESS;
+    }
+
+    mutex_lock(&tcp_mutex);
+    free_tcp_socket(socket);
+    mutex_release(&tcp_mutex);
     return TCP_SOCKET_TIMEOUT;
 }
 
-uint8_t close_tcp_connection(tcp_socket_t *socket)
+// tcp_mutex is held
+static uint8_t close_connection(tcp_socket_t *socket)
 {
-    if (socket->state != TCP_CONNECTION_ESTABLISHED)
+    socket->owned = 0;
+    if (socket->state == TCP_CONNECTION_ESTABLISHED)
+    {
+        socket->state = TCP_CONNECTION_FIN_1;
+        tcp_mark_pending(socket, TCP_PENDING_OUTPUT);
+    }
+    else if (!socket->hashed || socket->state == TCP_CONNECTION_SYN_SENT || socket->state == TCP_CONNECTION_SYN_RECEIVED)
+    {
+        free_tcp_socket(socket);
+    }
+    else
     {
+        // closing is already in progress
         return TCP_SOCKET_WRONG_STATE;
     }
-
-    socket->state = TCP_CONNECTION_FIN_1;
     return TCP_SOCKET_SUCCESS;
 }
 
-uint8_t tcp_listen(tcp_socket_binder_t *binder)
+// socket must not be used after the call, it's freed when connection is finished
+uint8_t close_tcp_connection(tcp_socket_t *socket)
+{
+    mutex_lock(&tcp_mutex);
+    uint8_t result = close_connection(socket);
+    mutex_release(&tcp_mutex);
+    return result;
+}
+
+// backlog limits both half-open connections and connections waiting for accept
+uint8_t tcp_listen(tcp_socket_binder_t *binder, int backlog)
 {
+    binder->backlog = backlog < 1 ? 1 : (backlog > TCP_MAX_BACKLOG ? TCP_MAX_BACKLOG : backlog);
     binder->is_listening = 1;
     //debug("[tcp] listens on port %i\n", binder->port);
     return TCP_SOCKET_SUCCESS;
 }
+
+/*
+ * Frees the port. Connections which weren't accepted are closed, the rest of connections made through the binder
+ * forget it, so they live on until they are closed.
+ */
+void release_tcp_binder(tcp_socket_binder_t *binder)
+{
+    mutex_lock(&tcp_mutex);
+    tcp_binders[binder->port] = 0;
+    while (binder->accept_wait != 0)
+    {
+        tcp_socket_t *socket = binder->accept_wait;
+        delete_from_list((void*)&binder->accept_wait, socket);
+        socket->in_accept_queue = 0;
+        binder->accept_count--;
+        socket->binder = 0;
+        close_connection(socket);
+    }
+    for (uint32_t i = 0; i < TCP_HASH_SIZE; i++)
+    {
+        for (tcp_socket_t *socket = connections[i]; socket != 0; socket = socket->hash_next)
+        {
+            if (socket->binder == binder)
+            {
+                socket->binder = 0;
+            }
+        }
+    }
+    mutex_release(&tcp_mutex);
+    kfree(binder);
+}
@@ -5,90 +5,249 @@
 #include "log.h"
 #include "liballoc.h"
 #include "mutex.h"
+#include "irq.h"
+#include "poll.h"
+#include "route.h"
 
-// UDP ports data and queue must be stored in net_dev, but i have no plans to support machines with 2+ lan cards
-udp_socket_t **udp_sockets = 0;
-mutex_t udp_sockets_mutex;
+// sockets of all devices, a socket without net_dev (INADDR_ANY) receives from every device
+static udp_socket_t *udp_sockets[UDP_HASH_SIZE];
+// hash table, RX thread holds it while datagram is queued, so socket isn't freed under it
+static mutex_t udp_sockets_mutex = {0};
+static uint32_t next_ephemeral_port = 0;
 
 void init_udp_protocol()
 {
-    udp_sockets = kmalloc(sizeof(udp_socket_t*) * 0xFFFF);
-    memset(udp_sockets, 0, sizeof(udp_socket_t*) * 0xFFFF);
+    memset(udp_sockets, 0, sizeof(udp_sockets));
 }
 
-void process_udp_packet(network_device_t *net_dev, void *packet)
+static uint32_t udp_hash(uint16_t port)
 {
-    udp_packet_t *udp_packet = packet;
+    return (port ^ (port >> 8)) & (UDP_HASH_SIZE - 1);
+}
+
+// udp_sockets_mutex must be held, socket bound to the device goes before the one bound to INADDR_ANY
+static udp_socket_t *find_udp_socket(network_device_t *net_dev, uint16_t port)
+{
+    udp_socket_t *any = 0;
+    for (udp_socket_t *socket = udp_sockets[udp_hash(port)]; socket != 0; socket = socket->hash_next)
+    {
+        if (socket->port == port && socket->net_dev == net_dev)
+        {
+            return socket;
+        }
+        if (socket->port == port && socket->net_dev == 0)
+        {
+            any = socket;
+        }
+    }
+    return any;
+}
+
+// udp_sockets_mutex must be held, a port can be bound once per device or once for all of them
+static uint8_t port_is_busy(network_device_t *net_dev, uint16_t port)
+{
+    for (udp_socket_t *socket = udp_sockets[udp_hash(port)]; socket != 0; socket = socket->hash_next)
+    {
+        if (socket->port == port && (net_dev == 0 || socket->net_dev == 0 || socket->net_dev == net_dev))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// udp_sockets_mutex must be held, search starts after the last allocated port, returns 0 if range is full
+static uint16_t alloc_ephemeral_port(network_device_t *net_dev)
+{
+    uint32_t range = UDP_EPHEMERAL_PORT_LAST - UDP_EPHEMERAL_PORT_FIRST + 1;
+    for (uint32_t i = 0; i < range; i++)
+    {
+        uint16_t port = UDP_EPHEMERAL_PORT_FIRST + next_ephemeral_port++ % range;
+        if (!port_is_busy(net_dev, port))
+        {
+            return port;
+        }
+    }
+    return 0;
+}
+
+// the socket ring takes the received buffer itself
+void process_udp_packet(network_device_t *net_dev, net_buffer_t *buffer)
+{
+    udp_packet_t *udp_packet = (udp_packet_t*)buffer->data;
     uint16_t port = bswap16(udp_packet->udp.destination_port);
 
-    if (udp_sockets[port] != 0)
+    // zero checksum means sender didn't compute it
+    if (buffer->len >= sizeof(udp_packet_t) && (udp_packet->udp.checksum == 0 || ip4_payload_valid(buffer)))
     {
-        // TODO: add validation for socket state... it can be deleted
-        void *buffer = kmalloc(udp_packet->ip.total_size + sizeof(eth_header_t));
-        memcpy(buffer, packet, udp_packet->ip.total_size + sizeof(eth_header_t));
-        udp_sockets[port]->receive_ring->push(udp_sockets[port]->receive_ring, buffer);
+        mutex_lock(&udp_sockets_mutex);
+        udp_socket_t *socket = find_udp_socket(net_dev, port);
+        if (socket != 0 && net_buffer_charge(&socket->rx_buffers, buffer))
+        {
+            if (socket->receive_ring->push(socket->receive_ring, buffer) == RING_BUFFER_OK)
+            {
+                wake_up(&socket->wait, WAIT_ANY_KEY, 0);
+                mutex_release(&udp_sockets_mutex);
+                return;
+            }
+            net_buffer_uncharge(&socket->rx_buffers, buffer);
+        }
+        mutex_release(&udp_sockets_mutex);
     }
+    release_net_buffer(buffer);
 }
 
 void release_udp_socket(udp_socket_t *socket)
 {
     mutex_lock(&udp_sockets_mutex);
-    udp_sockets[socket->port] = 0;
+    udp_socket_t **link = &udp_sockets[udp_hash(socket->port)];
+    while (*link != 0 && *link != socket)
+    {
+        link = &(*link)->hash_next;
+    }
+    if (*link != 0)
+    {
+        *link = socket->hash_next;
+    }
     mutex_release(&udp_sockets_mutex);
+    net_buffer_t *buffer;
+    while ((buffer = socket->receive_ring->pop(socket->receive_ring)) != 0)
+    {
+        release_net_buffer(buffer);
+    }
     socket->receive_ring->free(socket->receive_ring);
     kfree(socket);
 }
 
+/*
+ * Socket with net_dev receives only from that device and sends through it, without one it receives from all devices
+ * and routing picks the device for every datagram. Port 0 binds to a free ephemeral port, it's available in
+ * socket->port.
+ */
 uint8_t create_udp_socket(network_device_t *net_dev, uint16_t port, udp_socket_t **out)
 {
     mutex_lock(&udp_sockets_mutex);
-    if (udp_sockets[port] == 0)
-    {
-        udp_sockets[port] = kmalloc(sizeof(udp_socket_t));
-        memset(udp_sockets[port], 0, sizeof(udp_socket_t));
-        udp_sockets[port]->net_dev = net_dev;
-        udp_sockets[port]->port = port;
-        udp_sockets[port]->receive_ring = create_ring(UDP_SOCKET_RING_SIZE);
-        *out = udp_sockets[port];
+    if (port == 0)
+    {
+        port = alloc_ephemeral_port(net_dev);
+    }
+    if (port == 0 || port_is_busy(net_dev, port))
+    {
         mutex_release(&udp_sockets_mutex);
-        return UDP_SOCKET_SUCCESS;
+        return UDP_SOCKET_PORT_BUSY;
     }
+
+    udp_socket_t *socket = kmalloc(sizeof(udp_socket_t));
+    memset(socket, 0, sizeof(udp_socket_t));
+    socket->net_dev = net_dev;
+    socket->port = port;
+    socket->receive_ring = create_ring(UDP_SOCKET_RING_SIZE);
+    uint32_t bucket = udp_hash(port);
+    socket->hash_next = udp_sockets[bucket];
+    udp_sockets[bucket] = socket;
+    *out = socket;
     mutex_release(&udp_sockets_mutex);
-    return UDP_SOCKET_PORT_BUSY;
+    return UDP_SOCKET_SUCCESS;
+}
+
+static uint8_t ring_is_empty(ring_t *ring)
+{
+    return ring->head == ring->tail;
 }
 
-uint8_t receive_udp_packet(udp_socket_t *socket, uint32_t timeout, void **buffer)
+/*
+ * Sleeps until the first datagram arrives or timeout (in PIT ticks, 0 - don't wait, UDP_WAIT_FOREVER) expires, then
+ * takes up to count queued datagrams without waiting for more. Returns number of datagrams, caller owns the buffers.
+ */
+uint32_t receive_udp_packets(udp_socket_t *socket, net_buffer_t **buffers, uint32_t count, uint32_t timeout)
 {
-    void *ptr = 0;
-    uint32_t limit = get_pit_ticks() + timeout;
-    while(limit > get_pit_ticks())
+    uint32_t finish = get_pit_ticks() + timeout;
+    uint32_t received = 0;
+    while (received < count)
     {
-        ptr = socket->receive_ring->pop(socket->receive_ring);
-        if (ptr > 0)
+        net_buffer_t *buffer = socket->receive_ring->pop(socket->receive_ring);
+        if (buffer != 0)
+        {
+            net_buffer_uncharge(&socket->rx_buffers, buffer);
+            buffers[received++] = buffer;
+            continue;
+        }
+        if (received > 0)
+        {
+            break;
+        }
+
+        uint32_t now = get_pit_ticks();
+        if (timeout != UDP_WAIT_FOREVER && now >= finish)
+        {
+            break;
+        }
+        cli();
+        if (ring_is_empty(socket->receive_ring))
+        {
+            wait_event(&socket->wait, WAIT_ANY_KEY, timeout == UDP_WAIT_FOREVER ? 0 : finish - now);
+        }
+        else
         {
-            *buffer = ptr;
-            return UDP_SOCKET_SUCCESS;
+            sti();
         }
     }
-    return UDP_SOCKET_TIMEOUT;
+    return received;
+}
+
+// caller owns the returned buffer and releases it with release_net_buffer()
+uint8_t receive_udp_packet(udp_socket_t *socket, uint32_t timeout, net_buffer_t **buffer)
+{
+    return receive_udp_packets(socket, buffer, 1, timeout) == 1 ? UDP_SOCKET_SUCCESS : UDP_SOCKET_TIMEOUT;
+}
+
+// datagrams are sent without queueing, so socket is always writable
+uint32_t udp_poll_events(udp_socket_t *socket)
+{
+    return (ring_is_empty(socket->receive_ring) ? 0 : POLLIN) | POLLOUT;
 }
 
 uint8_t send_udp_packet(udp_socket_t *socket, ip4_addr_t* ip, uint16_t port, void *payload, size_t size)
 {
-    if (size + sizeof(udp_packet_t) > MAX_ETHERNET_PACKET_SIZE)
+    network_device_t *net_dev = socket->net_dev;
+    ip4_addr_t next_hop;
+    if (net_dev == 0 && (net_dev = route_lookup(ip, &next_hop)) == 0)
+    {
+        return UDP_SOCKET_NO_ROUTE;
+    }
+    // IP fragmentation isn't supported, datagram must fit into MTU of the device
+    if (size + sizeof(udp_packet_t) - sizeof(eth_header_t) > net_dev->mtu)
     {
         return UDP_SOCKET_TOO_BIG_PACKET;
     }
 
-    uint16_t total_size = size + sizeof(udp_packet_t);
-    udp_packet_t *udp_packet = kmalloc(total_size);
-    memset(udp_packet, 0, total_size);
-    memcpy(udp_packet + 1, payload, size);
-    udp_packet->udp.source_port = bswap16(socket->port);
-    udp_packet->udp.destination_port = bswap16(port);
-    udp_packet->udp.length = bswap16(size + sizeof(udp_header_t)); // only UDP header + payload
+    net_buffer_t *buffer = alloc_net_buffer();
+    if (buffer == 0)
+    {
+        return UDP_SOCKET_NO_BUFFER;
+    }
+    if (!net_buffer_append(buffer, payload, size))
+    {
+        release_net_buffer(buffer);
+        return UDP_SOCKET_NO_BUFFER;
+    }
+    udp_header_t *udp = net_buffer_push(buffer, sizeof(udp_header_t));
+    if (udp == NULL)
+    {
+        release_net_buffer(buffer);
+        return UDP_SOCKET_NO_BUFFER;
+    }
+    memset(udp, 0, sizeof(udp_header_t));
+    udp->source_port = bswap16(socket->port);
+    udp->destination_port = bswap16(port);
+    udp->length = bswap16(size + sizeof(udp_header_t)); // only UDP header + payload
+    // checksum is optional for UDP over IPv4, it's filled only when hardware does it
+    if (net_dev->features & NET_FEATURE_UDP_CSUM)
+    {
+        buffer->offload |= NET_OFFLOAD_TX_L4_CSUM;
+        udp->checksum = ip4_pseudo_checksum(&net_dev->ip4_addr, ip, PROTOCOL_UDP, size + sizeof(udp_header_t));
+    }
 
-    send_ip4_packet(socket->net_dev, ip, PROTOCOL_UDP, udp_packet, total_size);
-    kfree(udp_packet);
+    send_ip4_packet(net_dev, ip, PROTOCOL_UDP, buffer);
     return UDP_SOCKET_SUCCESS;
 }
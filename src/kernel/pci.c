@@ -9,6 +9,11 @@
 #include "mutex.h"
 #include "ata.h"
 #include "vesa_lfb.h"
+#include "apic.h"
+#include "irq.h"
+#include "errno.h"
+#include "mm.h"
+#include "mmio.h"
 
 driver_map_node_t driver_map[] = {
     {
@@ -42,6 +47,14 @@ driver_map_node_t driver_map[] = {
         .subclass_id = 0,
         .interface_id = 0,
         .init = &e1000_init
+    },
+    {
+        .vendor_id = 0x8086,
+        .device_id = 0x10d3,
+        .class_id = 0,
+        .subclass_id = 0,
+        .interface_id = 0,
+        .init = &e1000_init
     }
 };
 
@@ -92,6 +105,12 @@ void detect_pci_devices()
                 device->class = (uint8_t)(config >> 24);
                 device->subclass = (uint8_t)(config >> 16);
                 device->interface = (uint8_t)(config >> 8);
+                device->bus = bus;
+                device->slot = slot;
+                device->func = function;
+                config = pci_config_read(bus, slot, function, PCI_REG_INTERRUPT);
+                device->irq_pin = (uint8_t)(config >> 8);
+                device->irq_line = device->irq_pin == 0 ? PCI_NO_IRQ : (uint8_t)config;
 
                 debug("[PCI] device at %i:%i:%i; vendor id: %x, device id: %x, class: %x, sublclass: %x, interface: %x\n",
                     bus, slot, function, vendor_id, device_id, device->class, device->subclass, device->interface);
@@ -172,3 +191,202 @@ pci_device_t* get_pci_device_by_class(uint8_t class, pci_device_t* curr)
     mutex_release(&pci_devices_mutex);
     return NULL;
 }
+
+// returns offset of capability in config space or 0
+uint8_t pci_find_capability(pci_device_t *dev, uint8_t id)
+{
+    uint32_t status = pci_config_read(dev->bus, dev->slot, dev->func, PCI_REG_COMMAND) >> 16;
+    if ((status & PCI_STATUS_CAPABILITIES) == 0) {
+        return 0;
+    }
+
+    uint8_t offset = pci_config_read(dev->bus, dev->slot, dev->func, PCI_REG_CAPABILITIES) & 0xFC;
+    // list can't be longer than config space, it protects from broken loops
+    for (uint32_t i = 0; offset != 0 && i < 48; i++) {
+        uint32_t header = pci_config_read(dev->bus, dev->slot, dev->func, offset);
+        if ((header & 0xFF) == id) {
+            return offset;
+        }
+        offset = (header >> 8) & 0xFC;
+    }
+    return 0;
+}
+
+// one message, delivered to the current LAPIC as edge triggered fixed interrupt
+int pci_enable_msi(pci_device_t *dev, uint8_t vector)
+{
+    if (!apic_enabled()) {
+        return -ENODEV;
+    }
+    uint8_t cap = pci_find_capability(dev, PCI_CAP_MSI);
+    if (cap == 0) {
+        return -ENODEV;
+    }
+
+    uint32_t control = pci_config_read(dev->bus, dev->slot, dev->func, cap) >> 16;
+    pci_config_write(dev->bus, dev->slot, dev->func, cap + 4, MSI_ADDRESS_BASE | ((uint32_t)apic_id() << 12));
+    uint8_t data_offset = 8;
+    if (control & PCI_MSI_64BIT) {
+        pci_config_write(dev->bus, dev->slot, dev->func, cap + 8, 0);
+        data_offset = 12;
+    }
+    // data is 16 bit, upper half of the dword belongs to the next field (or is reserved)
+    uint32_t data = pci_config_read(dev->bus, dev->slot, dev->func, cap + data_offset);
+    pci_config_write(dev->bus, dev->slot, dev->func, cap + data_offset, (data & 0xFFFF0000) | vector);
+
+    // single message (multiple message enable = 0), then enable
+    control = (control & ~(7 << 4)) | PCI_MSI_ENABLE;
+    uint32_t header = pci_config_read(dev->bus, dev->slot, dev->func, cap);
+    pci_config_write(dev->bus, dev->slot, dev->func, cap, (header & 0xFFFF) | (control << 16));
+
+    uint32_t command = pci_config_read(dev->bus, dev->slot, dev->func, PCI_REG_COMMAND);
+    // status bits are write-1-to-clear, don't touch them
+    pci_config_write(dev->bus, dev->slot, dev->func, PCI_REG_COMMAND, (command & 0xFFFF) | PCI_COMMAND_INTX_DISABLE);
+    return 0;
+}
+
+// handlers of devices sharing a legacy line, all of them are called for its interrupt
+static void (*intx_handlers[ISA_IRQ_COUNT][PCI_INTX_SHARED_HANDLERS])(struct regs *r);
+
+static void pci_intx_handler(struct regs *r)
+{
+    for (uint32_t i = 0; i < PCI_INTX_SHARED_HANDLERS; i++) {
+        void (*handler)(struct regs *r) = intx_handlers[r->int_num - IRQ_VECTOR_BASE][i];
+        if (handler != NULL) {
+            handler(r);
+        }
+    }
+}
+
+// same handler is added once, it serves all devices of its driver; -EBUSY if line belongs to non-PCI device or is full
+static int pci_share_intx(uint8_t line, void *handler)
+{
+    int vector = IRQ_VECTOR_BASE + line;
+    void *installed = get_irq_handler(vector);
+    if (installed != NULL && installed != pci_intx_handler) {
+        return -EBUSY;
+    }
+
+    int free = -1;
+    for (int i = 0; i < PCI_INTX_SHARED_HANDLERS; i++) {
+        if (intx_handlers[line][i] == handler) {
+            return 0;
+        }
+        if (intx_handlers[line][i] == NULL && free < 0) {
+            free = i;
+        }
+    }
+    if (free < 0) {
+        return -EBUSY;
+    }
+    uint32_t flags = irq_save();
+    intx_handlers[line][free] = handler;
+    set_irq_handler(vector, pci_intx_handler);
+    irq_restore(flags);
+    return 0;
+}
+
+/*
+ * Installs top half handler for the device, prefers MSI and falls back to legacy INTx line.
+ * Returns vector or negative error. Legacy line may be wired to other devices too, so handler must check that its
+ * device really interrupted.
+ */
+int pci_request_irq(pci_device_t *dev, void *handler)
+{
+    if (apic_enabled()) {
+        int vector = apic_alloc_vector();
+        if (vector > 0) {
+            set_irq_handler(vector, handler);
+            if (pci_enable_msi(dev, vector) == 0) {
+                debug("[PCI] %i:%i:%i uses MSI, vector %i\n", dev->bus, dev->slot, dev->func, vector);
+                return vector;
+            }
+            set_irq_handler(vector, NULL);
+            apic_free_vector(vector);
+        }
+    }
+
+    if (dev->irq_line == PCI_NO_IRQ || dev->irq_line >= ISA_IRQ_COUNT) {
+        return -ENODEV;
+    }
+    int vector = IRQ_VECTOR_BASE + dev->irq_line;
+    int err = pci_share_intx(dev->irq_line, handler);
+    if (err < 0) {
+        log(KERN_ERR, "[PCI] %i:%i:%i can't share IRQ %i\n", dev->bus, dev->slot, dev->func, dev->irq_line);
+        return err;
+    }
+    if (apic_enabled()) {
+        apic_route_isa_irq(dev->irq_line, vector, true);
+    }
+    debug("[PCI] %i:%i:%i uses IRQ %i\n", dev->bus, dev->slot, dev->func, dev->irq_line);
+    return vector;
+}
+
+// programs count table entries with vectors on the current LAPIC and enables MSI-X, INTx and MSI stay off
+static int pci_enable_msix(pci_device_t *dev, int *vectors, uint32_t count)
+{
+    uint8_t cap = pci_find_capability(dev, PCI_CAP_MSIX);
+    if (cap == 0) {
+        return -ENODEV;
+    }
+    uint32_t control = pci_config_read(dev->bus, dev->slot, dev->func, cap) >> 16;
+    if ((control & PCI_MSIX_TABLE_SIZE_MASK) + 1 < count) {
+        return -ENODEV;
+    }
+    uint32_t table = pci_config_read(dev->bus, dev->slot, dev->func, cap + 4);
+    uint8_t bar = table & PCI_MSIX_BIR_MASK;
+    uint32_t offset = table & ~PCI_MSIX_BIR_MASK;
+    if (dev->base_address[bar] == 0) {
+        return -ENODEV;
+    }
+
+    // table is accessed only here, so its pages are mapped for the setup
+    uint32_t start = (dev->base_address[bar] + offset) & ~0xFFF;
+    uint32_t pages = PAGE_ALIGN(dev->base_address[bar] + offset + count * PCI_MSIX_ENTRY_SIZE - start) / 0x1000;
+    uint32_t virtual = alloc_hardware_space_chunk(pages);
+    map_virtual_to_physical_range(virtual, start, PAGE_NO_CACHE, pages);
+    uint32_t entries = virtual + ((dev->base_address[bar] + offset) & 0xFFF);
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t entry = entries + i * PCI_MSIX_ENTRY_SIZE;
+        mmio_write32(entry, 0, MSI_ADDRESS_BASE | ((uint32_t)apic_id() << 12));
+        mmio_write32(entry, 4, 0);
+        mmio_write32(entry, 8, vectors[i]);
+        mmio_write32(entry, 12, mmio_read32(entry, 12) & ~PCI_MSIX_ENTRY_MASKED);
+    }
+
+    uint32_t header = pci_config_read(dev->bus, dev->slot, dev->func, cap);
+    pci_config_write(dev->bus, dev->slot, dev->func, cap, (header & 0xFFFF) | ((control | PCI_MSIX_ENABLE) << 16));
+
+    uint32_t command = pci_config_read(dev->bus, dev->slot, dev->func, PCI_REG_COMMAND);
+    pci_config_write(dev->bus, dev->slot, dev->func, PCI_REG_COMMAND, (command & 0xFFFF) | PCI_COMMAND_INTX_DISABLE);
+    return 0;
+}
+
+/*
+ * Allocates count vectors with the same top half handler and delivers MSI-X table entries 0..count-1 to them.
+ * Returns 0 or negative error, caller falls back to pci_request_irq() then.
+ */
+int pci_request_msix(pci_device_t *dev, void *handler, int *vectors, uint32_t count)
+{
+    if (!apic_enabled() || count > PCI_MSIX_MAX_VECTORS) {
+        return -ENODEV;
+    }
+    uint32_t allocated = 0;
+    for (; allocated < count; allocated++) {
+        vectors[allocated] = apic_alloc_vector();
+        if (vectors[allocated] <= 0) {
+            break;
+        }
+        set_irq_handler(vectors[allocated], handler);
+    }
+    if (allocated == count && pci_enable_msix(dev, vectors, count) == 0) {
+        debug("[PCI] %i:%i:%i uses MSI-X, %i vectors from %i\n", dev->bus, dev->slot, dev->func, count, vectors[0]);
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < allocated; i++) {
+        set_irq_handler(vectors[i], NULL);
+        apic_free_vector(vectors[i]);
+    }
+    return -ENODEV;
+}
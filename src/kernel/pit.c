@@ -4,13 +4,14 @@
 #include "port.h"
 #include "irq.h"
 #include "task.h"
+#include "kernel_data.h"
 
 volatile uint32_t pit_ticks;
 extern volatile uint8_t task_switch_required;
 
 static void pit_tick_handler(struct regs *r)
 {
-    __sync_add_and_fetch(&pit_ticks, 1);
+    kernel_data_tick(__sync_add_and_fetch(&pit_ticks, 1));
     task_switch_required = 1;
 }
 
@@ -106,6 +106,9 @@ int execve(char *path, char **argv, char **envp)
     char *path_back = kmalloc(MAX_PATH_LENGTH);
     strcpy(path_back, path);
 
+    stop_other_threads();
+    // ring pages are freed with the rest of userspace, worker is stopped above
+    current_process->ioring = NULL;
     free_userspace();
     current_process->brk = NULL;
     // from now thread must be terminated if any errors, it can't return to userspace anymore
@@ -127,6 +130,8 @@ int execve(char *path, char **argv, char **envp)
     }
     // restore brk because it's modified by last map_virtual_to_physical calls
     current_process->brk = brk;
+    setup_main_thread_tls();
+    map_kernel_data(current_process);
 
     argv = make_params(argv_tmp, argc);
     envp = make_params(enpv_tmp, envc);
@@ -0,0 +1,104 @@
+#include "softirq.h"
+#include "irq.h"
+#include "log.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+// softirqs raised while handlers run are picked up again, the rest waits for the next interrupt exit
+#define SOFTIRQ_RESTARTS 10
+
+// the kernel is uniprocessor, so "per-CPU" state is just global
+static void (*softirq_handlers[SOFTIRQ_COUNT])();
+static volatile uint32_t softirq_pending = 0;
+volatile uint32_t preempt_count = 0;
+
+static struct tasklet *tasklet_head = NULL;
+static struct tasklet *tasklet_tail = NULL;
+
+void open_softirq(uint32_t nr, void (*handler)())
+{
+    assert(nr < SOFTIRQ_COUNT);
+    softirq_handlers[nr] = handler;
+}
+
+// safe to call from any context
+void raise_softirq(uint32_t nr)
+{
+    __sync_or_and_fetch(&softirq_pending, 1 << nr);
+}
+
+/*
+ * Must be called with interrupts disabled, returns with interrupts disabled. Handlers run with interrupts enabled,
+ * a hardware IRQ which arrives meanwhile only sets pending bits, it doesn't start another do_softirq() and doesn't
+ * switch task (preempt_count is held), so bottom halves always run to the end.
+ */
+void do_softirq()
+{
+    if (preempt_count != 0) {
+        return;
+    }
+    preempt_disable();
+
+    uint32_t restarts = SOFTIRQ_RESTARTS;
+    uint32_t pending;
+    while ((pending = softirq_pending) != 0 && restarts-- > 0) {
+        softirq_pending = 0;
+        sti();
+        for (uint32_t nr = 0; pending != 0; nr++, pending >>= 1) {
+            if ((pending & 1) && softirq_handlers[nr] != NULL) {
+                softirq_handlers[nr]();
+            }
+        }
+        cli();
+    }
+
+    preempt_enable();
+}
+
+void tasklet_init(struct tasklet *t, void (*func)(uint32_t), uint32_t data)
+{
+    t->next = NULL;
+    t->func = func;
+    t->data = data;
+    t->scheduled = 0;
+}
+
+// tasklet runs once even if scheduled many times before it started, it may reschedule itself
+void tasklet_schedule(struct tasklet *t)
+{
+    if (__sync_lock_test_and_set(&t->scheduled, 1)) {
+        return;
+    }
+
+    uint32_t flags = irq_save();
+    t->next = NULL;
+    if (tasklet_tail == NULL) {
+        tasklet_head = t;
+    } else {
+        tasklet_tail->next = t;
+    }
+    tasklet_tail = t;
+    irq_restore(flags);
+
+    raise_softirq(SOFTIRQ_TASKLET);
+}
+
+static void tasklet_action()
+{
+    cli();
+    struct tasklet *list = tasklet_head;
+    tasklet_head = tasklet_tail = NULL;
+    sti();
+
+    while (list != NULL) {
+        struct tasklet *t = list;
+        list = t->next;
+        __sync_lock_release(&t->scheduled);
+        t->func(t->data);
+    }
+}
+
+void init_softirq()
+{
+    open_softirq(SOFTIRQ_TASKLET, tasklet_action);
+}
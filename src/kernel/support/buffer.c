@@ -4,6 +4,16 @@
 #include "string.h"
 #include "log.h"
 
+// mutex must be held
+static uint32_t buffer_used(buffer_t *buffer)
+{
+    if (buffer->is_full)
+    {
+        return buffer->size;
+    }
+    return (buffer->head - buffer->tail + buffer->size) % buffer->size;
+}
+
 uint8_t buffer_add(buffer_t *buffer, void *payload, uint32_t size)
 {
     mutex_lock(&buffer->mutex);
@@ -15,25 +25,20 @@ uint8_t buffer_add(buffer_t *buffer, void *payload, uint32_t size)
     }
 
     // cant use get_free_space because of mutex in mutex
-    uint32_t space = (buffer->tail - buffer->head + buffer->size) % buffer->size;
-    if (space == 0)
-    {
-        space = buffer->size;
-    }
-
-    if (space < size)
+    if (buffer->size - buffer_used(buffer) < size)
     {
         mutex_release(&buffer->mutex);
         return BUFFER_FULL;
     }
 
+    uint8_t added = size > 0;
     while(size--)
     {
         buffer->buffer[buffer->head] = *(uint8_t*)payload++;
         buffer->head = (buffer->head + 1) % buffer->size;
     }
 
-    if (buffer->tail == buffer->head)
+    if (added && buffer->tail == buffer->head)
     {
         buffer->is_full = 1;
     }
@@ -46,7 +51,8 @@ uint32_t buffer_get_until(buffer_t *buffer, void *dest, uint32_t size, uint8_t s
 {
     mutex_lock(&buffer->mutex);
 
-    if (buffer->tail == buffer->head)
+    uint32_t used = buffer_used(buffer);
+    if (used == 0)
     {
         mutex_release(&buffer->mutex);
         return 0;
@@ -54,7 +60,7 @@ uint32_t buffer_get_until(buffer_t *buffer, void *dest, uint32_t size, uint8_t s
 
     uint32_t copied = 0;
     uint8_t *p = (uint8_t*)dest;
-    while(buffer->head != buffer->tail && copied < size)
+    while(copied < used && copied < size)
     {
         *p = buffer->buffer[buffer->tail];
         buffer->tail = (buffer->tail + 1) % buffer->size;
@@ -66,7 +72,7 @@ uint32_t buffer_get_until(buffer_t *buffer, void *dest, uint32_t size, uint8_t s
         p++;
     }
 
-    if (buffer->tail == buffer->head)
+    if (copied > 0)
     {
         buffer->is_full = 0;
     }
@@ -91,15 +97,96 @@ void buffer_clear(buffer_t *buffer)
 uint32_t buffer_get_free_space(buffer_t *buffer)
 {
     mutex_lock(&buffer->mutex);
+    uint32_t space = buffer->size - buffer_used(buffer);
+    mutex_release(&buffer->mutex);
+    return space;
+}
 
-    uint32_t space = (buffer->tail - buffer->head + buffer->size) % buffer->size;
-    if (space == 0)
+uint32_t buffer_get_used(buffer_t *buffer)
+{
+    mutex_lock(&buffer->mutex);
+    uint32_t used = buffer_used(buffer);
+    mutex_release(&buffer->mutex);
+    return used;
+}
+
+// copies data starting at offset from the tail without removing it
+uint32_t buffer_peek(buffer_t *buffer, void *dest, uint32_t offset, uint32_t size)
+{
+    mutex_lock(&buffer->mutex);
+
+    uint32_t used = buffer_used(buffer);
+    if (offset >= used)
+    {
+        mutex_release(&buffer->mutex);
+        return 0;
+    }
+    if (size > used - offset)
     {
-        space = buffer->size;
+        size = used - offset;
     }
 
+    // data can wrap around the end of storage
+    uint32_t start = (buffer->tail + offset) % buffer->size;
+    uint32_t first = buffer->size - start < size ? buffer->size - start : size;
+    memcpy(dest, buffer->buffer + start, first);
+    memcpy((uint8_t*)dest + first, buffer->buffer, size - first);
+
     mutex_release(&buffer->mutex);
-    return space;
+    return size;
+}
+
+// removes up to size bytes from the tail
+uint32_t buffer_drop(buffer_t *buffer, uint32_t size)
+{
+    mutex_lock(&buffer->mutex);
+
+    uint32_t used = buffer_used(buffer);
+    if (size > used)
+    {
+        size = used;
+    }
+    buffer->tail = (buffer->tail + size) % buffer->size;
+    if (size > 0)
+    {
+        buffer->is_full = 0;
+    }
+
+    mutex_release(&buffer->mutex);
+    return size;
+}
+
+// moves data into new storage of size bytes, fails if it doesn't fit; data keeps its order from the tail
+uint8_t buffer_resize(buffer_t *buffer, uint32_t size)
+{
+    mutex_lock(&buffer->mutex);
+
+    uint32_t used = buffer_used(buffer);
+    if (size == 0 || size < used)
+    {
+        mutex_release(&buffer->mutex);
+        return BUFFER_FULL;
+    }
+
+    uint8_t *storage = kmalloc(size);
+    if (storage == 0)
+    {
+        mutex_release(&buffer->mutex);
+        return BUFFER_FULL;
+    }
+    uint32_t first = buffer->size - buffer->tail < used ? buffer->size - buffer->tail : used;
+    memcpy(storage, buffer->buffer + buffer->tail, first);
+    memcpy(storage + first, buffer->buffer, used - first);
+    kfree(buffer->buffer);
+
+    buffer->buffer = storage;
+    buffer->size = size;
+    buffer->tail = 0;
+    buffer->head = used % size;
+    buffer->is_full = used == size;
+
+    mutex_release(&buffer->mutex);
+    return BUFFER_OK;
 }
 
 void buffer_free(buffer_t *buffer)
@@ -122,6 +209,10 @@ buffer_t* create_buffer(uint32_t size)
     buffer->get_until = &buffer_get_until;
     buffer->clear = &buffer_clear;
     buffer->get_free_space = &buffer_get_free_space;
+    buffer->get_used = &buffer_get_used;
+    buffer->peek = &buffer_peek;
+    buffer->drop = &buffer_drop;
+    buffer->resize = &buffer_resize;
     buffer->free = &buffer_free;
 
     return buffer;
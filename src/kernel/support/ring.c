@@ -14,7 +14,7 @@ uint8_t ring_push(ring_t *ring, void *payload)
     uint32_t next = (ring->head + 1) % ring->size;
     if (next == ring->tail)
     {
-        mutex_release(&ring->tail_mutex);
+        mutex_release(&ring->head_mutex);
         return RING_BUFFER_FULL;
     }
 
@@ -0,0 +1,163 @@
+#include <stddef.h>
+#include "wait_queue.h"
+#include "task.h"
+#include "irq.h"
+#include "pit.h"
+#include "errno.h"
+
+static void unlink_entry(struct wait_entry *entry)
+{
+    if (entry->queue != NULL) {
+        delete_from_list((void*)&entry->queue->entries, entry);
+        entry->queue = NULL;
+    }
+    if (entry->thread == NULL) {
+        return;
+    }
+
+    struct wait_entry **iterator = &entry->thread->waits;
+    while (*iterator != NULL) {
+        if (*iterator == entry) {
+            *iterator = entry->next;
+            break;
+        }
+        iterator = &(*iterator)->next;
+    }
+    entry->next = NULL;
+}
+
+void wait_queue_add(wait_queue_t *wq, struct wait_entry *entry, uint32_t key)
+{
+    uint32_t flags = irq_save();
+    entry->list.next = NULL;
+    entry->list.prev = NULL;
+    entry->thread = current_thread;
+    entry->queue = wq;
+    entry->key = key;
+    entry->woken = 0;
+    entry->callback = NULL;
+    push_in_list((void*)&wq->entries, entry);
+
+    entry->next = current_thread->waits;
+    current_thread->waits = entry;
+    irq_restore(flags);
+}
+
+/*
+ * Entry stays in queue and callback is called by every wake_up() instead of waking a thread. Callback runs with
+ * interrupts disabled, possibly in IRQ handler, so it must not sleep or take mutexes.
+ */
+void wait_queue_add_callback(wait_queue_t *wq, struct wait_entry *entry, void (*callback)(struct wait_entry*), void *private)
+{
+    uint32_t flags = irq_save();
+    entry->list.next = NULL;
+    entry->list.prev = NULL;
+    entry->thread = NULL;
+    entry->queue = wq;
+    entry->key = WAIT_ANY_KEY;
+    entry->woken = 0;
+    entry->next = NULL;
+    entry->callback = callback;
+    entry->private = private;
+    push_in_list((void*)&wq->entries, entry);
+    irq_restore(flags);
+}
+
+void wait_queue_remove(struct wait_entry *entry)
+{
+    uint32_t flags = irq_save();
+    unlink_entry(entry);
+    irq_restore(flags);
+}
+
+/*
+ * Wakes up to count threads waiting for key (WAIT_ANY_KEY matches everything, count <= 0 wakes all), callbacks
+ * are called regardless of count. Safe to call from IRQ handlers. Returns number of woken threads.
+ */
+int wake_up(wait_queue_t *wq, uint32_t key, int count)
+{
+    int woken = 0;
+    uint32_t flags = irq_save();
+    struct wait_entry *iterator = wq->entries;
+    while (iterator != NULL && (count <= 0 || woken < count)) {
+        struct wait_entry *entry = iterator;
+        iterator = (struct wait_entry*)iterator->list.next;
+        if (key != WAIT_ANY_KEY && entry->key != key) {
+            continue;
+        }
+        if (entry->callback != NULL) {
+            entry->callback(entry);
+            continue;
+        }
+
+        delete_from_list((void*)&wq->entries, entry);
+        entry->queue = NULL;
+        entry->woken = 1;
+        // stopped thread must stay stopped, killer() will clean it up
+        if (__sync_bool_compare_and_swap(&entry->thread->state, THREAD_SLEEPING, THREAD_RUNNING)) {
+            woken++;
+        }
+    }
+    irq_restore(flags);
+    return woken;
+}
+
+// called by killer() before thread memory is freed
+void wait_queue_cancel(struct thread *thread)
+{
+    uint32_t flags = irq_save();
+    while (thread->waits != NULL) {
+        unlink_entry(thread->waits);
+    }
+    irq_restore(flags);
+}
+
+/*
+ * Sleeps until wake_up() for key or timeout (in PIT ticks, 0 - no timeout).
+ * Caller must disable interrupts before checking its wait condition, otherwise wake up can be lost. Function returns
+ * with interrupts enabled.
+ */
+int wait_event(wait_queue_t *wq, uint32_t key, uint32_t timeout)
+{
+    struct wait_entry entry;
+    wait_queue_add(wq, &entry, key);
+
+    cli();
+    current_thread->wakeup_ticks = timeout ? get_pit_ticks() + timeout : 0;
+    if (!entry.woken) {
+        current_thread->state = THREAD_SLEEPING;
+        force_task_switch();
+    }
+    current_thread->wakeup_ticks = 0;
+    sti();
+
+    wait_queue_remove(&entry);
+    return entry.woken ? 0 : -ETIMEDOUT;
+}
+
+/*
+ * Sleeps until any of entries added by wait_queue_add() is woken or timeout expires, wait_event() for several queues
+ * (poll). Entries must be added before the wait conditions are checked. Caller removes entries.
+ */
+int wait_entries(struct wait_entry *entries, uint32_t count, uint32_t timeout)
+{
+    uint8_t woken = 0;
+    cli();
+    current_thread->wakeup_ticks = timeout ? get_pit_ticks() + timeout : 0;
+    for (uint32_t i = 0; i < count && !woken; i++) {
+        woken = entries[i].woken;
+    }
+    if (!woken) {
+        current_thread->state = THREAD_SLEEPING;
+        force_task_switch();
+    }
+    current_thread->wakeup_ticks = 0;
+    sti();
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (entries[i].woken) {
+            return 0;
+        }
+    }
+    return -ETIMEDOUT;
+}
@@ -11,6 +11,11 @@
 #include "string.h"
 #include "tty.h"
 #include "syscalls.h"
+#include "futex.h"
+#include "msr.h"
+#include "ioring.h"
+#include "socket.h"
+#include "poll.h"
 #include <stddef.h>
 
 typedef int (*syscall_handler)(int a, int b, int c);
@@ -23,7 +28,7 @@ typedef int (*syscall_handler)(int a, int b, int c);
 static int syscall_brk(uint32_t addr)
 {
     log(KERN_DEBUG, "PID %i requested brk %x\n", get_pid(), addr);
-    if (addr == 0 || (uint32_t)current_process->brk > addr || addr >= USERSPACE_SHARED_MEM)
+    if (addr == 0 || (uint32_t)current_process->brk > addr || addr >= USERSPACE_BRK_LIMIT)
     {
         return (uint32_t)current_process->brk;
     }
@@ -183,6 +188,48 @@ static int syscall_shm_get_addr()
     return 0;
 }
 
+// flags are passed in esi, address in edi
+static int syscall_send(int fd, void *buf, uint32_t size)
+{
+    return sys_sendto(fd, buf, size, current_thread->user_regs->esi, NULL);
+}
+
+static int syscall_recv(int fd, void *buf, uint32_t size)
+{
+    return sys_recvfrom(fd, buf, size, current_thread->user_regs->esi, NULL);
+}
+
+static int syscall_sendto(int fd, void *buf, uint32_t size)
+{
+    struct sockaddr_in *addr = (struct sockaddr_in*)current_thread->user_regs->edi;
+    return sys_sendto(fd, buf, size, current_thread->user_regs->esi, addr);
+}
+
+static int syscall_recvfrom(int fd, void *buf, uint32_t size)
+{
+    struct sockaddr_in *addr = (struct sockaddr_in*)current_thread->user_regs->edi;
+    return sys_recvfrom(fd, buf, size, current_thread->user_regs->esi, addr);
+}
+
+// event is passed in esi
+static int syscall_epoll_ctl(int epfd, int op, int fd)
+{
+    return sys_epoll_ctl(epfd, op, fd, (struct epoll_event*)current_thread->user_regs->esi);
+}
+
+// timeout is passed in esi
+static int syscall_epoll_wait(int epfd, struct epoll_event *events, int maxevents)
+{
+    return sys_epoll_wait(epfd, events, maxevents, current_thread->user_regs->esi);
+}
+
+// flags are passed in esi, timeout in edi
+static int syscall_recvmmsg(int fd, struct mmsghdr *msgvec, uint32_t vlen)
+{
+    struct timespec *timeout = (struct timespec*)current_thread->user_regs->edi;
+    return sys_recvmmsg(fd, msgvec, vlen, current_thread->user_regs->esi, timeout);
+}
+
 static void *syscall_table[] = {
     [SYSCALL_EXIT] = stop_process,
     [SYSCALL_FORK] = fork,
@@ -217,6 +264,26 @@ static void *syscall_table[] = {
     [SYSCALL_SHM_MAP] = syscall_shm_map,
     [SYSCALL_SHM_GET_ADDR] = syscall_shm_get_addr,
     [SYSCALL_SHM_ALLOC] = syscall_shm_alloc,
+    [SYSCALL_FUTEX] = futex,
+    [SYSCALL_THREAD_CREATE] = thread_create,
+    [SYSCALL_THREAD_EXIT] = thread_exit,
+    [SYSCALL_THREAD_JOIN] = thread_join,
+    [SYSCALL_RING_SETUP] = ring_setup,
+    [SYSCALL_RING_ENTER] = ring_enter,
+    [SYSCALL_SOCKET] = sys_socket,
+    [SYSCALL_BIND] = sys_bind,
+    [SYSCALL_LISTEN] = sys_listen,
+    [SYSCALL_ACCEPT] = sys_accept,
+    [SYSCALL_CONNECT] = sys_connect,
+    [SYSCALL_SEND] = syscall_send,
+    [SYSCALL_RECV] = syscall_recv,
+    [SYSCALL_SENDTO] = syscall_sendto,
+    [SYSCALL_RECVFROM] = syscall_recvfrom,
+    [SYSCALL_POLL] = sys_poll,
+    [SYSCALL_EPOLL_CREATE] = sys_epoll_create,
+    [SYSCALL_EPOLL_CTL] = syscall_epoll_ctl,
+    [SYSCALL_EPOLL_WAIT] = syscall_epoll_wait,
+    [SYSCALL_RECVMMSG] = syscall_recvmmsg,
     [0xce] = dup2
 };
 
@@ -236,7 +303,44 @@ void handle_syscall_routine(struct regs *r)
     }
 }
 
+// user esp passed by the sysenter stub must point into the stack of the calling thread
+static bool sysenter_stack_valid(uint32_t esp)
+{
+    uint32_t bottom = USERSPACE_STACK, top = USERSPACE_STACK_TOP;
+    if (current_thread->user_slot != 0) {
+        bottom = USERSPACE_THREAD_STACK(current_thread->user_slot);
+        top = bottom + USERSPACE_THREAD_STACK_SIZE;
+    }
+    return esp >= bottom && esp <= top - sizeof(uint32_t);
+}
+
+// called by sysenter_entry, ebp holds user esp and the return address is on top of the user stack
+void handle_sysenter_routine(struct regs *r)
+{
+    if (!sysenter_stack_valid(r->ebp)) {
+        log(KERN_ERR, "PID %i: sysenter with invalid stack pointer %x\n", get_pid(), r->ebp);
+        stop_process();
+    }
+    r->eip = *(uint32_t*)r->ebp;
+    handle_syscall_routine(r);
+}
+
+extern void sysenter_entry();
+// used only until sysenter_entry loads esp0 of current thread
+static uint8_t sysenter_stack[256] __attribute__((aligned(16)));
+
 void setup_syscalls()
 {
     set_irq_handler(0x80, handle_syscall_routine);
+
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & (1 << 11))) {
+        log(KERN_ERR, "CPU doesn't support sysenter, only int 0x80 syscalls are available\n");
+        return;
+    }
+    // sysexit uses SYSENTER_CS + 16 for userspace code and + 24 for stack (0x1B and 0x23)
+    wrmsr(MSR_SYSENTER_CS, 0x08);
+    wrmsr(MSR_SYSENTER_ESP, (uint32_t)sysenter_stack + sizeof(sysenter_stack));
+    wrmsr(MSR_SYSENTER_EIP, (uint32_t)&sysenter_entry);
 }
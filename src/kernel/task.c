@@ -13,6 +13,7 @@
 
 extern void perform_task_switch(uint32_t eip, uint32_t ebp, uint32_t esp);
 extern void return_to_userspace();
+extern void enter_userspace(uintptr_t location, uintptr_t stack);
 extern uint32_t read_eip();
 
 extern page_directory_t *page_directory;
@@ -60,9 +61,8 @@ static struct thread *create_thread()
     return thread;
 }
 
-void stop_process()
+void stop_other_threads()
 {
-    // stop all other threads, so nobody can work with files while current thread closes them
     // ref_count++ for thread isn't needed, thread can't be removed from list because of process mutex lock
     mutex_lock(&current_process->mutex);
     struct thread *iterator = current_process->threads;
@@ -74,6 +74,12 @@ void stop_process()
         iterator = (struct thread*)iterator->list.next;
     }
     mutex_release(&current_process->mutex);
+}
+
+void stop_process()
+{
+    // stop all other threads, so nobody can work with files while current thread closes them
+    stop_other_threads();
 
     // now only one thread is alive, so current_process can be changed without lock (or sys_close will cause deadlock)
     int err = 0;
@@ -102,7 +108,7 @@ static void failsafe_return()
     hlt();
 }
 
-void start_thread(void *entry_point, uint32_t arg)
+struct thread *start_thread(void *entry_point, uint32_t arg)
 {
     assert((uintptr_t)entry_point >= KERNEL_SPACE_ADDR);
     assert(current_process != NULL);
@@ -124,6 +130,182 @@ void start_thread(void *entry_point, uint32_t arg)
     cli();
     add_to_list(current_process->threads, thread);
     sti();
+
+    return thread;
+}
+
+// maps TLS page of the slot and makes it current for the calling thread
+static void setup_tls(uint8_t slot)
+{
+    uint32_t tls = USERSPACE_THREAD_TLS(slot);
+    if (get_physical_address(tls) == 0) {
+        map_virtual_to_physical(tls, alloc_physical_page(), 0);
+    }
+    memset((void*)tls, 0, 0x1000);
+    struct user_tls *header = (struct user_tls*)tls;
+    header->self = tls;
+    header->tid = current_thread->id;
+
+    current_thread->tls = tls;
+    current_thread->user_slot = slot;
+    set_tls_base(tls);
+}
+
+// called by execve, all other threads are already stopped
+void setup_main_thread_tls()
+{
+    memset(current_process->thread_slots, 0, sizeof(current_process->thread_slots));
+    current_process->thread_slots[0].tid = current_thread->id;
+    current_process->thread_slots[0].state = USER_THREAD_RUNNING;
+    setup_tls(0);
+}
+
+struct user_thread_start
+{
+    uint32_t entry_point;
+    uint32_t arg;
+    uint8_t slot;
+};
+
+static void user_thread_bootstrap(struct user_thread_start *start)
+{
+    uint32_t entry_point = start->entry_point;
+    uint32_t user_stack = USERSPACE_THREAD_STACK(start->slot) + USERSPACE_THREAD_STACK_SIZE;
+    PUSH_STACK(user_stack, start->arg);
+    user_stack -= 4; // return address, thread must call thread_exit()
+
+    setup_tls(start->slot);
+    kfree(start);
+    enter_userspace(entry_point, user_stack);
+}
+
+/*
+ * Creates thread in current process. It shares address space and gets its own stack & TLS page
+ * from a free slot. Returns thread id.
+ */
+int thread_create(uint32_t entry_point, uint32_t arg)
+{
+    if (entry_point == 0 || entry_point >= KERNEL_SPACE_ADDR) {
+        return -EINVAL;
+    }
+
+    mutex_lock(&current_process->mutex);
+    uint8_t slot = 0;
+    for (uint8_t i = 1; i < USERSPACE_THREADS_COUNT; i++) {
+        if (current_process->thread_slots[i].state == USER_THREAD_FREE) {
+            current_process->thread_slots[i].state = USER_THREAD_RUNNING;
+            current_process->thread_slots[i].joined = 0;
+            slot = i;
+            break;
+        }
+    }
+    mutex_release(&current_process->mutex);
+    if (slot == 0) {
+        return -EAGAIN;
+    }
+
+    // pages can be left from previous thread in this slot after fork
+    uint32_t stack = USERSPACE_THREAD_STACK(slot);
+    for (uint32_t i = 0; i < USERSPACE_THREAD_STACK_SIZE / 0x1000; i++) {
+        if (get_physical_address(stack + i * 0x1000) == 0) {
+            map_virtual_to_physical(stack + i * 0x1000, alloc_physical_page(), 0);
+        }
+    }
+
+    struct user_thread_start *start = kmalloc(sizeof(struct user_thread_start));
+    start->entry_point = entry_point;
+    start->arg = arg;
+    start->slot = slot;
+
+    // tid must be known before the thread can exit, otherwise join can't find it
+    mutex_lock(&current_process->mutex);
+    struct thread *thread = start_thread(&user_thread_bootstrap, (uint32_t)start);
+    current_process->thread_slots[slot].tid = thread->id;
+    mutex_release(&current_process->mutex);
+
+    return thread->id;
+}
+
+void thread_exit(uint32_t retval)
+{
+    bool last = true;
+    uint8_t slot = current_thread->user_slot;
+
+    mutex_lock(&current_process->mutex);
+    FOR_EACH(thread, current_process->threads, struct thread) {
+        if (thread != current_thread && thread->tls != 0 && thread->state != THREAD_STOPED) {
+            last = false;
+            break;
+        }
+    }
+    current_process->thread_slots[slot].retval = retval;
+    current_process->thread_slots[slot].state = USER_THREAD_EXITED;
+    mutex_release(&current_process->mutex);
+
+    if (last) {
+        stop_process();
+    }
+
+    // thread runs on kernel stack here, so user stack can be released before join
+    if (slot != 0) {
+        for (uint32_t i = 0; i < USERSPACE_THREAD_STACK_SIZE / 0x1000; i++) {
+            free_page(USERSPACE_THREAD_STACK(slot) + i * 0x1000);
+        }
+    }
+
+    wake_up(&current_process->join_queue, slot + 1, 0);
+    stop_thread();
+}
+
+int thread_join(int tid, uint32_t *retval)
+{
+    if (tid == current_thread->id) {
+        return -EINVAL;
+    }
+    if ((uintptr_t)retval > KERNEL_SPACE_ADDR - sizeof(uint32_t)) {
+        return -EFAULT;
+    }
+
+    struct user_thread_slot *slot = NULL;
+    uint32_t key = 0;
+    mutex_lock(&current_process->mutex);
+    for (uint32_t i = 0; i < USERSPACE_THREADS_COUNT; i++) {
+        if (current_process->thread_slots[i].state != USER_THREAD_FREE && current_process->thread_slots[i].tid == tid) {
+            slot = &current_process->thread_slots[i];
+            key = i + 1;
+            break;
+        }
+    }
+    // only one joiner gets the result and frees the slot
+    bool claimed = slot != NULL && slot->joined;
+    if (slot != NULL) {
+        slot->joined = 1;
+    }
+    mutex_release(&current_process->mutex);
+    if (slot == NULL) {
+        return -ESRCH;
+    }
+    if (claimed) {
+        return -EINVAL;
+    }
+
+    while (true) {
+        cli();
+        if (slot->state == USER_THREAD_EXITED) {
+            sti();
+            break;
+        }
+        wait_event(&current_process->join_queue, key, 0);
+    }
+
+    if (retval != NULL) {
+        *retval = slot->retval;
+    }
+    mutex_lock(&current_process->mutex);
+    slot->state = USER_THREAD_FREE;
+    mutex_release(&current_process->mutex);
+
+    return 0;
 }
 
 struct process *create_process(void *entry_point, uint32_t arg)
@@ -141,6 +323,7 @@ struct process *create_process(void *entry_point, uint32_t arg)
     process->page_dir_base = kmalloc(sizeof(page_directory_t) + 0x1000);
     process->page_dir = (page_directory_t*)PAGE_ALIGN((uint32_t)process->page_dir_base);
     strcpy(process->cur_dir, DEFAULT_DIR);
+    alloc_process_data(process);
 
     for(uint32_t i = 0; i < 0x400; i++) {
         if (i < KERNEL_SPACE_START_PAGE_DIR) {
@@ -235,11 +418,20 @@ int fork()
     p->group_id = current_process->group_id;
     strcpy(p->cur_dir, current_process->cur_dir);
 
+    // only forking thread is copied, it keeps its id, so TLS page content stays valid
+    p->threads->id = current_thread->id;
+    p->threads->tls = current_thread->tls;
+    p->threads->user_slot = current_thread->user_slot;
+    p->next_thread_id = current_process->next_thread_id;
+    if (current_thread->tls != 0) {
+        p->thread_slots[current_thread->user_slot].tid = current_thread->id;
+        p->thread_slots[current_thread->user_slot].state = USER_THREAD_RUNNING;
+    }
+
     for(uint32_t i = 0; i < MAX_OPENED_FILES; i++) {
         if (current_process->files[i] != NULL) {
             mutex_lock(&current_process->files[i]->mutex);
-            p->files[i] = kmalloc(sizeof(vfs_file_t));
-            memcpy(p->files[i], current_process->files[i], sizeof(vfs_file_t));
+            p->files[i] = dup_file(current_process->files[i]);
             mutex_release(&current_process->files[i]->mutex);
             p->files[i]->pid = p->id;
         }
@@ -272,6 +464,7 @@ int fork()
     }
     map_virtual_to_physical((uint32_t)buffer, buffer_phys_back, 0);
     kfree(buffer_chunk);
+    map_kernel_data(p);
 
     memcpy(p->threads[0].stack_mem + KERNEL_STACK_SIZE - sizeof(struct regs), current_thread->user_regs, sizeof(struct regs));
     p->threads[0].regs.esp = (uint32_t)p->threads[0].stack_mem + KERNEL_STACK_SIZE - sizeof(struct regs);
@@ -336,6 +529,9 @@ int set_proc_group(int pid, int group_id)
     while(iterator != NULL) {
         if (iterator->id == pid) {
             iterator->group_id = group_id;
+            if (iterator->data != NULL) {
+                iterator->data->gid = group_id;
+            }
             mutex_release(&global_mutex);
             return 0;
         }
@@ -362,6 +558,7 @@ static void killer()
                     delete_from_list((void*)&iterator->threads, tmp);
                     sti();
                     if (ref_dec(&tmp->ref_count) == 0) {
+                        wait_queue_cancel(tmp);
                         kfree(tmp->stack_mem);
                         kfree(tmp);
                         ref_dec(&iterator->ref_count);
@@ -374,6 +571,7 @@ static void killer()
             if (iterator->threads == NULL) {
                 iterator->state = PROCESS_DEAD;
                 kfree(iterator->page_dir_base);
+                free_process_data(iterator);
             }
 
             mutex_release(&iterator->mutex);
@@ -464,6 +662,9 @@ void switch_task()
             continue;
         }
         assert(th != NULL);
+        if (th->state == THREAD_SLEEPING && th->wakeup_ticks != 0 && get_pit_ticks() >= th->wakeup_ticks) {
+            __sync_bool_compare_and_swap(&th->state, THREAD_SLEEPING, THREAD_RUNNING);
+        }
         if (th->state != THREAD_RUNNING) {
             th = (struct thread*)th->list.next;
             c++;
@@ -498,6 +699,7 @@ void switch_task()
     ref_inc(&current_process->ref_count);
     ref_inc(&current_thread->ref_count);
     set_kernel_stack((uint32_t)th->stack_mem + KERNEL_STACK_SIZE);
+    set_tls_base(th->tls);
     if (current_thread->regs.eip == 0xc0100800) {
         hlt();
     }
@@ -526,6 +728,7 @@ int send_event(struct event_data *packet)
         if (p->id == packet->target) {
             packet->sender = get_pid();
             push_in_list((void*)&p->events, packet);
+            wake_up(&p->events_queue, WAIT_ANY_KEY, 0);
             mutex_release(&global_mutex);
             return 0;
         }
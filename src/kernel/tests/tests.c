@@ -109,42 +109,181 @@ void test_alloc_physical_range()
     asm("sti");
 }
 
+#include "task.h"
+#include "wait_queue.h"
+
+// entries are linked manually, because wait_queue_add() requires current_thread
+void test_wake_up()
+{
+    wait_queue_t wq = {0};
+    struct thread threads[3];
+    struct wait_entry entries[3];
+    memset(threads, 0, sizeof(threads));
+    memset(entries, 0, sizeof(entries));
+
+    for (int i = 0; i < 3; i++) {
+        threads[i].state = THREAD_SLEEPING;
+        entries[i].thread = &threads[i];
+        entries[i].queue = &wq;
+        entries[i].key = i == 1 ? 0x2000 : 0x1000;
+        push_in_list((void*)&wq.entries, &entries[i]);
+    }
+    threads[2].state = THREAD_STOPED;
+
+    int __attribute__((unused)) woken = wake_up(&wq, 0x1000, 1);
+    assert(woken == 1);
+    assert(threads[0].state == THREAD_RUNNING && entries[0].woken && entries[0].queue == NULL);
+    assert(threads[1].state == THREAD_SLEEPING && !entries[1].woken);
+    assert(wq.entries == &entries[1]);
+
+    // stopped thread isn't resurrected, but its entry is removed
+    woken = wake_up(&wq, 0x1000, 0);
+    assert(woken == 0);
+    assert(threads[2].state == THREAD_STOPED && entries[2].woken);
+    assert(get_list_length(wq.entries) == 1);
+
+    woken = wake_up(&wq, WAIT_ANY_KEY, 0);
+    assert(woken == 1);
+    assert(threads[1].state == THREAD_RUNNING);
+    assert(wq.entries == NULL);
+}
+
+static uint32_t wake_callback_calls;
+
+static void test_wake_callback(struct wait_entry *entry)
+{
+    wake_callback_calls += (uint32_t)entry->private;
+}
+
+// callback entries (epoll) are called on every wake up and stay in queue, they don't count as woken threads
+void test_wake_up_callback()
+{
+    wait_queue_t wq = {0};
+    struct thread thread;
+    struct wait_entry entries[2];
+    memset(&thread, 0, sizeof(thread));
+    memset(entries, 0, sizeof(entries));
+    wake_callback_calls = 0;
+
+    wait_queue_add_callback(&wq, &entries[0], &test_wake_callback, (void*)1);
+    thread.state = THREAD_SLEEPING;
+    entries[1].thread = &thread;
+    entries[1].queue = &wq;
+    push_in_list((void*)&wq.entries, &entries[1]);
+
+    int __attribute__((unused)) woken = wake_up(&wq, WAIT_ANY_KEY, 1);
+    assert(woken == 1 && wake_callback_calls == 1);
+    assert(thread.state == THREAD_RUNNING);
+    assert(wq.entries == &entries[0] && entries[0].queue == &wq);
+
+    woken = wake_up(&wq, WAIT_ANY_KEY, 0);
+    assert(woken == 0 && wake_callback_calls == 2);
+
+    wait_queue_remove(&entries[0]);
+    assert(wq.entries == NULL);
+    woken = wake_up(&wq, WAIT_ANY_KEY, 0);
+    assert(wake_callback_calls == 2);
+}
+
+#include "softirq.h"
+
+static uint32_t tasklet_runs;
+static struct tasklet test_tasklet_obj;
+
+// data - how many times tasklet reschedules itself
+static void test_tasklet_func(uint32_t data)
+{
+    // interrupts arriving now don't switch task
+    assert(!preemptible());
+    tasklet_runs++;
+    if (tasklet_runs <= data) {
+        tasklet_schedule(&test_tasklet_obj);
+    }
+}
+
+void test_tasklet()
+{
+    tasklet_init(&test_tasklet_obj, test_tasklet_func, 0);
+    tasklet_runs = 0;
+
+    // scheduled twice before it ran, runs once
+    tasklet_schedule(&test_tasklet_obj);
+    tasklet_schedule(&test_tasklet_obj);
+    cli();
+    do_softirq();
+    sti();
+    assert(tasklet_runs == 1);
+    assert(test_tasklet_obj.scheduled == 0);
+
+    // rescheduled from itself, picked up by the same do_softirq()
+    tasklet_init(&test_tasklet_obj, test_tasklet_func, 2);
+    tasklet_runs = 0;
+    tasklet_schedule(&test_tasklet_obj);
+    cli();
+    do_softirq();
+    sti();
+    assert(tasklet_runs == 3);
+    assert(preemptible());
+
+    // nested bottom half (or disabled preemption) leaves pending work for the outer one
+    tasklet_init(&test_tasklet_obj, test_tasklet_func, 0);
+    tasklet_runs = 0;
+    tasklet_schedule(&test_tasklet_obj);
+    preempt_disable();
+    cli();
+    do_softirq();
+    sti();
+    assert(tasklet_runs == 0);
+    preempt_enable();
+    cli();
+    do_softirq();
+    sti();
+    assert(tasklet_runs == 1);
+}
+
 #include "arp.h"
-extern arp_entry_t *arp_cache;
+extern arp_entry_t *arp_table[ARP_HASH_SIZE];
+
+static uint32_t arp_table_size()
+{
+    uint32_t size = 0;
+    for (uint32_t i = 0; i < ARP_HASH_SIZE; i++) {
+        for (arp_entry_t *entry = arp_table[i]; entry != NULL; entry = entry->next) {
+            size++;
+        }
+    }
+    return size;
+}
+
+static network_device_t arp_dev; // only the address is used as a key
 
 void test_get_mac_from_cache()
 {
     eth_addr_t addr = ETH_ADDR_EMPTY;
     ip4_addr_t ip = BUILD_IP4_ADDR(192, 168, 0, 2);
 
-    arp_cache = 0;
+    flush_arp_cache();
 
-    uint8_t __attribute__((unused)) result = get_mac_from_cache(&ip, &addr);
+    uint8_t __attribute__((unused)) result = get_mac_from_cache(&arp_dev, &ip, &addr);
     assert(result == 0);
 
-    arp_entry_t entry;
-    entry.ip_addr = ip;
     eth_addr_t tmp = {{19, 200, 20, 34, 23, 17}};
-    entry.mac = tmp;
-    add_to_list(arp_cache, &entry);
-    arp_entry_t entry2;
+    add_mac_to_arp_cache(&arp_dev, &ip, &tmp);
     ip4_addr_t ip2 = BUILD_IP4_ADDR(192, 168, 0, 3);
-    entry2.ip_addr = ip2;
     eth_addr_t tmp2 = {{34, 89, 01, 34, 23, 70}};
-    entry2.mac = tmp2;
-    add_to_list(arp_cache, &entry2);
+    add_mac_to_arp_cache(&arp_dev, &ip2, &tmp2);
 
-    result = get_mac_from_cache(&ip, &addr);
+    result = get_mac_from_cache(&arp_dev, &ip, &addr);
     assert(result == 1);
     assert(addr.b[0] == 19);
     assert(addr.b[5] == 17);
 
-    result = get_mac_from_cache(&ip2, &addr);
+    result = get_mac_from_cache(&arp_dev, &ip2, &addr);
     assert(result == 1);
     assert(addr.b[0] == 34);
     assert(addr.b[5] == 70);
 
-    arp_cache = 0;
+    flush_arp_cache();
 }
 
 void test_add_mac_to_arp_cache()
@@ -154,26 +293,666 @@ void test_add_mac_to_arp_cache()
     eth_addr_t mac2 = {{20, 200, 20, 34, 23, 117}};
     ip4_addr_t ip2 = BUILD_IP4_ADDR(192, 168, 0, 2);
 
-    arp_cache = 0;
+    flush_arp_cache();
 
-    add_mac_to_arp_cache(&ip, &mac);
+    add_mac_to_arp_cache(&arp_dev, &ip, &mac);
     eth_addr_t __attribute__((unused)) out = ETH_ADDR_EMPTY;
-    assert(get_mac_from_cache(&ip, &out));
+    assert(get_mac_from_cache(&arp_dev, &ip, &out));
     assert(out.b[0] == 19);
     assert(out.b[5] == 17);
 
-    add_mac_to_arp_cache(&ip2, &mac2);
-    assert(get_mac_from_cache(&ip2, &out));
+    add_mac_to_arp_cache(&arp_dev, &ip2, &mac2);
+    assert(get_mac_from_cache(&arp_dev, &ip2, &out));
     assert(out.b[0] == 20);
     assert(out.b[5] == 117);
 
     mac2.b[0] = 21;
-    add_mac_to_arp_cache(&ip2, &mac2);
-    assert(get_mac_from_cache(&ip2, &out));
+    add_mac_to_arp_cache(&arp_dev, &ip2, &mac2);
+    assert(get_mac_from_cache(&arp_dev, &ip2, &out));
     assert(out.b[0] == 21);
     assert(out.b[5] == 117);
-    assert(get_list_length(arp_cache) == 2);
-    arp_cache = 0;
+    assert(arp_table_size() == 2);
+
+    // entries of another device are separate
+    network_device_t other_dev;
+    assert(!get_mac_from_cache(&other_dev, &ip2, &out));
+    add_mac_to_arp_cache(&other_dev, &ip2, &mac);
+    assert(get_mac_from_cache(&other_dev, &ip2, &out) && out.b[5] == 17);
+    assert(get_mac_from_cache(&arp_dev, &ip2, &out) && out.b[5] == 117);
+    assert(arp_table_size() == 3);
+    flush_arp_cache();
+}
+
+static net_buffer_t *arp_sent_buffer;
+
+static void test_arp_send_packet(network_device_t *net_dev, net_buffer_t *buffer)
+{
+    arp_sent_buffer = buffer;
+}
+
+// packet to unresolved address waits in incomplete entry and is sent with the MAC from reply
+void test_arp_pending_queue()
+{
+    network_device_t net_dev;
+    memset(&net_dev, 0, sizeof(net_dev));
+    net_dev.send_packet = &test_arp_send_packet;
+    ip4_addr_t local = BUILD_IP4_ADDR(192, 168, 0, 10);
+    ip4_addr_t mask = BUILD_IP4_ADDR(255, 255, 255, 0);
+    net_dev.ip4_addr = local;
+    net_dev.subnet_mask = mask;
+
+    // pool isn't initialized, so request can't be allocated and only queued packet goes to send_packet
+    uint8_t frame[64];
+    memset(frame, 0, sizeof(frame));
+    net_buffer_t buffer;
+    memset(&buffer, 0, sizeof(buffer));
+    buffer.data = frame;
+    buffer.len = sizeof(frame);
+    buffer.ref_count = 1;
+
+    flush_arp_cache();
+    arp_sent_buffer = NULL;
+    ip4_addr_t ip = BUILD_IP4_ADDR(192, 168, 0, 20);
+    eth_addr_t __attribute__((unused)) out = ETH_ADDR_EMPTY;
+    assert(arp_resolve(&net_dev, &ip, &buffer, &out) == 0);
+    assert(!get_mac_from_cache(&net_dev, &ip, &out));
+    assert(arp_sent_buffer == NULL);
+
+    eth_addr_t mac = {{2, 0, 0, 0, 0, 7}};
+    add_mac_to_arp_cache(&net_dev, &ip, &mac);
+    assert(arp_sent_buffer == &buffer);
+    assert(((eth_header_t*)frame)->destination.b[5] == 7);
+    assert(arp_resolve(&net_dev, &ip, NULL, &out) == 1 && out.b[0] == 2);
+    assert(arp_table_size() == 1);
+    flush_arp_cache();
+}
+
+#include "route.h"
+
+void test_route_lookup()
+{
+    network_device_t lan, wan;
+    ip4_addr_t lan_net = BUILD_IP4_ADDR(10, 0, 0, 0);
+    ip4_addr_t lan_mask = BUILD_IP4_ADDR(255, 0, 0, 0);
+    ip4_addr_t host_net = BUILD_IP4_ADDR(10, 1, 2, 0);
+    ip4_addr_t host_mask = BUILD_IP4_ADDR(255, 255, 255, 0);
+    ip4_addr_t any = IP4_ADDR_EMPTY;
+    ip4_addr_t router = BUILD_IP4_ADDR(10, 0, 0, 1);
+    ip4_addr_t wan_router = BUILD_IP4_ADDR(192, 168, 1, 1);
+    add_route(&any, &any, &wan_router, &wan);
+    add_route(&lan_net, &lan_mask, &any, &lan);
+    add_route(&host_net, &host_mask, &router, &lan);
+
+    ip4_addr_t next_hop;
+    ip4_addr_t on_link = BUILD_IP4_ADDR(10, 5, 0, 7);
+    assert(route_lookup(&on_link, &next_hop) == &lan && COMPARE_IP4_ADDR(next_hop, on_link));
+    // /24 wins over /8
+    ip4_addr_t routed = BUILD_IP4_ADDR(10, 1, 2, 3);
+    assert(route_lookup(&routed, &next_hop) == &lan && COMPARE_IP4_ADDR(next_hop, router));
+    ip4_addr_t remote = BUILD_IP4_ADDR(8, 8, 8, 8);
+    assert(route_lookup(&remote, &next_hop) == &wan && COMPARE_IP4_ADDR(next_hop, wan_router));
+    // limited broadcast isn't sent to a gateway
+    ip4_addr_t broadcast = IP4_ADDR_BROADCAST;
+    assert(route_lookup(&broadcast, &next_hop) == &wan && COMPARE_IP4_ADDR(next_hop, broadcast));
+    // through a device without matching route destination is on the link
+    next_hop = route_next_hop(&lan, &remote);
+    assert(COMPARE_IP4_ADDR(next_hop, remote));
+
+    remove_device_routes(&wan);
+    assert(route_lookup(&remote, &next_hop) == NULL);
+    remove_device_routes(&lan);
+    assert(route_lookup(&on_link, &next_hop) == NULL);
+}
+
+#include "net_buffer.h"
+
+// pool isn't initialized yet, buffer is built by hand (storage isn't static, kernel BSS is small)
+void test_net_buffer()
+{
+    uint8_t *storage = kmalloc(NET_BUFFER_SIZE);
+    net_buffer_t buffer;
+    memset(&buffer, 0, sizeof(net_buffer_t));
+    buffer.head = storage;
+    buffer.data = storage + NET_BUFFER_HEADROOM;
+    buffer.ref_count = 1;
+
+    uint8_t __attribute__((unused)) *payload = net_buffer_put(&buffer, 100);
+    assert(payload == storage + NET_BUFFER_HEADROOM);
+    assert(buffer.len == 100);
+    assert(net_buffer_tailroom(&buffer) == NET_BUFFER_SIZE - NET_BUFFER_HEADROOM - 100);
+
+    uint8_t __attribute__((unused)) *header = net_buffer_push(&buffer, 20);
+    assert(header == payload - 20);
+    assert(buffer.len == 120);
+    assert(net_buffer_headroom(&buffer) == NET_BUFFER_HEADROOM - 20);
+    assert(net_buffer_push(&buffer, NET_BUFFER_HEADROOM) == NULL);
+
+    assert(net_buffer_pull(&buffer, 20) == header);
+    assert(buffer.data == payload);
+    assert(net_buffer_pull(&buffer, 101) == NULL);
+    assert(net_buffer_put(&buffer, NET_BUFFER_SIZE) == NULL);
+
+    hold_net_buffer(&buffer);
+    release_net_buffer(&buffer);
+    assert(buffer.ref_count == 1);
+    kfree(storage);
+}
+
+// jumbo frame spread over two hand built buffers, append fills tailroom of the last one without allocation
+void test_net_buffer_chain()
+{
+    uint8_t *first_storage = kmalloc(NET_BUFFER_SIZE);
+    uint8_t *second_storage = kmalloc(NET_BUFFER_SIZE);
+    net_buffer_t first, second;
+    memset(&first, 0, sizeof(net_buffer_t));
+    memset(&second, 0, sizeof(net_buffer_t));
+    first.head = first_storage;
+    first.data = first_storage + NET_BUFFER_HEADROOM;
+    second.head = second.data = second_storage;
+    first.next_frag = &second;
+
+    uint32_t first_len = NET_BUFFER_SIZE - NET_BUFFER_HEADROOM;
+    for (uint32_t i = 0; i < first_len; i++) {
+        first.data[i] = i;
+    }
+    first.len = first_len;
+    uint8_t data[100];
+    for (uint32_t i = 0; i < sizeof(data); i++) {
+        data[i] = first_len + i;
+    }
+    assert(net_buffer_append(&first, data, sizeof(data)));
+    assert(first.len == first_len && second.len == sizeof(data));
+    assert(net_buffer_total_len(&first) == first_len + sizeof(data));
+
+    uint8_t out[20];
+    assert(net_buffer_copy(&first, first_len - 10, out, sizeof(out)) == sizeof(out));
+    for (uint32_t i = 0; i < sizeof(out); i++) {
+        assert(out[i] == (uint8_t)(first_len - 10 + i));
+    }
+    // only what's left of the packet is copied
+    assert(net_buffer_copy(&first, first_len + sizeof(data) - 5, out, sizeof(out)) == 5);
+    kfree(first_storage);
+    kfree(second_storage);
+}
+
+// pool isn't initialized, so it's below low watermark: only a socket which holds nothing can queue
+void test_net_buffer_charge()
+{
+    net_buffer_t first, second;
+    memset(&first, 0, sizeof(net_buffer_t));
+    memset(&second, 0, sizeof(net_buffer_t));
+    first.next_frag = &second;
+    assert(net_buffer_count(&first) == 2);
+
+    volatile uint32_t held = 0;
+    assert(net_buffer_charge(&held, &first));
+    assert(held == 2);
+    assert(!net_buffer_charge(&held, &second));
+    assert(held == 2);
+    net_buffer_uncharge(&held, &first);
+    assert(held == 0);
+    assert(net_buffer_charge(&held, &second));
+    assert(held == 1);
+}
+
+#include "errno.h"
+
+void test_network_mtu()
+{
+    network_device_t net_dev;
+    memset(&net_dev, 0, sizeof(network_device_t));
+    net_dev.mtu = NET_DEFAULT_MTU;
+
+    assert(set_network_mtu(&net_dev, NET_MIN_MTU - 1) == -EINVAL);
+    // jumbo frames need driver support
+    assert(set_network_mtu(&net_dev, NET_MAX_MTU) == -EINVAL);
+    assert(set_network_mtu(&net_dev, 1280) == 0);
+    assert(net_dev.mtu == 1280);
+}
+
+#include "pcap.h"
+
+// "udp dst port 53" as printed by tcpdump -dd, run on a hand built frame
+void test_bpf_filter()
+{
+    bpf_insn_t program[] = {
+        {BPF_LD | BPF_H | BPF_ABS, 0, 0, 12},
+        {BPF_JMP | BPF_JEQ | BPF_K, 0, 6, 0x800},
+        {BPF_LD | BPF_B | BPF_ABS, 0, 0, 23},
+        {BPF_JMP | BPF_JEQ | BPF_K, 0, 4, 17},
+        {BPF_LDX | BPF_B | BPF_MSH, 0, 0, 14},
+        {BPF_LD | BPF_H | BPF_IND, 0, 0, 16},
+        {BPF_JMP | BPF_JEQ | BPF_K, 0, 1, 53},
+        {BPF_RET | BPF_K, 0, 0, 0x40000},
+        {BPF_RET | BPF_K, 0, 0, 0},
+    };
+    uint32_t count = sizeof(program) / sizeof(bpf_insn_t);
+    assert(bpf_validate(program, count));
+
+    static uint8_t storage[64];
+    net_buffer_t buffer;
+    memset(&buffer, 0, sizeof(net_buffer_t));
+    buffer.head = buffer.data = storage;
+    buffer.len = sizeof(storage);
+    storage[12] = 0x08; // IPv4
+    storage[14] = 0x45;
+    storage[23] = 17; // UDP
+    storage[37] = 53; // destination port, IP header is 20 bytes
+    assert(bpf_run(program, &buffer) == 0x40000);
+    storage[37] = 54;
+    assert(bpf_run(program, &buffer) == 0);
+    // load past the end of the frame drops it
+    storage[37] = 53;
+    buffer.len = 30;
+    assert(bpf_run(program, &buffer) == 0);
+
+    // jump out of the program and missing return are rejected
+    program[1].jf = 7;
+    assert(!bpf_validate(program, count));
+    program[1].jf = 6;
+    assert(!bpf_validate(program, 3));
+    // load of undefined size
+    bpf_insn_t bad_size[] = {
+        {BPF_LD | 0x18 | BPF_ABS, 0, 0, 12},
+        {BPF_RET | BPF_K, 0, 0, 0},
+    };
+    assert(!bpf_validate(bad_size, 2));
+    bad_size[0].code = BPF_LD | 0x18 | BPF_IND;
+    assert(!bpf_validate(bad_size, 2));
+}
+
+#include "checksum.h"
+
+void test_checksum()
+{
+    // RFC 1071 example, sum of big endian words is 0xDDF2
+    uint8_t data[] = {0x00, 0x01, 0xF2, 0x03, 0xF4, 0xF5, 0xF6, 0xF7, 0x12};
+    assert(checksum_fold(checksum_partial(data, 8, 0)) == 0xF2DD);
+    assert(checksum(data, 8) == (uint16_t)~0xF2DD);
+    // odd length, last byte is padded with zero
+    assert(checksum_fold(checksum_partial(data, 9, 0)) == 0xF2EF);
+
+    // blocks summed separately, odd offsets included
+    uint32_t __attribute__((unused)) whole = checksum_fold(checksum_partial(data, 9, 0));
+    uint32_t sum = checksum_partial(data, 3, 0);
+    sum = checksum_block_add(sum, checksum_partial(data + 3, 5, 0), 3);
+    sum = checksum_block_add(sum, checksum_partial(data + 8, 1, 0), 8);
+    assert(checksum_fold(sum) == whole);
+
+    // incremental update gives the same result as recalculation
+    uint8_t header[20];
+    for (uint32_t i = 0; i < sizeof(header); i++) {
+        header[i] = i * 37 + 11;
+    }
+    uint16_t __attribute__((unused)) check = checksum(header, sizeof(header));
+    uint16_t *word = (uint16_t*)(header + 6);
+    uint16_t old_word = *word;
+    *word = 0xBEEF;
+    assert(checksum_update16(check, old_word, 0xBEEF) == checksum(header, sizeof(header)));
+
+    check = checksum(header, sizeof(header));
+    uint32_t *dword = (uint32_t*)(header + 12);
+    uint32_t old_dword = *dword;
+    *dword = 0x0A00020F;
+    assert(checksum_update32(check, old_dword, 0x0A00020F) == checksum(header, sizeof(header)));
+}
+
+#include "buffer.h"
+
+void test_buffer_peek_drop()
+{
+    buffer_t *buffer = create_buffer(8);
+    uint8_t data[] = {1, 2, 3, 4, 5, 6, 7, 8};
+    uint8_t out[8];
+
+    buffer->add(buffer, data, 6);
+    buffer->drop(buffer, 4);
+    // data wraps around the end of storage
+    buffer->add(buffer, data, 6);
+    assert(buffer->get_used(buffer) == 8);
+    assert(buffer->get_free_space(buffer) == 0);
+    assert(buffer->add(buffer, data, 1) == BUFFER_FULL);
+
+    assert(buffer->peek(buffer, out, 1, 8) == 7);
+    assert(out[0] == 6 && out[1] == 1 && out[6] == 6);
+    assert(buffer->peek(buffer, out, 8, 1) == 0);
+    assert(buffer->get_used(buffer) == 8);
+
+    assert(buffer->drop(buffer, 3) == 3);
+    assert(buffer->get(buffer, out, 8) == 5);
+    assert(out[0] == 2 && out[4] == 6);
+    assert(buffer->drop(buffer, 1) == 0);
+    buffer->free(buffer);
+}
+
+// wrapped data is moved to the start of new storage
+void test_buffer_resize()
+{
+    buffer_t *buffer = create_buffer(8);
+    uint8_t data[] = {1, 2, 3, 4, 5, 6, 7, 8};
+    uint8_t out[16];
+
+    buffer->add(buffer, data, 6);
+    buffer->drop(buffer, 4);
+    buffer->add(buffer, data, 6);
+    assert(buffer->resize(buffer, 7) == BUFFER_FULL);
+    assert(buffer->get_used(buffer) == 8);
+
+    assert(buffer->resize(buffer, 16) == BUFFER_OK);
+    assert(buffer->size == 16 && buffer->get_used(buffer) == 8);
+    assert(buffer->get_free_space(buffer) == 8);
+    assert(buffer->add(buffer, data, 8) == BUFFER_OK);
+    assert(buffer->get_free_space(buffer) == 0);
+    assert(buffer->get(buffer, out, 16) == 16);
+    assert(out[0] == 5 && out[1] == 6 && out[2] == 1 && out[7] == 6 && out[8] == 1 && out[15] == 8);
+
+    // shrinking keeps data which fits
+    buffer->add(buffer, data, 3);
+    assert(buffer->resize(buffer, 3) == BUFFER_OK);
+    assert(buffer->get_free_space(buffer) == 0);
+    assert(buffer->get(buffer, out, 16) == 3);
+    assert(out[0] == 1 && out[2] == 3);
+    buffer->free(buffer);
+}
+
+#include "ring.h"
+#include "udp.h"
+
+// full ring must stay usable for both sides
+void test_ring_full()
+{
+    ring_t *ring = create_ring(4);
+    uint32_t values[4] = {1, 2, 3, 4};
+    for (uint32_t i = 0; i < 3; i++) {
+        assert(ring->push(ring, &values[i]) == RING_BUFFER_OK);
+    }
+    assert(ring->push(ring, &values[3]) == RING_BUFFER_FULL);
+    assert(ring->pop(ring) == &values[0]);
+    assert(ring->push(ring, &values[3]) == RING_BUFFER_OK);
+    assert(ring->pop(ring) == &values[1]);
+    ring->free(ring);
+}
+
+void test_udp_socket_ports()
+{
+    init_udp_protocol();
+    udp_socket_t *first, *second, *busy;
+    assert(create_udp_socket(NULL, 0, &first) == UDP_SOCKET_SUCCESS);
+    assert(create_udp_socket(NULL, 0, &second) == UDP_SOCKET_SUCCESS);
+    assert(first->port >= UDP_EPHEMERAL_PORT_FIRST && first->port <= UDP_EPHEMERAL_PORT_LAST);
+    assert(second->port >= UDP_EPHEMERAL_PORT_FIRST && second->port != first->port);
+    assert(create_udp_socket(NULL, first->port, &busy) == UDP_SOCKET_PORT_BUSY);
+
+    // 68 and 0x1155 share a bucket
+    udp_socket_t *low, *high;
+    assert(create_udp_socket(NULL, 68, &low) == UDP_SOCKET_SUCCESS);
+    assert(create_udp_socket(NULL, 0x1155, &high) == UDP_SOCKET_SUCCESS);
+    release_udp_socket(low);
+    assert(create_udp_socket(NULL, 0x1155, &busy) == UDP_SOCKET_PORT_BUSY);
+    assert(create_udp_socket(NULL, 68, &low) == UDP_SOCKET_SUCCESS);
+
+    net_buffer_t __attribute__((unused)) *buffers[2];
+    assert(receive_udp_packets(first, buffers, 2, 0) == 0);
+    release_udp_socket(low);
+    release_udp_socket(high);
+    release_udp_socket(first);
+    release_udp_socket(second);
+}
+
+#include "tcp.h"
+extern volatile uint32_t pit_ticks;
+tcp_socket_t *create_tcp_socket(network_device_t *net_dev, uint16_t port, ip4_addr_t *remote_ip, uint16_t remote_port);
+tcp_socket_t *lookup_connection(ip4_addr_t *local, uint16_t port, ip4_addr_t *remote, uint16_t remote_port);
+void hash_connection(tcp_socket_t *socket);
+void unhash_connection(tcp_socket_t *socket);
+void arm_timer(tcp_socket_t *socket, uint32_t deadline);
+void tcp_worker_run();
+void process_segment(tcp_socket_t *socket, uint8_t *reply_flags, net_buffer_t *buffer);
+uint32_t build_tcp_options(tcp_socket_t *socket, uint8_t flags, uint32_t payload_size, uint8_t *options);
+
+static tcp_socket_t *test_tcp_connection(network_device_t *net_dev, uint32_t local, uint32_t remote)
+{
+    ip4_addr_t remote_ip = {.addr = remote};
+    tcp_socket_t *socket = create_tcp_socket(net_dev, 80, &remote_ip, 1234);
+    socket->local_host.addr = local;
+    hash_connection(socket);
+    return socket;
+}
+
+// local and remote addresses are xor-ed by the hash, so these connections share a bucket
+void test_tcp_connection_hash()
+{
+    network_device_t net_dev;
+    memset(&net_dev, 0, sizeof(network_device_t));
+    net_dev.mtu = NET_DEFAULT_MTU;
+    tcp_socket_t *first = test_tcp_connection(&net_dev, 0x0100000A, 0x0200000A);
+    tcp_socket_t *second = test_tcp_connection(&net_dev, 0x0200000A, 0x0100000A);
+    tcp_socket_t *third = test_tcp_connection(&net_dev, 0x0500000A, 0x0600000A);
+
+    assert(lookup_connection(&first->local_host, 80, &first->remote_host, 1234) == first);
+    assert(lookup_connection(&second->local_host, 80, &second->remote_host, 1234) == second);
+    assert(lookup_connection(&third->local_host, 80, &third->remote_host, 1234) == third);
+    assert(lookup_connection(&first->local_host, 80, &first->remote_host, 1235) == 0);
+
+    // removed from the middle of the chain
+    unhash_connection(second);
+    assert(lookup_connection(&second->local_host, 80, &second->remote_host, 1234) == 0);
+    assert(lookup_connection(&first->local_host, 80, &first->remote_host, 1234) == first);
+    assert(lookup_connection(&third->local_host, 80, &third->remote_host, 1234) == third);
+    close_tcp_connection(second);
+
+    // TIME_WAIT timers fire through the worker, owned socket is left for close, the other one is freed
+    uint32_t ticks = pit_ticks;
+    first->state = TCP_CONNECTION_TIME_WAIT;
+    first->owned = 1;
+    third->state = TCP_CONNECTION_TIME_WAIT;
+    arm_timer(first, ticks + 10);
+    arm_timer(third, ticks + 20);
+    tcp_worker_run();
+    assert(first->hashed && first->timer_armed);
+
+    pit_ticks = ticks + 10;
+    tcp_worker_run();
+    assert(!first->hashed && !first->timer_armed && !first->queued);
+    assert(lookup_connection(&first->local_host, 80, &first->remote_host, 1234) == 0);
+    assert(lookup_connection(&third->local_host, 80, &third->remote_host, 1234) == third);
+    close_tcp_connection(first);
+
+    pit_ticks = ticks + 20;
+    tcp_worker_run();
+    assert(lookup_connection(&third->local_host, 80, &third->remote_host, 1234) == 0);
+    pit_ticks = ticks;
+}
+
+// segment as received from the peer, payload bytes are their sequence numbers; storage isn't from the pool
+static net_buffer_t *test_tcp_segment(uint8_t flags, uint32_t seq, uint32_t ack, uint16_t window, uint8_t *options,
+    uint32_t options_size, uint32_t payload_size)
+{
+    net_buffer_t *buffer = kmalloc(sizeof(net_buffer_t) + NET_BUFFER_SIZE);
+    memset(buffer, 0, sizeof(net_buffer_t) + NET_BUFFER_SIZE);
+    buffer->head = (uint8_t*)(buffer + 1);
+    buffer->data = buffer->head;
+    buffer->ref_count = 1;
+    buffer->len = sizeof(tcp_packet_t) + options_size + payload_size;
+
+    tcp_packet_t *packet = (tcp_packet_t*)buffer->data;
+    packet->ip.total_size = bswap16(sizeof(ip4_header_t) + sizeof(tcp_header_t) + options_size + payload_size);
+    packet->tcp.seq_number = bswap32(seq);
+    packet->tcp.ack_number = bswap32(ack);
+    packet->tcp.data_offset = (sizeof(tcp_header_t) + options_size) / 4;
+    packet->tcp.flags = flags;
+    packet->tcp.window_size = bswap16(window);
+    uint8_t *option = (uint8_t*)&packet->tcp + sizeof(tcp_header_t);
+    memcpy(option, options, options_size);
+    for (uint32_t i = 0; i < payload_size; i++) {
+        option[options_size + i] = seq + i;
+    }
+    return buffer;
+}
+
+static uint8_t test_tcp_input(tcp_socket_t *socket, uint8_t flags, uint32_t seq, uint32_t ack, uint16_t window,
+    uint8_t *options, uint32_t options_size, uint32_t payload_size)
+{
+    uint8_t reply_flags = 0;
+    net_buffer_t *buffer = test_tcp_segment(flags, seq, ack, window, options, options_size, payload_size);
+    process_segment(socket, &reply_flags, buffer);
+    if (buffer->ref_count == 1) {
+        kfree(buffer);
+    }
+    return reply_flags;
+}
+
+// timestamp option without echo, so ACKs don't give RTT samples
+static uint32_t test_tcp_timestamp(uint8_t *option, uint32_t value)
+{
+    memset(option, 0, TCP_TIMESTAMP_OPTION_SIZE);
+    option[0] = TCP_OPTION_NOP;
+    option[1] = TCP_OPTION_NOP;
+    option[2] = TCP_OPTION_TIMESTAMP;
+    option[3] = 10;
+    *(uint32_t*)(option + 4) = bswap32(value);
+    return TCP_TIMESTAMP_OPTION_SIZE;
+}
+
+static uint32_t test_tcp_sack(uint8_t *option, uint32_t count, uint32_t *blocks)
+{
+    option[0] = TCP_OPTION_NOP;
+    option[1] = TCP_OPTION_NOP;
+    option[2] = TCP_OPTION_SACK;
+    option[3] = 2 + count * 8;
+    for (uint32_t i = 0; i < count * 2; i++) {
+        *(uint32_t*)(option + 4 + i * 4) = bswap32(blocks[i]);
+    }
+    return 4 + count * 8;
+}
+
+// passive open with window scale, SACK and timestamps, then PAWS, reassembly with SACK blocks and the scoreboard
+void test_tcp_segments()
+{
+    network_device_t net_dev;
+    memset(&net_dev, 0, sizeof(network_device_t));
+    net_dev.mtu = NET_DEFAULT_MTU;
+    tcp_socket_binder_t binder;
+    memset(&binder, 0, sizeof(tcp_socket_binder_t));
+    binder.port = 80;
+    tcp_listen(&binder, 1000);
+    assert(binder.backlog == TCP_MAX_BACKLOG);
+    tcp_listen(&binder, 0);
+    assert(binder.backlog == 1);
+
+    // as created by process_tcp_packet() for SYN
+    tcp_socket_t *socket = test_tcp_connection(&net_dev, 0x0100000A, 0x0200000A);
+    socket->binder = &binder;
+    socket->half_open = 1;
+    binder.syn_count++;
+
+    uint8_t syn_options[] = {
+        TCP_OPTION_MSS, 4, 0x05, 0xb4,
+        TCP_OPTION_NOP, TCP_OPTION_NOP, TCP_OPTION_SACK_PERMITTED, 2,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        TCP_OPTION_NOP, TCP_OPTION_WINDOW_SCALE, 3, 7
+    };
+    test_tcp_timestamp(syn_options + 8, 1000);
+    uint32_t irs = 5000;
+    uint8_t reply = test_tcp_input(socket, TCP_FLAG_SYN, irs, 0, 0xFFFF, syn_options, sizeof(syn_options), 0);
+    assert(reply == TCP_FLAG_ACK);
+    assert(socket->state == TCP_CONNECTION_SYN_RECEIVED);
+    assert(socket->ack_number == irs + 1);
+    assert(socket->snd_window_scale == 7 && socket->rcv_window_scale == TCP_WINDOW_SCALE);
+    assert(socket->sack_ok && socket->ts_ok && socket->ts_recent == 1000);
+    assert(socket->mss == 1460 - TCP_TIMESTAMP_OPTION_SIZE);
+    // window in SYN isn't scaled
+    assert(socket->remote_window_size == 0xFFFF);
+
+    // ACK of SYN-ACK completes the handshake, the window is scaled from now on
+    uint8_t options[TCP_MAX_OPTIONS_SIZE];
+    socket->snd_max = socket->snd_una + 1;
+    uint32_t size = test_tcp_timestamp(options, 1001);
+    test_tcp_input(socket, TCP_FLAG_ACK, irs + 1, socket->snd_max, 100, options, size, 0);
+    assert(socket->state == TCP_CONNECTION_ESTABLISHED);
+    assert(socket->remote_window_size == 100 << 7);
+    assert(socket->in_accept_queue && !socket->half_open);
+    assert(binder.syn_count == 0 && binder.accept_count == 1);
+    assert(socket->ts_recent == 1001);
+
+    // PAWS: older timestamp means an old duplicate, it's only acknowledged
+    uint32_t una = socket->snd_una;
+    size = test_tcp_timestamp(options, 500);
+    reply = test_tcp_input(socket, TCP_FLAG_ACK, irs + 1, una, 100, options, size, 10);
+    assert(reply == TCP_FLAG_ACK);
+    assert(socket->ack_number == irs + 1 && socket->ts_recent == 1001);
+    assert(socket->receive_buffer->get_used(socket->receive_buffer) == 0);
+
+    // two segments after a hole, there is no pool in tests, so only a socket holding nothing can be charged
+    size = test_tcp_timestamp(options, 1002);
+    reply = test_tcp_input(socket, TCP_FLAG_ACK, irs + 101, una, 100, options, size, 100);
+    assert(reply == TCP_FLAG_ACK && socket->ooo_count == 1);
+    net_buffer_t *drained = socket->ooo_queue;
+    socket->ooo_buffers = 0;
+    test_tcp_input(socket, TCP_FLAG_ACK, irs + 301, una, 100, options, size, 100);
+    assert(socket->ooo_count == 2 && socket->ack_number == irs + 1);
+    socket->ooo_buffers = 0;
+
+    // block of the latest segment goes first, after the timestamp
+    uint8_t out[TCP_MAX_OPTIONS_SIZE];
+    assert(build_tcp_options(socket, TCP_FLAG_ACK, 0, out) == TCP_TIMESTAMP_OPTION_SIZE + 4 + 2 * 8);
+    assert(out[2] == TCP_OPTION_TIMESTAMP && out[14] == TCP_OPTION_SACK && out[15] == 2 + 2 * 8);
+    uint32_t *blocks = (uint32_t*)(out + 16);
+    assert(bswap32(blocks[0]) == irs + 301 && bswap32(blocks[1]) == irs + 401);
+    assert(bswap32(blocks[2]) == irs + 101 && bswap32(blocks[3]) == irs + 201);
+    // and only with pure ACKs
+    assert(build_tcp_options(socket, TCP_FLAG_ACK, 1, out) == TCP_TIMESTAMP_OPTION_SIZE);
+
+    // segment filling the hole drains the queue up to the next hole
+    size = test_tcp_timestamp(options, 1003);
+    test_tcp_input(socket, TCP_FLAG_ACK, irs + 1, una, 100, options, size, 100);
+    assert(socket->ack_number == irs + 201 && socket->ooo_count == 1);
+    assert(socket->ts_recent == 1003);
+    assert(drained->ref_count == 1 && socket->ooo_queue != drained);
+    kfree(drained);
+    uint8_t received[200];
+    assert(socket->receive_buffer->get(socket->receive_buffer, received, 200) == 200);
+    for (uint32_t i = 0; i < 200; i++) {
+        assert(received[i] == (uint8_t)(irs + 1 + i));
+    }
+
+    // scoreboard of sent data: blocks are sorted, merged and dropped once acknowledged
+    for (uint32_t i = 0; i < 15; i++) {
+        socket->transmit_buffer->add(socket->transmit_buffer, received, 200);
+    }
+    socket->snd_max = una + 3000;
+    socket->seq_number = socket->snd_max;
+    uint32_t first_blocks[] = {una + 2000, una + 2500, una + 1000, una + 1500};
+    size = test_tcp_timestamp(options, 1004);
+    size += test_tcp_sack(options + size, 2, first_blocks);
+    test_tcp_input(socket, TCP_FLAG_ACK, irs + 201, una, 100, options, size, 0);
+    assert(socket->sack_count == 2 && socket->dup_acks == 1);
+    assert(socket->sack_left[0] == una + 1000 && socket->sack_right[0] == una + 1500);
+    assert(socket->sack_left[1] == una + 2000 && socket->sack_right[1] == una + 2500);
+
+    uint32_t middle_block[] = {una + 1500, una + 2000};
+    size = test_tcp_timestamp(options, 1004);
+    size += test_tcp_sack(options + size, 1, middle_block);
+    test_tcp_input(socket, TCP_FLAG_ACK, irs + 201, una, 100, options, size, 0);
+    assert(socket->sack_count == 1);
+    assert(socket->sack_left[0] == una + 1000 && socket->sack_right[0] == una + 2500);
+
+    size = test_tcp_timestamp(options, 1004);
+    test_tcp_input(socket, TCP_FLAG_ACK, irs + 201, una + 2500, 100, options, size, 0);
+    assert(socket->sack_count == 0 && socket->snd_una == una + 2500);
+    assert(socket->transmit_buffer->get_used(socket->transmit_buffer) == 500);
+
+    tcp_socket_t *accepted = 0;
+    assert(accept_tcp_connection(&binder, &accepted, 1) == TCP_SOCKET_SUCCESS);
+    assert(accepted == socket && binder.accept_count == 0);
+
+    // remaining queued segment is released with the socket
+    net_buffer_t *queued = socket->ooo_queue;
+    unhash_connection(socket);
+    socket->state = TCP_CONNECTION_CLOSED;
+    close_tcp_connection(socket);
+    assert(queued->ref_count == 1);
+    kfree(queued);
 }
 
 void run_tests()
@@ -181,6 +960,23 @@ void run_tests()
     test_list();
     test_mm_mark_memory_region();
     test_alloc_physical_range();
+    test_wake_up();
+    test_wake_up_callback();
+    test_tasklet();
+    test_net_buffer();
+    test_net_buffer_chain();
+    test_net_buffer_charge();
+    test_network_mtu();
+    test_bpf_filter();
+    test_checksum();
+    test_buffer_peek_drop();
+    test_buffer_resize();
     test_get_mac_from_cache();
     test_add_mac_to_arp_cache();
+    test_arp_pending_queue();
+    test_route_lookup();
+    test_ring_full();
+    test_udp_socket_ports();
+    test_tcp_connection_hash();
+    test_tcp_segments();
 }
@@ -94,6 +94,27 @@ typedef struct page_directory
 #define USERSPACE_SHARED_MEM_TOP (USERSPACE_STACK - 0x1000)
 #define USERSPACE_SHARED_MEM (USERSPACE_SHARED_MEM_TOP - USERSPACE_SHARED_MEM_SIZE)
 
+// thread slot: unmapped guard page, stack, TLS page. Slot 0 belongs to the main thread, it only uses TLS page
+#define USERSPACE_THREADS_COUNT 64
+#define USERSPACE_THREAD_STACK_SIZE USERSPACE_STACK_SIZE
+#define USERSPACE_THREAD_SLOT_SIZE (0x1000 + USERSPACE_THREAD_STACK_SIZE + 0x1000)
+// -0x1000 for unmapped page (overflow guard)
+#define USERSPACE_THREADS_TOP (USERSPACE_SHARED_MEM - 0x1000)
+#define USERSPACE_THREADS (USERSPACE_THREADS_TOP - USERSPACE_THREAD_SLOT_SIZE * USERSPACE_THREADS_COUNT)
+#define USERSPACE_THREAD_STACK(slot) (USERSPACE_THREADS + USERSPACE_THREAD_SLOT_SIZE * (slot) + 0x1000)
+#define USERSPACE_THREAD_TLS(slot) (USERSPACE_THREAD_STACK(slot) + USERSPACE_THREAD_STACK_SIZE)
+
+// read-only kernel data: global page and per-process page (see kernel_data.h)
+// -0x1000 for unmapped page (overflow guard)
+#define USERSPACE_KDATA (USERSPACE_THREADS - 0x1000 - 0x2000)
+
+// submission/completion ring of the process (see ioring.h)
+// -0x1000 for unmapped page (overflow guard)
+#define USERSPACE_IORING (USERSPACE_KDATA - 0x1000 - 0x4000)
+
+// heap can't grow above this address
+#define USERSPACE_BRK_LIMIT USERSPACE_IORING
+
 
 typedef struct kernel_load_info
 {
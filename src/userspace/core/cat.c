@@ -2,6 +2,61 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stdbool.h>
+#include <ioring.h>
+
+#define CHUNK_SIZE 4096
+
+#define CAT_READ 1
+#define CAT_WRITE 2
+
+static char buffers[2][CHUNK_SIZE];
+
+static void cat_plain(int fd)
+{
+    int c = 0;
+    while((c = read(fd, buffers[0], CHUNK_SIZE)) > 0) {
+        write(STDOUT_FILENO, buffers[0], c);
+    }
+}
+
+// write of the current chunk and read of the next one go to the kernel in a single ring_enter()
+static int cat_ring(int fd)
+{
+    uint32_t offset = 0;
+    int cur = 0;
+    struct ioring_sqe *sqe = ioring_get_sqe();
+    ioring_prep_read(sqe, fd, buffers[cur], CHUNK_SIZE, offset);
+    sqe->user_data = CAT_READ;
+    uint32_t pending = 1;
+
+    while (true) {
+        if (ioring_submit_and_wait(pending) == -1) {
+            return 1;
+        }
+        int n = 0;
+        for (; pending > 0; pending--) {
+            struct ioring_cqe *cqe = ioring_peek_cqe();
+            if (cqe->user_data == CAT_READ) {
+                n = cqe->res;
+            }
+            ioring_cqe_seen();
+        }
+        if (n <= 0) {
+            return n < 0;
+        }
+
+        sqe = ioring_get_sqe();
+        ioring_prep_write(sqe, STDOUT_FILENO, buffers[cur], n, IORING_OFFSET_CURRENT);
+        sqe->user_data = CAT_WRITE;
+        offset += n;
+        cur ^= 1;
+        sqe = ioring_get_sqe();
+        ioring_prep_read(sqe, fd, buffers[cur], CHUNK_SIZE, offset);
+        sqe->user_data = CAT_READ;
+        pending = 2;
+    }
+}
 
 int main(int argc, char *argv[])
 {
@@ -14,10 +69,9 @@ int main(int argc, char *argv[])
         printf("can't open file %s\n", argv[1]);
         return 1;
     }
-    char buffer[100];
-    int c = 0;
-    while((c = read(fd, buffer, 100)) > 0) {
-        write(STDOUT_FILENO, buffer, c);
+    if (ioring_init(4) == -1) {
+        cat_plain(fd);
+        return 0;
     }
-    return 0;
+    return cat_ring(fd);
 }
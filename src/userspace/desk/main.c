@@ -2,6 +2,11 @@
 #include "text.h"
 #include <string.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include "event.h"
 #include <cairo/cairo.h>
 
 int shm_map(char *);
@@ -29,11 +34,16 @@ void draw()
     redraw_window(window_id);
 }
 
+// desk doesn't handle events yet, they are dropped; poll() sleeps until one arrives instead of spinning
 void event_loop()
 {
+    struct event_data *packet = malloc(MAX_EVENT_PACKET_SIZE);
+    struct pollfd events = {.fd = open("/dev/event", O_RDONLY), .events = POLLIN};
     while(true)
     {
-
+        if (poll(&events, 1, -1) > 0 && (events.revents & POLLIN)) {
+            read(events.fd, packet, MAX_EVENT_PACKET_SIZE);
+        }
     }
 }
 
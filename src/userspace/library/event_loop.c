@@ -1,20 +1,17 @@
 #include "event.h"
 #include "stddef.h"
 #include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
 
 static int event_stream = -1;
 static void* handlers[USHRT_MAX] = {0};
-static uint8_t handlers_mutex = 0;
 
-void lock(uint8_t *lock)
-{
-    while (__sync_lock_test_and_set(lock, 1)){}
-}
-
-void unlock(uint8_t *lock)
-{
-     __sync_lock_release(lock);
-}
+// descriptors polled together with the event stream, changed only by the loop thread (handlers)
+static struct event_source sources[MAX_EVENT_SOURCES];
+static int sources_count = 0;
 
 int init_event_loop()
 {
@@ -22,7 +19,8 @@ int init_event_loop()
         return -EEXIST;
     }
 
-    event_stream = open("/dev/event", O_RDWR);
+    // stream is drained until EAGAIN, so a burst of events is handled in one loop iteration
+    event_stream = open("/dev/event", O_RDWR | O_NONBLOCK);
     if (event_stream == -1) {
         return -1;
     }
@@ -40,30 +38,81 @@ int remove_event_handler()
 
 }
 
-void process_event_loop()
+// handler is called when fd is readable, fd is switched to O_NONBLOCK so handler can read it until EAGAIN
+int add_event_source(int fd, void (*handler)(int fd))
 {
-    int done = 0;
-    struct event_data *packet = malloc(MAX_EVENT_PACKET_SIZE);
-    void (*handler)(struct event_data*);
-
-    while (true) {
-        done = read(event_stream, packet, MAX_EVENT_PACKET_SIZE);
+    if (sources_count == MAX_EVENT_SOURCES) {
+        return -ENOMEM;
+    }
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        return -1;
+    }
+    sources[sources_count].fd = fd;
+    sources[sources_count].handler = handler;
+    sources_count++;
+    return 0;
+}
 
-        if (done == 0) { // events read is blocking syscall, but better to have this check. Mb i will introduce timeout later...
-            continue;
+int remove_event_source(int fd)
+{
+    for (int i = 0; i < sources_count; i++) {
+        if (sources[i].fd == fd) {
+            sources[i] = sources[--sources_count];
+            return 0;
         }
+    }
+    return -ENOENT;
+}
 
+// returns -1 if stream is broken
+static int drain_events(struct event_data *packet)
+{
+    void (*handler)(struct event_data*);
+    int done;
+    while ((done = read(event_stream, packet, MAX_EVENT_PACKET_SIZE)) > 0) {
         // lock isn't needed. In worst case we may call wrong handler. But it may occur anyway because of queue.
         handler = handlers[packet->event_type];
         if (handler != NULL) {
             handler(packet);
-            continue;
+        }
+    }
+
+    if (done == -1 && errno != EAGAIN) {
+        printf("ops, event loop can't read events, something is really unstable, errno = %i\n", errno);
+        return -1;
+    }
+    return 0;
+}
+
+void process_event_loop()
+{
+    struct event_data *packet = malloc(MAX_EVENT_PACKET_SIZE);
+    struct pollfd fds[MAX_EVENT_SOURCES + 1];
+
+    while (true) {
+        // sleeps until any source is ready, then every ready source is drained
+        fds[0].fd = event_stream;
+        fds[0].events = POLLIN;
+        int count = sources_count;
+        for (int i = 0; i < count; i++) {
+            fds[i + 1].fd = sources[i].fd;
+            fds[i + 1].events = POLLIN;
+        }
+        if (poll(fds, count + 1, -1) == -1) {
+            printf("ops, event loop can't poll, errno = %i\n", errno);
+            break;
         }
 
-        if (done == -1) {
-            printf("ops, event loop can't read events, something is really unstable, errno = %i\n", errno);
+        if ((fds[0].revents & POLLIN) && drain_events(packet) == -1) {
             break;
         }
+        // handler can remove sources, so a slot is checked to still hold the polled descriptor
+        for (int i = count - 1; i >= 0; i--) {
+            if (fds[i + 1].revents != 0 && i < sources_count && sources[i].fd == fds[i + 1].fd) {
+                sources[i].handler(sources[i].fd);
+            }
+        }
     }
 
     free(packet);
@@ -3,6 +3,7 @@
 
 #define EVENT_TYPE_CUSTOM 12
 #define MAX_EVENT_PACKET_SIZE 4096
+#define MAX_EVENT_SOURCES 16
 
 struct event_data {
     struct list_node list;
@@ -12,8 +13,15 @@ struct event_data {
     size_t size;
 };
 
+struct event_source {
+    int fd;
+    void (*handler)(int fd);
+};
+
 int init_event_loop();
 int add_event_handler();
 int remove_event_handler();
+int add_event_source(int fd, void (*handler)(int fd));
+int remove_event_source(int fd);
 
 #endif
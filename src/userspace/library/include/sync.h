@@ -0,0 +1,32 @@
+#ifndef H_SYNC
+#define H_SYNC
+
+#include <stdint.h>
+
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+
+#define SYNC_MUTEX_INIT {0}
+#define SYNC_COND_INIT {0}
+
+// futex word of newlib's _LOCK_T, see sys/lock.h
+typedef struct sync_mutex {
+    volatile int state;
+} sync_mutex_t;
+
+typedef struct sync_cond {
+    volatile int seq;
+} sync_cond_t;
+
+int futex(volatile int *uaddr, int op, int val, uint32_t timeout_ms);
+
+void sync_mutex_lock(sync_mutex_t *m);
+int sync_mutex_trylock(sync_mutex_t *m);
+void sync_mutex_unlock(sync_mutex_t *m);
+
+void sync_cond_wait(sync_cond_t *c, sync_mutex_t *m);
+int sync_cond_timedwait(sync_cond_t *c, sync_mutex_t *m, uint32_t timeout_ms);
+void sync_cond_signal(sync_cond_t *c);
+void sync_cond_broadcast(sync_cond_t *c);
+
+#endif
@@ -0,0 +1,43 @@
+#include "sync.h"
+#include <sys/lock.h>
+#include <limits.h>
+#include <errno.h>
+
+/*
+ * Futex mutex and condition variable are implemented once in newlib (sys/moo/lock.c), these are typed wrappers
+ * with negative error codes.
+ */
+void sync_mutex_lock(sync_mutex_t *m)
+{
+    __moo_lock_acquire(&m->state);
+}
+
+int sync_mutex_trylock(sync_mutex_t *m)
+{
+    return __moo_lock_try_acquire(&m->state) == 0 ? 0 : -EBUSY;
+}
+
+void sync_mutex_unlock(sync_mutex_t *m)
+{
+    __moo_lock_release(&m->state);
+}
+
+void sync_cond_wait(sync_cond_t *c, sync_mutex_t *m)
+{
+    __moo_cond_wait(&c->seq, &m->state, 0);
+}
+
+int sync_cond_timedwait(sync_cond_t *c, sync_mutex_t *m, uint32_t timeout_ms)
+{
+    return __moo_cond_wait(&c->seq, &m->state, timeout_ms) == ETIMEDOUT ? -ETIMEDOUT : 0;
+}
+
+void sync_cond_signal(sync_cond_t *c)
+{
+    __moo_cond_wake(&c->seq, 1);
+}
+
+void sync_cond_broadcast(sync_cond_t *c)
+{
+    __moo_cond_wake(&c->seq, INT_MAX);
+}
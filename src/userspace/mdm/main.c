@@ -10,6 +10,7 @@
 #include "list.h"
 #include "mdm.h"
 #include "drawing.h"
+#include "kernel_data.h"
 
 // move me to gui.h
 #define WINDOW_FLAG_FULL_SCREEN (1 << 0)
@@ -21,19 +22,20 @@ extern int errno;
 
 struct mdm_state global_state;
 
-void lock(uint8_t *lock)
+// timestamps come from kernel data page, no syscalls per frame
+static uint32_t frame_time_us(uint64_t start_tsc)
 {
-    while (__sync_lock_test_and_set(lock, 1)){}
-}
-
-void unlock(uint8_t *lock)
-{
-     __sync_lock_release(lock);
+    const struct kernel_data *kd = get_kernel_data();
+    if (kd->tsc_khz == 0) {
+        return 0;
+    }
+    return (uint32_t)((rdtsc() - start_tsc) * 1000 / kd->tsc_khz);
 }
 
 void redraw()
 {
-    lock(&global_state.render_lock);
+    uint64_t frame_start = rdtsc();
+    sync_mutex_lock(&global_state.render_lock);
 
     cairo_set_source_rgba(global_state.cairo, 0, 0, 0, 1);
     cairo_rectangle(global_state.cairo, 0, 0, global_state.surface_width, global_state.surface_height);
@@ -69,7 +71,9 @@ void redraw()
         w = w->list.prev;
     }
 
-    unlock(&global_state.render_lock);
+    global_state.last_frame_tick = get_kernel_data()->ticks;
+    global_state.last_frame_us = frame_time_us(frame_start);
+    sync_mutex_unlock(&global_state.render_lock);
 }
 
 static void set_fg_window(struct window *w)
@@ -78,10 +82,10 @@ static void set_fg_window(struct window *w)
         redraw(); // force redraw
         return;
     }
-    lock(&global_state.render_lock);
+    sync_mutex_lock(&global_state.render_lock);
     delete_from_list((void*)global_state.windows, w);
     add_to_list(global_state.windows, w);
-    unlock(&global_state.render_lock);
+    sync_mutex_unlock(&global_state.render_lock);
     redraw();
     printf("active window set to %d\n", w->id);
 }
@@ -110,9 +114,9 @@ struct window *get_window(int id, int pid)
 
 static void close_window(struct window *w)
 {
-    lock(&global_state.render_lock);
+    sync_mutex_lock(&global_state.render_lock);
     delete_from_list((void*)&global_state.windows, w);
-    unlock(&global_state.render_lock);
+    sync_mutex_unlock(&global_state.render_lock);
     redraw();
     shm_unmap(w->buffers[0]);
     shm_unmap(w->buffers[1]);
@@ -160,9 +164,9 @@ static struct window *create_window(size_t width, size_t height, uint32_t pid, u
     shm_alloc(name, global_state.bbp * w->c_rect.width * w->c_rect.height);
     w->buffers[1] = shm_get_addr(name);
 
-    lock(&global_state.render_lock);
+    sync_mutex_lock(&global_state.render_lock);
     add_to_list(global_state.windows, w);
-    unlock(&global_state.render_lock);
+    sync_mutex_unlock(&global_state.render_lock);
     printf("created window at %d:%d with size %d:%d for owner %d, id %d\n", w->w_rect.x, w->w_rect.y, w->w_rect.width, w->w_rect.height, w->pid, w->id);
     set_fg_window(w);
     return w;
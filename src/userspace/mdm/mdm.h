@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include "primitives.h"
+#include "sync.h"
 
 #define REQUEST_CREATE_WINDOW 1
 #define REQUEST_CLOSE_WINDOW 2
@@ -48,7 +49,9 @@ struct mdm_state {
     uint8_t bbp;
     struct window *windows;
     uint32_t next_id;
-    uint8_t render_lock;
+    sync_mutex_t render_lock;
+    uint32_t last_frame_tick;
+    uint32_t last_frame_us;
     cairo_surface_t *cairo_surface;
     cairo_t *cairo;
     void *fb;
@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * Internet checksum: kernel checksum_partial() vs the old loop which folded carries after every 16 bit add, in TSC
+ * cycles per call. Kernel source is compiled in, so build with -I src/kernel/include.
+ */
+
+#include "../../kernel/network/checksum.c"
+
+#define ITERATIONS 2000
+
+static inline uint64_t rdtsc()
+{
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a" (low), "=d" (high));
+    return ((uint64_t)high << 32) | low;
+}
+
+static uint16_t checksum_old(const void *data, uint32_t size)
+{
+    uint32_t checksum = 0;
+    const uint16_t *p = data;
+    for (uint32_t i = 0; i < size / 2; i++) {
+        checksum += *p;
+        while (checksum > 0xFFFF) {
+            checksum = (checksum >> 16) + (checksum & 0x0FFFF);
+        }
+        p++;
+    }
+    if (size % 2 != 0) {
+        checksum += *(const uint8_t*)p;
+    }
+    while (checksum > 0xFFFF) {
+        checksum = (checksum >> 16) + (checksum & 0x0FFFF);
+    }
+    return ~checksum;
+}
+
+static uint16_t checksum_new(const void *data, uint32_t size)
+{
+    return checksum(data, size);
+}
+
+static uint64_t bench(uint16_t (*call)(const void*, uint32_t), const void *data, uint32_t size, uint16_t *result)
+{
+    uint64_t best = UINT64_MAX;
+    for (int i = 0; i < ITERATIONS; i++) {
+        // data may change as far as compiler knows, so the call isn't hoisted
+        __asm__ __volatile__("" : : "r" (data) : "memory");
+        uint64_t start = rdtsc();
+        *result = call(data, size);
+        uint64_t cycles = rdtsc() - start;
+        if (cycles < best) {
+            best = cycles;
+        }
+    }
+    return best;
+}
+
+int main()
+{
+    static const uint32_t sizes[] = {64, 1500, 65536};
+    uint8_t *data = malloc(65536);
+    for (uint32_t i = 0; i < 65536; i++) {
+        data[i] = rand();
+    }
+
+    for (uint32_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        uint16_t old_result, new_result;
+        uint64_t old_cycles = bench(checksum_old, data, sizes[i], &old_result);
+        uint64_t new_cycles = bench(checksum_new, data, sizes[i], &new_result);
+        if (old_result != new_result) {
+            printf("%u bytes: checksum mismatch %x != %x\n", (uint32_t)sizes[i], old_result, new_result);
+            return 1;
+        }
+        printf("%u bytes: old %u cycles, new %u cycles\n", (uint32_t)sizes[i], (uint32_t)old_cycles, (uint32_t)new_cycles);
+    }
+    free(data);
+    return 0;
+}
@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/*
+ * TCP echo server: one connection at a time, every received byte is sent back. Prints bytes echoed per
+ * connection, so throughput can be measured from the client side with any TCP load generator.
+ * Usage: echo_server [port], port 7 (echo) by default.
+ */
+
+#define BUFFER_SIZE 16384
+
+static char buffer[BUFFER_SIZE];
+
+static uint32_t echo(int fd)
+{
+    uint32_t total = 0;
+    while (1) {
+        int received = recv(fd, buffer, BUFFER_SIZE, 0);
+        if (received <= 0) {
+            return total;
+        }
+        for (int sent = 0; sent < received; ) {
+            int res = send(fd, buffer + sent, received - sent, 0);
+            if (res < 0) {
+                return total;
+            }
+            sent += res;
+        }
+        total += received;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int port = argc > 1 ? atoi(argv[1]) : 7;
+
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    if (server < 0) {
+        perror("socket");
+        return 1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(server, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        return 1;
+    }
+    if (listen(server, 16) < 0) {
+        perror("listen");
+        return 1;
+    }
+    printf("echo server on port %i\n", port);
+
+    while (1) {
+        struct sockaddr_in client;
+        socklen_t len = sizeof(client);
+        int fd = accept(server, (struct sockaddr*)&client, &len);
+        if (fd < 0) {
+            perror("accept");
+            return 1;
+        }
+        printf("connection from %s:%i\n", inet_ntoa(client.sin_addr), ntohs(client.sin_port));
+        printf("%u bytes echoed\n", echo(fd));
+        close(fd);
+    }
+    return 0;
+}
@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Null syscall latency: getpid through int 0x80 vs sysenter, in TSC cycles per call.
+ */
+
+#define SYSCALL_GETPID 10
+#define ITERATIONS 100000
+
+static inline uint64_t rdtsc()
+{
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a" (low), "=d" (high));
+    return ((uint64_t)high << 32) | low;
+}
+
+static int getpid_int80()
+{
+    int res;
+    __asm__ __volatile__("int $0x80" : "=a" (res) : "0" (SYSCALL_GETPID) : "memory");
+    return res;
+}
+
+static int getpid_sysenter()
+{
+    int res, c, d;
+    __asm__ __volatile__("push %%ebp; push $1f; mov %%esp, %%ebp; sysenter; 1: pop %%ebp"
+            : "=a" (res), "=c" (c), "=d" (d)
+            : "0" (SYSCALL_GETPID)
+            : "memory", "cc");
+    return res;
+}
+
+static void bench(const char *name, int (*call)())
+{
+    uint64_t best = UINT64_MAX;
+    uint64_t total = 0;
+    int pid = call();
+
+    for (int i = 0; i < ITERATIONS; i++) {
+        uint64_t start = rdtsc();
+        int res = call();
+        uint64_t cycles = rdtsc() - start;
+
+        if (res != pid) {
+            printf("%s: unexpected result %i (expected %i)\n", name, res, pid);
+            return;
+        }
+        total += cycles;
+        if (cycles < best) {
+            best = cycles;
+        }
+    }
+
+    printf("%s: avg %u cycles, best %u cycles\n", name, (uint32_t)(total / ITERATIONS), (uint32_t)best);
+}
+
+int main()
+{
+    bench("int 0x80", getpid_int80);
+    bench("sysenter", getpid_sysenter);
+    return 0;
+}